@@ -0,0 +1,66 @@
+function latency(file, n, payload)
+% LATENCY  The round-trip latency of calls between Matlab and R via the MEX files.
+%
+%   latency('latency.tsv')
+%   latency('latency.tsv', 1000, 2^23)
+%
+% Times n calls of each of
+%   empty   callR('invisible')                     no arguments and result NULL
+%   scalar  callR('sum', 1, 2)                     two scalar arguments
+%   named   callNamedR('sum', 1, 2, {'na.rm' true}) with a cell of named arguments
+%   struct  callNamedR('sum', 1, 2, struct('na.rm', true))
+%   large   callR('identity', x)                   x and the result are payload bytes
+% and then the same for .Matlab() from R in this session (latency.R),
+% appending a line for each to file in the format described in README.
+% R must have been initialized with initializeR, with the RMatlab package.
+
+if nargin < 2
+  n = 1000;
+end
+if nargin < 3
+  payload = 2^23;
+end
+
+x = (1:payload/8)';
+here = fileparts(mfilename('fullpath'));
+version = callNamedR('packageDescription', 'RMatlab', {'fields' 'Version'});
+
+cases = {
+  'empty',  0,           n,                 @() callR('invisible');
+  'scalar', 16,          n,                 @() callR('sum', 1, 2);
+  'named',  24,          n,                 @() callNamedR('sum', 1, 2, {'na.rm' true});
+  'struct', 24,          n,                 @() callNamedR('sum', 1, 2, struct('na.rm', true));
+  'large',  2 * payload, max(1, floor(n/10)), @() callR('identity', x)
+};
+
+isNew = isempty(dir(file));
+fid = fopen(file, 'a');
+if isNew
+  fprintf(fid, 'version\tdate\tmode\tcase\tbytes\tcalls\tp50_us\tp99_us\tcalls_per_sec\n');
+end
+
+for i = 1:size(cases, 1)
+  f = cases{i, 4};
+  for j = 1:10
+    f();
+  end
+
+  times = zeros(cases{i, 3}, 1);
+  for j = 1:cases{i, 3}
+    t = tic;
+    f();
+    times(j) = toc(t);
+  end
+
+    % The order statistics, as latency.R computes them.
+  s = sort(times);
+  fprintf(fid, '%s\t%s\t%s\t%s\t%.0f\t%d\t%.1f\t%.1f\t%.1f\n', version, ...
+          datestr(now, 'yyyy-mm-ddTHH:MM:SS'), 'mex:callR', cases{i, 1}, cases{i, 2}, numel(times), ...
+          1e6 * s(ceil(0.5 * numel(s))), 1e6 * s(ceil(0.99 * numel(s))), numel(times) / sum(times));
+end
+fclose(fid);
+
+  % .Matlab() from R, via .MatlabMexCall() and RMatlab_invoke.
+  % We source latency.R into R's global environment, passed as a reference.
+callR('sys.source', fullfile(here, 'latency.R'), callR('.RReference', 'globalenv'));
+callNamedR('benchmarkMatlabCalls', {'n' n 'payload' payload 'file' file});
@@ -0,0 +1,365 @@
+/*
+ The round-trip latency of the call sequences RMatlab uses, against a
+ stand-in for the Matlab engine and for the MEX host, so that this can be
+ run and compared across machines and versions without Matlab.
+
+ engine  .Matlab() via the engine puts each argument into the workspace,
+         evaluates the call, gets the result and clears the temporary
+         variables: four round trips for a one-argument call.  The stand-in
+         is a child process that reads these requests from a pipe, as the
+         engine (or the broker, matlabBroker.c) does, and keeps the variables.
+ mex     callR and .MatlabMexCall are a function call in the same process.
+         The stand-in host copies the arguments into new buffers and the
+         result back, as convertToR() and convertFromR() do.
+
+ This measures the floor set by the process boundary and the copies, not
+ RMatlab's own code, which needs Matlab's libraries (see latency.R and
+ latency.m for that).  The results are written in the same format.
+
+   cc -O2 -o standIn standIn.c
+   ./standIn [file] [calls] [payload bytes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#ifndef RMATLAB_VERSION
+#define RMATLAB_VERSION "unknown"
+#endif
+
+#define MAX_VARS 8
+
+typedef enum { PUT = 1, EVAL, GET, CLEAR, QUIT } Op;
+
+typedef struct {
+  char name[32];
+  double *data;
+  long long n;
+} Variable;
+
+  /* The in-process calls take less than a microsecond. */
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static int
+readFully(FILE *in, void *buf, size_t len)
+{
+  return(fread(buf, 1, len, in) == len);
+}
+
+
+/*
+ The stand-in engine.  Each request is an op, a name (32 bytes) and,
+ for PUT, a length and the doubles.  EVAL's name is the function to call
+ on the arguments r_arg_1 and r_arg_2, assigning r_ans, e.g.
+    r_ans = double(r_arg_1)
+ The reply is a status and, for GET, the length and the doubles.
+*/
+static Variable Workspace[MAX_VARS];
+
+static Variable *
+findVariable(const char *name, int create)
+{
+  int i;
+
+  for(i = 0; i < MAX_VARS; i++)
+    if(Workspace[i].data && strcmp(Workspace[i].name, name) == 0)
+      return(Workspace + i);
+
+  for(i = 0; create && i < MAX_VARS; i++)
+    if(!Workspace[i].data) {
+      strcpy(Workspace[i].name, name);
+      return(Workspace + i);
+    }
+
+  return(NULL);
+}
+
+static void
+assign(const char *name, double *data, long long n)
+{
+  Variable *v = findVariable(name, 1);
+
+  free(v->data);
+  v->data = data;
+  v->n = n;
+}
+
+static void
+standInEngine(FILE *in, FILE *out)
+{
+  char name[32];
+  int op, status;
+  long long n;
+  double *data;
+  Variable *v, *a, *b;
+
+  while(readFully(in, &op, sizeof(op)) && op != QUIT && readFully(in, name, sizeof(name))) {
+    status = 0;
+    switch(op) {
+      case PUT:
+        readFully(in, &n, sizeof(n));
+        data = (double *) malloc((n ? n : 1) * sizeof(double));
+        readFully(in, data, n * sizeof(double));
+        assign(name, data, n);
+        break;
+      case EVAL:
+        a = findVariable("r_arg_1", 0);
+        b = findVariable("r_arg_2", 0);
+        data = (double *) malloc((a ? a->n : 1) * sizeof(double));
+        if(strcmp(name, "pi") == 0) {
+          data[0] = 3.141592653589793;
+          assign("r_ans", data, 1);
+        } else if(strcmp(name, "plus") == 0 && a && b) {
+          data[0] = a->data[0] + b->data[0];
+          assign("r_ans", data, 1);
+        } else if(strcmp(name, "double") == 0 && a) {
+          memcpy(data, a->data, a->n * sizeof(double));
+          assign("r_ans", data, a->n);
+        } else {
+          free(data);
+          status = 1;
+        }
+        break;
+      case GET:
+        v = findVariable(name, 0);
+        status = v == NULL;
+        fwrite(&status, sizeof(status), 1, out);
+        if(v) {
+          fwrite(&v->n, sizeof(v->n), 1, out);
+          fwrite(v->data, sizeof(double), v->n, out);
+        }
+        fflush(out);
+        continue;
+      case CLEAR:
+        if((v = findVariable(name, 0))) {
+          free(v->data);
+          v->data = NULL;
+        }
+        break;
+    }
+    fwrite(&status, sizeof(status), 1, out);
+    fflush(out);
+  }
+}
+
+
+/*
+ R's side: the requests .Matlab() makes for one call.
+*/
+static FILE *Cmd, *Reply;
+
+static int
+request(Op op, const char *varName, const double *data, long long n)
+{
+  char name[32];
+  int status = -1;
+
+  memset(name, 0, sizeof(name));
+  strncpy(name, varName, sizeof(name) - 1);
+  fwrite(&op, sizeof(op), 1, Cmd);
+  fwrite(name, sizeof(name), 1, Cmd);
+  if(op == PUT) {
+    fwrite(&n, sizeof(n), 1, Cmd);
+    fwrite(data, sizeof(double), n, Cmd);
+  }
+  fflush(Cmd);
+  readFully(Reply, &status, sizeof(status));
+  return(status);
+}
+
+static double *
+engineCall(const char *funcName, int nargs, const double **args, const long long *lengths, long long *n)
+{
+  char name[32];
+  double *ans = NULL;
+  int i;
+
+  for(i = 0; i < nargs; i++) {
+    snprintf(name, sizeof(name), "r_arg_%d", i + 1);
+    request(PUT, name, args[i], lengths[i]);
+  }
+
+  if(request(EVAL, funcName, NULL, 0) == 0 && request(GET, "r_ans", NULL, 0) == 0) {
+    readFully(Reply, n, sizeof(*n));
+    ans = (double *) malloc((*n ? *n : 1) * sizeof(double));
+    readFully(Reply, ans, *n * sizeof(double));
+  } else
+    fprintf(stderr, "FAIL: %s\n", funcName);
+
+  for(i = 0; i < nargs; i++) {
+    snprintf(name, sizeof(name), "r_arg_%d", i + 1);
+    request(CLEAR, name, NULL, 0);
+  }
+  request(CLEAR, "r_ans", NULL, 0);
+
+  return(ans);
+}
+
+
+/*
+ The stand-in MEX host: the arguments are copied into new vectors,
+ the function called and its result copied into a new array.
+*/
+static double *
+copyOf(const double *x, long long n)
+{
+  double *ans = (double *) malloc((n ? n : 1) * sizeof(double));
+  memcpy(ans, x, n * sizeof(double));
+  return(ans);
+}
+
+static double *
+mexCall(const char *funcName, int nargs, const double **args, const long long *lengths, long long *n)
+{
+  double *copies[2], *result, *ans;
+  int i;
+
+  for(i = 0; i < nargs; i++)
+    copies[i] = copyOf(args[i], lengths[i]);
+
+  if(strcmp(funcName, "plus") == 0) {
+    result = (double *) malloc(sizeof(double));
+    result[0] = copies[0][0] + copies[1][0];
+    *n = 1;
+  } else if(strcmp(funcName, "double") == 0) {
+    result = copies[0];
+    copies[0] = NULL;
+    *n = lengths[0];
+  } else {
+    result = (double *) malloc(sizeof(double));
+    result[0] = 3.141592653589793;
+    *n = 1;
+  }
+
+  ans = copyOf(result, *n);
+  free(result);
+  for(i = 0; i < nargs; i++)
+    free(copies[i]);
+
+  return(ans);
+}
+
+
+typedef double *(*CallFun)(const char *, int, const double **, const long long *, long long *);
+
+static int
+compareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return(x < y ? -1 : x > y);
+}
+
+/*
+ Time n calls and write the line of results, with the order statistics
+ for the quantiles as latency.R and latency.m compute them.
+*/
+static int
+benchmark(FILE *out, const char *mode, const char *id, double bytes, CallFun call, const char *funcName,
+           int nargs, const double **args, const long long *lengths, int n)
+{
+  double *times = (double *) malloc(n * sizeof(double)), *ans, total = 0, start;
+  long long len;
+  char date[32];
+  time_t t = time(NULL);
+  int i, failures = 0;
+
+  for(i = -10; i < n; i++) {
+    start = now();
+    ans = call(funcName, nargs, args, lengths, &len);
+    if(i >= 0)
+      total += times[i] = now() - start;
+    failures += ans == NULL;
+    free(ans);
+  }
+
+  qsort(times, n, sizeof(double), compareDoubles);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+  fprintf(out, "%s\t%s\t%s\t%s\t%.0f\t%d\t%.1f\t%.1f\t%.1f\n", RMATLAB_VERSION, date, mode, id, bytes, n,
+           1e6 * times[(n + 1) / 2 - 1], 1e6 * times[(99 * n + 99) / 100 - 1], n / total);
+  fflush(out);
+  free(times);
+
+  return(failures);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  int toEngine[2], fromEngine[2], failures = 0, n, large, newFile, i;
+  long long payload, scalarLengths[2] = {1, 1};
+  const double one = 1, two = 2, *scalarArgs[2] = {&one, &two};
+  double *x;
+  FILE *out = stdout;
+  pid_t pid;
+
+  if(argc > 1) {
+    newFile = access(argv[1], F_OK) != 0;
+    if(!(out = fopen(argv[1], "a"))) {
+      perror(argv[1]);
+      return(2);
+    }
+  } else
+    newFile = 1;
+  n = argc > 2 ? atoi(argv[2]) : 1000;
+  payload = (argc > 3 ? atof(argv[3]) : 8388608) / sizeof(double);
+  large = n / 10 > 0 ? n / 10 : 1;
+
+  if(pipe(toEngine) < 0 || pipe(fromEngine) < 0) {
+    perror("pipe");
+    return(2);
+  }
+
+  pid = fork();
+  if(pid == 0) {
+    close(toEngine[1]);
+    close(fromEngine[0]);
+    standInEngine(fdopen(toEngine[0], "r"), fdopen(fromEngine[1], "w"));
+    _exit(0);
+  }
+
+  close(toEngine[0]);
+  close(fromEngine[1]);
+  Cmd = fdopen(toEngine[1], "w");
+  Reply = fdopen(fromEngine[0], "r");
+
+  x = (double *) malloc(payload * sizeof(double));
+  for(i = 0; i < payload; i++)
+    x[i] = i;
+
+  if(newFile)
+    fprintf(out, "version\tdate\tmode\tcase\tbytes\tcalls\tp50_us\tp99_us\tcalls_per_sec\n");
+
+  failures += benchmark(out, "standin:engine", "empty", 0, engineCall, "pi", 0, NULL, NULL, n);
+  failures += benchmark(out, "standin:engine", "scalar", 16, engineCall, "plus", 2, scalarArgs, scalarLengths, n);
+  failures += benchmark(out, "standin:engine", "large", 2.0 * payload * sizeof(double), engineCall, "double",
+                         1, (const double **) &x, &payload, large);
+
+  failures += benchmark(out, "standin:mex", "empty", 0, mexCall, "pi", 0, NULL, NULL, n);
+  failures += benchmark(out, "standin:mex", "scalar", 16, mexCall, "plus", 2, scalarArgs, scalarLengths, n);
+  failures += benchmark(out, "standin:mex", "large", 2.0 * payload * sizeof(double), mexCall, "double",
+                         1, (const double **) &x, &payload, large);
+
+  i = QUIT;
+  fwrite(&i, sizeof(i), 1, Cmd);
+  fclose(Cmd);
+  waitpid(pid, NULL, 0);
+  free(x);
+  if(out != stdout)
+    fclose(out);
+
+  if(failures)
+    fprintf(stderr, "%d calls failed\n", failures);
+
+  return(failures > 0);
+}
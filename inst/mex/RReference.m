@@ -0,0 +1,38 @@
+classdef RReference < handle
+% A reference to an R object kept in R, returned by callR('.RReference', ...)
+% and by the calls to the R functions named in the R option RMatlab.references.
+% Passing it to callR or callNamedR gives the R object itself to the R function,
+% so a fitted model, say, need not be converted to Matlab and back:
+%
+%   fit = callR('.RReference', 'lm', 'y ~ x', d);
+%   p = callR('predict', fit);
+%
+% The R object is released when the last copy of the RReference is cleared.
+
+  properties (SetAccess = private)
+    id        % the identifier of the R object in RMatlab's table.
+    RClass    % the (first) class of the R object.
+  end
+
+  methods
+    function obj = RReference(id, RClass)
+      obj.id = id;
+      obj.RClass = RClass;
+    end
+
+    function delete(obj)
+        % Once initializeR has been cleared, R has gone too.
+      [ignore, mexFiles] = inmem;
+      if any(strcmp(mexFiles, 'initializeR'))
+        try
+          callR('.RReleaseReference', obj.id);
+        catch
+        end
+      end
+    end
+
+    function disp(obj)
+      fprintf('  RReference %d to an R object of class %s\n', obj.id, obj.RClass);
+    end
+  end
+end
@@ -1,8 +1,22 @@
 #include "RMatlabConvert.h"
+#include "RMatlabWatchdog.h"
+#include "RMatlabTrace.h"
 
-#include "engine.h"
+#include "RMatlabBroker.h"
 
 #include "Rdefines.h"
+#include <Rinterface.h> /* for R_interrupts_pending */
+#include <Rversion.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+
+int RMatlab_shmEligible(Engine *eng, SEXP val);
+int RMatlab_shmPutVariable(Engine *eng, const char *varName, SEXP val);
+SEXP RMatlab_shmGetVariable(Engine *eng, const char *varName);
+void RMatlab_shmRelease(Engine *eng);
 
 #ifdef MATLAB_MEX_FILE
 #undef MATLAB_MEX_FILE
@@ -43,7 +57,7 @@ R_matlabEngine(Engine *eng)
 Engine *
 getEngine(SEXP rengine)
 {
-  Engine *eng;
+  Engine *eng = NULL;
 
   if(Rf_length(rengine) == 0) {
     PROBLEM "NULL value in Matlab interface"
@@ -53,6 +67,10 @@ getEngine(SEXP rengine)
   if(TYPEOF(rengine) == EXTPTRSXP) 
     eng = R_ExternalPtrAddr(rengine);
 
+    /* In a MEX session, record into the trace Matlab has, if any. See trace.c */
+  if(!eng)
+    RMatlab_traceUseShared();
+
   return(eng);
 }
 
@@ -73,6 +91,20 @@ RMatlab_getDefaultEngine()
 }
 
 
+/*
+  An identifier for the engine while it is open, its address, for the
+  keys of the cache of results (see cache.R).
+*/
+SEXP
+RMatlab_engineId(SEXP engine)
+{
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%p", TYPEOF(engine) == EXTPTRSXP ? R_ExternalPtrAddr(engine) : NULL);
+  return(mkString(buf));
+}
+
+
 /*
   Open a Matlab Engine instance.
   This makes that engine the default.
@@ -93,9 +125,13 @@ RMatlab_init(SEXP arg)
 }
 
 
+static void forgetMatlabProcessId(Engine *eng);
+
 /*
   Close a Matlab Engine that we will no longer use to 
   perform computations or store data.
+  We forget everything we know about it, as a later engine may
+  have the same address.
 */
 SEXP
 RMatlab_close(SEXP engine)
@@ -105,7 +141,10 @@ RMatlab_close(SEXP engine)
 
  eng = getEngine(engine);
 
- status = engClose(eng);
+ status = RMatlab_engClose(eng);
+ RMatlab_syncForget(eng, NULL, NULL);
+ RMatlab_shmRelease(eng);
+ forgetMatlabProcessId(eng);
 
  DefaultMatlabEngine  = NULL;
 
@@ -113,79 +152,382 @@ RMatlab_close(SEXP engine)
 }
 
 
+/*
+ The process identifiers of the Matlab engines, so that we can
+ interrupt a command that is taking too long.
+*/
+typedef struct _MatlabProcess {
+  Engine *engine;
+  pid_t pid;
+  struct _MatlabProcess *next;
+} MatlabProcess;
+
+static MatlabProcess *MatlabProcesses = NULL;
+
+static pid_t
+getMatlabProcessId(Engine *eng)
+{
+  MatlabProcess *p;
+  mxArray *val;
+  pid_t pid = 0;
+
+  for(p = MatlabProcesses; p; p = p->next)
+    if(p->engine == eng)
+      return(p->pid);
+
+  if(RMatlab_engEvalString(eng, "r_matlab_pid = feature('getpid');") == 0
+       && (val = RMatlab_engGetVariable(eng, "r_matlab_pid"))) {
+    pid = (pid_t) mxGetScalar(val);
+    mxDestroyArray(val);
+    RMatlab_engEvalString(eng, "clear r_matlab_pid");
+  }
+
+  p = (MatlabProcess *) malloc(sizeof(MatlabProcess));
+  p->engine = eng;
+  p->pid = pid;
+  p->next = MatlabProcesses;
+  MatlabProcesses = p;
+
+  return(pid);
+}
+
+static void
+forgetMatlabProcessId(Engine *eng)
+{
+  MatlabProcess *p, *prev = NULL;
+
+  for(p = MatlabProcesses; p; prev = p, p = p->next) {
+    if(p->engine == eng) {
+      if(prev)
+        prev->next = p->next;
+      else
+        MatlabProcesses = p->next;
+      free(p);
+      return;
+    }
+  }
+}
+
+/*
+  Called by the watchdog thread.  We send Matlab the equivalent of Ctrl-C
+  and, if that doesn't stop the command, kill it.
+  The engine then has to be restarted.
+*/
+static void
+interruptMatlab(void *data, RMatlabCancelReason reason, int escalate)
+{
+  kill(*((pid_t *) data), escalate ? SIGKILL : SIGINT);
+}
+
+static int
+rInterruptPending(void *data)
+{
+  return(R_interrupts_pending);
+}
+
+
 /*
   Evaluate a Matlab command given as a string.
   The return value is not the result of the LHS of the
   command, but rather the status of the evaluation.
   One has to retrieve the value of the variable.
+  With the engine and a finite timeout, the command is interrupted after
+  timeout seconds, or if the R user interrupts, and Matlab is killed if it
+  has not stopped grace seconds later.  The result then has a "cancelled"
+  attribute.  Without a timeout, we don't start the watchdog thread, as
+  .Matlab() makes several of these calls for each Matlab function call.
 */
 SEXP
-RMatlab_evalString(SEXP cmd, SEXP engine)
+RMatlab_evalString(SEXP cmd, SEXP engine, SEXP timeout, SEXP grace)
 {
   int status;
   Engine *eng = NULL;
+  RMatlabWatchdog dog;
+  RMatlabCancelReason cancelled = RMATLAB_NOT_CANCELLED;
+  pid_t pid = 0;
+  SEXP ans;
+  double t0;
 
   eng = getEngine(engine);
 
+  t0 = RMatlab_traceBegin();
   if(!eng)
     status = mexEvalString(CHAR(STRING_ELT(cmd, 0)));
+  else {
+      /* Interrupt Matlab if the command takes too long or the R user presses Ctrl-C. */
+    if(R_FINITE(REAL(timeout)[0]))
+      pid = getMatlabProcessId(eng);
+    if(pid > 0)
+      RMatlabWatchdog_start(&dog, REAL(timeout)[0], R_FINITE(REAL(grace)[0]) ? REAL(grace)[0] : -1,
+                              interruptMatlab, rInterruptPending, &pid);
+    status = RMatlab_engEvalString(eng, CHAR(STRING_ELT(cmd, 0)));
+    if(pid > 0)
+      cancelled = RMatlabWatchdog_stop(&dog);
+      /* The engine is no longer running, so its process identifier may be reused. */
+    if(status != 0)
+      forgetMatlabProcessId(eng);
+  }
+  RMatlab_traceEnd(t0, "Matlab", CHAR(STRING_ELT(cmd, 0)), -1);
+
+  PROTECT(ans = Rf_ScalarInteger(status));
+  if(cancelled != RMATLAB_NOT_CANCELLED) {
+    Rf_setAttrib(ans, Rf_install("cancelled"), mkString(cancelled == RMATLAB_TIMED_OUT ? "timeout" : "interrupt"));
+    Rf_setAttrib(ans, Rf_install("killed"), ScalarLogical(dog.escalated));
+    if(dog.escalated)
+      forgetMatlabProcessId(eng);
+  }
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+
+/*
+  Via the engine we cannot create or take apart categorical arrays and
+  tables (see attributes.c), so Matlab converts between them and the
+  attribute form of factors and data frames for the variables we get and set.
+  If the conversion fails, e.g. in an old version of Matlab, the variable
+  is left as it is.
+*/
+#define PORTABLE_VAR "RMatlab_portable__"
+
+static const char *PortableFromMatlab =
+  "if iscategorical(%1$s), "
+    PORTABLE_VAR " = struct('data', double(%1$s), 'RAttributes', struct('levels', {categories(%1$s)}, "
+                      "'class', {[repmat({'ordered'}, isordinal(%1$s), 1); {'factor'}]})); "
+  "elseif istable(%1$s), "
+    PORTABLE_VAR " = struct('data', table2struct(%1$s, 'ToScalar', true), "
+                      "'RAttributes', struct('names', {%1$s.Properties.VariableNames'}, 'class', 'data.frame')); "
+    "if ~isempty(%1$s.Properties.RowNames), " PORTABLE_VAR ".RAttributes.row_names = %1$s.Properties.RowNames; end; "
+  "end";
+
+static const char *FactorToMatlab =
+  "try, %1$s = categorical(%1$s.data, 1:numel(%1$s.RAttributes.levels), %1$s.RAttributes.levels, "
+                          "'Ordinal', any(strcmp(%1$s.RAttributes.class, 'ordered'))); catch, end";
+
+static const char *DataFrameToMatlab =
+  "try, " PORTABLE_VAR " = %1$s; %1$s = struct2table(" PORTABLE_VAR ".data); "
+    "%1$s.Properties.VariableNames = " PORTABLE_VAR ".RAttributes.names; "
+    "if isfield(" PORTABLE_VAR ".RAttributes, 'row_names'), %1$s.Properties.RowNames = " PORTABLE_VAR ".RAttributes.row_names; end; "
+  "catch, end; clear " PORTABLE_VAR;
+
+static mxArray *
+engGetPortableVariable(Engine *eng, const char *name, mxArray *el)
+{
+  char cmd[4096];
+
+  if(el && strcmp(mxGetClassName(el), "categorical") && strcmp(mxGetClassName(el), "table"))
+    return(el);
+
+    /* el is NULL if the broker cannot send the object. */
+  if(el)
+    mxDestroyArray(el);
+  el = NULL;
+
+  snprintf(cmd, sizeof(cmd), PortableFromMatlab, name);
+  if(RMatlab_engEvalString(eng, cmd) == 0)
+    el = RMatlab_engGetVariable(eng, PORTABLE_VAR);
+  RMatlab_engEvalString(eng, "clear " PORTABLE_VAR);
+
+  return(el);
+}
+
+static void
+engConvertVariable(Engine *eng, const char *name, SEXP val)
+{
+  char cmd[4096];
+
+  if(Rf_isFactor(val))
+    snprintf(cmd, sizeof(cmd), FactorToMatlab, name);
+  else if(Rf_inherits(val, "data.frame"))
+    snprintf(cmd, sizeof(cmd), DataFrameToMatlab, name);
   else
-   status = engEvalString(eng, CHAR(STRING_ELT(cmd, 0)));
+    return;
 
-   return(Rf_ScalarInteger(status));
+  RMatlab_engEvalString(eng, cmd);
 }
 
 
+/*
+  The size of the Matlab variable and whether it is logical, from whos, so
+  that we can check the memory budget before the engine copies it to us.
+*/
+#define BUDGET_VAR "RMatlab_budget__"
+
+static const char *VariableSize =
+  BUDGET_VAR " = whos('%1$s'); " BUDGET_VAR " = [sum([" BUDGET_VAR ".bytes]), islogical(%1$s)];";
+
+/*
+  Our estimate of the memory for getting the variable via the engine,
+  or -1 if we cannot tell.
+*/
+static double
+engVariableBytes(Engine *eng, const char *name)
+{
+  char cmd[4096];
+  mxArray *info = NULL;
+  double ans = -1;
+
+  snprintf(cmd, sizeof(cmd), VariableSize, name);
+  if(RMatlab_engEvalString(eng, cmd) == 0)
+    info = RMatlab_engGetVariable(eng, BUDGET_VAR);
+  RMatlab_engEvalString(eng, "clear " BUDGET_VAR);
+
+    /* The engine's copy and the R vector, with 4 bytes for each logical. */
+  if(info && mxIsDouble(info) && mxGetNumberOfElements(info) == 2)
+    ans = mxGetPr(info)[0] * (mxGetPr(info)[1] ? 5 : 2);
+  if(info)
+    mxDestroyArray(info);
+
+  return(ans);
+}
+
+
+/*
+  shm says which variables to try to get via the shared memory transport
+  (shm.c).  This costs a round trip to Matlab for a variable that turns
+  out to be too small, so the caller asks for it for the large ones.
+*/
 SEXP
-RMatlab_getVariable(SEXP varNames, SEXP where, SEXP convert, SEXP engine)
+RMatlab_getVariable(SEXP varNames, SEXP where, SEXP convert, SEXP engine, SEXP shm)
 {
   SEXP ans;
   int i, n;
   Engine *eng;
+  double t0;
 
   eng = getEngine(engine);
+  RMatlab_poolConfigure();
+  RMatlab_convertConfigure(eng == NULL);
 
   PROTECT(ans = allocVector(VECSXP, Rf_length(varNames)));
   n = Rf_length(varNames);
   for(i = 0; i < n ; i++) {
     SEXP tmp;
     const mxArray *el;
+    const char *name = CHAR(STRING_ELT(varNames, i));
+    double bytes = -1;
+    int level = RMatlab_budgetEnter();
+
+      /* Check the budget before the engine copies the variable to us, if we can. */
+    if(eng && LOGICAL_DATA(convert)[i] && RMatlab_budgetLimited()
+         && (bytes = engVariableBytes(eng, name)) >= 0)
+      RMatlab_budgetRequire(bytes, "The Matlab variable", name);
+
+    t0 = RMatlab_traceBegin();
+    if(eng && LOGICAL_DATA(convert)[i] && LOGICAL_DATA(shm)[i] == TRUE
+         && (tmp = RMatlab_shmGetVariable(eng, CHAR(STRING_ELT(varNames, i))))) {
+      SET_VECTOR_ELT(ans, i, tmp);
+      RMatlab_traceEnd(t0, "getVariable", CHAR(STRING_ELT(varNames, i)), t0 >= 0 ? RMatlab_traceRBytes(tmp) : -1);
+      RMatlab_budgetLeave(level);
+      continue;
+    }
+
     if(!eng)
-      el = mexGetVariablePtr(CHAR(STRING_ELT(varNames, i)), CHAR(STRING_ELT(where, 0))); 
+      el = mexGetVariablePtr(CHAR(STRING_ELT(where, 0)), CHAR(STRING_ELT(varNames, i))); 
+    else if(LOGICAL_DATA(convert)[i])
+      el = engGetPortableVariable(eng, CHAR(STRING_ELT(varNames, i)),
+                                  RMatlab_engGetVariable(eng, CHAR(STRING_ELT(varNames, i))));
     else
-      el = engGetVariable(eng, CHAR(STRING_ELT(varNames, i)));
-
-    if(LOGICAL_DATA(convert)[i])
+      el = RMatlab_engGetVariable(eng, CHAR(STRING_ELT(varNames, i)));
+    RMatlab_traceEnd(t0, "getVariable", CHAR(STRING_ELT(varNames, i)), t0 >= 0 ? RMatlab_traceArrayBytes(el) : -1);
+
+    if(LOGICAL_DATA(convert)[i]) {
+      if(bytes < 0) {
+        bytes = RMatlab_budgetToR(el) + (eng ? RMatlab_traceArrayBytes(el) : 0);
+        if(!RMatlab_budgetReserve(bytes)) {
+          if(eng && el)
+            mxDestroyArray((mxArray *) el);
+          RMatlab_budgetRequire(bytes, "The Matlab variable", name);
+        }
+      }
+
+      t0 = RMatlab_traceBegin();
       tmp = convertToR(el);
-    else {
+      RMatlab_traceEnd(t0, "convertToR", CHAR(STRING_ELT(varNames, i)), t0 >= 0 ? RMatlab_traceArrayBytes(el) : -1);
+        /* engGetVariable() gives us a copy which we no longer need. */
+      if(eng && el)
+        mxDestroyArray((mxArray *) el);
+    } else {
       /*XXX make this a separate routine and put class info on it. */
       tmp = R_MakeExternalPtr((void *) el, Rf_install("MatlabReference"), R_NilValue);
     }
     SET_VECTOR_ELT(ans, i, tmp);
+    RMatlab_budgetLeave(level);
   }
   UNPROTECT(1);
   return(ans);
 }
 
 
+/*
+  Assign the R values to the Matlab variables.
+  If sync is TRUE, we skip the values that we know the Matlab
+  variables already hold from an earlier call (see sync.c).
+*/
 SEXP
-RMatlab_setVariable(SEXP varNames, SEXP values, SEXP where, SEXP engine)
+RMatlab_setVariable(SEXP varNames, SEXP values, SEXP where, SEXP engine, SEXP sync)
 {
   SEXP ans = R_NilValue;
   int i, n;
+  int useSync = LOGICAL(sync)[0];
+  const char *whereName = CHAR(STRING_ELT(where, 0));
   Engine *eng;
+  double t0;
 
   eng = getEngine(engine);
+  RMatlab_poolConfigure();
+  RMatlab_convertConfigure(eng == NULL);
 
   n = Rf_length(values);
   PROTECT(ans = allocVector(INTSXP, Rf_length(varNames)));
   for(i = 0; i < n ; i++) {
-    mxArray *tmp = convertFromR(VECTOR_ELT(values, i), 1, NULL);
-    if(!eng)
-      INTEGER_DATA(ans)[i] = mexPutVariable(CHAR(STRING_ELT(where, 0)), CHAR(STRING_ELT(varNames, i)), tmp); 
-    else
-      INTEGER_DATA(ans)[i] = engPutVariable(eng, CHAR(STRING_ELT(varNames, i)), tmp); 
+    SEXP val = VECTOR_ELT(values, i);
+    const char *name = CHAR(STRING_ELT(varNames, i));
+    RMatlabHash hash = 0;
+    mxArray *tmp;
+    int status, level;
+
+    if(useSync && RMatlab_syncIsCurrent(eng, whereName, name, val, &hash)) {
+      INTEGER_DATA(ans)[i] = 0;
+      continue;
+    }
+
+    level = RMatlab_budgetEnter();
+    RMatlab_budgetRequire(RMatlab_budgetFromR(val), "The value for", name);
 
+    status = -1;
+    t0 = RMatlab_traceBegin();
+    if(RMatlab_shmEligible(eng, val)) {
+      status = RMatlab_shmPutVariable(eng, name, val);
+      RMatlab_traceEnd(t0, "setVariable", name, t0 >= 0 ? RMatlab_traceRBytes(val) : -1);
+    }
+
+    if(status < 0) {
+      t0 = RMatlab_traceBegin();
+      tmp = convertFromRPooled(val);
+      RMatlab_traceEnd(t0, "convertFromR", name, t0 >= 0 ? RMatlab_traceRBytes(val) : -1);
+
+      t0 = RMatlab_traceBegin();
+      if(!eng)
+        status = mexPutVariable(whereName, name, tmp); 
+      else {
+        status = RMatlab_engPutVariable(eng, name, tmp); 
+        if(status == 0 && RMatlab_convertsAttributes(val))
+          engConvertVariable(eng, name, val);
+      }
+      RMatlab_traceEnd(t0, "setVariable", name, t0 >= 0 ? RMatlab_traceArrayBytes(tmp) : -1);
+
+        /* Both of these copy the value, so we can reuse ours. */
+      RMatlab_poolReleaseArray(tmp, eng == NULL);
+    }
+    RMatlab_budgetLeave(level);
+    INTEGER_DATA(ans)[i] = status;
+
+    if(useSync && status == 0)
+      RMatlab_syncRecord(eng, whereName, name, val, hash);
+    else
+      RMatlab_syncForget(eng, whereName, name);
   }
   UNPROTECT(1);
   return(ans);
@@ -195,40 +537,223 @@ RMatlab_setVariable(SEXP varNames, SEXP values, SEXP where, SEXP engine)
 
 
 
+/*
+  The state of a call to a Matlab function from R in a MEX session.
+  Everything we allocate is recorded here so that invokeCleanup()
+  can release it however we leave invokeMatlab(), including via an
+  R error in converting the arguments or the results.
+*/
+typedef struct {
+  const char *funcName;
+  SEXP args;
+  int nargs, nout;
+  mxArray **mxArgs, **plhs;
+  mxArray *error;
+  int budgetLevel;       /* see budget.c */
+  SEXP readOnly;         /* logical, recycled over the arguments */
+  char *shared;          /* which mxArgs refer to the R data (share.c) */
+} MatlabCall;
+
+/*
+  Get the details of the error in the last call to mexCallMATLAB() from
+  lasterror as a list with the message, identifier and the stack as
+  a list of the file, name and line of each frame.
+  .MatlabMexCall() turns this into a MatlabError condition.
+  The lasterror struct is left in *error for the caller to destroy,
+  so that it is released even if we run out of memory here.
+  This is also used for the call sites in callsite.c.
+*/
 SEXP
-RMatlab_invoke(SEXP fun, SEXP args, SEXP numOut)
+RMatlab_matlabErrorInfo(mxArray **error)
 {
- mxArray **plhs = NULL, **mxArgs = NULL;
- int nout = INTEGER_DATA(numOut)[0];
- int i, status;
- SEXP ans = R_NilValue;
-
- if(nout > 0)
-   plhs = (mxArray **) R_alloc(nout, sizeof(mxArray *));
-
- if(Rf_length(args)) {
-    int n = Rf_length(args);
-    mxArgs = (mxArray **) R_alloc(nout, sizeof(mxArray *));
-    for(i = 0; i < n; i++) 
-       mxArgs[i] = convertFromR(VECTOR_ELT(args, i), 1, NULL);
-  }
+  static const char *names[] = {"message", "identifier", "stack"};
+  static const char *frameNames[] = {"file", "name", "line"};
+  SEXP ans, tmp, stack, file, name, line;
+  const mxArray *el;
+  char *buf;
+  int i, j, n, len;
+
+  PROTECT(ans = allocVector(VECSXP, 3));
+  PROTECT(tmp = allocVector(STRSXP, 3));
+  for(i = 0; i < 3; i++)
+    SET_STRING_ELT(tmp, i, mkChar(names[i]));
+  SET_NAMES(ans, tmp);
+  SET_CLASS(ans, mkString("MatlabErrorInfo"));
+  UNPROTECT(1);
 
- mexSetTrapFlag(1); /* Ensure that any errors in the MEX call return us to here. */
- status = mexCallMATLAB(nout, plhs, Rf_length(args), mxArgs, CHAR(STRING_ELT(fun, 0)));
+  if(mexCallMATLAB(1, error, 0, NULL, "lasterror") || !mxIsStruct(*error)) {
+    SET_VECTOR_ELT(ans, 0, mkString(""));
+    SET_VECTOR_ELT(ans, 1, mkString(""));
+    UNPROTECT(1);
+    return(ans);
+  }
 
- if(status) {
-   PROBLEM "Error calling matlab function %s", CHAR(STRING_ELT(fun, 0))
-   ERROR;
- }
+  for(i = 0; i < 2; i++) {
+    el = mxGetField(*error, 0, names[i]);
+    if(el && mxIsChar(el)) {
+      len = mxGetNumberOfElements(el) + 1;
+      buf = (char *) R_alloc(len, sizeof(char));
+      mxGetString(el, buf, len);
+      SET_VECTOR_ELT(ans, i, mkString(buf));
+    } else
+      SET_VECTOR_ELT(ans, i, mkString(""));
+  }
 
- if(nout) {
-  PROTECT(ans = allocVector(VECSXP, nout));
-  for(i = 0; i < nout ; i++)
-     SET_VECTOR_ELT(ans, i,  convertToR(plhs[i]));
+  el = mxGetField(*error, 0, "stack");
+  n = el && mxIsStruct(el) ? mxGetNumberOfElements(el) : 0;
+  PROTECT(stack = allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(stack, 0, file = allocVector(STRSXP, n));
+  SET_VECTOR_ELT(stack, 1, name = allocVector(STRSXP, n));
+  SET_VECTOR_ELT(stack, 2, line = allocVector(INTSXP, n));
+  PROTECT(tmp = allocVector(STRSXP, 3));
+  for(j = 0; j < 3; j++)
+    SET_STRING_ELT(tmp, j, mkChar(frameNames[j]));
+  SET_NAMES(stack, tmp);
   UNPROTECT(1);
- }
 
- return(ans);
+  for(i = 0; i < n; i++) {
+    const mxArray *field;
+    for(j = 0; j < 2; j++) {
+      field = mxGetField(el, i, frameNames[j]);
+      if(field && mxIsChar(field)) {
+        len = mxGetNumberOfElements(field) + 1;
+        buf = (char *) R_alloc(len, sizeof(char));
+        mxGetString(field, buf, len);
+        SET_STRING_ELT(VECTOR_ELT(stack, j), i, mkChar(buf));
+      }
+    }
+    field = mxGetField(el, i, "line");
+    INTEGER(line)[i] = field && mxIsNumeric(field) ? (int) mxGetScalar(field) : NA_INTEGER;
+  }
+  SET_VECTOR_ELT(ans, 2, stack);
+
+  UNPROTECT(2);
+  return(ans);
+}
+
+static SEXP
+invokeMatlab(void *data)
+{
+  MatlabCall *c = (MatlabCall *) data;
+  SEXP ans = R_NilValue;
+  double t0, bytes;
+  int i, status, n = Rf_length(c->readOnly);
+  SEXP el;
+
+    /* The arguments Matlab only reads refer to the R data rather than copy it. */
+  for(i = 0, bytes = 0; i < c->nargs; i++) {
+    el = VECTOR_ELT(c->args, i);
+    c->shared[i] = n > 0 && LOGICAL(c->readOnly)[i % n] == TRUE && RMatlab_shareEligible(el);
+    if(!c->shared[i])
+      bytes += RMatlab_budgetFromR(el);
+  }
+  RMatlab_budgetRequire(bytes, "The arguments of", c->funcName);
+
+  t0 = RMatlab_traceBegin();
+  for(i = 0; i < c->nargs; i++) {
+    el = VECTOR_ELT(c->args, i);
+    c->mxArgs[i] = c->shared[i] ? RMatlab_shareFromR(el) : convertFromR(el, 1, NULL);
+  }
+  RMatlab_traceEnd(t0, "convertFromR", c->funcName, t0 >= 0 ? RMatlab_traceRBytes(c->args) : -1);
+
+  t0 = RMatlab_traceBegin();
+  mexSetTrapFlag(1); /* Ensure that any errors in the MEX call return us to here. */
+  status = mexCallMATLAB(c->nout, c->plhs, c->nargs, c->mxArgs, c->funcName);
+  RMatlab_traceEnd(t0, "Matlab", c->funcName, -1);
+  if(status)
+    return(RMatlab_matlabErrorInfo(&c->error));
+
+  if(c->nout) {
+    for(i = 0, bytes = 0; i < c->nout ; i++)
+      bytes += RMatlab_budgetToR(c->plhs[i]);
+    RMatlab_budgetRequire(bytes, "The results of", c->funcName);
+
+    t0 = RMatlab_traceBegin();
+    PROTECT(ans = allocVector(VECSXP, c->nout));
+    for(i = 0; i < c->nout ; i++)
+      SET_VECTOR_ELT(ans, i,  convertToR(c->plhs[i]));
+    RMatlab_traceEnd(t0, "convertToR", c->funcName, t0 >= 0 ? RMatlab_traceRBytes(ans) : -1);
+    UNPROTECT(1);
+  }
+
+  return(ans);
+}
+
+static void
+invokeCleanup(void *data, Rboolean jump)
+{
+  MatlabCall *c = (MatlabCall *) data;
+  int i, j;
+
+    /* A result that is, or contains, a shared copy of a read-only argument has the R data too. */
+  for(i = 0; i < c->nout; i++)
+    if(c->plhs[i]) {
+      for(j = 0; j < c->nargs; j++)
+        if(c->shared[j])
+          RMatlab_shareDetach(c->plhs[i], VECTOR_ELT(c->args, j));
+      mxDestroyArray(c->plhs[i]);
+      c->plhs[i] = NULL;
+    }
+  for(i = 0; i < c->nargs; i++)
+    if(c->mxArgs[i]) {
+      if(c->shared[i])
+        RMatlab_shareRelease(c->mxArgs[i]);
+      else
+        mxDestroyArray(c->mxArgs[i]);
+      c->mxArgs[i] = NULL;
+    }
+  if(c->error) {
+    mxDestroyArray(c->error);
+    c->error = NULL;
+  }
+  RMatlab_budgetLeave(c->budgetLevel);
+}
+
+/*
+  If the Matlab function fails, this returns a MatlabErrorInfo object
+  (see RMatlab_matlabErrorInfo()) rather than raising an error so that
+  .MatlabMexCall() can raise it as a MatlabError condition.
+  readOnly says which of the arguments the function only reads (see share.c).
+*/
+SEXP
+RMatlab_invoke(SEXP fun, SEXP args, SEXP numOut, SEXP readOnly)
+{
+  MatlabCall c;
+  SEXP ans, token;
+  double t0;
+
+  RMatlab_traceUseShared();
+  RMatlab_convertConfigure(1);
+  t0 = RMatlab_traceBegin();
+
+  c.funcName = CHAR(STRING_ELT(fun, 0));
+  c.args = args;
+  c.nargs = Rf_length(args);
+  c.nout = INTEGER_DATA(numOut)[0];
+  c.error = NULL;
+  c.readOnly = readOnly;
+  c.budgetLevel = RMatlab_budgetEnter();
+
+    /* Zeroed so that invokeCleanup() knows which ones we have created. */
+  c.mxArgs = (mxArray **) R_alloc(c.nargs + 1, sizeof(mxArray *));
+  c.plhs = (mxArray **) R_alloc(c.nout + 1, sizeof(mxArray *));
+  c.shared = (char *) R_alloc(c.nargs + 1, sizeof(char));
+  memset(c.mxArgs, 0, (c.nargs + 1) * sizeof(mxArray *));
+  memset(c.plhs, 0, (c.nout + 1) * sizeof(mxArray *));
+  memset(c.shared, 0, c.nargs + 1);
+
+#if R_VERSION >= R_Version(3, 5, 0)
+    /* An R error in the conversions calls invokeCleanup() and then carries on to R. */
+  PROTECT(token = R_MakeUnwindCont());
+  PROTECT(ans = R_UnwindProtect(invokeMatlab, &c, invokeCleanup, &c, token));
+  UNPROTECT(2);
+#else
+  ans = invokeMatlab(&c);
+#endif
+  invokeCleanup(&c, FALSE);
+  RMatlab_traceEnd(t0, ".MatlabMexCall", c.funcName, -1);
+
+  return(ans);
 }
 
 SEXP
@@ -258,6 +783,8 @@ RMatlab_mexGetProperty(SEXP handle, SEXP props)
   int i, n;
   SEXP ans;
 
+  RMatlab_convertConfigure(1);
+
   n = Rf_length(props);
   PROTECT(ans = allocVector(VECSXP, n));
 
@@ -285,6 +812,8 @@ RMatlab_mexSetProperty(SEXP handle, SEXP props, SEXP values)
   int i, n;
   SEXP ans;
 
+  RMatlab_convertConfigure(1);
+
   n = Rf_length(props);
 
   PROTECT(ans = allocVector(LGLSXP, n));
@@ -295,7 +824,8 @@ RMatlab_mexSetProperty(SEXP handle, SEXP props, SEXP values)
 
     name = CHAR(STRING_ELT(props, i));
     el = convertFromR(VECTOR_ELT(values, i), 1, NULL);
-    LOGICAL(ans)[0] = mexSet(h, name, el);
+    LOGICAL(ans)[i] = mexSet(h, name, el) == 0;
+    mxDestroyArray(el);
   }
 
   SET_NAMES(ans, props);
@@ -303,3 +833,99 @@ RMatlab_mexSetProperty(SEXP handle, SEXP props, SEXP values)
 
   return(ans);
 }
+
+
+/*
+ Vectorized versions of the two routines above for many handles at once.
+ The result is a matrix with a row for each handle and a column for each
+ property: a list of the values for the getter and a logical matrix
+ of the successes for the setter.
+*/
+static SEXP
+propertyTable(SEXPTYPE type, int nhandles, SEXP props)
+{
+  SEXP ans, dims, dimnames;
+
+  PROTECT(ans = allocVector(type, nhandles * Rf_length(props)));
+
+  PROTECT(dims = allocVector(INTSXP, 2));
+  INTEGER(dims)[0] = nhandles;
+  INTEGER(dims)[1] = Rf_length(props);
+  Rf_setAttrib(ans, R_DimSymbol, dims);
+
+  PROTECT(dimnames = allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(dimnames, 1, props);
+  Rf_setAttrib(ans, R_DimNamesSymbol, dimnames);
+
+  UNPROTECT(3);
+  return(ans);
+}
+
+SEXP
+RMatlab_mexGetProperties(SEXP handles, SEXP props)
+{
+  int i, j, nh, np;
+  SEXP ans;
+
+  RMatlab_convertConfigure(1);
+
+  nh = Rf_length(handles);
+  np = Rf_length(props);
+  PROTECT(ans = propertyTable(VECSXP, nh, props));
+
+  for(j = 0; j < np; j++) {
+    const char *name = CHAR(STRING_ELT(props, j));
+    for(i = 0; i < nh; i++)
+      SET_VECTOR_ELT(ans, i + j * nh, convertToR(mexGet(REAL(handles)[i], name)));
+  }
+
+  UNPROTECT(1);
+  return(ans);
+}
+
+/*
+ values is either a list with a value for each property, which we
+ convert just once and set on all the handles, or a list matrix with
+ a row for each handle and a column for each property (checked by the R code).
+ If redraw is TRUE, we have Matlab update the figures once at the end
+ rather than leave it to Matlab, which may redraw as each property is set.
+*/
+SEXP
+RMatlab_mexSetProperties(SEXP handles, SEXP props, SEXP values, SEXP redraw)
+{
+  int i, j, nh, np, perHandle;
+  mxArray *el = NULL;
+  SEXP ans;
+
+  RMatlab_convertConfigure(1);
+
+  nh = Rf_length(handles);
+  np = Rf_length(props);
+  perHandle = Rf_getAttrib(values, R_DimSymbol) != R_NilValue;
+
+  PROTECT(ans = propertyTable(LGLSXP, nh, props));
+
+  for(j = 0; j < np; j++) {
+    const char *name = CHAR(STRING_ELT(props, j));
+
+    if(!perHandle)
+      el = convertFromR(VECTOR_ELT(values, j), 1, NULL);
+
+    for(i = 0; i < nh; i++) {
+      if(perHandle)
+        el = convertFromR(VECTOR_ELT(values, i + j * nh), 1, NULL);
+      LOGICAL(ans)[i + j * nh] = mexSet(REAL(handles)[i], name, el) == 0;
+      if(perHandle)
+        mxDestroyArray(el);
+    }
+
+    if(!perHandle)
+      mxDestroyArray(el);
+  }
+
+  if(LOGICAL(redraw)[0])
+    mexEvalString("drawnow");
+
+  UNPROTECT(1);
+  return(ans);
+}
@@ -0,0 +1,88 @@
+#ifndef R_MATLAB_BROKER_H
+#define R_MATLAB_BROKER_H
+
+#include "engine.h"
+#include "RMatlabSize.h"
+
+#include <stddef.h>
+
+/*
+ The protocol between R sessions and the Matlab engine broker
+ (matlabBroker.c), a daemon that keeps Matlab engines running so that
+ a new R session doesn't have to wait for Matlab to start.
+
+ The broker listens on a Unix domain socket.  Each client is given an
+ engine of its own for the duration of the connection and, when it
+ disconnects, the broker clears the engine's workspace and gives it
+ to the next client.
+
+ Each request is an operation code followed by its arguments and the
+ broker sends back a reply:
+
+   EVAL  command, output buffer size  ->  status, output
+   PUT   name, array                  ->  status
+   GET   name                         ->  found, array (if found)
+   CLOSE                              ->  (nothing; the broker closes the connection)
+
+ Integers are sent as 32 bit values in the host's byte order (the socket
+ is local), strings as a length and the characters, and arrays as
+ described in wire.c, with 64 bit dimensions.
+*/
+
+#define RMATLAB_BROKER_MAGIC    0x524D4252   /* RMBR */
+#define RMATLAB_BROKER_VERSION  2
+
+#define RMATLAB_BROKER_SOCKET   "RMatlabBroker"
+
+typedef enum {
+  RMATLAB_BROKER_HELLO = 1,
+  RMATLAB_BROKER_EVAL,
+  RMATLAB_BROKER_PUT,
+  RMATLAB_BROKER_GET,
+  RMATLAB_BROKER_CLOSE
+} RMatlabBrokerOp;
+
+
+/*
+ A buffered connection. Once a read or write fails, failed is set and
+ all the subsequent operations do nothing, so the caller can check
+ just once at the end of a message.
+*/
+typedef struct {
+  int fd;
+  int failed;
+  char *in, *out;          /* what we have read but not yet used, and what we have yet to send. */
+  size_t inLen, inPos, outLen;
+  size_t capacity;
+} RMatlabWire;
+
+void RMatlabWire_init(RMatlabWire *w, int fd);
+void RMatlabWire_free(RMatlabWire *w);
+
+void RMatlabWire_putInt(RMatlabWire *w, int val);
+void RMatlabWire_putString(RMatlabWire *w, const char *str);
+void RMatlabWire_putArray(RMatlabWire *w, const mxArray *val);
+int  RMatlabWire_flush(RMatlabWire *w);
+
+int      RMatlabWire_getInt(RMatlabWire *w);
+char    *RMatlabWire_getString(RMatlabWire *w);   /* malloc()'ed */
+mxArray *RMatlabWire_getArray(RMatlabWire *w);
+
+const char *RMatlab_brokerSocketPath(char *buf, size_t size);
+
+
+/*
+ For RMatlab.so.  An Engine * is either a real Matlab engine or a
+ connection to the broker.  The code that uses the engine calls these
+ rather than the engine API and they forward to the right one.
+*/
+Engine  *RMatlab_brokerOpen(const char *path);
+int      RMatlab_isBrokered(Engine *eng);
+
+int      RMatlab_engEvalString(Engine *eng, const char *cmd);
+mxArray *RMatlab_engGetVariable(Engine *eng, const char *name);
+int      RMatlab_engPutVariable(Engine *eng, const char *name, const mxArray *val);
+int      RMatlab_engOutputBuffer(Engine *eng, char *buf, int size);
+int      RMatlab_engClose(Engine *eng);
+
+#endif
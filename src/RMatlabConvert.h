@@ -2,11 +2,90 @@
 #define R_MATLAB_CONVERT_H
 
 #include "mex.h"
+#include "RMatlabSize.h"
+#include "RMatlabParallel.h"
 #include <Rinternals.h>
 
 #define MATLAB_ERROR_MESSAGE(x) mexErrMsgTxt((x))
 
 mxArray *convertFromR(SEXP val, int nout, mxArray *output[]);
 SEXP convertToR(const mxArray *val);
+mwSize *RMatlab_dimsFromR(SEXP dim);
+
+/* Reusing R vectors and Matlab arrays across conversions (pool.c) */
+void RMatlab_poolConfigure();
+SEXP RMatlab_poolVector(SEXPTYPE type, R_xlen_t n);
+void RMatlab_poolReleaseVector(SEXP x);
+mxArray *RMatlab_poolArray(mxClassID classID, mxComplexity complexity, int ndims, const mwSize *dims);
+void RMatlab_poolReleaseArray(mxArray *val, int persistent);
+mxArray *convertFromRPooled(SEXP val);
+
+/* Copying the data of large arrays on several threads (parallel.c) */
+void RMatlab_parallelConfigure();
+
+/* Factors, data frames and the attributes of R objects (attributes.c) */
+  /* For RMatlab_convertConfigure(): on the R worker thread, for RMatlab_nativeArray() to finish on Matlab's thread. */
+#define RMATLAB_CONVERT_DEFERRED 2
+void RMatlab_convertConfigure(int canCallMatlab);
+int RMatlab_convertsAttributes(SEXP val);
+mxArray *RMatlab_attributesFromR(SEXP val);
+int RMatlab_isAttributeArray(const mxArray *val);
+SEXP RMatlab_attributesToR(const mxArray *val);
+mxArray *RMatlab_portableArray(const mxArray *val);
+mxArray *RMatlab_nativeArray(mxArray *val);
+mxArray *RMatlab_callMatlab(const char *funcName, int nargs, const mxArray **args);
+
+/* The memory budget for transfers (budget.c) */
+void RMatlab_budgetConfigure(int canCallMatlab);
+double RMatlab_budgetFromR(SEXP val);
+double RMatlab_budgetToR(const mxArray *val);
+int  RMatlab_budgetEnter();
+void RMatlab_budgetLeave(int level);
+int  RMatlab_budgetReserve(double bytes);
+void RMatlab_budgetRequire(double bytes, const char *what, const char *name);
+const char *RMatlab_budgetDescribe(double bytes, const char *what, const char *name);
+int  RMatlab_budgetLimited();
+
+/* Read-only arguments of Matlab functions that refer to the R data (share.c) */
+int RMatlab_shareEligible(SEXP val);
+mxArray *RMatlab_shareFromR(SEXP val);
+int RMatlab_shareDetach(mxArray *arr, SEXP val);
+void RMatlab_shareRelease(mxArray *arr);
+
+/* References to R objects from Matlab (references.c) */
+int RMatlab_isRReference(SEXP val);
+int RMatlab_isReferenceArray(const mxArray *val);
+mxArray *RMatlab_referenceFromR(SEXP val, int canCallMatlab);
+SEXP RMatlab_referenceToR(const mxArray *val, int canCallMatlab);
+mxArray *RMatlab_portableReference(const mxArray *val);
+mxArray *RMatlab_nativeReference(const mxArray *val);
+
+/* Creating the R call from the Matlab arguments to callR and callNamedR (rcall.c) */
+SEXP RMatlab_createRCall(const char *funcName, int nargs, const mxArray *args[], const mxArray *namedArgs);
+int  RMatlab_isNamedArgs(const mxArray *val);
+void RMatlab_releaseRCall(SEXP call, SEXP result);
+
+/* Reporting errors in calls to R to Matlab (rerror.c) */
+typedef struct {
+  char id[128];
+  char message[4096];
+  mxArray *lastError;   /* the value for RLastError until RMatlab_publishRError() assigns it. */
+} RMatlabErrorInfo;
+
+int  RMatlab_isRError(SEXP val);
+void RMatlab_recordRError(RMatlabErrorInfo *info, const char *funcName, SEXP err);
+void RMatlab_describeRError(RMatlabErrorInfo *info, const char *funcName, SEXP err);
+void RMatlab_publishRError(RMatlabErrorInfo *info);
+void RMatlab_recordRErrorMessage(RMatlabErrorInfo *info, const char *funcName, const char *id, const char *message);
+
+/* Content hashing and synchronization of variables with the Matlab workspace (sync.c) */
+typedef unsigned long long RMatlabHash;
+
+RMatlabHash RMatlab_hashBytes(const void *data, size_t len, RMatlabHash seed);
+RMatlabHash RMatlab_hashRObject(SEXP obj, RMatlabHash seed);
+
+int RMatlab_syncIsCurrent(void *engine, const char *where, const char *name, SEXP val, RMatlabHash *hash);
+void RMatlab_syncRecord(void *engine, const char *where, const char *name, SEXP val, RMatlabHash hash);
+void RMatlab_syncForget(void *engine, const char *where, const char *name);
 
 #endif
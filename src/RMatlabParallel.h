@@ -0,0 +1,29 @@
+#ifndef R_MATLAB_PARALLEL_H
+#define R_MATLAB_PARALLEL_H
+
+#include <stddef.h>
+#include <R_ext/Complex.h>
+
+/*
+ Copying the data of large arrays on several threads (parallel.c).
+ This is used by the conversions in RMatlab.so and the MEX functions and
+ by the test tests/parallelCopy.c, so it doesn't depend on Matlab's headers
+ or R's library, only R's Rcomplex.  Matlab's logical arrays (mxLogical)
+ are a byte per element and are passed as void *.
+ RMatlab_parallelConfigure() (convert.c) reads the R options and calls
+ RMatlab_parallelSetup().
+*/
+
+void RMatlab_parallelSetup(int threads, double threshold);
+void RMatlab_parallelBegin();
+void RMatlab_parallelEnd();
+int RMatlab_parallelSuspend();
+void RMatlab_parallelResume(int depth);
+void RMatlab_parallelCopy(void *dest, const void *src, size_t bytes);
+void RMatlab_parallelIntToDouble(double *dest, const int *src, size_t n);
+void RMatlab_parallelIntToLogical(void *dest, const int *src, size_t n);
+void RMatlab_parallelLogicalToInt(int *dest, const void *src, size_t n);
+void RMatlab_parallelJoinComplex(Rcomplex *dest, const double *real, const double *imaginary, size_t n);
+void RMatlab_parallelSplitComplex(double *real, double *imaginary, const Rcomplex *src, size_t n);
+
+#endif
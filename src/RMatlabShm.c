@@ -0,0 +1,182 @@
+#include "mex.h"
+#include "RMatlabSize.h"
+#include "RMatlabShm.h"
+
+#include <string.h>
+
+/*
+ The Matlab side of the shared memory transport used by RMatlab
+ when it talks to a Matlab engine.  R evaluates commands such as
+
+    x = RMatlabShm('get', '/rmatlab-123-0');
+    RMatlabShm('put', '/rmatlab-123-0', x, threshold);
+
+ so only the name of the segment goes through the engine's pipe.
+ 'get' creates the Matlab array from the segment R has filled in.
+ 'put' copies the array into the segment if it is a numeric or logical
+ array with at least threshold bytes.  If the segment is too small,
+ we record the size we need in the header and R creates a larger one.
+
+ We keep the most recent segment mapped for subsequent calls,
+ as R may remove its name once we have used it.
+*/
+
+static RMatlabShmMapping Mapping;
+
+static void
+unmapSegment()
+{
+  RMatlabShm_unmap(&Mapping);
+}
+
+static RMatlabShmHeader *
+mapSegment(const char *name)
+{
+  static int registered = 0;
+  RMatlabShmHeader *hdr;
+
+  if(!registered) {
+    mexAtExit(unmapSegment);
+    registered = 1;
+  }
+
+  hdr = RMatlabShm_map(&Mapping, name);
+  if(!hdr)
+    mexErrMsgTxt("Cannot open the shared memory segment");
+
+  return(hdr);
+}
+
+
+static void
+getArray(int nlhs, mxArray *plhs[], const char *name)
+{
+  RMatlabShmHeader *hdr;
+  mxArray *ans;
+  mwSize dims[RMATLAB_SHM_MAX_DIMS];
+  int i;
+
+  hdr = mapSegment(name);
+  if(!RMatlabShm_checkHeader(hdr, Mapping.size))
+    mexErrMsgTxt("The shared memory segment does not contain an RMatlab array");
+
+  for(i = 0; i < hdr->ndims; i++)
+    dims[i] = hdr->dims[i];
+
+  switch(hdr->type) {
+    case RMATLAB_SHM_DOUBLE:
+      ans = mxCreateNumericArray(hdr->ndims, dims, mxDOUBLE_CLASS, mxREAL);
+      memcpy(mxGetPr(ans), RMatlabShm_data(hdr), hdr->length * sizeof(double));
+      break;
+    case RMATLAB_SHM_COMPLEX:
+      ans = mxCreateNumericArray(hdr->ndims, dims, mxDOUBLE_CLASS, mxCOMPLEX);
+#if MX_HAS_INTERLEAVED_COMPLEX
+      memcpy(mxGetComplexDoubles(ans), RMatlabShm_data(hdr), hdr->length * 2 * sizeof(double));
+#else
+      {
+        double *src = (double *) RMatlabShm_data(hdr), *real = mxGetPr(ans), *imaginary = mxGetPi(ans);
+        long long j;
+        for(j = 0; j < hdr->length; j++) {
+          real[j] = src[2 * j];
+          imaginary[j] = src[2 * j + 1];
+        }
+      }
+#endif
+      break;
+    default: {
+      unsigned char *src = (unsigned char *) RMatlabShm_data(hdr);
+      mxLogical *dest;
+      long long j;
+
+      ans = mxCreateLogicalArray(hdr->ndims, dims);
+      dest = mxGetLogicals(ans);
+      for(j = 0; j < hdr->length; j++)
+        dest[j] = src[j] != 0;
+    }
+      break;
+  }
+
+  hdr->consumed = 1;
+
+  plhs[0] = ans;
+}
+
+static void
+putArray(const char *name, const mxArray *val, double threshold)
+{
+  RMatlabShmHeader *hdr;
+  long long dims[RMATLAB_SHM_MAX_DIMS];
+  const mwSize *mdims;
+  int i, ndims, type;
+
+  if(mxIsSparse(val) || mxGetNumberOfDimensions(val) > RMATLAB_SHM_MAX_DIMS)
+    return;
+
+  if(mxIsDouble(val))
+    type = mxIsComplex(val) ? RMATLAB_SHM_COMPLEX : RMATLAB_SHM_DOUBLE;
+  else if(mxIsLogical(val))
+    type = RMATLAB_SHM_LOGICAL;
+  else
+    return;
+
+  if(mxGetNumberOfElements(val) * RMatlabShm_elementSize(type) < threshold)
+    return;
+
+  ndims = mxGetNumberOfDimensions(val);
+  mdims = mxGetDimensions(val);
+  for(i = 0; i < ndims; i++)
+    dims[i] = mdims[i];
+
+  mapSegment(name);
+  if(!(hdr = RMatlabShm_reply(&Mapping, type, ndims, dims)))
+    return;
+
+  switch(type) {
+    case RMATLAB_SHM_DOUBLE:
+      memcpy(RMatlabShm_data(hdr), mxGetPr(val), hdr->length * sizeof(double));
+      break;
+    case RMATLAB_SHM_COMPLEX:
+#if MX_HAS_INTERLEAVED_COMPLEX
+      memcpy(RMatlabShm_data(hdr), mxGetComplexDoubles(val), hdr->length * 2 * sizeof(double));
+#else
+      {
+        double *dest = (double *) RMatlabShm_data(hdr), *real = mxGetPr(val), *imaginary = mxGetPi(val);
+        long long j;
+        for(j = 0; j < hdr->length; j++) {
+          dest[2 * j] = real[j];
+          dest[2 * j + 1] = imaginary[j];
+        }
+      }
+#endif
+      break;
+    default: {
+      unsigned char *dest = (unsigned char *) RMatlabShm_data(hdr);
+      mxLogical *src = mxGetLogicals(val);
+      long long j;
+      for(j = 0; j < hdr->length; j++)
+        dest[j] = src[j];
+    }
+      break;
+  }
+}
+
+
+void
+mexFunction(int nlhs, mxArray *plhs[],
+            int nrhs, const mxArray *prhs[])
+{
+  char op[10], name[256];
+
+  if(nrhs < 2 || !mxIsChar(prhs[0]) || !mxIsChar(prhs[1]))
+    mexErrMsgTxt("Usage: RMatlabShm('get', segmentName) or RMatlabShm('put', segmentName, value, threshold)");
+
+  mxGetString(prhs[0], op, sizeof(op));
+  mxGetString(prhs[1], name, sizeof(name));
+
+  if(strcmp(op, "get") == 0)
+    getArray(nlhs, plhs, name);
+  else if(strcmp(op, "put") == 0 && nrhs > 2)
+    putArray(name, prhs[2], nrhs > 3 ? mxGetScalar(prhs[3]) : 0);
+  else
+    mexErrMsgTxt("Unrecognized RMatlabShm operation");
+}
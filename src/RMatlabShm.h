@@ -0,0 +1,95 @@
+#ifndef R_MATLAB_SHM_H
+#define R_MATLAB_SHM_H
+
+#include <stddef.h>
+
+/*
+ The layout of a POSIX shared memory segment used to transfer a
+ numeric array between R and the Matlab engine process.
+ This header is shared by RMatlab.so (shm.c), the RMatlabShm MEX function
+ that runs within Matlab (RMatlabShm.c) and the test tests/shmTransfer.c.
+ It must not depend on R or Matlab headers.
+
+ The segment consists of this header followed by the data, starting
+ at dataOffset.  Complex arrays are stored as (real, imaginary) pairs, as
+ in R's Rcomplex and Matlab's interleaved complex storage, so that R and
+ RMatlabShm built with the interleaved API (mex -R2018a) copy them with
+ a single memcpy().
+ Logical values are stored as one byte per element.
+
+ The same segment is reused for successive transfers and both processes
+ keep it mapped, so that a transfer costs a copy into the segment and a copy
+ out of it, without faulting in new pages each time.
+*/
+
+#define RMATLAB_SHM_MAGIC    0x524D5348   /* RMSH */
+#define RMATLAB_SHM_VERSION  3
+#define RMATLAB_SHM_MAX_DIMS 32
+
+typedef enum {
+  RMATLAB_SHM_DOUBLE = 1,
+  RMATLAB_SHM_LOGICAL,
+  RMATLAB_SHM_COMPLEX
+} RMatlabShmType;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  int type;               /* 0 if there is no array in the segment. */
+  int ndims;
+  int consumed;           /* set by the reader once it has copied the data. */
+  int pad;
+  long long dims[RMATLAB_SHM_MAX_DIMS];
+  long long length;       /* number of elements. */
+  long long dataOffset;   /* offset of the data from the start of the segment. */
+  long long needed;       /* size of segment the writer needed if this one was too small. */
+} RMatlabShmHeader;
+
+#define RMATLAB_SHM_DATA_OFFSET  ((sizeof(RMatlabShmHeader) + 63) & ~((size_t) 63))
+
+size_t RMatlabShm_elementSize(int type);
+size_t RMatlabShm_segmentSize(int type, long long length);
+
+void *RMatlabShm_create(const char *name, size_t size);
+void *RMatlabShm_open(const char *name, size_t *size);
+void RMatlabShm_close(void *ptr, size_t size);
+int RMatlabShm_unlink(const char *name);
+char *RMatlabShm_uniqueName(char *buf, size_t len);
+
+RMatlabShmHeader *RMatlabShm_initHeader(void *segment, int type, int ndims, const long long *dims);
+RMatlabShmHeader *RMatlabShm_checkHeader(void *segment, size_t size);
+RMatlabShmHeader *RMatlabShm_clearHeader(void *segment);
+
+/*
+ R's end of the connection (shm.c): the segment it writes arrays into and
+ asks Matlab to write into, replaced by a larger one when an array doesn't
+ fit.  Once the other side has mapped it, its name is removed.
+*/
+typedef struct {
+  char name[64];
+  void *segment;
+  size_t size;
+  int unlinked;
+} RMatlabShmSegment;
+
+void *RMatlabShm_reserve(RMatlabShmSegment *seg, size_t size);
+void RMatlabShm_mapped(RMatlabShmSegment *seg);
+void RMatlabShm_release(RMatlabShmSegment *seg);
+
+/*
+ Matlab's end (RMatlabShm.c): the mapping of the most recent segment R
+ named, kept for the subsequent calls as R may remove the name.
+*/
+typedef struct {
+  char name[256];
+  void *segment;
+  size_t size;
+} RMatlabShmMapping;
+
+RMatlabShmHeader *RMatlabShm_map(RMatlabShmMapping *m, const char *name);
+void RMatlabShm_unmap(RMatlabShmMapping *m);
+RMatlabShmHeader *RMatlabShm_reply(RMatlabShmMapping *m, int type, int ndims, const long long *dims);
+
+#define RMatlabShm_data(hdr) ((void *) ((char *) (hdr) + (hdr)->dataOffset))
+
+#endif
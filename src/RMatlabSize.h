@@ -0,0 +1,17 @@
+#ifndef R_MATLAB_SIZE_H
+#define R_MATLAB_SIZE_H
+
+#include "matrix.h"
+
+/*
+ mwSize and mwIndex are the types of the dimensions and indices of Matlab
+ arrays: 64 bits with -largeArrayDims and -R2018a, where an int * passed as
+ the dimensions is read with the wrong width.  We always use mwSize for
+ these.  Matlab before 7.3 doesn't define them and uses int.
+*/
+#ifndef MWSIZE_MAX
+typedef int mwSize;
+typedef int mwIndex;
+#endif
+
+#endif
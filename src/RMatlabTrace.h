@@ -0,0 +1,66 @@
+#ifndef R_MATLAB_TRACE_H
+#define R_MATLAB_TRACE_H
+
+#include "mex.h"
+#include <Rinternals.h>
+
+#include <stddef.h>
+
+/*
+ Tracing the calls between R and Matlab (trace.c).
+
+ When tracing is on, the calls to R from Matlab, to Matlab from R and the
+ conversions of their arguments and results record their start and end
+ time, thread, name and the size of the data in a ring buffer.
+ This can be written as a Chrome trace (JSON) file for viewing in
+ chrome://tracing or Perfetto.
+
+ The MEX files (initializeR, callR, callNamedR, callRAsync) and RMatlab.so
+ are separate shared libraries, so, as for the R worker, the trace is
+ published as a uint64 scalar holding its address in the Matlab global
+ variable RMatlabTrace and each entry point looks it up with
+ RMatlab_traceUseShared().  When R runs the Matlab engine, only RMatlab.so
+ is involved and it keeps its own trace.
+
+ Recording an event is lock free so the R worker thread and Matlab's thread
+ can both record.  When the buffer is full, the oldest events are overwritten.
+*/
+
+#define RMATLAB_TRACE_MAGIC      0x524D5452   /* RMTR */
+#define RMATLAB_TRACE_VARIABLE   "RMatlabTrace"
+#define RMATLAB_TRACE_SIZE       65536
+
+typedef struct {
+  volatile size_t seq;      /* the event's position + 1, set once the event is complete. */
+  double begin, end;        /* microseconds since the trace was created. */
+  double bytes;             /* the size of the data, or -1. */
+  unsigned long thread;
+  char name[24];
+  char detail[64];
+} RMatlabTraceEvent;
+
+typedef struct {
+  unsigned int magic;
+  volatile int enabled;
+  double start;             /* seconds, from the monotonic clock. */
+  size_t capacity;
+  volatile size_t next;
+  RMatlabTraceEvent *events;
+} RMatlabTrace;
+
+RMatlabTrace *RMatlab_traceCreate(size_t capacity);
+void RMatlab_tracePublish(RMatlabTrace *trace);
+void RMatlab_traceUseShared();
+void RMatlab_traceUse(RMatlabTrace *trace);
+RMatlabTrace *RMatlab_traceCurrent();
+
+double RMatlab_traceBegin();
+void RMatlab_traceEnd(double begin, const char *name, const char *detail, double bytes);
+
+int RMatlab_traceWrite(RMatlabTrace *trace, const char *fileName);
+int RMatlab_traceWriteToDir(RMatlabTrace *trace);
+
+double RMatlab_traceArrayBytes(const mxArray *val);
+double RMatlab_traceRBytes(SEXP val);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef R_MATLAB_WATCHDOG_H
+#define R_MATLAB_WATCHDOG_H
+
+#include <Rinternals.h>
+#include <pthread.h>
+
+/*
+ A thread that watches a call from one interpreter into the other and
+ interrupts it if it takes longer than the timeout or if the user asks
+ to cancel it (poll returns non-zero).
+ fire is called on the watchdog thread with the reason. If the call
+ still hasn't finished grace seconds later, fire is called again with
+ escalate set so that it can take more drastic action.
+ See watchdog.c.
+*/
+
+typedef enum {
+  RMATLAB_NOT_CANCELLED = 0,
+  RMATLAB_TIMED_OUT,
+  RMATLAB_INTERRUPTED
+} RMatlabCancelReason;
+
+typedef void (*RMatlabWatchdogFire)(void *data, RMatlabCancelReason reason, int escalate);
+typedef int (*RMatlabWatchdogPoll)(void *data);
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  int done, running;
+
+  double timeout;            /* seconds, or negative for no limit. */
+  double grace;              /* seconds before escalating, or negative to never escalate. */
+  RMatlabWatchdogFire fire;
+  RMatlabWatchdogPoll poll;
+  void *data;
+
+  RMatlabCancelReason reason;
+  int escalated;
+} RMatlabWatchdog;
+
+int RMatlabWatchdog_start(RMatlabWatchdog *dog, double timeout, double grace,
+                           RMatlabWatchdogFire fire, RMatlabWatchdogPoll poll, void *data);
+RMatlabCancelReason RMatlabWatchdog_stop(RMatlabWatchdog *dog);
+
+SEXP RMatlab_tryEvalWithTimeout(SEXP e, SEXP env, int *errorOccurred, RMatlabCancelReason *reason);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef R_MATLAB_WORKER_H
+#define R_MATLAB_WORKER_H
+
+#include "RMatlabConvert.h"
+#include "RMatlabTrace.h"
+
+#include <pthread.h>
+
+/*
+ The R worker thread used when initializeR is called with the 'async'
+ option.  The worker thread initializes R and is the only thread that
+ evaluates R code.  Matlab queues calls via callRAsync (and callR and
+ callNamedR) and collects their results later.
+
+ initializeR, callR, callNamedR and callRAsync are separate MEX files and so
+ do not share any static variables.  initializeR publishes the address
+ of the RMatlabWorker as a uint64 scalar in the Matlab global variable
+ RMatlabWorker and the other MEX files find it there.
+*/
+
+#define RMATLAB_WORKER_MAGIC    0x524D574B   /* RMWK */
+#define RMATLAB_WORKER_VARIABLE "RMatlabWorker"
+
+typedef enum {
+  RMATLAB_JOB_QUEUED,
+  RMATLAB_JOB_RUNNING,
+  RMATLAB_JOB_DONE,
+  RMATLAB_JOB_ERROR
+} RMatlabJobStatus;
+
+typedef struct _RMatlabJob {
+  int id;
+  RMatlabJobStatus status;
+
+  char *funcName;
+  int nargs;
+  mxArray **args;       /* persistent copies of the Matlab arguments. */
+  mxArray *namedArgs;   /* persistent copy of the cell or struct of named arguments, or NULL. */
+
+  SEXP result;          /* preserved until the job is collected; an RMatlabRError if the call failed in R. */
+  char *errorMessage;
+  const char *errorId;  /* the Matlab error identifier for errorMessage. */
+  int cancelled;        /* set by RMatlabWorker_cancel(). */
+
+    /* Set when the job is collected: the worker converts result and releases it. */
+  int finishing, finished;
+  mxArray *output;      /* the result converted to Matlab. */
+  RMatlabErrorInfo *error;  /* the details of an R error, for RLastError. */
+  RMatlabTrace *trace;  /* the trace in use when the call was submitted, or NULL. */
+
+  struct _RMatlabJob *next;
+} RMatlabJob;
+
+typedef int (*RMatlabWorkerInitFun)(int argc, char **argv);
+typedef void (*RMatlabWorkerEndFun)();
+
+typedef struct {
+  unsigned int magic;
+
+  pthread_mutex_t lock;       /* protects the fields below and the jobs. */
+  pthread_cond_t changed;     /* signalled when a job is queued or finishes. */
+
+  pthread_t thread;           /* the only thread that uses R. */
+  int started, initStatus, shutdown;
+
+  int nextId;
+  RMatlabJob *jobs;           /* the jobs not yet collected, in the order submitted. */
+
+  int argc;
+  char **argv;
+  RMatlabWorkerInitFun initR;
+  RMatlabWorkerEndFun endR;
+} RMatlabWorker;
+
+
+RMatlabWorker *RMatlabWorker_start(int argc, char **argv, RMatlabWorkerInitFun initR, RMatlabWorkerEndFun endR);
+void RMatlabWorker_stop(RMatlabWorker *worker);
+
+void RMatlabWorker_publish(RMatlabWorker *worker);
+RMatlabWorker *RMatlabWorker_find();
+
+int RMatlabWorker_submit(RMatlabWorker *worker, const char *funcName, int nargs, const mxArray *args[],
+                          const mxArray *namedArgs);
+int RMatlabWorker_status(RMatlabWorker *worker, int id);
+int RMatlabWorker_wait(RMatlabWorker *worker, int id, double timeout);
+int RMatlabWorker_cancel(RMatlabWorker *worker, int id);
+void RMatlabWorker_collect(RMatlabWorker *worker, int id, int nout, mxArray *output[]);
+
+#endif
@@ -0,0 +1,800 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ Converting R factors, data frames and the attributes of other R objects.
+
+ A factor becomes a Matlab categorical array whose categories are the
+ factor's levels (ordinal for an ordered factor), and a data frame becomes
+ a table with the names of the columns as its variable names and, unless
+ they are the default 1, 2, ..., its row names.  These go back to R the
+ same way.  Categorical arrays and tables are Matlab objects which we can
+ only create and take apart by calling Matlab functions, so we do this only
+ when the caller has told us via RMatlab_convertConfigure() that we are on
+ Matlab's thread in a MEX session.
+
+ Otherwise, i.e. via the Matlab engine or on the R worker thread, we use the
+ "attribute" form: a 1x1 struct with fields data, the value converted without
+ its attributes, and RAttributes, a struct with a field for each of the R
+ object's attributes other than dim.  convertToR() restores the attributes
+ from this form, so a factor survives a round trip.  When the R option
+ RMatlab.attributes is TRUE, any R vector with attributes, e.g. a named
+ vector or a matrix with dimnames, is converted to this form too.
+ Matlab field names can only have letters, digits and '_' and must start
+ with a letter, so, as matlab.lang.makeValidName() does, other characters
+ become '_' and a name that doesn't start with a letter gets an 'x' in front.
+ RAttributes.row_names is restored as row.names.
+
+ The references to R objects in references.c are converted here too.
+
+ RMatlab_portableArray() turns categorical arrays and tables into the
+ attribute form on Matlab's thread for the arguments of calls that are
+ converted to R on the worker thread.  The results of these calls are
+ converted on the worker thread too, with RMATLAB_CONVERT_DEFERRED, which
+ puts data frames in the attribute form as well, and RMatlab_nativeArray()
+ makes the categorical arrays, tables and RReferences from these on
+ Matlab's thread when the call is collected.
+*/
+
+static int CanCallMatlab = 0;
+static int Deferred = 0;
+static int KeepAttributes = 0;
+
+static const char *AttributeFields[] = {"data", "RAttributes"};
+
+
+void
+RMatlab_convertConfigure(int canCallMatlab)
+{
+  static SEXP optionSym = NULL;
+  SEXP opt;
+
+  if(!optionSym)
+    optionSym = Rf_install("RMatlab.attributes");
+
+  opt = Rf_GetOption1(optionSym);
+  KeepAttributes = TYPEOF(opt) == LGLSXP && Rf_length(opt) && LOGICAL(opt)[0] == TRUE;
+  CanCallMatlab = canCallMatlab == 1;
+  Deferred = canCallMatlab == RMATLAB_CONVERT_DEFERRED;
+
+  RMatlab_parallelConfigure();
+  RMatlab_budgetConfigure(CanCallMatlab);
+}
+
+/*
+  Call the Matlab function, returning its single result or NULL if it fails.
+  This must be called on Matlab's thread.
+*/
+mxArray *
+RMatlab_callMatlab(const char *funcName, int nargs, const mxArray **args)
+{
+  mxArray *ans = NULL;
+
+  mexSetTrapFlag(1);
+  if(mexCallMATLAB(1, &ans, nargs, (mxArray **) args, funcName))
+    return(NULL);
+
+  return(ans);
+}
+
+/*
+  The Properties.<name> of a Matlab table.
+*/
+static mxArray *
+tableProperty(const mxArray *table, const char *name)
+{
+  const mxArray *args[4];
+  mxArray *index, *ans;
+
+  args[0] = mxCreateString(".");
+  args[1] = mxCreateString("Properties");
+  args[2] = args[0];
+  args[3] = mxCreateString(name);
+  index = RMatlab_callMatlab("substruct", 4, args);
+  mxDestroyArray((mxArray *) args[0]);
+  mxDestroyArray((mxArray *) args[1]);
+  mxDestroyArray((mxArray *) args[3]);
+  if(!index)
+    return(NULL);
+
+  args[0] = table;
+  args[1] = index;
+  ans = RMatlab_callMatlab("subsref", 2, args);
+  mxDestroyArray(index);
+
+  return(ans);
+}
+
+static int
+isMatlabClass(const mxArray *val, const char *className)
+{
+  return(strcmp(mxGetClassName(val), className) == 0);
+}
+
+static int
+isAttributeStruct(const mxArray *val)
+{
+  return(mxIsStruct(val) && mxGetNumberOfElements(val) == 1 && mxGetNumberOfFields(val) == 2
+          && mxGetFieldNumber(val, "data") >= 0 && mxGetFieldNumber(val, "RAttributes") >= 0
+          && mxIsStruct(mxGetField(val, 0, "RAttributes")));
+}
+
+  /* The attributes that record the Matlab type of a value we converted to R. */
+static int
+isMatlabTypeAttribute(SEXP tag)
+{
+  return(tag == Rf_install("MatlabMode") || tag == Rf_install("Csingle"));
+}
+
+static int
+isAutomaticRowNames(SEXP tag, SEXP value)
+{
+  return(tag == R_RowNamesSymbol && TYPEOF(value) == INTSXP && Rf_length(value) == 2
+           && INTEGER(value)[0] == NA_INTEGER);
+}
+
+
+/*
+  Does convertFromR() convert this R value here rather than as a plain vector or list.
+*/
+int
+RMatlab_convertsAttributes(SEXP val)
+{
+  SEXP a;
+
+  if(Rf_isFactor(val) || RMatlab_isRReference(val))
+    return(1);
+
+  if(TYPEOF(val) == VECSXP && Rf_inherits(val, "data.frame"))
+    return(CanCallMatlab || Deferred || KeepAttributes);
+
+  if(!KeepAttributes || !Rf_isVector(val))
+    return(0);
+
+    /* Lists keep their names as the fields of a struct. */
+  for(a = ATTRIB(val); a != R_NilValue; a = CDR(a))
+    if(TAG(a) != R_DimSymbol && !isMatlabTypeAttribute(TAG(a))
+         && !(TYPEOF(val) == VECSXP && TAG(a) == R_NamesSymbol))
+      return(1);
+
+  return(0);
+}
+
+
+/*
+  The codes of a factor as doubles, with NaN for NA, which is how
+  categorical() and double() in Matlab represent undefined elements.
+*/
+static mxArray *
+factorCodes(SEXP val)
+{
+  SEXP dim = GET_DIM(val);
+  mxArray *ans;
+  double *codes;
+  int i, n = Rf_length(val);
+
+  if(Rf_length(dim))
+    ans = mxCreateNumericArray(Rf_length(dim), RMatlab_dimsFromR(dim), mxDOUBLE_CLASS, mxREAL);
+  else
+    ans = mxCreateDoubleMatrix(n, 1, mxREAL);
+
+  codes = mxGetPr(ans);
+  for(i = 0; i < n; i++)
+    codes[i] = INTEGER(val)[i] == NA_INTEGER ? mxGetNaN() : (double) INTEGER(val)[i];
+
+  return(ans);
+}
+
+static mxArray *
+factorToCategorical(SEXP val)
+{
+  SEXP levels = Rf_getAttrib(val, R_LevelsSymbol);
+  const mxArray *args[5];
+  mxArray *ans;
+  int i, n = Rf_length(levels), nargs = 3;
+
+    /* categorical(codes, 1:nlevels, levels), so each level appears once whatever the number of elements. */
+  args[0] = factorCodes(val);
+  args[1] = mxCreateDoubleMatrix(1, n, mxREAL);
+  for(i = 0; i < n; i++)
+    mxGetPr((mxArray *) args[1])[i] = i + 1;
+  args[2] = convertFromR(levels, 1, NULL);
+  if(Rf_inherits(val, "ordered")) {
+    args[3] = mxCreateString("Ordinal");
+    args[4] = mxCreateLogicalScalar(1);
+    nargs = 5;
+  }
+
+  ans = RMatlab_callMatlab("categorical", nargs, args);
+  for(i = 0; i < nargs; i++)
+    mxDestroyArray((mxArray *) args[i]);
+
+  return(ans);
+}
+
+static mxArray *
+dataFrameToTable(SEXP val)
+{
+  SEXP names = GET_NAMES(val), rowNames;
+  const mxArray **args;
+  mxArray *ans = NULL;
+  int i, n = Rf_length(val), nargs = n, ok = 1;
+
+  args = (const mxArray **) mxCalloc(n + 4, sizeof(mxArray *));
+  for(i = 0; i < n; i++)
+    ok = (args[i] = convertFromR(VECTOR_ELT(val, i), 1, NULL)) != NULL && ok;
+
+  args[nargs++] = mxCreateString("VariableNames");
+  args[nargs++] = convertFromR(names, 1, NULL);
+
+  rowNames = Rf_getAttrib(val, R_RowNamesSymbol);
+  if(TYPEOF(rowNames) == STRSXP) {
+    args[nargs++] = mxCreateString("RowNames");
+    args[nargs++] = convertFromR(rowNames, 1, NULL);
+  }
+
+  if(ok)
+    ans = RMatlab_callMatlab("table", nargs, args);
+
+  for(i = 0; i < nargs; i++)
+    if(args[i])
+      mxDestroyArray((mxArray *) args[i]);
+  mxFree(args);
+
+  return(ans);
+}
+
+  /* namelengthmax in Matlab. */
+#define MAX_FIELD_NAME 63
+
+/*
+  The name of an R attribute as a valid Matlab field name that isn't one
+  of the first n names, allocated with mxCalloc().
+*/
+static char *
+validFieldName(const char *name, const char **names, int n)
+{
+  char *ans, *ptr;
+  size_t len;
+  int i, k;
+
+  ans = (char *) mxCalloc(MAX_FIELD_NAME + 1, sizeof(char));
+  snprintf(ans, MAX_FIELD_NAME + 1, "%s%s", isalpha((unsigned char) name[0]) ? "" : "x", name);
+  for(ptr = ans; *ptr; ptr++)
+    if(!isalnum((unsigned char) *ptr) && *ptr != '_')
+      *ptr = '_';
+
+    /* e.g. dim.names and dim_names, so add a number as makeUniqueStrings() does. */
+  len = strlen(ans);
+  for(k = 1, i = 0; i < n; i++)
+    if(strcmp(ans, names[i]) == 0) {
+      snprintf(ans + (len > MAX_FIELD_NAME - 8 ? MAX_FIELD_NAME - 8 : len), 9, "_%d", k++);
+      i = -1;
+    }
+
+  return(ans);
+}
+
+/*
+  The attribute form of the R value.
+*/
+static mxArray *
+attributeStruct(SEXP val)
+{
+  mxArray *ans, *data, *attrs;
+  const char **names;
+  SEXP tmp, a;
+  int i, n = 0;
+
+  for(a = ATTRIB(val); a != R_NilValue; a = CDR(a))
+    n++;
+  names = (const char **) mxCalloc(n > 0 ? n : 1, sizeof(char *));
+
+  for(a = ATTRIB(val), n = 0; a != R_NilValue; a = CDR(a)) {
+    if(TAG(a) == R_DimSymbol || isMatlabTypeAttribute(TAG(a)) || isAutomaticRowNames(TAG(a), CAR(a)))
+      continue;
+    names[n] = validFieldName(CHAR(PRINTNAME(TAG(a))), names, n);
+    n++;
+  }
+
+  attrs = mxCreateStructMatrix(1, 1, n, names);
+  for(i = 0; i < n; i++)
+    mxFree((char *) names[i]);
+  mxFree(names);
+  if(!attrs) {
+    PROBLEM "Cannot create the Matlab struct for the attributes of the R value"
+    ERROR;
+  }
+
+  for(a = ATTRIB(val), i = 0; a != R_NilValue; a = CDR(a)) {
+    if(TAG(a) == R_DimSymbol || isMatlabTypeAttribute(TAG(a)) || isAutomaticRowNames(TAG(a), CAR(a)))
+      continue;
+    mxSetFieldByNumber(attrs, 0, i++, convertFromR(CAR(a), 1, NULL));
+  }
+
+  if(Rf_isFactor(val))
+    data = factorCodes(val);
+  else {
+      /* The value without the attributes, other than dim and a list's names. */
+    PROTECT(tmp = Rf_shallow_duplicate(val));
+    for(a = ATTRIB(val); a != R_NilValue; a = CDR(a))
+      if(TAG(a) != R_DimSymbol && !(TYPEOF(val) == VECSXP && TAG(a) == R_NamesSymbol))
+        Rf_setAttrib(tmp, TAG(a), R_NilValue);
+    data = convertFromR(tmp, 1, NULL);
+    UNPROTECT(1);
+  }
+
+  ans = mxCreateStructMatrix(1, 1, 2, AttributeFields);
+  if(!ans) {
+    mxDestroyArray(data);
+    mxDestroyArray(attrs);
+    PROBLEM "Cannot create the Matlab struct for the R value with attributes"
+    ERROR;
+  }
+  mxSetFieldByNumber(ans, 0, 0, data);
+  mxSetFieldByNumber(ans, 0, 1, attrs);
+
+  return(ans);
+}
+
+/*
+  Convert a value for which RMatlab_convertsAttributes() is TRUE.
+*/
+mxArray *
+RMatlab_attributesFromR(SEXP val)
+{
+  mxArray *ans = NULL;
+
+  if(RMatlab_isRReference(val))
+    return(RMatlab_referenceFromR(val, CanCallMatlab));
+
+  if(CanCallMatlab) {
+    if(Rf_isFactor(val))
+      ans = factorToCategorical(val);
+    else if(TYPEOF(val) == VECSXP && Rf_inherits(val, "data.frame"))
+      ans = dataFrameToTable(val);
+  }
+
+    /* If Matlab couldn't create the categorical or table, e.g. an old version of Matlab, we fall back to this. */
+  if(!ans)
+    ans = attributeStruct(val);
+
+  return(ans);
+}
+
+
+/*
+  Is this Matlab value converted by RMatlab_attributesToR().
+*/
+int
+RMatlab_isAttributeArray(const mxArray *val)
+{
+  return(isMatlabClass(val, "categorical") || isMatlabClass(val, "table") || isAttributeStruct(val)
+           || RMatlab_isReferenceArray(val));
+}
+
+  /* convertToR() of a Matlab struct gives it the class "struct" which we don't want here. */
+static SEXP
+convertPlainToR(const mxArray *val)
+{
+  SEXP ans = convertToR(val);
+
+  if(val && mxIsStruct(val) && TYPEOF(ans) == VECSXP)
+    Rf_setAttrib(ans, R_ClassSymbol, R_NilValue);
+
+  return(ans);
+}
+
+static SEXP
+factorFromParts(const mxArray *codes, const mxArray *categories, int ordered)
+{
+  SEXP ans, levels, klass;
+
+  PROTECT(ans = Rf_coerceVector(convertToR(codes), INTSXP));
+  if(mxGetNumberOfElements(categories) == 0)
+    PROTECT(levels = allocVector(STRSXP, 0));
+  else
+    PROTECT(levels = convertToR(categories));
+  Rf_setAttrib(ans, R_LevelsSymbol, levels);
+
+  PROTECT(klass = allocVector(STRSXP, ordered ? 2 : 1));
+  if(ordered)
+    SET_STRING_ELT(klass, 0, mkChar("ordered"));
+  SET_STRING_ELT(klass, ordered, mkChar("factor"));
+  Rf_classgets(ans, klass);
+  UNPROTECT(3);
+
+  return(ans);
+}
+
+static void
+setAutomaticRowNames(SEXP ans)
+{
+  SEXP rowNames;
+
+  PROTECT(rowNames = allocVector(INTSXP, 2));
+  INTEGER(rowNames)[0] = NA_INTEGER;
+  INTEGER(rowNames)[1] = -(Rf_length(ans) ? Rf_length(VECTOR_ELT(ans, 0)) : 0);
+  Rf_setAttrib(ans, R_RowNamesSymbol, rowNames);
+  UNPROTECT(1);
+}
+
+static void
+destroyArrays(mxArray **arrays, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(arrays[i])
+      mxDestroyArray(arrays[i]);
+}
+
+static SEXP
+categoricalToFactor(const mxArray *val)
+{
+  mxArray *parts[3];  /* the codes, categories and whether it is ordinal. */
+  SEXP ans;
+
+  if(!CanCallMatlab) {
+    PROBLEM "Cannot convert a Matlab categorical array to R here. Use double() and categories() in Matlab"
+    ERROR;
+  }
+
+  parts[0] = RMatlab_callMatlab("double", 1, &val);
+  parts[1] = RMatlab_callMatlab("categories", 1, &val);
+  parts[2] = RMatlab_callMatlab("isordinal", 1, &val);
+  if(!parts[0] || !parts[1] || !parts[2]) {
+    destroyArrays(parts, 3);
+    PROBLEM "Cannot get the codes and categories of the Matlab categorical array"
+    ERROR;
+  }
+
+  PROTECT(ans = factorFromParts(parts[0], parts[1], mxIsLogicalScalarTrue(parts[2])));
+  destroyArrays(parts, 3);
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+static SEXP
+tableToDataFrame(const mxArray *val)
+{
+  const mxArray *args[3];
+  mxArray *parts[5];  /* the columns, the names, the row names and the arguments of table2struct. */
+  SEXP ans;
+
+  if(!CanCallMatlab) {
+    PROBLEM "Cannot convert a Matlab table to R here. Use table2struct() in Matlab"
+    ERROR;
+  }
+
+  args[0] = val;
+  args[1] = parts[3] = mxCreateString("ToScalar");
+  args[2] = parts[4] = mxCreateLogicalScalar(1);
+  parts[0] = RMatlab_callMatlab("table2struct", 3, args);
+  parts[1] = tableProperty(val, "VariableNames");
+  parts[2] = tableProperty(val, "RowNames");
+  if(!parts[0] || !parts[1]) {
+    destroyArrays(parts, 5);
+    PROBLEM "Cannot get the variables of the Matlab table"
+    ERROR;
+  }
+
+  PROTECT(ans = convertPlainToR(parts[0]));
+  if(mxGetNumberOfElements(parts[1]))
+    SET_NAMES(ans, convertToR(parts[1]));
+  Rf_classgets(ans, mkString("data.frame"));
+  if(parts[2] && mxGetNumberOfElements(parts[2]))
+    Rf_setAttrib(ans, R_RowNamesSymbol, convertToR(parts[2]));
+  else
+    setAutomaticRowNames(ans);
+  destroyArrays(parts, 5);
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+/*
+  Restore the value and its attributes from the attribute form.
+*/
+static SEXP
+attributeStructToR(const mxArray *val)
+{
+  const mxArray *attrs = mxGetField(val, 0, "RAttributes");
+  char name[256];
+  SEXP ans, el;
+  int i, n;
+
+  PROTECT(ans = convertPlainToR(mxGetField(val, 0, "data")));
+
+    /* The codes of a factor come back as doubles. */
+  el = convertPlainToR(mxGetField(attrs, 0, "class"));
+  if(TYPEOF(el) == STRSXP && Rf_length(el) && strcmp(CHAR(STRING_ELT(el, Rf_length(el) - 1)), "factor") == 0) {
+    UNPROTECT(1);
+    PROTECT(ans = Rf_coerceVector(ans, INTSXP));
+  }
+
+  n = mxGetNumberOfFields(attrs);
+  for(i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "%s", mxGetFieldNameByNumber(attrs, i));
+    if(strcmp(name, "row_names") == 0)
+      strcpy(name, "row.names");
+
+    el = convertPlainToR(mxGetFieldByNumber(attrs, 0, i));
+      /* e.g. a character matrix comes back from a cell as a vector, so it cannot have dimnames. */
+    if(el != R_NilValue && !(strcmp(name, "dimnames") == 0 && Rf_length(el) != Rf_length(GET_DIM(ans)))
+         && !(strcmp(name, "names") == 0 && Rf_length(el) != Rf_length(ans))) {
+      PROTECT(el);
+      Rf_setAttrib(ans, Rf_install(name), el);
+      UNPROTECT(1);
+    }
+  }
+
+  if(Rf_inherits(ans, "data.frame") && mxGetFieldNumber(attrs, "row_names") < 0)
+    setAutomaticRowNames(ans);
+
+  UNPROTECT(1);
+  return(ans);
+}
+
+SEXP
+RMatlab_attributesToR(const mxArray *val)
+{
+  if(RMatlab_isReferenceArray(val))
+    return(RMatlab_referenceToR(val, CanCallMatlab));
+  if(isMatlabClass(val, "categorical"))
+    return(categoricalToFactor(val));
+  if(isMatlabClass(val, "table"))
+    return(tableToDataFrame(val));
+
+  return(attributeStructToR(val));
+}
+
+
+/*
+  The attribute form of a categorical array or table.
+  This must be called on Matlab's thread.
+*/
+static mxArray *
+toAttributeStruct(const mxArray *val)
+{
+  static const char *factorFields[] = {"levels", "class"};
+  static const char *dataFrameFields[] = {"names", "class", "row_names"};
+  const mxArray *args[3];
+  mxArray *ans, *attrs, *data, *klass, *tmp;
+  int ordered;
+
+  if(isMatlabClass(val, "categorical")) {
+    data = RMatlab_callMatlab("double", 1, &val);
+    attrs = mxCreateStructMatrix(1, 1, 2, factorFields);
+    mxSetFieldByNumber(attrs, 0, 0, RMatlab_callMatlab("categories", 1, &val));
+    tmp = RMatlab_callMatlab("isordinal", 1, &val);
+    ordered = tmp && mxIsLogicalScalarTrue(tmp);
+    if(tmp)
+      mxDestroyArray(tmp);
+    klass = mxCreateCellMatrix(ordered + 1, 1);
+    if(ordered)
+      mxSetCell(klass, 0, mxCreateString("ordered"));
+    mxSetCell(klass, ordered, mxCreateString("factor"));
+    mxSetFieldByNumber(attrs, 0, 1, klass);
+  } else {
+    args[0] = val;
+    args[1] = mxCreateString("ToScalar");
+    args[2] = mxCreateLogicalScalar(1);
+    data = RMatlab_callMatlab("table2struct", 3, args);
+    mxDestroyArray((mxArray *) args[1]);
+    mxDestroyArray((mxArray *) args[2]);
+    tmp = tableProperty(val, "RowNames");
+    attrs = mxCreateStructMatrix(1, 1, tmp && mxGetNumberOfElements(tmp) ? 3 : 2, dataFrameFields);
+    mxSetFieldByNumber(attrs, 0, 0, tableProperty(val, "VariableNames"));
+    mxSetFieldByNumber(attrs, 0, 1, mxCreateString("data.frame"));
+    if(tmp && mxGetNumberOfElements(tmp))
+      mxSetFieldByNumber(attrs, 0, 2, tmp);
+    else if(tmp)
+      mxDestroyArray(tmp);
+  }
+
+  if(!data) {
+    mxDestroyArray(attrs);
+    return(NULL);
+  }
+
+  ans = mxCreateStructMatrix(1, 1, 2, AttributeFields);
+  mxSetFieldByNumber(ans, 0, 0, data);
+  mxSetFieldByNumber(ans, 0, 1, attrs);
+
+  return(ans);
+}
+
+/*
+  A copy of the value that convertToR() can convert without calling Matlab,
+  i.e. with the categorical arrays and tables at the top level, in a cell
+  or in the fields of a scalar struct in the attribute form.  This must be called on Matlab's thread.
+*/
+mxArray *
+RMatlab_portableArray(const mxArray *val)
+{
+  mxArray *ans, *el;
+  int i, n;
+
+  if(isMatlabClass(val, "categorical") || isMatlabClass(val, "table"))
+    if((ans = toAttributeStruct(val)))
+      return(ans);
+
+  if(isMatlabClass(val, "RReference"))
+    if((ans = RMatlab_portableReference(val)))
+      return(ans);
+
+  ans = mxDuplicateArray(val);
+  if(mxIsCell(ans)) {
+    n = mxGetNumberOfElements(ans);
+    for(i = 0; i < n; i++) {
+      el = mxGetCell(ans, i);
+      if(el && (isMatlabClass(el, "categorical") || isMatlabClass(el, "table") || isMatlabClass(el, "RReference"))) {
+        mxSetCell(ans, i, RMatlab_portableArray(el));
+        mxDestroyArray(el);
+      }
+    }
+  } else if(mxIsStruct(ans) && mxGetNumberOfElements(ans) == 1) {
+      /* The fields of a struct of named arguments for callNamedR. */
+    n = mxGetNumberOfFields(ans);
+    for(i = 0; i < n; i++) {
+      el = mxGetFieldByNumber(ans, 0, i);
+      if(el && (isMatlabClass(el, "categorical") || isMatlabClass(el, "table") || isMatlabClass(el, "RReference"))) {
+        mxSetFieldByNumber(ans, 0, i, RMatlab_portableArray(el));
+        mxDestroyArray(el);
+      }
+    }
+  }
+
+  return(ans);
+}
+
+
+/*
+  The last of the classes in the attribute form, e.g. "factor" for an
+  ordered factor, and whether the first is "ordered".
+*/
+static void
+attributeClass(const mxArray *attrs, char *buf, size_t len, int *ordered)
+{
+  const mxArray *klass = mxGetField(attrs, 0, "class"), *el;
+  char first[16] = "";
+  size_t n;
+
+  buf[0] = '\0';
+  *ordered = 0;
+  if(!klass || !mxIsCell(klass) || (n = mxGetNumberOfElements(klass)) == 0)
+    return;
+
+  if((el = mxGetCell(klass, n - 1)) && mxIsChar(el))
+    mxGetString(el, buf, len);
+  if(n > 1 && (el = mxGetCell(klass, 0)) && mxIsChar(el)) {
+    mxGetString(el, first, sizeof(first));
+    *ordered = strcmp(first, "ordered") == 0;
+  }
+}
+
+static mxArray *
+attributeStructToCategorical(const mxArray *data, const mxArray *attrs, int ordered)
+{
+  const mxArray *args[5], *levels = mxGetField(attrs, 0, "levels");
+  mxArray *ans, *values;
+  int i, n, nargs = 3;
+
+  if(!levels || !mxIsCell(levels))
+    return(NULL);
+
+  n = mxGetNumberOfElements(levels);
+  args[0] = data;
+  args[1] = values = mxCreateDoubleMatrix(1, n, mxREAL);
+  for(i = 0; i < n; i++)
+    mxGetPr(values)[i] = i + 1;
+  args[2] = levels;
+  if(ordered) {
+    args[3] = mxCreateString("Ordinal");
+    args[4] = mxCreateLogicalScalar(1);
+    nargs = 5;
+  }
+
+  ans = RMatlab_callMatlab("categorical", nargs, args);
+  mxDestroyArray(values);
+  if(ordered) {
+    mxDestroyArray((mxArray *) args[3]);
+    mxDestroyArray((mxArray *) args[4]);
+  }
+
+  return(ans);
+}
+
+static mxArray *
+attributeStructToTable(const mxArray *data, const mxArray *attrs)
+{
+  const mxArray **args, *names = mxGetField(attrs, 0, "names"), *rowNames = mxGetField(attrs, 0, "row_names");
+  mxArray *variableNames, *rowNamesName = NULL, *ans;
+  int i, n, nargs;
+
+  if(!mxIsStruct(data) || mxGetNumberOfElements(data) != 1 || !names)
+    return(NULL);
+
+  n = mxGetNumberOfFields(data);
+  args = (const mxArray **) mxCalloc(n + 4, sizeof(mxArray *));
+  for(i = 0; i < n; i++)
+    args[i] = mxGetFieldByNumber(data, 0, i);
+  nargs = n;
+  args[nargs++] = variableNames = mxCreateString("VariableNames");
+  args[nargs++] = names;
+  if(rowNames && mxIsCell(rowNames)) {
+    args[nargs++] = rowNamesName = mxCreateString("RowNames");
+    args[nargs++] = rowNames;
+  }
+
+  ans = RMatlab_callMatlab("table", nargs, args);
+  mxDestroyArray(variableNames);
+  if(rowNamesName)
+    mxDestroyArray(rowNamesName);
+  mxFree(args);
+
+  return(ans);
+}
+
+/*
+  The inverse of RMatlab_portableArray() for the result of a call run on
+  the R worker thread: the factors, data frames and references that
+  convertFromR() left in the attribute or struct form there, at any depth,
+  become categorical arrays, tables and RReference objects, as they do when
+  R runs on Matlab's thread.  If Matlab cannot create one, it stays in the
+  attribute form.  val is modified or destroyed, so use the result.
+  This must be called on Matlab's thread.
+*/
+mxArray *
+RMatlab_nativeArray(mxArray *val)
+{
+  mxArray *el, *ans = NULL;
+  char klass[32];
+  int i, j, n, nfields, ordered;
+
+  if(!val)
+    return(NULL);
+
+  if(mxIsCell(val)) {
+    n = mxGetNumberOfElements(val);
+    for(i = 0; i < n; i++)
+      if((el = mxGetCell(val, i)))
+        mxSetCell(val, i, RMatlab_nativeArray(el));
+    return(val);
+  }
+
+  if(!mxIsStruct(val))
+    return(val);
+
+  if(RMatlab_isReferenceArray(val))
+    ans = RMatlab_nativeReference(val);
+  else {
+      /* The columns of a data frame may be factors. */
+    n = mxGetNumberOfElements(val);
+    nfields = mxGetNumberOfFields(val);
+    for(i = 0; i < n; i++)
+      for(j = 0; j < nfields; j++)
+        if((el = mxGetFieldByNumber(val, i, j)))
+          mxSetFieldByNumber(val, i, j, RMatlab_nativeArray(el));
+
+    if(isAttributeStruct(val)) {
+      attributeClass(mxGetField(val, 0, "RAttributes"), klass, sizeof(klass), &ordered);
+      if(strcmp(klass, "factor") == 0)
+        ans = attributeStructToCategorical(mxGetField(val, 0, "data"), mxGetField(val, 0, "RAttributes"), ordered);
+      else if(strcmp(klass, "data.frame") == 0)
+        ans = attributeStructToTable(mxGetField(val, 0, "data"), mxGetField(val, 0, "RAttributes"));
+    }
+  }
+
+  if(!ans)
+    return(val);
+
+  mxDestroyArray(val);
+  return(ans);
+}
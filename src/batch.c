@@ -0,0 +1,234 @@
+#include "RMatlabConvert.h"
+
+#include "RMatlabBroker.h"
+
+#include <Rdefines.h>
+#include <string.h>
+
+/*
+ Evaluation of a collection of Matlab commands in a single round trip
+ to the engine.
+
+ We create a single Matlab script in which each command is evaluated
+ via evalc() within a try-catch block.  The status, the printed output and
+ the error message for each command are collected into a Matlab cell
+ which we retrieve with one call to engGetVariable().
+ Anything else Matlab prints is captured via engOutputBuffer().
+ The output is accumulated in a ring buffer so that we keep the
+ last bufferSize characters if there is more than that.
+*/
+
+#define BATCH_RESULT_VAR "r_batch_result"
+
+Engine *getEngine(SEXP rengine);
+
+typedef struct {
+  char *data;
+  size_t capacity;
+  size_t start;     /* index of the oldest character. */
+  size_t length;
+  int truncated;
+} RMatlabRingBuffer;
+
+
+static void
+ringBufferAppend(RMatlabRingBuffer *buf, const char *text, size_t len)
+{
+  size_t i, pos;
+
+  if(buf->capacity == 0) {
+    buf->truncated = buf->truncated || len > 0;
+    return;
+  }
+
+  if(len > buf->capacity) {
+    text += len - buf->capacity;
+    len = buf->capacity;
+    buf->truncated = 1;
+  }
+
+  for(i = 0; i < len; i++) {
+    pos = (buf->start + buf->length) % buf->capacity;
+    buf->data[pos] = text[i];
+    if(buf->length < buf->capacity)
+      buf->length++;
+    else {
+      buf->start = (buf->start + 1) % buf->capacity;
+      buf->truncated = 1;
+    }
+  }
+}
+
+static SEXP
+ringBufferToR(RMatlabRingBuffer *buf)
+{
+  char *tmp;
+  size_t i;
+
+  tmp = R_alloc(buf->length + 1, sizeof(char));
+  for(i = 0; i < buf->length; i++)
+    tmp[i] = buf->data[(buf->start + i) % buf->capacity];
+  tmp[buf->length] = '\0';
+
+  return(mkString(tmp));
+}
+
+
+/*
+  Write the Matlab string literal for cmd into out, i.e. '...' with
+  the quotes doubled. Newlines cannot appear within a literal, so we
+  create a vector [ 'line1' char(10) 'line2' ].
+  Returns a pointer to the end of what we have written.
+*/
+static char *
+writeMatlabLiteral(char *out, const char *cmd)
+{
+  const char *p;
+
+  out += sprintf(out, "['");
+  for(p = cmd; *p; p++) {
+    if(*p == '\'') {
+      *out++ = '\'';
+      *out++ = '\'';
+    } else if(*p == '\n')
+      out += sprintf(out, "' char(10) '");
+    else
+      *out++ = *p;
+  }
+  out += sprintf(out, "']");
+
+  return(out);
+}
+
+static char *
+createBatchScript(SEXP cmds, int stopOnError)
+{
+  int i, n = Rf_length(cmds);
+  size_t len = 512;
+  char *script, *out;
+
+  /* Compute the worst case: each quote is doubled, each newline becomes
+     ' char(10) ' and each command has about 200 characters of code around it. */
+  for(i = 0; i < n; i++) {
+    const char *p;
+    len += 256;
+    for(p = CHAR(STRING_ELT(cmds, i)); *p; p++)
+      len += (*p == '\n') ? 12 : 2;
+  }
+
+  script = out = R_alloc(len, sizeof(char));
+
+  out += sprintf(out, "r_batch_status = -ones(1, %d); r_batch_output = cell(1, %d); r_batch_errors = cell(1, %d);\n", n, n, n);
+  for(i = 0; i < n; i++) {
+    if(stopOnError)
+      out += sprintf(out, "if ~any(r_batch_status == 1)\n");
+    out += sprintf(out, "try\n r_batch_output{%d} = evalc(", i + 1);
+    out = writeMatlabLiteral(out, CHAR(STRING_ELT(cmds, i)));
+    out += sprintf(out, ");\n r_batch_status(%d) = 0;\ncatch\n r_batch_status(%d) = 1; r_batch_errors{%d} = lasterr;\nend\n", i + 1, i + 1, i + 1);
+    if(stopOnError)
+      out += sprintf(out, "end\n");
+  }
+  out += sprintf(out, BATCH_RESULT_VAR " = {r_batch_status, r_batch_output, r_batch_errors};\n"
+                      "clear r_batch_status r_batch_output r_batch_errors\n");
+
+  return(script);
+}
+
+
+/*
+  Evaluate the Matlab commands given in the character vector cmds
+  and return a list with the status for each command (0 for success,
+  1 for an error and -1 if it was not evaluated because of an earlier error),
+  the error message for each command (or NA) and the printed output.
+*/
+SEXP
+RMatlab_evalStrings(SEXP cmds, SEXP engine, SEXP bufferSize, SEXP stopOnError)
+{
+  RMatlabRingBuffer output;
+  Engine *eng;
+  char *script, *engineOutput = NULL;
+  const mxArray *result = NULL;
+  mxArray *engResult = NULL;
+  SEXP ans, status, errors, names;
+  int i, n = Rf_length(cmds), evalStatus;
+
+  eng = getEngine(engine);
+
+  output.capacity = INTEGER(bufferSize)[0];
+  output.data = R_alloc(output.capacity + 1, sizeof(char));
+  output.start = output.length = 0;
+  output.truncated = 0;
+
+  script = createBatchScript(cmds, LOGICAL(stopOnError)[0]);
+
+  if(eng) {
+    engineOutput = R_alloc(output.capacity + 1, sizeof(char));
+    engineOutput[0] = '\0';
+    RMatlab_engOutputBuffer(eng, engineOutput, output.capacity);
+    evalStatus = RMatlab_engEvalString(eng, script);
+    RMatlab_engOutputBuffer(eng, NULL, 0);
+    if(evalStatus == 0)
+      result = engResult = RMatlab_engGetVariable(eng, BATCH_RESULT_VAR);
+    RMatlab_engEvalString(eng, "clear " BATCH_RESULT_VAR);
+  } else {
+    evalStatus = mexEvalString(script);
+    if(evalStatus == 0)
+      result = mexGetVariablePtr("caller", BATCH_RESULT_VAR);
+  }
+
+  if(!result || !mxIsCell(result) || mxGetNumberOfElements(result) != 3) {
+    if(engResult)
+      mxDestroyArray(engResult);
+    PROBLEM "Failed to evaluate the batch of Matlab commands%s%.2000s",
+             engineOutput && engineOutput[0] ? ": " : "",  engineOutput ? engineOutput : ""
+    ERROR;
+  }
+
+  PROTECT(status = allocVector(INTSXP, n));
+  PROTECT(errors = allocVector(STRSXP, n));
+
+  for(i = 0; i < n; i++) {
+    const mxArray *el;
+
+    INTEGER(status)[i] = mxGetPr(mxGetCell(result, 0))[i];
+
+    el = mxGetCell(mxGetCell(result, 1), i);
+    if(el && mxIsChar(el) && mxGetNumberOfElements(el)) {
+      char *tmp = mxArrayToString(el);
+      ringBufferAppend(&output, tmp, strlen(tmp));
+      mxFree(tmp);
+    }
+
+    el = mxGetCell(mxGetCell(result, 2), i);
+    if(el && mxIsChar(el)) {
+      char *tmp = mxArrayToString(el);
+      SET_STRING_ELT(errors, i, mkChar(tmp));
+      mxFree(tmp);
+    } else
+      SET_STRING_ELT(errors, i, NA_STRING);
+  }
+
+  if(engineOutput)
+    ringBufferAppend(&output, engineOutput, strlen(engineOutput));
+
+  if(eng)
+    mxDestroyArray(engResult);
+  else
+    mexEvalString("clear " BATCH_RESULT_VAR);
+
+  PROTECT(ans = allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(ans, 0, status);
+  SET_VECTOR_ELT(ans, 1, errors);
+  SET_VECTOR_ELT(ans, 2, ringBufferToR(&output));
+  SET_VECTOR_ELT(ans, 3, ScalarLogical(output.truncated));
+
+  PROTECT(names = allocVector(STRSXP, 4));
+  SET_STRING_ELT(names, 0, mkChar("status"));
+  SET_STRING_ELT(names, 1, mkChar("errors"));
+  SET_STRING_ELT(names, 2, mkChar("output"));
+  SET_STRING_ELT(names, 3, mkChar("truncated"));
+  SET_NAMES(ans, names);
+
+  UNPROTECT(4);
+  return(ans);
+}
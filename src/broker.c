@@ -0,0 +1,236 @@
+#include "RMatlabConvert.h"
+#include "RMatlabBroker.h"
+
+#include "Rdefines.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ The R side of a connection to the Matlab engine broker (matlabBroker.c).
+ A connection stands in for the Engine * so that the rest of RMatlab.so
+ doesn't need to know whether it has a Matlab engine of its own or one
+ from the broker.  We keep a list of the connections to tell them apart.
+ All the code that uses an engine calls the RMatlab_eng*() routines here
+ rather than the engine API directly.
+*/
+
+typedef struct _BrokerConnection {
+  RMatlabWire wire;
+  char *output;          /* the buffer given to RMatlab_engOutputBuffer(), if any. */
+  int outputSize;
+  struct _BrokerConnection *next;
+} BrokerConnection;
+
+static BrokerConnection *Connections = NULL;
+
+SEXP R_matlabEngine(Engine *eng);
+
+
+static BrokerConnection *
+getConnection(Engine *eng)
+{
+  BrokerConnection *con;
+
+  for(con = Connections; con; con = con->next)
+    if((Engine *) con == eng)
+      return(con);
+
+  return(NULL);
+}
+
+int
+RMatlab_isBrokered(Engine *eng)
+{
+  return(eng && getConnection(eng) != NULL);
+}
+
+
+/*
+  Connect to the broker listening on the socket path.
+  This waits until the broker has an engine for us, which may
+  involve starting Matlab if all of its engines are in use.
+*/
+Engine *
+RMatlab_brokerOpen(const char *path)
+{
+  BrokerConnection *con;
+  struct sockaddr_un addr;
+  int fd, status;
+
+  if(strlen(path) >= sizeof(addr.sun_path))
+    return(NULL);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return(NULL);
+  if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    return(NULL);
+  }
+
+  con = (BrokerConnection *) calloc(1, sizeof(BrokerConnection));
+  RMatlabWire_init(&con->wire, fd);
+
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_HELLO);
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_MAGIC);
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_VERSION);
+  RMatlabWire_flush(&con->wire);
+  status = RMatlabWire_getInt(&con->wire);
+
+  if(status != 0) {
+    RMatlabWire_free(&con->wire);
+    close(fd);
+    free(con);
+    return(NULL);
+  }
+
+  con->next = Connections;
+  Connections = con;
+
+  return((Engine *) con);
+}
+
+
+int
+RMatlab_engEvalString(Engine *eng, const char *cmd)
+{
+  BrokerConnection *con;
+  char *output;
+  int status;
+
+  if(!(con = getConnection(eng)))
+    return(engEvalString(eng, cmd));
+
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_EVAL);
+  RMatlabWire_putString(&con->wire, cmd);
+  RMatlabWire_putInt(&con->wire, con->output ? con->outputSize : 0);
+  RMatlabWire_flush(&con->wire);
+
+  status = RMatlabWire_getInt(&con->wire);
+  output = RMatlabWire_getString(&con->wire);
+  if(output) {
+    if(con->output && con->outputSize > 0) {
+      strncpy(con->output, output, con->outputSize - 1);
+      con->output[con->outputSize - 1] = '\0';
+    }
+    free(output);
+  }
+
+  return(con->wire.failed ? 1 : status);
+}
+
+mxArray *
+RMatlab_engGetVariable(Engine *eng, const char *name)
+{
+  BrokerConnection *con;
+
+  if(!(con = getConnection(eng)))
+    return(engGetVariable(eng, name));
+
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_GET);
+  RMatlabWire_putString(&con->wire, name);
+  RMatlabWire_flush(&con->wire);
+
+  if(RMatlabWire_getInt(&con->wire) != 1)
+    return(NULL);
+
+  return(RMatlabWire_getArray(&con->wire));
+}
+
+int
+RMatlab_engPutVariable(Engine *eng, const char *name, const mxArray *val)
+{
+  BrokerConnection *con;
+  int status;
+
+  if(!(con = getConnection(eng)))
+    return(engPutVariable(eng, name, val));
+
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_PUT);
+  RMatlabWire_putString(&con->wire, name);
+  RMatlabWire_putArray(&con->wire, val);
+  RMatlabWire_flush(&con->wire);
+
+  status = RMatlabWire_getInt(&con->wire);
+  return(con->wire.failed ? 1 : status);
+}
+
+/*
+  The broker captures the output on its side and sends it back with
+  the result of each command, so we just remember the buffer.
+*/
+int
+RMatlab_engOutputBuffer(Engine *eng, char *buf, int size)
+{
+  BrokerConnection *con;
+
+  if(!(con = getConnection(eng)))
+    return(engOutputBuffer(eng, buf, size));
+
+  con->output = buf;
+  con->outputSize = buf ? size : 0;
+  if(buf && size > 0)
+    buf[0] = '\0';
+
+  return(0);
+}
+
+/*
+  For a broker connection, this returns the engine to the broker
+  rather than closing Matlab.
+*/
+int
+RMatlab_engClose(Engine *eng)
+{
+  BrokerConnection *con, *prev = NULL;
+
+  if(!(con = getConnection(eng)))
+    return(engClose(eng));
+
+  RMatlabWire_putInt(&con->wire, RMATLAB_BROKER_CLOSE);
+  RMatlabWire_flush(&con->wire);
+  close(con->wire.fd);
+  RMatlabWire_free(&con->wire);
+
+  if(Connections == con)
+    Connections = con->next;
+  else {
+    for(prev = Connections; prev->next != con; prev = prev->next) ;
+    prev->next = con->next;
+  }
+  free(con);
+
+  return(0);
+}
+
+
+/*
+  Called from R (.MatlabInit(broker = )) to get an engine from the broker.
+  An empty path means the default socket (see RMatlab_brokerSocketPath()).
+*/
+SEXP
+RMatlab_brokerInit(SEXP path)
+{
+  char buf[512];
+  const char *socketPath;
+  Engine *eng;
+
+  socketPath = CHAR(STRING_ELT(path, 0));
+  if(!socketPath[0])
+    socketPath = RMatlab_brokerSocketPath(buf, sizeof(buf));
+
+  if(!(eng = RMatlab_brokerOpen(socketPath))) {
+    PROBLEM "Cannot connect to the Matlab engine broker at %s", socketPath
+    ERROR;
+  }
+
+  return(R_matlabEngine(eng));
+}
@@ -0,0 +1,333 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ A memory budget for the transfers between R and Matlab.
+
+ Before we convert a value, we estimate from its dimensions and type the
+ size of the Matlab array or R vector we will create and reserve it.  If the
+ reservations in progress would then exceed the R option
+ RMatlab.memoryBudget (in bytes; NULL or Inf for no limit), the transfer is
+ refused before anything is allocated.  .MatlabPut() can instead send large
+ numeric and logical arrays in blocks via .MatlabPutChunked() (see
+ RMatlab.memoryBudgetAction in matlab.R).  We keep the bytes reserved now and
+ the peak, which .MatlabBudget() reports.
+
+ Transfers nest, e.g. R code run by callR may call .MatlabGet(), so each
+ entry point calls RMatlab_budgetEnter() and its reservations are released by
+ RMatlab_budgetLeave() with the level this returned.  If an R error skips an
+ inner RMatlab_budgetLeave(), the outer one releases the inner levels too.
+ Via the engine, the entry points of RMatlab.so don't nest, so entering at
+ the outermost level releases anything left by an earlier error.
+
+ In a Matlab session, RMatlab.so and the MEX files are separate shared
+ libraries.  As for the trace (trace.c), the first entry point on Matlab's
+ thread publishes the counters via the Matlab global variable RMatlabBudget
+ and the others use these.  Only Matlab's thread makes reservations.
+*/
+
+#define RMATLAB_BUDGET_MAGIC     0x524D4247   /* RMBG */
+#define RMATLAB_BUDGET_VARIABLE  "RMatlabBudget"
+#define RMATLAB_BUDGET_DEPTH     32
+
+  /* Our estimate of the header of a Matlab array or an R vector. */
+#define ARRAY_OVERHEAD 64
+
+typedef struct {
+  unsigned int magic;
+  double current, peak;
+  double transfers, refused;
+  int depth;
+  double reserved[RMATLAB_BUDGET_DEPTH];
+} RMatlabBudget;
+
+static RMatlabBudget Local = {RMATLAB_BUDGET_MAGIC};
+static RMatlabBudget *Budget = &Local;
+
+  /* The limit in bytes, or a negative number for none. */
+static double Limit = -1;
+
+
+static void
+useSharedBudget()
+{
+  const mxArray *ptr;
+  RMatlabBudget *budget = NULL;
+
+  ptr = mexGetVariablePtr("global", RMATLAB_BUDGET_VARIABLE);
+  if(ptr && mxGetClassID(ptr) == mxUINT64_CLASS && mxGetNumberOfElements(ptr) == 1) {
+    budget = (RMatlabBudget *) (uintptr_t) *((unsigned long long *) mxGetData(ptr));
+    if(budget && budget->magic != RMATLAB_BUDGET_MAGIC)
+      budget = NULL;
+  }
+
+  if(!budget) {
+      /* Never freed, as a MEX file that is cleared may not be the last to use it. */
+    if(!(budget = (RMatlabBudget *) calloc(1, sizeof(RMatlabBudget))))
+      return;
+    budget->magic = RMATLAB_BUDGET_MAGIC;
+    ptr = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+    *((unsigned long long *) mxGetData(ptr)) = (unsigned long long) (uintptr_t) budget;
+    mexPutVariable("global", RMATLAB_BUDGET_VARIABLE, ptr);
+    mxDestroyArray((mxArray *) ptr);
+  }
+
+  Budget = budget;
+}
+
+/*
+  Read RMatlab.memoryBudget.  canCallMatlab is TRUE if we are on
+  Matlab's thread in a Matlab session and so should use the shared counters.
+*/
+void
+RMatlab_budgetConfigure(int canCallMatlab)
+{
+  static SEXP optionSym = NULL;
+  SEXP opt;
+
+  if(!optionSym)
+    optionSym = Rf_install("RMatlab.memoryBudget");
+
+  opt = Rf_GetOption1(optionSym);
+  Limit = Rf_isNumeric(opt) && Rf_length(opt) && R_FINITE(Rf_asReal(opt)) && Rf_asReal(opt) >= 0 ? Rf_asReal(opt) : -1;
+
+  if(canCallMatlab && Budget == &Local)
+    useSharedBudget();
+}
+
+
+/*
+  The size of the Matlab array convertFromR() creates for the R value.
+*/
+double
+RMatlab_budgetFromR(SEXP val)
+{
+  double total = ARRAY_OVERHEAD;
+  R_xlen_t i, n;
+
+  switch(TYPEOF(val)) {
+    case LGLSXP:
+    case RAWSXP:
+      return(total + (double) XLENGTH(val));
+    case INTSXP:
+    case REALSXP:
+      return(total + (double) XLENGTH(val) * sizeof(double));
+    case CPLXSXP:
+      return(total + (double) XLENGTH(val) * 2 * sizeof(double));
+    case STRSXP:
+        /* A cell of char arrays, at worst, of 2-byte characters. */
+      n = XLENGTH(val);
+      for(i = 0; i < n; i++)
+        total += ARRAY_OVERHEAD + sizeof(void *) + 2.0 * LENGTH(STRING_ELT(val, i));
+      return(total);
+    case VECSXP:
+      n = XLENGTH(val);
+      for(i = 0; i < n; i++)
+        total += sizeof(void *) + RMatlab_budgetFromR(VECTOR_ELT(val, i));
+      return(total);
+    default:
+      return(total);
+  }
+}
+
+/*
+  The size of the R value convertToR() creates for the Matlab array.
+*/
+double
+RMatlab_budgetToR(const mxArray *val)
+{
+  double total = ARRAY_OVERHEAD, n;
+  int i, j, nfields;
+
+  if(!val)
+    return(0);
+
+  n = (double) mxGetNumberOfElements(val);
+  if(mxIsCell(val)) {
+    for(i = 0; i < n; i++)
+      total += sizeof(SEXP) + RMatlab_budgetToR(mxGetCell(val, i));
+  } else if(mxIsStruct(val)) {
+    nfields = mxGetNumberOfFields(val);
+    for(i = 0; i < n; i++)
+      for(j = 0; j < nfields; j++)
+        total += sizeof(SEXP) + RMatlab_budgetToR(mxGetFieldByNumber(val, i, j));
+  } else if(mxIsChar(val))
+      /* A string for each row. */
+    total += n + (double) mxGetM(val) * (ARRAY_OVERHEAD + sizeof(SEXP));
+  else if(mxIsLogical(val))
+    total += n * sizeof(int);
+  else
+    total += n * (mxIsComplex(val) ? sizeof(Rcomplex) : sizeof(double));
+
+  return(total);
+}
+
+
+/*
+  Start the reservations of an entry point.  The result is passed to
+  RMatlab_budgetLeave().
+*/
+int
+RMatlab_budgetEnter()
+{
+  RMatlabBudget *b = Budget;
+
+    /* Without Matlab's shared counters, we are not inside another transfer. */
+  if(b == &Local)
+    RMatlab_budgetLeave(0);
+
+  if(b->depth < RMATLAB_BUDGET_DEPTH)
+    b->reserved[b->depth] = 0;
+  return(b->depth++);
+}
+
+/*
+  Release the reservations made since RMatlab_budgetEnter() returned level.
+*/
+void
+RMatlab_budgetLeave(int level)
+{
+  RMatlabBudget *b = Budget;
+
+  if(level < 0)
+    return;
+
+  while(b->depth > level) {
+    b->depth--;
+    if(b->depth < RMATLAB_BUDGET_DEPTH) {
+      b->current -= b->reserved[b->depth];
+      b->reserved[b->depth] = 0;
+    }
+  }
+  if(b->depth == 0)
+    b->current = 0;
+}
+
+/*
+  Reserve bytes for the current transfer, returning FALSE (and reserving
+  nothing) if this would exceed the budget.
+*/
+int
+RMatlab_budgetReserve(double bytes)
+{
+  RMatlabBudget *b = Budget;
+  int level = b->depth > 0 ? b->depth - 1 : 0;
+
+  b->transfers++;
+  if(Limit >= 0 && b->current + bytes > Limit) {
+    b->refused++;
+    return(0);
+  }
+
+  b->current += bytes;
+  if(b->current > b->peak)
+    b->peak = b->current;
+
+    /* Outside an entry point, we only record the peak. */
+  if(b->depth == 0)
+    b->current -= bytes;
+  else if(level < RMATLAB_BUDGET_DEPTH)
+    b->reserved[level] += bytes;
+
+  return(1);
+}
+
+/*
+  The message for a transfer the budget refuses.
+  what and name describe the transfer.
+*/
+const char *
+RMatlab_budgetDescribe(double bytes, const char *what, const char *name)
+{
+  static char buf[512];
+
+  snprintf(buf, sizeof(buf),
+            "%s %s needs about %.0f bytes, which would exceed the memory budget of %.0f bytes (RMatlab.memoryBudget) with %.0f bytes in use",
+            what, name, bytes, Limit, Budget->current);
+  return(buf);
+}
+
+/*
+  As RMatlab_budgetReserve() but raise an R error if we cannot.
+*/
+void
+RMatlab_budgetRequire(double bytes, const char *what, const char *name)
+{
+  if(!RMatlab_budgetReserve(bytes)) {
+    PROBLEM "%s", RMatlab_budgetDescribe(bytes, what, name)
+    ERROR;
+  }
+}
+
+/*
+  Is there a limit on the bytes we can reserve.
+*/
+int
+RMatlab_budgetLimited()
+{
+  return(Limit >= 0);
+}
+
+
+/*
+  Which of the R values would not fit in the budget now,
+  for .MatlabPut() to send them in blocks.
+*/
+SEXP
+RMatlab_budgetExceeds(SEXP values, SEXP mex)
+{
+  SEXP ans;
+  int i, n = Rf_length(values);
+
+  RMatlab_budgetConfigure(LOGICAL(mex)[0]);
+
+  PROTECT(ans = allocVector(LGLSXP, n));
+  for(i = 0; i < n; i++)
+    LOGICAL(ans)[i] = Limit >= 0 && Budget->current + RMatlab_budgetFromR(VECTOR_ELT(values, i)) > Limit;
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+/*
+  Called from R via .MatlabBudget().  Returns the budget, the bytes
+  reserved now and at most, the number of transfers and how many were
+  refused.  If reset is TRUE, the peak and the counts start again.
+  mex is TRUE if R is running inside Matlab.
+*/
+SEXP
+RMatlab_budgetInfo(SEXP reset, SEXP mex)
+{
+  static const char *names[] = {"budget", "current", "peak", "transfers", "refused"};
+  RMatlabBudget *b;
+  SEXP ans, tmp;
+  int i;
+
+  RMatlab_budgetConfigure(LOGICAL(mex)[0]);
+  b = Budget;
+
+  PROTECT(ans = allocVector(REALSXP, 5));
+  PROTECT(tmp = allocVector(STRSXP, 5));
+  REAL(ans)[0] = Limit >= 0 ? Limit : R_PosInf;
+  REAL(ans)[1] = b->current;
+  REAL(ans)[2] = b->peak;
+  REAL(ans)[3] = b->transfers;
+  REAL(ans)[4] = b->refused;
+  for(i = 0; i < 5; i++)
+    SET_STRING_ELT(tmp, i, mkChar(names[i]));
+  SET_NAMES(ans, tmp);
+  UNPROTECT(2);
+
+  if(LOGICAL(reset)[0] == TRUE) {
+    b->peak = b->current;
+    b->transfers = 0;
+    b->refused = 0;
+  }
+
+  return(ans);
+}
@@ -0,0 +1,91 @@
+#include "RMatlabWorker.h"
+
+#include <string.h>
+
+/*
+ Asynchronous calls to R functions from Matlab.
+ This requires R to be running on its own thread, i.e. initializeR
+ was called with the 'async' option, e.g.
+
+    initializeR({'RMatlab' '--silent'}, 'async')
+    t = callRAsync('submit', 'lm', ...)          % returns a ticket immediately
+    t2 = callRAsync('submitNamed', 'rnorm', 10, {'mean' 100})
+      ... do other work in Matlab ...
+    s = callRAsync('poll', t)                    % 'queued', 'running', 'done' or 'error'
+    done = callRAsync('wait', t, 5)              % wait at most 5 seconds
+    fit = callRAsync('collect', t)               % waits, if necessary, and converts the result
+    callRAsync('cancel', t2)                     % interrupts the call if it is running
+
+ The calls are evaluated in the order they are submitted.
+ A ticket can be collected only once.  Collecting a call that failed,
+ was cancelled or exceeded the R option RMatlab.callTimeout raises a Matlab error.
+ 'submitNamed' takes a final cell of name-value pairs for the named
+ arguments, as callNamedR does.
+*/
+
+static const char *StatusNames[] = {"queued", "running", "done", "error"};
+
+static int
+getTicket(int nrhs, const mxArray *prhs[])
+{
+  if(nrhs < 2 || !mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1)
+    mexErrMsgTxt("The second argument must be a ticket returned by callRAsync('submit', ...)");
+
+  return((int) mxGetScalar(prhs[1]));
+}
+
+void
+mexFunction(int nlhs, mxArray *plhs[],
+            int nrhs, const mxArray *prhs[])
+{
+  RMatlabWorker *worker;
+  char op[20], *funcName;
+  int buflen, status, nargs;
+  const mxArray *namedArgs = NULL;
+
+  if(nrhs == 0 || !mxIsChar(prhs[0]))
+    mexErrMsgTxt("Usage: callRAsync('submit' | 'submitNamed' | 'poll' | 'wait' | 'cancel' | 'collect', ...)");
+
+  if(!(worker = RMatlabWorker_find()))
+    mexErrMsgTxt("R is not running asynchronously. Call initializeR with the 'async' option.");
+
+  RMatlab_traceUseShared();
+
+  mxGetString(prhs[0], op, sizeof(op));
+
+  if(strcmp(op, "submit") == 0 || strcmp(op, "submitNamed") == 0) {
+    if(nrhs < 2 || !mxIsChar(prhs[1]) || mxGetM(prhs[1]) != 1)
+      mexErrMsgTxt("The name of the R function must be a single string");
+
+    buflen = mxGetNumberOfElements(prhs[1]) + 1;
+    funcName = (char *) mxCalloc(buflen, sizeof(char));
+    mxGetString(prhs[1], funcName, buflen);
+
+    nargs = nrhs - 2;
+    if(strcmp(op, "submitNamed") == 0 && nargs > 0 && RMatlab_isNamedArgs(prhs[nrhs - 1])) {
+      namedArgs = prhs[nrhs - 1];
+      nargs--;
+      if(mxIsCell(namedArgs) && mxGetNumberOfElements(namedArgs) % 2)
+        mexErrMsgTxt("The collection of named arguments does not have an even number of elements");
+    }
+
+    plhs[0] = mxCreateDoubleScalar(RMatlabWorker_submit(worker, funcName, nargs, prhs + 2, namedArgs));
+
+  } else if(strcmp(op, "poll") == 0) {
+    status = RMatlabWorker_status(worker, getTicket(nrhs, prhs));
+    plhs[0] = mxCreateString(status < 0 ? "unknown" : StatusNames[status]);
+
+  } else if(strcmp(op, "wait") == 0) {
+    status = RMatlabWorker_wait(worker, getTicket(nrhs, prhs), nrhs > 2 ? mxGetScalar(prhs[2]) : -1);
+    plhs[0] = mxCreateLogicalScalar(status == RMATLAB_JOB_DONE || status == RMATLAB_JOB_ERROR);
+
+  } else if(strcmp(op, "cancel") == 0) {
+    status = RMatlabWorker_cancel(worker, getTicket(nrhs, prhs));
+    plhs[0] = mxCreateLogicalScalar(status == RMATLAB_JOB_QUEUED || status == RMATLAB_JOB_RUNNING);
+
+  } else if(strcmp(op, "collect") == 0) {
+    RMatlabWorker_collect(worker, getTicket(nrhs, prhs), nlhs, plhs);
+
+  } else
+    mexErrMsgTxt("Unrecognized callRAsync operation");
+}
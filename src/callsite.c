@@ -0,0 +1,392 @@
+#include "RMatlabConvert.h"
+#include "RMatlabTrace.h"
+
+#include "Rdefines.h"
+#include <Rversion.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ Call sites for calling a Matlab function from R many times in a MEX
+ session, e.g. interp1 or filter in an R loop.
+
+ .MatlabFunction() in R creates a call site which resolves the name of
+ the Matlab function to a function handle once, via str2func, and keeps the
+ converted arguments of the last call.  Each call then goes to feval with the
+ handle, so Matlab doesn't look the name up on its path each time, and we
+ only convert the arguments that have changed since the previous call.
+ An argument whose contents are the same (by the hash in sync.c) is passed
+ as is.  A numeric or logical argument of the same size as before is copied
+ into a new array of the same shape directly rather than via convertFromR().
+ We don't copy it into the existing array, as the Matlab function may have
+ kept a shared copy of that array, e.g. in a persistent variable, and we
+ cannot tell.
+
+ The handle and the arguments are made persistent so they survive
+ between calls to the MEX function.  They are released when the R
+ object for the call site is garbage collected or by
+ .MatlabFunctionInfo(, release = TRUE).
+*/
+
+SEXP RMatlab_matlabErrorInfo(mxArray **error);
+
+typedef struct {
+  char *funcName;
+  int nargs;             /* the number of arguments we have slots for. */
+  mxArray **args;        /* args[0] is the function handle, args[i] the (i-1)'th argument. */
+  RMatlabHash *hashes;   /* hashes[i] is the hash of the R value for args[i]. */
+
+  int nout;
+  mxArray **plhs;        /* the results of the current call, until they are converted. */
+  mxArray *error;
+
+  double calls, reused, updated, converted;
+} MatlabCallSite;
+
+
+static MatlabCallSite *
+getCallSite(SEXP ref)
+{
+  MatlabCallSite *site;
+
+  if(TYPEOF(ref) != EXTPTRSXP || R_ExternalPtrTag(ref) != Rf_install("MatlabCallSite")
+       || !(site = (MatlabCallSite *) R_ExternalPtrAddr(ref))) {
+    PROBLEM "The Matlab call site has been released"
+    ERROR;
+  }
+
+  return(site);
+}
+
+static void
+releaseArgs(MatlabCallSite *site, int from)
+{
+  int i;
+
+  for(i = from; i < site->nargs + 1; i++)
+    if(site->args[i]) {
+      mxDestroyArray(site->args[i]);
+      site->args[i] = NULL;
+    }
+}
+
+static void
+freeCallSite(MatlabCallSite *site)
+{
+  releaseArgs(site, 0);
+  free(site->args);
+  free(site->hashes);
+  free(site->funcName);
+  free(site);
+}
+
+static void
+callSiteFinalizer(SEXP ref)
+{
+  MatlabCallSite *site = (MatlabCallSite *) R_ExternalPtrAddr(ref);
+
+  if(site) {
+    freeCallSite(site);
+    R_ClearExternalPtr(ref);
+  }
+}
+
+
+/*
+  Is there a Matlab function with this name, according to exist():
+  an M, MEX or P file, a built-in function or a class constructor.
+  str2func() returns a handle for any name.
+*/
+static int
+functionExists(mxArray *name)
+{
+  mxArray *kind = NULL;
+  int status, code;
+
+  mexSetTrapFlag(1);
+  status = mexCallMATLAB(1, &kind, 1, &name, "exist");
+  if(status || !kind)
+    return(0);
+
+  code = (int) mxGetScalar(kind);
+  mxDestroyArray(kind);
+
+  return(code == 2 || code == 3 || code == 5 || code == 6 || code == 8);
+}
+
+/*
+  Create the call site for the Matlab function funcName.
+*/
+SEXP
+RMatlab_callSiteCreate(SEXP funcName)
+{
+  MatlabCallSite *site;
+  mxArray *name, *handle = NULL;
+  SEXP ans;
+  int status = 1;
+
+  name = mxCreateString(CHAR(STRING_ELT(funcName, 0)));
+  if(functionExists(name)) {
+    mexSetTrapFlag(1);
+    status = mexCallMATLAB(1, &handle, 1, &name, "str2func");
+  }
+  mxDestroyArray(name);
+  if(status || !handle) {
+    PROBLEM "Cannot find the Matlab function %s", CHAR(STRING_ELT(funcName, 0))
+    ERROR;
+  }
+  mexMakeArrayPersistent(handle);
+
+  site = (MatlabCallSite *) calloc(1, sizeof(MatlabCallSite));
+  site->funcName = strdup(CHAR(STRING_ELT(funcName, 0)));
+  site->args = (mxArray **) calloc(1, sizeof(mxArray *));
+  site->hashes = (RMatlabHash *) calloc(1, sizeof(RMatlabHash));
+  site->args[0] = handle;
+
+  PROTECT(ans = R_MakeExternalPtr(site, Rf_install("MatlabCallSite"), R_NilValue));
+  R_RegisterCFinalizer(ans, callSiteFinalizer);
+  SET_CLASS(ans, mkString("MatlabCallSite"));
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+SEXP
+RMatlab_callSiteRelease(SEXP ref)
+{
+  callSiteFinalizer(ref);
+  return(R_NilValue);
+}
+
+
+/*
+  Can we copy the R value into the Matlab array we have for the argument,
+  i.e. the array convertFromR() would create has the same class and shape.
+*/
+static int
+sameShape(const mxArray *arg, SEXP val)
+{
+  SEXP dim = GET_DIM(val);
+  const mwSize *dims;
+  int i;
+
+  if(mxIsSparse(arg) || mxIsComplex(arg))
+    return(0);
+
+  if(TYPEOF(val) == REALSXP || TYPEOF(val) == INTSXP) {
+    if(!mxIsDouble(arg))
+      return(0);
+  } else if(TYPEOF(val) == LGLSXP) {
+    if(!mxIsLogical(arg))
+      return(0);
+  } else
+    return(0);
+
+  dims = mxGetDimensions(arg);
+  if(Rf_length(dim) == 0)
+    return(mxGetNumberOfDimensions(arg) == 2 && dims[0] == (mwSize) Rf_length(val) && dims[1] == 1);
+
+  if(mxGetNumberOfDimensions(arg) != Rf_length(dim))
+    return(0);
+  for(i = 0; i < Rf_length(dim); i++)
+    if(dims[i] != (mwSize) INTEGER(dim)[i])
+      return(0);
+
+  return(1);
+}
+
+/*
+  A new array with the class and shape of arg and the values of val,
+  for which sameShape() is TRUE.
+*/
+static mxArray *
+copyInto(const mxArray *arg, SEXP val)
+{
+  size_t i, n = (size_t) Rf_xlength(val);
+  double *data;
+  mxLogical *lgl;
+  mxArray *ans;
+
+  if(mxIsLogical(arg))
+    ans = mxCreateLogicalArray(mxGetNumberOfDimensions(arg), mxGetDimensions(arg));
+  else
+    ans = mxCreateNumericArray(mxGetNumberOfDimensions(arg), mxGetDimensions(arg), mxDOUBLE_CLASS, mxREAL);
+
+  switch(TYPEOF(val)) {
+    case REALSXP:
+      memcpy(mxGetPr(ans), REAL(val), n * sizeof(double));
+      break;
+    case INTSXP:
+      data = mxGetPr(ans);
+        /* NA becomes NaN and, for logicals, TRUE, as in convertFromR(). */
+      for(i = 0; i < n; i++)
+        data[i] = INTEGER(val)[i] == NA_INTEGER ? mxGetNaN() : (double) INTEGER(val)[i];
+      break;
+    case LGLSXP:
+      lgl = mxGetLogicals(ans);
+      for(i = 0; i < n; i++)
+        lgl[i] = LOGICAL(val)[i] != 0;
+      break;
+    default:
+      break;
+  }
+
+  return(ans);
+}
+
+/*
+  Bring the argument slots up to date with the R values.
+*/
+static void
+updateArgs(MatlabCallSite *site, SEXP args)
+{
+  int i, n = Rf_length(args);
+  RMatlabHash hash;
+  mxArray *tmp;
+  SEXP val;
+
+  if(n != site->nargs) {
+    releaseArgs(site, n + 1);
+    site->args = (mxArray **) realloc(site->args, (n + 1) * sizeof(mxArray *));
+    site->hashes = (RMatlabHash *) realloc(site->hashes, (n + 1) * sizeof(RMatlabHash));
+    for(i = site->nargs + 1; i < n + 1; i++)
+      site->args[i] = NULL;
+    site->nargs = n;
+  }
+
+  for(i = 0; i < n; i++) {
+    val = VECTOR_ELT(args, i);
+    hash = RMatlab_hashRObject(val, 0);
+
+    if(site->args[i + 1] && site->hashes[i + 1] == hash)
+      site->reused++;
+    else if(site->args[i + 1] && sameShape(site->args[i + 1], val)) {
+      tmp = copyInto(site->args[i + 1], val);
+      mexMakeArrayPersistent(tmp);
+      mxDestroyArray(site->args[i + 1]);
+      site->args[i + 1] = tmp;
+      site->updated++;
+    } else {
+      if(site->args[i + 1]) {
+        mxDestroyArray(site->args[i + 1]);
+        site->args[i + 1] = NULL;
+      }
+        /* If this raises an error, the slot is empty and we convert it again next time. */
+      tmp = convertFromR(val, 1, NULL);
+      mexMakeArrayPersistent(tmp);
+      site->args[i + 1] = tmp;
+      site->converted++;
+    }
+    site->hashes[i + 1] = hash;
+  }
+}
+
+static SEXP
+invokeCallSite(void *data)
+{
+  MatlabCallSite *site = (MatlabCallSite *) data;
+  SEXP ans = R_NilValue;
+  double t0;
+  int i, status;
+
+  t0 = RMatlab_traceBegin();
+  mexSetTrapFlag(1);
+  status = mexCallMATLAB(site->nout, site->plhs, site->nargs + 1, site->args, "feval");
+  RMatlab_traceEnd(t0, "Matlab", site->funcName, -1);
+  if(status)
+    return(RMatlab_matlabErrorInfo(&site->error));
+
+  if(site->nout) {
+    t0 = RMatlab_traceBegin();
+    PROTECT(ans = allocVector(VECSXP, site->nout));
+    for(i = 0; i < site->nout ; i++)
+      SET_VECTOR_ELT(ans, i,  convertToR(site->plhs[i]));
+    RMatlab_traceEnd(t0, "convertToR", site->funcName, t0 >= 0 ? RMatlab_traceRBytes(ans) : -1);
+    UNPROTECT(1);
+  }
+
+  return(ans);
+}
+
+static void
+callSiteCleanup(void *data, Rboolean jump)
+{
+  MatlabCallSite *site = (MatlabCallSite *) data;
+  int i;
+
+  for(i = 0; i < site->nout; i++)
+    if(site->plhs[i]) {
+      mxDestroyArray(site->plhs[i]);
+      site->plhs[i] = NULL;
+    }
+  if(site->error) {
+    mxDestroyArray(site->error);
+    site->error = NULL;
+  }
+}
+
+/*
+  Call the function with the R values in the list args and return a list of
+  the nout results or, if it fails, a MatlabErrorInfo (see RMatlab_invoke()).
+*/
+SEXP
+RMatlab_callSiteInvoke(SEXP ref, SEXP args, SEXP numOut)
+{
+  MatlabCallSite *site = getCallSite(ref);
+  SEXP ans, token;
+  double t0, t1;
+
+  RMatlab_traceUseShared();
+  RMatlab_convertConfigure(1);
+  t0 = RMatlab_traceBegin();
+
+  t1 = RMatlab_traceBegin();
+  updateArgs(site, args);
+  RMatlab_traceEnd(t1, "convertFromR", site->funcName, t1 >= 0 ? RMatlab_traceRBytes(args) : -1);
+  site->calls++;
+
+  site->nout = INTEGER(numOut)[0];
+  site->plhs = (mxArray **) R_alloc(site->nout + 1, sizeof(mxArray *));
+  memset(site->plhs, 0, (site->nout + 1) * sizeof(mxArray *));
+
+#if R_VERSION >= R_Version(3, 5, 0)
+  PROTECT(token = R_MakeUnwindCont());
+  PROTECT(ans = R_UnwindProtect(invokeCallSite, site, callSiteCleanup, site, token));
+  UNPROTECT(2);
+#else
+  ans = invokeCallSite(site);
+#endif
+  callSiteCleanup(site, FALSE);
+  site->plhs = NULL;
+  site->nout = 0;
+  RMatlab_traceEnd(t0, ".MatlabFunction", site->funcName, -1);
+
+  return(ans);
+}
+
+/*
+  The number of calls and of the arguments that were reused as is,
+  copied into the existing array and converted anew.
+*/
+SEXP
+RMatlab_callSiteStats(SEXP ref)
+{
+  static const char *names[] = {"calls", "reused", "updated", "converted"};
+  MatlabCallSite *site = getCallSite(ref);
+  SEXP ans, tmp;
+  int i;
+
+  PROTECT(ans = allocVector(REALSXP, 4));
+  PROTECT(tmp = allocVector(STRSXP, 4));
+  REAL(ans)[0] = site->calls;
+  REAL(ans)[1] = site->reused;
+  REAL(ans)[2] = site->updated;
+  REAL(ans)[3] = site->converted;
+  for(i = 0; i < 4; i++)
+    SET_STRING_ELT(tmp, i, mkChar(names[i]));
+  SET_NAMES(ans, tmp);
+  UNPROTECT(2);
+
+  return(ans);
+}
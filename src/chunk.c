@@ -0,0 +1,210 @@
+#include "RMatlabConvert.h"
+
+#include "RMatlabBroker.h"
+
+#include <Rdefines.h>
+#include <string.h>
+
+/*
+ Transferring a matrix between R and Matlab a block of columns at a time,
+ for .MatlabPutChunked() and .MatlabGetChunked().
+ Only one block is held in a temporary Matlab variable at any time,
+ so the peak memory is the matrix on the receiving side plus one block,
+ rather than two or three copies of the entire matrix.
+
+ We copy the columns directly between the R vector and the mxArray
+ so that R doesn't need to create the block via x[, from:to]
+ and we don't go via convertToR()/convertFromR().
+*/
+
+#define CHUNK_VAR "r_chunk"
+
+Engine *getEngine(SEXP rengine);
+
+static int
+evalMatlab(Engine *eng, const char *cmd)
+{
+  return(eng ? RMatlab_engEvalString(eng, cmd) : mexEvalString(cmd));
+}
+
+
+/*
+  Copy columns from to to (1-based, inclusive) of the R matrix x
+  into the Matlab matrix name, starting at column at.
+  name must already exist and have the same number of rows as x.
+*/
+SEXP
+RMatlab_putColumnBlock(SEXP name, SEXP x, SEXP from, SEXP to, SEXP at, SEXP engine)
+{
+  Engine *eng;
+  mxArray *block;
+  char *cmd;
+  const char *varName = CHAR(STRING_ELT(name, 0));
+  R_xlen_t nrow, ncol, i, n, offset;
+  int status, level, first = INTEGER(from)[0], last = INTEGER(to)[0];
+
+  eng = getEngine(engine);
+  RMatlab_budgetConfigure(eng == NULL);
+
+  nrow = Rf_isMatrix(x) ? Rf_nrows(x) : XLENGTH(x);
+  ncol = last - first + 1;
+  n = nrow * ncol;
+  offset = (first - 1) * nrow;
+
+  if(first < 1 || ncol < 1 || offset + n > XLENGTH(x)) {
+    PROBLEM "invalid block of columns %d:%d", first, last
+    ERROR;
+  }
+
+  level = RMatlab_budgetEnter();
+  RMatlab_budgetRequire((double) n * (TYPEOF(x) == LGLSXP ? sizeof(mxLogical) : (TYPEOF(x) == CPLXSXP ? 2 : 1) * sizeof(double)),
+                         "The block of columns of", varName);
+
+  switch(TYPEOF(x)) {
+    case REALSXP:
+      block = mxCreateDoubleMatrix(nrow, ncol, mxREAL);
+      memcpy(mxGetPr(block), REAL(x) + offset, n * sizeof(double));
+      break;
+    case INTSXP: {
+      double *data;
+      block = mxCreateDoubleMatrix(nrow, ncol, mxREAL);
+      data = mxGetPr(block);
+      for(i = 0; i < n; i++)
+        data[i] = INTEGER(x)[offset + i] == NA_INTEGER ? mxGetNaN() : INTEGER(x)[offset + i];
+    }
+      break;
+    case CPLXSXP: {
+      block = mxCreateDoubleMatrix(nrow, ncol, mxCOMPLEX);
+#if MX_HAS_INTERLEAVED_COMPLEX
+      memcpy(mxGetComplexDoubles(block), COMPLEX(x) + offset, n * sizeof(Rcomplex));
+#else
+      double *real = mxGetPr(block), *imaginary = mxGetPi(block);
+      for(i = 0; i < n; i++) {
+        real[i] = COMPLEX(x)[offset + i].r;
+        imaginary[i] = COMPLEX(x)[offset + i].i;
+      }
+#endif
+    }
+      break;
+    case LGLSXP: {
+      mxLogical *data;
+      block = mxCreateLogicalMatrix(nrow, ncol);
+      data = mxGetLogicals(block);
+      for(i = 0; i < n; i++)
+        data[i] = LOGICAL(x)[offset + i] != 0;
+    }
+      break;
+    default:
+      PROBLEM "can only transfer numeric, complex or logical matrices in blocks"
+      ERROR;
+  }
+
+  if(eng)
+    status = RMatlab_engPutVariable(eng, CHUNK_VAR, block);
+  else
+    status = mexPutVariable("caller", CHUNK_VAR, block);
+  mxDestroyArray(block);
+  RMatlab_budgetLeave(level);
+
+  if(status != 0) {
+    PROBLEM "cannot assign the block of columns %d:%d to Matlab", first, last
+    ERROR;
+  }
+
+  cmd = R_alloc(strlen(varName) + 100, sizeof(char));
+  sprintf(cmd, "%s(:, %d:%d) = " CHUNK_VAR "; clear " CHUNK_VAR,
+           varName, INTEGER(at)[0], INTEGER(at)[0] + (int) ncol - 1);
+  status = evalMatlab(eng, cmd);
+
+  return(ScalarInteger(status));
+}
+
+
+/*
+  Retrieve columns from to to of the Matlab matrix name.
+  If into is a matrix, the values are copied into it starting at column at
+  and it is returned. The caller must have created into and not shared it
+  with any other R variable as we modify it in place.
+  Otherwise, we return a new matrix for this block.
+  Matlab values that are not logical are converted to double.
+*/
+SEXP
+RMatlab_getColumnBlock(SEXP name, SEXP from, SEXP to, SEXP engine, SEXP into, SEXP at)
+{
+  Engine *eng;
+  mxArray *engBlock = NULL;
+  const mxArray *block = NULL;
+  char *cmd;
+  const char *varName = CHAR(STRING_ELT(name, 0));
+  R_xlen_t i, n, offset = 0;
+  int first = INTEGER(from)[0], last = INTEGER(to)[0], type, nprotect = 0;
+  SEXP ans;
+
+  eng = getEngine(engine);
+
+  cmd = R_alloc(2 * strlen(varName) + 100, sizeof(char));
+  sprintf(cmd, CHUNK_VAR " = %s(:, %d:%d); if ~islogical(" CHUNK_VAR "), " CHUNK_VAR " = double(" CHUNK_VAR "); end",
+           varName, first, last);
+
+  if(evalMatlab(eng, cmd) == 0) {
+    if(eng)
+      block = engBlock = RMatlab_engGetVariable(eng, CHUNK_VAR);
+    else
+      block = mexGetVariablePtr("caller", CHUNK_VAR);
+  }
+
+  if(!block) {
+    evalMatlab(eng, "clear " CHUNK_VAR);
+    PROBLEM "cannot retrieve columns %d:%d of the Matlab variable %s", first, last, varName
+    ERROR;
+  }
+
+  n = mxGetNumberOfElements(block);
+  type = mxIsLogical(block) ? LGLSXP : (mxIsComplex(block) ? CPLXSXP : REALSXP);
+
+  if(Rf_isMatrix(into)) {
+    ans = into;
+    offset = (R_xlen_t) (INTEGER(at)[0] - 1) * Rf_nrows(into);
+    if(TYPEOF(into) != type || Rf_nrows(into) != (int) mxGetM(block) || offset + n > XLENGTH(into)) {
+      if(engBlock)
+        mxDestroyArray(engBlock);
+      evalMatlab(eng, "clear " CHUNK_VAR);
+      PROBLEM "the block of columns %d:%d of %s does not fit into the R matrix", first, last, varName
+      ERROR;
+    }
+  } else {
+    PROTECT(ans = allocMatrix(type, mxGetM(block), mxGetN(block)));
+    nprotect++;
+  }
+
+  switch(type) {
+    case REALSXP:
+      memcpy(REAL(ans) + offset, mxGetPr(block), n * sizeof(double));
+      break;
+    case CPLXSXP: {
+#if MX_HAS_INTERLEAVED_COMPLEX
+      memcpy(COMPLEX(ans) + offset, mxGetComplexDoubles(block), n * sizeof(Rcomplex));
+#else
+      double *real = mxGetPr(block), *imaginary = mxGetPi(block);
+      for(i = 0; i < n; i++) {
+        COMPLEX(ans)[offset + i].r = real[i];
+        COMPLEX(ans)[offset + i].i = imaginary[i];
+      }
+#endif
+    }
+      break;
+    case LGLSXP: {
+      mxLogical *data = mxGetLogicals(block);
+      for(i = 0; i < n; i++)
+        LOGICAL(ans)[offset + i] = data[i];
+    }
+      break;
+  }
+
+  if(engBlock)
+    mxDestroyArray(engBlock);
+  evalMatlab(eng, "clear " CHUNK_VAR);
+
+  UNPROTECT(nprotect);
+  return(ans);
+}
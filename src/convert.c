@@ -1,5 +1,6 @@
 #include "RMatlabConvert.h"
 #include <Rdefines.h>
+#include <unistd.h>
 
 /*
  See http://www.mathworks.com/access/helpdesk/help/techdoc/apiref/apiref.html
@@ -11,7 +12,111 @@ SEXP convertMatlabCell(const mxArray *m);
 mxArray *convertFromRObject(SEXP obj);
 SEXP convertMatlabStructToR(const mxArray *m);
 SEXP convertMatlabCellToRList(const mxArray *m, int nels);
-SEXP convertUint8ToR(const mxArray *m, int ndims, const int *dims, int nelements);
+SEXP convertUint8ToR(const mxArray *m, int ndims, const mwSize *dims, int nelements);
+
+/*
+ Set by convertFromRPooled() so that the next numeric, logical or complex
+ array we create (the top-level one) comes from the pool (see pool.c).
+*/
+static int PoolNextArray = 0;
+
+#define PARALLEL_DEFAULT_THRESHOLD  (8 * 1024 * 1024)
+
+/*
+  Read the R options RMatlab.parallel and RMatlab.parallelThreshold
+  that control copying the data on several threads (see parallel.c).
+*/
+void
+RMatlab_parallelConfigure()
+{
+  static SEXP optionSym = NULL, thresholdSym = NULL;
+  SEXP opt;
+  long cores;
+  int threads;
+
+  if(!optionSym) {
+    optionSym = Rf_install("RMatlab.parallel");
+    thresholdSym = Rf_install("RMatlab.parallelThreshold");
+  }
+
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if(cores < 1)
+    cores = 1;
+
+  opt = Rf_GetOption1(optionSym);
+  if(TYPEOF(opt) == LGLSXP && Rf_length(opt))
+    threads = LOGICAL(opt)[0] == FALSE ? 1 : cores;
+  else if(Rf_isNumeric(opt) && Rf_length(opt))
+    threads = Rf_asInteger(opt) > 1 ? Rf_asInteger(opt) : 1;
+  else
+    threads = cores;
+
+  opt = Rf_GetOption1(thresholdSym);
+  RMatlab_parallelSetup(threads,
+                        Rf_isNumeric(opt) && Rf_length(opt) && Rf_asReal(opt) > 0 ? Rf_asReal(opt) : PARALLEL_DEFAULT_THRESHOLD);
+}
+
+/*
+ R's dim attribute as the dimensions of a Matlab array, which are mwSize
+ rather than int with -largeArrayDims and -R2018a.  This is allocated
+ with R_alloc().
+*/
+mwSize *
+RMatlab_dimsFromR(SEXP dim)
+{
+  int i, n = Rf_length(dim);
+  mwSize *dims = (mwSize *) R_alloc(n > 2 ? n : 2, sizeof(mwSize));
+
+  for(i = 0; i < n; i++)
+    dims[i] = INTEGER(dim)[i];
+
+  return(dims);
+}
+
+/*
+ Create the array for an R vector of length len or with the given dimensions.
+*/
+static mxArray *
+newArray(mxClassID classID, mxComplexity complexity, int ndims, const mwSize *dims, int len)
+{
+  mwSize vectorDims[2];
+
+  if(ndims == 0) {
+    vectorDims[0] = len;
+    vectorDims[1] = 1;
+    ndims = 2;
+    dims = vectorDims;
+  }
+
+  if(PoolNextArray) {
+    PoolNextArray = 0;
+    return(RMatlab_poolArray(classID, complexity, ndims, dims));
+  }
+
+  if(classID == mxLOGICAL_CLASS)
+    return(mxCreateLogicalArray(ndims, dims));
+
+  return(mxCreateNumericArray(ndims, dims, classID, complexity));
+}
+
+/*
+ Convert the R value to a Matlab array which the caller gives back
+ via RMatlab_poolReleaseArray() rather than mxDestroyArray().
+ Only numeric, logical and complex vectors come from the pool.
+*/
+mxArray *
+convertFromRPooled(SEXP val)
+{
+  mxArray *ans;
+
+  PoolNextArray = TYPEOF(val) == REALSXP || TYPEOF(val) == INTSXP
+                    || TYPEOF(val) == LGLSXP || TYPEOF(val) == CPLXSXP;
+  ans = convertFromR(val, 1, NULL);
+  PoolNextArray = 0;
+
+  return(ans);
+}
+
 
 /*
  Convert an R object to one or more Matlab objects
@@ -23,16 +128,29 @@ convertFromR(SEXP val, int nout, mxArray *output[])
   mxArray *ans = NULL;
   int len, i;
 
-  int *dims = NULL;
+  mwSize *dims = NULL;
   int ndims;
 
   if(nout < 1)
     return(NULL);
 
+    /* Factors, data frames and, if RMatlab.attributes is TRUE, other values with attributes (attributes.c) */
+  if(RMatlab_convertsAttributes(val)) {
+    int depth;
+    PoolNextArray = 0;
+      /* This calls Matlab with the arrays it creates, so their data must be there. */
+    depth = RMatlab_parallelSuspend();
+    ans = RMatlab_attributesFromR(val);
+    RMatlab_parallelResume(depth);
+    if(output)
+      output[0] = ans;
+    return(ans);
+  }
+
   ndims = Rf_length(GET_DIM(val));
   len = Rf_length(val);
   if(ndims) {
-    dims = INTEGER(GET_DIM(val));
+    dims = RMatlab_dimsFromR(GET_DIM(val));
   }
 
   /* Have to check for matrices/arrays (i.e. having a dimension) before just looking at the mode. 
@@ -43,26 +161,20 @@ convertFromR(SEXP val, int nout, mxArray *output[])
     /* First check if we have a matrix.
        Then if we have an object with a class we convert it to a structure.
      */
-  if(TYPEOF(val) == VECSXP) { /*  && Rf_length(GET_CLASS(val)) */
+  if(TYPEOF(val) == NILSXP) {
+    ans = mxCreateDoubleMatrix(0, 0, mxREAL);
+  } else if(TYPEOF(val) == VECSXP) { /*  && Rf_length(GET_CLASS(val)) */
     ans = convertFromRObject(val);
   } else if(IS_COMPLEX(val)) {
-    double *real, *imaginary;
-
-    if(ndims == 0)
-      ans = mxCreateNumericMatrix(len, 1, mxDOUBLE_CLASS, mxCOMPLEX);
-    else if(ndims == 2)
-      ans = mxCreateNumericMatrix(dims[0], dims[1], mxDOUBLE_CLASS, mxCOMPLEX);
-    else 
-      ans = mxCreateNumericArray(ndims, dims, mxDOUBLE_CLASS, mxCOMPLEX);
+    ans = newArray(mxDOUBLE_CLASS, mxCOMPLEX, ndims, dims, len);
 
     len =  Rf_length(val);
-    real = mxGetPr(ans);
-    imaginary = mxGetPi(ans);
-    for(i = 0; i < len; i++) {
-      Rcomplex el = COMPLEX(val)[i];
-      real[i] = el.r;
-      imaginary[i] = el.i;
-    }
+#if MX_HAS_INTERLEAVED_COMPLEX
+      /* mxComplexDouble has the same layout as Rcomplex. */
+    RMatlab_parallelCopy(mxGetComplexDoubles(ans), COMPLEX(val), len * sizeof(Rcomplex));
+#else
+    RMatlab_parallelSplitComplex(mxGetPr(ans), mxGetPi(ans), COMPLEX(val), len);
+#endif
 
   } else if(IS_CHARACTER(val)) {
 
@@ -79,40 +191,21 @@ convertFromR(SEXP val, int nout, mxArray *output[])
       mxSetCell(ans, i, mxCreateString(CHAR(STRING_ELT(val, i))));
     }
   } else if(IS_NUMERIC(val) || IS_INTEGER(val)) {
-    double *data;
-
-    if(ndims == 0)
-      ans = mxCreateDoubleMatrix(len, 1, mxREAL);
-    else if(ndims == 2)
-      ans = mxCreateDoubleMatrix(dims[0], dims[1], mxREAL);
-    else 
-      ans = mxCreateNumericArray(ndims, dims, mxDOUBLE_CLASS, mxREAL);
+    ans = newArray(mxDOUBLE_CLASS, mxREAL, ndims, dims, len);
 
     len =  Rf_length(val);
 
-    data = mxGetPr(ans);
-    for(i = 0; i < len; i++) {
-      data[i] = TYPEOF(val) == REALSXP ? REAL(val)[i] : (double) INTEGER(val)[i];
-
-      /*	            ISNAN(INTEGER(val)[i]) ? mxGetNaN() : INTEGER(val)[i] ; */
-    } 
+      /* An integer NA becomes NaN (see parallel.c). */
+    if(TYPEOF(val) == REALSXP)
+      RMatlab_parallelCopy(mxGetPr(ans), REAL(val), len * sizeof(double));
+    else
+      RMatlab_parallelIntToDouble(mxGetPr(ans), INTEGER(val), len);
   } else if(IS_LOGICAL(val)) {
-    mxLogical *data;
-
-    if(ndims == 0)
-      ans = mxCreateLogicalMatrix(len, 1);
-    else if(ndims == 2)
-      ans = mxCreateLogicalMatrix(dims[0], dims[1]);
-    else 
-      ans = mxCreateLogicalArray(ndims, dims);
-
+    ans = newArray(mxLOGICAL_CLASS, mxREAL, ndims, dims, len);
 
     len =  Rf_length(val);
 
-    data = mxGetLogicals(ans);
-    for(i = 0; i < len; i++) {
-      data[i] = IS_NUMERIC(val) ? REAL(val)[i] : INTEGER(val)[i];
-    } 
+    RMatlab_parallelIntToLogical(mxGetLogicals(ans), LOGICAL(val), len);
   } else {
     fprintf(stderr, "Unhandled conversion from R to Matlab %d\n", TYPEOF(val)); fflush(stderr);
     Rf_PrintValue(val);
@@ -138,13 +231,19 @@ convertToR(const mxArray *val)
   int i;
 
   int ndims, nelements;
-  const int *dims;
+  const mwSize *dims;
   int numProtects = 0;
 
   if(!val)
     return(ans);
 
-  if(mxIsCell(val)) {
+  if(RMatlab_isAttributeArray(val)) {
+      /* This looks at the values of the R vectors it creates, so their data must be there. */
+    int depth = RMatlab_parallelSuspend();
+    ans = RMatlab_attributesToR(val);
+    RMatlab_parallelResume(depth);
+    return(ans);
+  } else if(mxIsCell(val)) {
     return(convertMatlabCell(val));
   } else if(mxIsStruct(val)) {
     return(convertMatlabStructToR(val));
@@ -172,14 +271,10 @@ convertToR(const mxArray *val)
       type = mxIsLogical(val) ? LGLSXP : REALSXP;
 
 
-      /* Allocate a vector or matrix or array */
-    if(ndims == 2 && (dims[0] == 1 || dims[1] == 1)) {
-      PROTECT(ans = allocVector(type, dims[0] * dims[1]));
-      numProtects++;
-    } else if(ndims == 2) {
-      PROTECT(ans = allocMatrix(type, dims[0], dims[1]));
-      numProtects++;
-    } else {
+      /* Allocate a vector or matrix or array, reusing one from the pool if we can. */
+    PROTECT(ans = RMatlab_poolVector(type, nelements));
+    numProtects++;
+    if(!(ndims == 2 && (dims[0] == 1 || dims[1] == 1))) {
       SEXP tmp;
       PROTECT(tmp = allocVector(INTSXP, ndims));
       numProtects++;
@@ -187,20 +282,20 @@ convertToR(const mxArray *val)
       for(i = 0; i < ndims; i++)
 	INTEGER(tmp)[i] = dims[i];
 
-      PROTECT(ans = allocArray(type, tmp));
-      numProtects++;
+      Rf_setAttrib(ans, R_DimSymbol, tmp);
     }
 
 
-    for(i = 0; i < nelements; i++) {
-      if(type == LGLSXP)
-	LOGICAL(ans)[i] = mxGetLogicals(val)[i];
-      else if(type == REALSXP)
-	REAL(ans)[i] = mxGetPr(val)[i];
-      else {
-	COMPLEX(ans)[i].r = mxGetPr(val)[i];
-	COMPLEX(ans)[i].i = mxGetPi(val)[i];
-      }
+    if(type == LGLSXP)
+      RMatlab_parallelLogicalToInt(LOGICAL(ans), mxGetLogicals(val), nelements);
+    else if(type == REALSXP)
+      RMatlab_parallelCopy(REAL(ans), mxGetPr(val), nelements * sizeof(double));
+    else {
+#if MX_HAS_INTERLEAVED_COMPLEX
+      RMatlab_parallelCopy(COMPLEX(ans), mxGetComplexDoubles(val), nelements * sizeof(Rcomplex));
+#else
+      RMatlab_parallelJoinComplex(COMPLEX(ans), mxGetPr(val), mxGetPi(val), nelements);
+#endif
     }
 
   } else if(mxIsChar(val)) {
@@ -336,8 +431,10 @@ convertMatlabCell(const mxArray *m)
       case mxCHAR_CLASS:
 	len = mxGetN(el) * mxGetM(el) + 1;
 	buf = (char *) R_alloc(len, sizeof(char)); 
-	if(!buf) 
-	  MATLAB_ERROR_MESSAGE("Cannot allocate space to hold Matlab string as R character vector");
+	if(!buf) {
+	  PROBLEM "Cannot allocate space to hold Matlab string as R character vector"
+	  ERROR;
+	}
 
 	mxGetString(el, buf, len); 
 	SET_STRING_ELT(ans, i, COPY_TO_USER_STRING(buf));
@@ -374,10 +471,12 @@ convertMatlabCellToRList(const mxArray *m, int nels)
     nels = mxGetNumberOfElements(m);
 
   PROTECT(ans = allocVector(VECSXP, nels));
+  RMatlab_parallelBegin();
   for(i = 0; i < nels; i++) {
     el = mxGetCell(m, i);
     SET_VECTOR_ELT(ans, i , convertToR(el));
   }
+  RMatlab_parallelEnd();
 
   UNPROTECT(1);
 
@@ -447,6 +546,7 @@ convertFromRObject(SEXP obj)
     ans = mxCreateCellMatrix(1, len);
   }
 
+  RMatlab_parallelBegin();
   for(i = 0; i < len; i++) {
     mxArray *val;
     val = convertFromR(VECTOR_ELT(obj, i), 1, NULL);
@@ -456,6 +556,7 @@ convertFromRObject(SEXP obj)
     else
       mxSetCell(ans, i, val);
   }
+  RMatlab_parallelEnd();
 
   return(ans);
 }
@@ -475,6 +576,7 @@ convertMatlabStructToR(const mxArray *m)
   PROTECT(ans = allocVector(VECSXP, len));
   PROTECT(names = allocVector(STRSXP, len));
 
+  RMatlab_parallelBegin();
   for(i = 0; i < len ; i++) {
     const char *name;
     mxArray *el;
@@ -487,6 +589,7 @@ convertMatlabStructToR(const mxArray *m)
     if(el)
       SET_VECTOR_ELT(ans, i, convertToR(el));
   }
+  RMatlab_parallelEnd();
 
   SET_NAMES(ans, names);
 
@@ -509,7 +612,7 @@ convertMatlabStructToR(const mxArray *m)
   resulting object.
 */
 SEXP
-convertUint8ToR(const mxArray *m, int ndims, const int *dims, int nelements)
+convertUint8ToR(const mxArray *m, int ndims, const mwSize *dims, int nelements)
 {
   int numProtects = 0;
   SEXP ans;
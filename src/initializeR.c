@@ -1,5 +1,10 @@
 #include "mex.h"
 #include "engine.h"
+#include "RMatlabWorker.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
 
 #include <Rinternals.h>
 #include <Rdefines.h>
@@ -16,6 +21,25 @@
 
 
 static int loadRMatlab();
+static int startR(int nargs, char **R_cmdArgs);
+static void preloadPackages(char **pkgs, int n);
+
+  /* Non-NULL if R is running on its own thread. */
+static RMatlabWorker *Worker = NULL;
+
+  /* Options given to initializeR that control how R is started. See mexFunction. */
+static int LazyLoad = 0;
+  /* Copied from the Matlab array on Matlab's thread, as startR() may run on the R worker thread. */
+static char **Preload = NULL;
+static int NumPreload = 0;
+
+  /* The time (in seconds) spent in each phase of starting R. */
+static struct {
+  double initialize, mainloop, preload, load, total;
+} Timings;
+
+  /* The trace of the calls between R and Matlab, if the 'trace' option or RMATLAB_TRACE_DIR was given. */
+static RMatlabTrace *Trace = NULL;
 
 static void RMatlab_closeRSession() {
 #if R_VERSION >= R_Version(2, 4, 0)
@@ -23,32 +47,98 @@ static void RMatlab_closeRSession() {
 #endif
 }
 
+static void RMatlab_stopWorker() {
+  RMatlabWorker_stop(Worker);
+}
+
+static void RMatlab_atExit() {
+  if(Worker)
+    RMatlab_stopWorker();
+  else
+    RMatlab_closeRSession();
+  RMatlab_traceWriteToDir(Trace);
+}
+
 
 
 /*
-  Takes a Matlab cell array of strings and places them in 
-  an array.
+  Takes a Matlab cell array of strings, or a single string, and places them in
+  an array.  The pointers and the strings are allocated as a single block
+  so the caller can release them with one call to free().
 */
 static char **
 copyCommandLineArguments(const mxArray *mxEls, int *nargs)
 {
-    char **args;
-    int len, i;
+    char **args, *strings;
+    size_t total = 0;
+    int i, isString = mxIsChar(mxEls);
 
-    *nargs = mxGetNumberOfElements(mxEls);
-    args = (char **) malloc(sizeof(char *) * *nargs);
+    *nargs = isString ? 1 : (mxIsCell(mxEls) ? mxGetNumberOfElements(mxEls) : 0);
+    for(i = 0; i < *nargs; i++)
+      total += mxGetNumberOfElements(isString ? mxEls : mxGetCell(mxEls, i)) + 1;
+
+    args = (char **) malloc(sizeof(char *) * *nargs + total);
+    strings = (char *) (args + *nargs);
 
     for(i = 0; i < *nargs; i++) {
       int len;
-      mxArray *el = mxGetCell(mxEls, i);
-      len = mxGetN(el) + 1;
-      args[i] = (char *) malloc(len * sizeof(char));
+      const mxArray *el = isString ? mxEls : mxGetCell(mxEls, i);
+      len = mxGetNumberOfElements(el) + 1;
+      args[i] = strings;
       mxGetString(el, args[i], len);
+      strings += len;
     }
 
     return(args);
 }
 
+/*
+  Convert an array of C strings to an R character vector.
+*/
+static SEXP
+stringsToR(char **strings, int n)
+{
+    SEXP ans;
+    int i;
+
+    PROTECT(ans = allocVector(STRSXP, n));
+    for(i = 0; i < n; i++)
+      SET_STRING_ELT(ans, i, mkChar(strings[i]));
+    UNPROTECT(1);
+
+    return(ans);
+}
+
+static double
+currentTime()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return(tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+static mxArray *
+timingsToMatlab()
+{
+    const char *names[] = {"initialize", "mainloop", "preload", "load", "total"};
+    double values[5];
+    mxArray *ans;
+    int i;
+
+    values[0] = Timings.initialize;
+    values[1] = Timings.mainloop;
+    values[2] = Timings.preload;
+    values[3] = Timings.load;
+    values[4] = Timings.total;
+
+    ans = mxCreateStructMatrix(1, 1, 5, names);
+    for(i = 0; i < 5; i++)
+      mxSetFieldByNumber(ans, 0, i, mxCreateDoubleScalar(values[i]));
+
+    return(ans);
+}
+
 /*
  This is the routine that actually starts the R engine.
 */
@@ -63,7 +153,10 @@ mexFunction(int nlhs, mxArray *plhs[],
     static  char **R_cmdArgs = NULL;
     static int embeddedR_Is_Running = 0;
 
-    int nargs;
+    static char *defaultArgs[] = {"RMatlab", "--no-save", "--silent"};
+    int nargs, async = 0, showTimings = 0, trace = 0, ok, i;
+    char option[20];
+    double start = currentTime(), traceStart;
 
     mxArray *init;
 
@@ -74,8 +167,71 @@ mexFunction(int nlhs, mxArray *plhs[],
     }
 
       /* Command line arguments in prhs[0] */
-    nargs = nrhs; 
-    R_cmdArgs = copyCommandLineArguments(prhs[0], &nargs);
+    if(nrhs > 0 && mxIsCell(prhs[0]))
+      R_cmdArgs = copyCommandLineArguments(prhs[0], &nargs);
+    else {
+      nargs = sizeof(defaultArgs)/sizeof(defaultArgs[0]);
+      R_cmdArgs = NULL;
+    }
+
+      /* The remaining arguments are options:
+           'async'  runs R on its own thread. See callRAsync.c
+           'lazy'   defers loading the RMatlab package until the first call to R.
+           'preload', {'pkg1' 'pkg2'}  attaches these packages once R has started.
+           'defaultPackages', {'stats'}  the packages R attaches at startup,
+                                         instead of R_DEFAULT_PACKAGES.
+           'timings'  displays the time spent in each phase.
+           'trace'  records the calls between R and Matlab (see trace.c).
+                    This is also on if RMATLAB_TRACE_DIR is set, and the trace
+                    is written to that directory when Matlab exits.
+         The second output from initializeR is a struct with these times.
+       */
+    for(i = 1; i < nrhs; i++) {
+      if(!mxIsChar(prhs[i]))
+        mexErrMsgTxt("The options for initializeR must be strings");
+      mxGetString(prhs[i], option, sizeof(option));
+
+      if(strcmp(option, "async") == 0)
+        async = 1;
+      else if(strcmp(option, "lazy") == 0)
+        LazyLoad = 1;
+      else if(strcmp(option, "timings") == 0)
+        showTimings = 1;
+      else if(strcmp(option, "trace") == 0)
+        trace = 1;
+      else if(strcmp(option, "preload") == 0 && i + 1 < nrhs) {
+        free(Preload);
+        Preload = copyCommandLineArguments(prhs[++i], &NumPreload);
+      }
+      else if(strcmp(option, "defaultPackages") == 0 && i + 1 < nrhs) {
+        char *pkgs;
+        int j, n, len = 0;
+        const mxArray *val = prhs[++i];
+
+        n = mxIsCell(val) ? mxGetNumberOfElements(val) : 0;
+        for(j = 0; j < n; j++)
+          len += mxGetNumberOfElements(mxGetCell(val, j)) + 1;
+        pkgs = (char *) mxCalloc(len + 5, sizeof(char));
+        if(n == 0)
+          strcpy(pkgs, "NULL");
+        for(j = 0; j < n; j++) {
+          if(j > 0)
+            strcat(pkgs, ",");
+          mxGetString(mxGetCell(val, j), pkgs + strlen(pkgs), len + 5 - strlen(pkgs));
+        }
+        setenv("R_DEFAULT_PACKAGES", pkgs, 1);
+      } else
+        mexErrMsgIdAndTxt("RMatlab:initializeR", "Unrecognized option '%s' for initializeR", option);
+    }
+
+    if(trace || (getenv("RMATLAB_TRACE_DIR") && getenv("RMATLAB_TRACE_DIR")[0])) {
+      Trace = RMatlab_traceCreate(RMATLAB_TRACE_SIZE);
+      if(Trace) {
+        RMatlab_tracePublish(Trace);
+        RMatlab_traceUse(Trace);
+      }
+    }
+    traceStart = RMatlab_traceBegin();
 
 #if R_VERSION >= R_Version(2, 3, 1)
     /* Before starting the R main loop, we need to disable signal handlers, 
@@ -86,38 +242,107 @@ mexFunction(int nlhs, mxArray *plhs[],
     R_SignalHandlers = 0;
 #endif
 
+    if(async) {
+        /* R is initialized on the worker thread and only used there. */
+      Worker = RMatlabWorker_start(nargs, R_cmdArgs ? R_cmdArgs : defaultArgs, startR, RMatlab_closeRSession);
+      ok = Worker != NULL;
+    } else
+      ok = startR(nargs, R_cmdArgs ? R_cmdArgs : defaultArgs);
+    free(Preload);
+    Preload = NULL;
+    NumPreload = 0;
+
+    Timings.total = currentTime() - start;
+    RMatlab_traceEnd(traceStart, "initializeR", "", -1);
+    if(showTimings)
+      mexPrintf("R started in %.3f seconds: initialize %.3f, main loop %.3f, preload %.3f, RMatlab %.3f\n",
+                  Timings.total, Timings.initialize, Timings.mainloop, Timings.preload, Timings.load);
+
+    embeddedR_Is_Running = 1;
+
+    if (R_cmdArgs)
+      free(R_cmdArgs);
+
+    if(!ok)
+      mexErrMsgTxt("Cannot load RMatlab package in R. Something is wrong with the installation of RMatlab.");
+
+    if(Worker)
+      RMatlabWorker_publish(Worker);
+
+    init = mxCreateLogicalScalar(1);
+    mexPutVariable("base", "REngineInitialized", init);
+
+    if(nlhs > 0) 
+      plhs[0] = init;
+    if(nlhs > 1)
+      plhs[1] = timingsToMatlab();
+
+    mexAtExit(RMatlab_atExit);
+}
+
+
+/*
+ Start R, attach any packages given via the 'preload' option and load
+ the RMatlab package unless we are to do that lazily.
+ This is called on Matlab's thread or, in async mode, on the R worker thread.
+*/
+static int
+startR(int nargs, char **R_cmdArgs)
+{
+    double start = currentTime(), traceStart;
+
 #if 0
-    if (!(embeddedR_Is_Running = Rf_initEmbeddedR(nargs, R_cmdArgs)))
-    	mexErrMsgTxt("Error initializing the R embedded environment");
+    if (!Rf_initEmbeddedR(nargs, R_cmdArgs))
+        return(0);
 #else
      /* We need to unroll Rf_initEmbeddedR(nargs, R_cmdArgs) to disable the
         stack-checking between Rf_initialize_R() and setup_Rmainloop() */
      Rf_initialize_R(nargs, R_cmdArgs);
      R_Interactive = TRUE;  /* Rf_initialize_R set this based on isatty */
      R_CStackLimit = (uintptr_t)-1;
+     Timings.initialize = currentTime() - start;
+
+     start = currentTime();
      setup_Rmainloop();
- 
-     embeddedR_Is_Running = 1;
+     Timings.mainloop = currentTime() - start;
 #endif
 
-    if (R_cmdArgs)
-      free(R_cmdArgs);
+    if(Preload) {
+      start = currentTime();
+      preloadPackages(Preload, NumPreload);
+      Timings.preload = currentTime() - start;
+    }
 
+    start = currentTime();
+    if(!loadRMatlab())
+      return(0);
+    Timings.load = currentTime() - start;
 
-    loadRMatlab();
+    return(1);
+}
 
-    init = mxCreateLogicalScalar(1);
-    mexPutVariable("base", "REngineInitialized", init);
 
-    if(nlhs > 0) 
-      plhs[0] = init;
+/*
+  Attach the packages in a single call to R, rather than one call each from Matlab.
+  A package that cannot be loaded produces a warning, not an error.
+*/
+static void
+preloadPackages(char **pkgs, int n)
+{
+  SEXP e;
+  int errorOccurred;
 
-    mexAtExit(RMatlab_closeRSession);
+    /* invisible(lapply(pkgs, require, character.only = TRUE)) */
+  PROTECT(e = Rf_lang4(Rf_install("lapply"), stringsToR(pkgs, n), Rf_install("require"), ScalarLogical(TRUE)));
+  SET_TAG(CDR(CDR(CDR(e))), Rf_install("character.only"));
+  PROTECT(e = Rf_lang2(Rf_install("invisible"), e));
+  R_tryEval(e, R_GlobalEnv, &errorOccurred);
+  UNPROTECT(2);
 }
 
 
 /*
-  This routine is called to load the RMatlab package and
+  This routine is called to load the RMatlab package (unless it is to be loaded lazily) and
   to store a variable (named .MexInterface) in the R 
   work space to indicate that there is a Mex interface
   available rather than the Engine API. 
@@ -126,17 +351,20 @@ static int
 loadRMatlab()
 {
   SEXP e, klass;
-  int errorOccurred;
+  int errorOccurred = 0;
 
-  PROTECT(e = allocVector(LANGSXP, 2));
-  SETCAR(e, Rf_install("library"));
-  SETCAR(CDR(e), mkString("RMatlab"));
+    /* With the 'lazy' option, RMatlab_createRCall() loads it when we first call R. */
+  if(!LazyLoad) {
+    PROTECT(e = allocVector(LANGSXP, 2));
+    SETCAR(e, Rf_install("library"));
+    SETCAR(CDR(e), mkString("RMatlab"));
 
-  R_tryEval(e, R_GlobalEnv, &errorOccurred);
-  UNPROTECT(1);
+    R_tryEval(e, R_GlobalEnv, &errorOccurred);
+    UNPROTECT(1);
+  }
 
   if(errorOccurred)
-    mexErrMsgTxt("Cannot load RMatlab package in R. Something is wrong with the installation of RMatlab.");
+    return(0);
 
   PROTECT(e = ScalarLogical(1));
   PROTECT(klass = allocVector(STRSXP, 2));
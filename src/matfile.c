@@ -0,0 +1,1132 @@
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+
+#if R_VERSION >= R_Version(3, 6, 0)
+#include <R_ext/Altrep.h>
+#define MATFILE_ALTREP 1
+#endif
+
+#include <zlib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ Reading MAT files (level 5, i.e. those saved with -v6 or -v7) without Matlab.
+
+ .MatFile() in R maps the file into memory and indexes the variables by
+ reading only the header of each one: its name, class and dimensions.
+ A variable is read when it is accessed.  A real numeric or logical
+ variable becomes an ALTREP vector backed by the file which pages in the
+ parts of the data R uses.  If the file holds the data as R does (doubles
+ for a numeric vector, int32 for an integer one), R works directly on the
+ mapped memory.  Otherwise the elements are converted as R asks for them,
+ or all at once when R needs the whole vector in memory (e.g. to modify it).
+ A compressed variable (-v7) is decompressed when its data is first needed.
+ Complex, character, cell and struct variables are read in full when
+ accessed.  Sparse matrices and objects are not supported.
+
+ The mapping is released when the MatFile and all the vectors from it
+ have been garbage collected.
+
+ The types are converted as convertToR() does for Matlab arrays.  Only files
+ written with the byte order of this machine can be read.  v7.3 files are
+ HDF5 files and not handled here.
+
+ This doesn't use Matlab and is built as a library of its own,
+ RMatlabMatFile.so, so that R can load it where Matlab is not installed.
+*/
+
+#define MAT_HEADER_SIZE   128
+#define MAT_MAX_DIMS      32
+#define MAT_NAME_SIZE     64
+  /* Enough of a compressed variable to hold its header. */
+#define MAT_PEEK_SIZE     1024
+
+  /* The types of the data elements. */
+enum {
+  MI_INT8 = 1, MI_UINT8, MI_INT16, MI_UINT16, MI_INT32, MI_UINT32, MI_SINGLE,
+  MI_DOUBLE = 9, MI_INT64 = 12, MI_UINT64, MI_MATRIX, MI_COMPRESSED, MI_UTF8, MI_UTF16, MI_UTF32
+};
+
+  /* The classes of the arrays. */
+enum {
+  MAT_CELL = 1, MAT_STRUCT, MAT_OBJECT, MAT_CHAR, MAT_SPARSE, MAT_DOUBLE, MAT_SINGLE,
+  MAT_INT8, MAT_UINT8, MAT_INT16, MAT_UINT16, MAT_INT32, MAT_UINT32, MAT_INT64, MAT_UINT64,
+  MAT_NUM_CLASSES
+};
+
+static const char *ClassNames[] = {"unknown", "cell", "struct", "object", "char", "sparse", "double", "single",
+                                   "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64"};
+
+typedef struct {
+  unsigned int type;
+  size_t nbytes;
+  const unsigned char *data;
+  size_t size;             /* of the whole element, with its tag and padding. */
+} MatTag;
+
+typedef struct {
+  int classID, complex, logical;
+  int ndims;
+  int dims[MAT_MAX_DIMS];
+  char name[MAT_NAME_SIZE];
+  const unsigned char *rest;     /* the contents after the name, e.g. the real part. */
+  size_t restSize;
+} MatHeader;
+
+typedef struct {
+  MatHeader header;
+  int compressed;
+  const unsigned char *body;     /* the contents of the miMATRIX or miCOMPRESSED element. */
+  size_t size;
+  size_t inflatedSize;           /* of the miMATRIX element within the compressed one. */
+} MatVariable;
+
+typedef struct {
+  unsigned char *map;
+  size_t mapSize;
+  int numVars;
+  MatVariable *vars;
+} MatFile;
+
+
+static int
+readTag(const unsigned char *p, size_t avail, MatTag *tag)
+{
+  uint32_t word[2];
+
+  if(avail < 8)
+    return(0);
+
+  memcpy(word, p, 8);
+  if(word[0] >> 16) {
+      /* A small data element, with its data in the second word of the tag. */
+    tag->type = word[0] & 0xffff;
+    tag->nbytes = word[0] >> 16;
+    tag->data = p + 4;
+    tag->size = 8;
+    return(tag->nbytes <= 4);
+  }
+
+  tag->type = word[0];
+  tag->nbytes = word[1];
+  tag->data = p + 8;
+  if(tag->nbytes > avail - 8)
+    return(0);
+    /* Compressed elements are not padded to a multiple of 8 bytes. */
+  tag->size = 8 + (tag->type == MI_COMPRESSED ? tag->nbytes : (tag->nbytes + 7) & ~((size_t) 7));
+  if(tag->size > avail)
+    tag->size = avail;
+
+  return(1);
+}
+
+/*
+  Read the array flags, dimensions and name at the start of a miMATRIX element.
+*/
+static int
+parseHeader(const unsigned char *body, size_t size, MatHeader *h)
+{
+  const unsigned char *end = body + size;
+  uint32_t flags;
+  MatTag tag;
+  size_t len;
+
+  memset(h, 0, sizeof(MatHeader));
+
+  if(!readTag(body, size, &tag) || tag.type != MI_UINT32 || tag.nbytes < 8)
+    return(0);
+  memcpy(&flags, tag.data, 4);
+  h->classID = flags & 0xff;
+  h->complex = (flags & 0x0800) != 0;
+  h->logical = (flags & 0x0200) != 0;
+  body += tag.size;
+
+  if(!readTag(body, end - body, &tag) || tag.type != MI_INT32 || tag.nbytes / 4 > MAT_MAX_DIMS)
+    return(0);
+  h->ndims = tag.nbytes / 4;
+  memcpy(h->dims, tag.data, h->ndims * 4);
+  body += tag.size;
+
+  if(!readTag(body, end - body, &tag) || (tag.type != MI_INT8 && tag.type != MI_UINT8))
+    return(0);
+  len = tag.nbytes < MAT_NAME_SIZE ? tag.nbytes : MAT_NAME_SIZE - 1;
+  memcpy(h->name, tag.data, len);
+  body += tag.size;
+
+  h->rest = body;
+  h->restSize = end - body;
+
+  return(1);
+}
+
+static double
+numElements(const MatHeader *h)
+{
+  double n = 1;
+  int i;
+
+  for(i = 0; i < h->ndims; i++)
+    n *= h->dims[i];
+
+  return(n);
+}
+
+static size_t
+miSize(unsigned int type)
+{
+  switch(type) {
+    case MI_INT8:
+    case MI_UINT8:
+    case MI_UTF8:
+      return(1);
+    case MI_INT16:
+    case MI_UINT16:
+    case MI_UTF16:
+      return(2);
+    case MI_INT32:
+    case MI_UINT32:
+    case MI_SINGLE:
+    case MI_UTF32:
+      return(4);
+    case MI_DOUBLE:
+    case MI_INT64:
+    case MI_UINT64:
+      return(8);
+    default:
+      return(0);
+  }
+}
+
+/*
+  The type of the R vector for a numeric or logical Matlab array,
+  following convertToR(), or NILSXP for the other classes.
+*/
+static SEXPTYPE
+rType(const MatHeader *h)
+{
+  if(h->logical)
+    return(LGLSXP);
+
+  switch(h->classID) {
+    case MAT_INT8:
+    case MAT_UINT8:
+    case MAT_INT16:
+    case MAT_UINT16:
+    case MAT_INT32:
+      return(INTSXP);
+    case MAT_DOUBLE:
+    case MAT_SINGLE:
+    case MAT_UINT32:
+    case MAT_INT64:
+    case MAT_UINT64:
+      return(REALSXP);
+    default:
+      return(NILSXP);
+  }
+}
+
+
+/*
+  Decompress up to size bytes of the compressed element into buf,
+  returning the number of bytes we got.
+*/
+static size_t
+inflateElement(const unsigned char *src, size_t srcSize, unsigned char *buf, size_t size)
+{
+  z_stream zs;
+  size_t done = 0, consumed = 0, chunk, before;
+  int status;
+
+  memset(&zs, 0, sizeof(zs));
+  if(inflateInit(&zs) != Z_OK)
+    return(0);
+
+    /* zlib counts in unsigned ints, so we give it at most 1GB at a time. */
+  while(done < size) {
+    if(zs.avail_in == 0 && consumed < srcSize) {
+      chunk = srcSize - consumed < (1 << 30) ? srcSize - consumed : (1 << 30);
+      zs.next_in = (Bytef *) src + consumed;
+      zs.avail_in = chunk;
+      consumed += chunk;
+    }
+    zs.next_out = buf + done;
+    zs.avail_out = size - done < (1 << 30) ? size - done : (1 << 30);
+    before = zs.avail_out;
+
+    status = inflate(&zs, Z_NO_FLUSH);
+    done += before - zs.avail_out;
+    if(status == Z_STREAM_END || (status != Z_OK && status != Z_BUF_ERROR)
+        || (status == Z_BUF_ERROR && zs.avail_in == 0 && consumed == srcSize))
+      break;
+  }
+
+  inflateEnd(&zs);
+  return(done);
+}
+
+/*
+  The miMATRIX element of the compressed variable, in an R raw vector.
+*/
+static SEXP
+inflateVariable(const MatVariable *v)
+{
+  SEXP ans;
+
+  PROTECT(ans = allocVector(RAWSXP, v->inflatedSize));
+  if(inflateElement(v->body, v->size, RAW(ans), v->inflatedSize) != v->inflatedSize) {
+    PROBLEM "cannot decompress the MAT file variable %s", v->header.name
+    ERROR;
+  }
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+
+/*
+  Copy n elements of the stored data, starting at from, into the R vector's
+  data converting them to its type.
+*/
+#define COPY_ELEMENTS(ctype) \
+  for(i = 0; i < n; i++) { \
+    ctype v; \
+    memcpy(&v, src + (from + i) * sizeof(ctype), sizeof(ctype)); \
+    if(type == REALSXP) \
+      ((double *) dest)[i] = (double) v; \
+    else if(type == LGLSXP) \
+      ((int *) dest)[i] = v != 0; \
+    else \
+      ((int *) dest)[i] = (int) v; \
+  }
+
+static void
+copyElements(void *dest, SEXPTYPE type, unsigned int miType, const unsigned char *src, R_xlen_t from, R_xlen_t n)
+{
+  R_xlen_t i;
+
+  if((type == REALSXP && miType == MI_DOUBLE) || (type == INTSXP && miType == MI_INT32)) {
+    memcpy(dest, src + from * miSize(miType), n * miSize(miType));
+    return;
+  }
+
+  switch(miType) {
+    case MI_INT8:   COPY_ELEMENTS(int8_t);   break;
+    case MI_UINT8:  COPY_ELEMENTS(uint8_t);  break;
+    case MI_INT16:  COPY_ELEMENTS(int16_t);  break;
+    case MI_UINT16: COPY_ELEMENTS(uint16_t); break;
+    case MI_INT32:  COPY_ELEMENTS(int32_t);  break;
+    case MI_UINT32: COPY_ELEMENTS(uint32_t); break;
+    case MI_SINGLE: COPY_ELEMENTS(float);    break;
+    case MI_DOUBLE: COPY_ELEMENTS(double);   break;
+    case MI_INT64:  COPY_ELEMENTS(int64_t);  break;
+    case MI_UINT64: COPY_ELEMENTS(uint64_t); break;
+  }
+}
+
+/*
+  Read the tag of the next numeric data element (the real or imaginary part)
+  and check it holds n elements.
+*/
+static const unsigned char *
+dataElement(const unsigned char **pos, const unsigned char *end, R_xlen_t n, const char *name, unsigned int *miType)
+{
+  MatTag tag;
+
+  if(!readTag(*pos, end - *pos, &tag) || miSize(tag.type) == 0 || tag.nbytes < n * miSize(tag.type)) {
+    PROBLEM "the data of the MAT file variable %s is missing or truncated", name
+    ERROR;
+  }
+
+  *pos += tag.size;
+  *miType = tag.type;
+  return(tag.data);
+}
+
+static void
+setDimensions(SEXP ans, const MatHeader *h)
+{
+  SEXP dims;
+  int i;
+
+  if(h->ndims == 2 && (h->dims[0] == 1 || h->dims[1] == 1))
+    return;
+
+  PROTECT(dims = allocVector(INTSXP, h->ndims));
+  for(i = 0; i < h->ndims; i++)
+    INTEGER(dims)[i] = h->dims[i];
+  Rf_setAttrib(ans, R_DimSymbol, dims);
+  UNPROTECT(1);
+}
+
+
+#ifdef MATFILE_ALTREP
+/*
+ The ALTREP vectors backed by the file.  data1 is an external pointer to
+ the MatVector, protecting the MatFile's external pointer.  data2 is the
+ ordinary vector once we have had to create it.
+*/
+
+typedef struct {
+  MatFile *file;
+  int var;                         /* the compressed variable to inflate, or -1. */
+  const unsigned char *data;       /* the stored data in the mapping, if not compressed. */
+  unsigned int miType;
+  R_xlen_t length;
+  SEXPTYPE type;
+} MatVector;
+
+static R_altrep_class_t MatRealClass, MatIntegerClass, MatLogicalClass;
+static int ClassesCreated = 0;
+
+static MatVector *
+matVector(SEXP x)
+{
+  return((MatVector *) R_ExternalPtrAddr(R_altrep_data1(x)));
+}
+
+  /* Can R use the stored data as is. */
+static int
+sameRepresentation(const MatVector *v)
+{
+  return(v->data && ((v->type == REALSXP && v->miType == MI_DOUBLE) || (v->type == INTSXP && v->miType == MI_INT32)));
+}
+
+/*
+  Create the ordinary vector with all the elements.
+*/
+static SEXP
+materialize(SEXP x)
+{
+  MatVector *v = matVector(x);
+  MatVariable *var;
+  MatHeader h;
+  SEXP ans, buf;
+  const unsigned char *pos, *data;
+  unsigned int miType;
+
+  if(R_altrep_data2(x) != R_NilValue)
+    return(R_altrep_data2(x));
+
+  PROTECT(ans = allocVector(v->type, v->length));
+  if(v->data)
+    copyElements(DATAPTR(ans), v->type, v->miType, v->data, 0, v->length);
+  else {
+    var = v->file->vars + v->var;
+    PROTECT(buf = inflateVariable(var));
+    if(!parseHeader(RAW(buf) + 8, var->inflatedSize - 8, &h)) {
+      PROBLEM "cannot read the MAT file variable %s", var->header.name
+      ERROR;
+    }
+    pos = h.rest;
+    data = dataElement(&pos, h.rest + h.restSize, v->length, h.name, &miType);
+    copyElements(DATAPTR(ans), v->type, miType, data, 0, v->length);
+    UNPROTECT(1);
+  }
+  R_set_altrep_data2(x, ans);
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+static R_xlen_t
+matVectorLength(SEXP x)
+{
+  return(matVector(x)->length);
+}
+
+static Rboolean
+matVectorInspect(SEXP x, int pre, int deep, int pvec, void (*inspectSubtree)(SEXP, int, int, int))
+{
+  MatVector *v = matVector(x);
+
+  Rprintf(" MAT file vector (%s)\n", R_altrep_data2(x) != R_NilValue ? "in memory"
+            : (v->data ? "mapped" : "compressed"));
+  return(TRUE);
+}
+
+static void *
+matVectorDataptr(SEXP x, Rboolean writeable)
+{
+  MatVector *v = matVector(x);
+
+  if(R_altrep_data2(x) != R_NilValue)
+    return(DATAPTR(R_altrep_data2(x)));
+
+    /* The mapping is read-only, so R gets a copy to modify. */
+  if(!writeable && sameRepresentation(v))
+    return((void *) v->data);
+
+  return(DATAPTR(materialize(x)));
+}
+
+static const void *
+matVectorDataptrOrNull(SEXP x)
+{
+  MatVector *v = matVector(x);
+
+  if(R_altrep_data2(x) != R_NilValue)
+    return(DATAPTR(R_altrep_data2(x)));
+
+  return(sameRepresentation(v) ? (const void *) v->data : NULL);
+}
+
+static R_xlen_t
+matVectorRegion(SEXP x, R_xlen_t from, R_xlen_t n, void *buf)
+{
+  MatVector *v = matVector(x);
+  size_t size = v->type == REALSXP ? sizeof(double) : sizeof(int);
+
+  if(from >= v->length)
+    return(0);
+  if(n > v->length - from)
+    n = v->length - from;
+
+  if(R_altrep_data2(x) != R_NilValue)
+    memcpy(buf, (char *) DATAPTR(R_altrep_data2(x)) + from * size, n * size);
+  else if(v->data)
+    copyElements(buf, v->type, v->miType, v->data, from, n);
+  else
+    memcpy(buf, (char *) DATAPTR(materialize(x)) + from * size, n * size);
+
+  return(n);
+}
+
+static double
+matRealElt(SEXP x, R_xlen_t i)
+{
+  double ans;
+  matVectorRegion(x, i, 1, &ans);
+  return(ans);
+}
+
+static int
+matIntegerElt(SEXP x, R_xlen_t i)
+{
+  int ans;
+  matVectorRegion(x, i, 1, &ans);
+  return(ans);
+}
+
+static R_xlen_t
+matRealRegion(SEXP x, R_xlen_t from, R_xlen_t n, double *buf)
+{
+  return(matVectorRegion(x, from, n, buf));
+}
+
+static R_xlen_t
+matIntegerRegion(SEXP x, R_xlen_t from, R_xlen_t n, int *buf)
+{
+  return(matVectorRegion(x, from, n, buf));
+}
+
+static void
+setVectorMethods(R_altrep_class_t cl)
+{
+  R_set_altrep_Length_method(cl, matVectorLength);
+  R_set_altrep_Inspect_method(cl, matVectorInspect);
+  R_set_altvec_Dataptr_method(cl, matVectorDataptr);
+  R_set_altvec_Dataptr_or_null_method(cl, matVectorDataptrOrNull);
+}
+
+static void
+createClasses()
+{
+  DllInfo *dll = R_getDllInfo("RMatlabMatFile");
+
+  MatRealClass = R_make_altreal_class("MatFileReal", "RMatlabMatFile", dll);
+  setVectorMethods(MatRealClass);
+  R_set_altreal_Elt_method(MatRealClass, matRealElt);
+  R_set_altreal_Get_region_method(MatRealClass, matRealRegion);
+
+  MatIntegerClass = R_make_altinteger_class("MatFileInteger", "RMatlabMatFile", dll);
+  setVectorMethods(MatIntegerClass);
+  R_set_altinteger_Elt_method(MatIntegerClass, matIntegerElt);
+  R_set_altinteger_Get_region_method(MatIntegerClass, matIntegerRegion);
+
+  MatLogicalClass = R_make_altlogical_class("MatFileLogical", "RMatlabMatFile", dll);
+  setVectorMethods(MatLogicalClass);
+  R_set_altlogical_Elt_method(MatLogicalClass, matIntegerElt);
+  R_set_altlogical_Get_region_method(MatLogicalClass, matIntegerRegion);
+
+  ClassesCreated = 1;
+}
+
+static void
+matVectorFinalizer(SEXP ref)
+{
+  MatVector *v = (MatVector *) R_ExternalPtrAddr(ref);
+
+  if(v) {
+    free(v);
+    R_ClearExternalPtr(ref);
+  }
+}
+
+/*
+  The file-backed vector for the data at data in the mapping or, if that is NULL,
+  the compressed variable var.
+*/
+static SEXP
+newMatVector(SEXP fileRef, SEXPTYPE type, R_xlen_t length, const unsigned char *data, unsigned int miType, int var)
+{
+  MatVector *v;
+  SEXP ref, ans;
+
+  if(!ClassesCreated)
+    createClasses();
+
+  v = (MatVector *) calloc(1, sizeof(MatVector));
+  if(!v) {
+    PROBLEM "cannot allocate the MAT file vector"
+    ERROR;
+  }
+  v->file = (MatFile *) R_ExternalPtrAddr(fileRef);
+  v->var = var;
+  v->data = data;
+  v->miType = miType;
+  v->length = length;
+  v->type = type;
+
+  PROTECT(ref = R_MakeExternalPtr(v, Rf_install("MatVector"), fileRef));
+  R_RegisterCFinalizer(ref, matVectorFinalizer);
+  ans = R_new_altrep(type == REALSXP ? MatRealClass : (type == INTSXP ? MatIntegerClass : MatLogicalClass),
+                      ref, R_NilValue);
+  UNPROTECT(1);
+
+  return(ans);
+}
+#endif
+
+
+static SEXP decodeArray(SEXP fileRef, const unsigned char *body, size_t size, int mapped);
+
+/*
+  A numeric or logical array.  If mapped, the data is in the file's mapping
+  and we can leave it there.
+*/
+static SEXP
+decodeNumeric(SEXP fileRef, const MatHeader *h, int mapped)
+{
+  const unsigned char *pos = h->rest, *end = h->rest + h->restSize, *real, *imaginary;
+  unsigned int realType, imaginaryType;
+  R_xlen_t i, n = (R_xlen_t) numElements(h);
+  SEXPTYPE type = rType(h);
+  double *tmp;
+  SEXP ans;
+
+  real = dataElement(&pos, end, n, h->name, &realType);
+
+  if(h->complex) {
+    imaginary = dataElement(&pos, end, n, h->name, &imaginaryType);
+    PROTECT(ans = allocVector(CPLXSXP, n));
+    tmp = (double *) R_alloc(n, sizeof(double));
+    copyElements(tmp, REALSXP, realType, real, 0, n);
+    for(i = 0; i < n; i++)
+      COMPLEX(ans)[i].r = tmp[i];
+    copyElements(tmp, REALSXP, imaginaryType, imaginary, 0, n);
+    for(i = 0; i < n; i++)
+      COMPLEX(ans)[i].i = tmp[i];
+  } else {
+#ifdef MATFILE_ALTREP
+    if(mapped && n > 0)
+      PROTECT(ans = newMatVector(fileRef, type, n, real, realType, -1));
+    else
+#endif
+    {
+      PROTECT(ans = allocVector(type, n));
+      copyElements(DATAPTR(ans), type, realType, real, 0, n);
+    }
+  }
+
+  setDimensions(ans, h);
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+/*
+  Append the UTF-8 encoding of the character code to buf.
+*/
+static char *
+putUTF8(char *buf, unsigned int code)
+{
+  if(code < 0x80)
+    *buf++ = code;
+  else if(code < 0x800) {
+    *buf++ = 0xC0 | (code >> 6);
+    *buf++ = 0x80 | (code & 0x3F);
+  } else if(code < 0x10000) {
+    *buf++ = 0xE0 | (code >> 12);
+    *buf++ = 0x80 | ((code >> 6) & 0x3F);
+    *buf++ = 0x80 | (code & 0x3F);
+  } else {
+    *buf++ = 0xF0 | (code >> 18);
+    *buf++ = 0x80 | ((code >> 12) & 0x3F);
+    *buf++ = 0x80 | ((code >> 6) & 0x3F);
+    *buf++ = 0x80 | (code & 0x3F);
+  }
+
+  return(buf);
+}
+
+/*
+  Decode the UTF-8 character data into n character codes.
+*/
+static void
+decodeUTF8(unsigned int *codes, R_xlen_t n, const unsigned char *data, size_t nbytes)
+{
+  const unsigned char *end = data + nbytes;
+  unsigned int code;
+  int extra;
+  R_xlen_t k;
+
+  for(k = 0; k < n; k++) {
+    if(data >= end) {
+      codes[k] = ' ';
+      continue;
+    }
+    code = *data++;
+    extra = code >= 0xF0 ? 3 : (code >= 0xE0 ? 2 : (code >= 0xC0 ? 1 : 0));
+    if(extra)
+      code &= 0x3F >> extra;
+    for( ; extra > 0 && data < end; extra--)
+      code = (code << 6) | (*data++ & 0x3F);
+    codes[k] = code;
+  }
+}
+
+/*
+  A char array, with each row as an R string as in convertToR().
+*/
+static SEXP
+decodeChar(const MatHeader *h)
+{
+  const unsigned char *pos = h->rest, *data;
+  R_xlen_t i, j, k, nrow, ncol, n = (R_xlen_t) numElements(h);
+  unsigned int miType, code, *codes;
+  uint16_t u16;
+  uint32_t u32;
+  MatTag tag;
+  char *buf, *ptr;
+  SEXP ans;
+
+  nrow = h->ndims ? h->dims[0] : 0;
+  ncol = nrow ? n / nrow : 0;
+  if(!readTag(pos, h->restSize, &tag)) {
+    PROBLEM "the data of the MAT file variable %s is missing or truncated", h->name
+    ERROR;
+  }
+  data = dataElement(&pos, h->rest + h->restSize, n, h->name, &miType);
+
+  codes = (unsigned int *) R_alloc(n, sizeof(unsigned int));
+  if(miType == MI_UTF8)
+    decodeUTF8(codes, n, data, tag.nbytes);
+  else
+    for(k = 0; k < n; k++)
+      switch(miSize(miType)) {
+        case 1:
+          codes[k] = data[k];
+          break;
+        case 2:
+          memcpy(&u16, data + 2 * k, 2);
+          codes[k] = u16;
+          break;
+        default:
+          memcpy(&u32, data + 4 * k, 4);
+          codes[k] = u32;
+          break;
+      }
+
+  PROTECT(ans = allocVector(STRSXP, nrow));
+  buf = R_alloc(4 * ncol + 1, sizeof(char));
+  for(i = 0; i < nrow; i++) {
+    ptr = buf;
+    for(j = 0; j < ncol; j++) {
+      code = codes[i + j * nrow];
+        /* A surrogate pair in UTF-16 is in successive columns. */
+      if(code >= 0xD800 && code < 0xDC00 && j + 1 < ncol
+           && codes[i + (j + 1) * nrow] >= 0xDC00 && codes[i + (j + 1) * nrow] < 0xE000) {
+        code = 0x10000 + ((code - 0xD800) << 10) + (codes[i + (j + 1) * nrow] - 0xDC00);
+        j++;
+      }
+      ptr = putUTF8(ptr, code);
+    }
+    *ptr = '\0';
+    SET_STRING_ELT(ans, i, Rf_mkCharCE(buf, CE_UTF8));
+  }
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+/*
+  The next miMATRIX element, e.g. an element of a cell or a field of a struct.
+*/
+static SEXP
+nextArray(SEXP fileRef, const unsigned char **pos, const unsigned char *end, const char *name, int mapped)
+{
+  MatTag tag;
+
+  if(!readTag(*pos, end - *pos, &tag) || tag.type != MI_MATRIX) {
+    PROBLEM "the MAT file variable %s is truncated", name
+    ERROR;
+  }
+  *pos += tag.size;
+
+  return(decodeArray(fileRef, tag.data, tag.nbytes, mapped));
+}
+
+static SEXP
+decodeCell(SEXP fileRef, const MatHeader *h, int mapped)
+{
+  const unsigned char *pos = h->rest, *end = h->rest + h->restSize;
+  R_xlen_t i, n = (R_xlen_t) numElements(h);
+  SEXP ans;
+
+  PROTECT(ans = allocVector(VECSXP, n));
+  for(i = 0; i < n; i++)
+    SET_VECTOR_ELT(ans, i, nextArray(fileRef, &pos, end, h->name, mapped));
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+/*
+  A struct as a named list, or a list of these for a struct array.
+*/
+static SEXP
+decodeStruct(SEXP fileRef, const MatHeader *h, int mapped)
+{
+  const unsigned char *pos = h->rest, *end = h->rest + h->restSize;
+  R_xlen_t i, n = (R_xlen_t) numElements(h);
+  int j, nfields, nameLength;
+  MatTag tag;
+  SEXP ans, el, names;
+
+  if(!readTag(pos, end - pos, &tag) || tag.type != MI_INT32 || tag.nbytes != 4) {
+    PROBLEM "the MAT file variable %s is truncated", h->name
+    ERROR;
+  }
+  memcpy(&nameLength, tag.data, 4);
+  pos += tag.size;
+
+  if(nameLength <= 0 || !readTag(pos, end - pos, &tag)) {
+    PROBLEM "the MAT file variable %s is truncated", h->name
+    ERROR;
+  }
+  nfields = tag.nbytes / nameLength;
+  pos += tag.size;
+
+  PROTECT(names = allocVector(STRSXP, nfields));
+  for(j = 0; j < nfields; j++)
+    SET_STRING_ELT(names, j, mkCharLen((const char *) tag.data + j * nameLength,
+                                       strnlen((const char *) tag.data + j * nameLength, nameLength)));
+
+  PROTECT(ans = allocVector(VECSXP, n));
+  for(i = 0; i < n; i++) {
+    el = allocVector(VECSXP, nfields);
+    SET_VECTOR_ELT(ans, i, el);
+    for(j = 0; j < nfields; j++)
+      SET_VECTOR_ELT(el, j, nextArray(fileRef, &pos, end, h->name, mapped));
+    SET_NAMES(el, names);
+  }
+  UNPROTECT(2);
+
+  return(n == 1 ? VECTOR_ELT(ans, 0) : ans);
+}
+
+static SEXP
+decodeArray(SEXP fileRef, const unsigned char *body, size_t size, int mapped)
+{
+  MatHeader h;
+
+    /* An empty element of a cell. */
+  if(size == 0)
+    return(R_NilValue);
+
+  if(!parseHeader(body, size, &h)) {
+    PROBLEM "cannot read an array in the MAT file"
+    ERROR;
+  }
+
+  switch(h.classID) {
+    case MAT_CELL:
+      return(decodeCell(fileRef, &h, mapped));
+    case MAT_STRUCT:
+      return(decodeStruct(fileRef, &h, mapped));
+    case MAT_CHAR:
+      return(decodeChar(&h));
+    default:
+      if(rType(&h) != NILSXP)
+        return(decodeNumeric(fileRef, &h, mapped));
+      Rf_warning("cannot read the Matlab %s %s from the MAT file",
+                  h.classID > 0 && h.classID < MAT_NUM_CLASSES ? ClassNames[h.classID] : "array", h.name);
+      return(R_NilValue);
+  }
+}
+
+
+static void
+matFileFinalizer(SEXP ref)
+{
+  MatFile *f = (MatFile *) R_ExternalPtrAddr(ref);
+
+  if(f) {
+    munmap(f->map, f->mapSize);
+    free(f->vars);
+    free(f);
+    R_ClearExternalPtr(ref);
+  }
+}
+
+static MatFile *
+getMatFile(SEXP ref)
+{
+  MatFile *f;
+
+  if(TYPEOF(ref) != EXTPTRSXP || R_ExternalPtrTag(ref) != Rf_install("MatFile")
+       || !(f = (MatFile *) R_ExternalPtrAddr(ref))) {
+    PROBLEM "not an open MAT file"
+    ERROR;
+  }
+
+  return(f);
+}
+
+/*
+  Add the variable in the top-level element to the index.
+  Returns 0 if we cannot read its header.
+*/
+static int
+indexVariable(MatFile *f, const MatTag *tag)
+{
+  unsigned char peek[MAT_PEEK_SIZE];
+  MatVariable *v = f->vars + f->numVars;
+  uint32_t word[2];
+  size_t n;
+
+  memset(v, 0, sizeof(MatVariable));
+  v->body = tag->data;
+  v->size = tag->nbytes;
+
+  if(tag->type == MI_COMPRESSED) {
+      /* The name is in the compressed miMATRIX element, so we decompress its start. */
+    v->compressed = 1;
+    n = inflateElement(tag->data, tag->nbytes, peek, sizeof(peek));
+    if(n < 8)
+      return(0);
+    memcpy(word, peek, 8);
+    if(word[0] != MI_MATRIX)
+      return(0);
+    v->inflatedSize = 8 + (size_t) word[1];
+    return(parseHeader(peek + 8, n - 8, &v->header));
+  }
+
+  return(parseHeader(tag->data, tag->nbytes, &v->header));
+}
+
+/*
+  Map the file and index its variables.
+*/
+SEXP
+RMatlab_matFileOpen(SEXP fileName)
+{
+  const char *name = CHAR(STRING_ELT(fileName, 0));
+  unsigned char *map;
+  struct stat info;
+  uint16_t version, endian;
+  size_t pos, capacity = 16;
+  MatTag tag;
+  MatFile *f;
+  SEXP ans;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0 || fstat(fd, &info) != 0) {
+    if(fd >= 0)
+      close(fd);
+    PROBLEM "cannot open the MAT file %s", name
+    ERROR;
+  }
+
+  if(info.st_size < MAT_HEADER_SIZE) {
+    close(fd);
+    PROBLEM "%s is not a MAT file", name
+    ERROR;
+  }
+
+  map = (unsigned char *) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    PROBLEM "cannot map the MAT file %s into memory", name
+    ERROR;
+  }
+
+  memcpy(&version, map + 124, 2);
+  memcpy(&endian, map + 126, 2);
+  if(memcmp(map, "MATLAB", 6) != 0 || (endian != 0x4D49 && endian != 0x494D)) {
+    munmap(map, info.st_size);
+    PROBLEM "%s is not a level 5 MAT file", name
+    ERROR;
+  }
+  if(endian != 0x4D49) {
+    munmap(map, info.st_size);
+    PROBLEM "%s was written with the other byte order and cannot be read", name
+    ERROR;
+  }
+  if(version != 0x0100) {
+    munmap(map, info.st_size);
+    PROBLEM "%s is a v7.3 (HDF5) MAT file. Save it with -v7 to read it here", name
+    ERROR;
+  }
+
+  f = (MatFile *) calloc(1, sizeof(MatFile));
+  if(f)
+    f->vars = (MatVariable *) malloc(capacity * sizeof(MatVariable));
+  if(!f || !f->vars) {
+    free(f);
+    munmap(map, info.st_size);
+    PROBLEM "cannot allocate the index of the MAT file %s", name
+    ERROR;
+  }
+  f->map = map;
+  f->mapSize = info.st_size;
+
+  PROTECT(ans = R_MakeExternalPtr(f, Rf_install("MatFile"), R_NilValue));
+  R_RegisterCFinalizer(ans, matFileFinalizer);
+
+  for(pos = MAT_HEADER_SIZE; readTag(map + pos, f->mapSize - pos, &tag); pos += tag.size) {
+    if(tag.type != MI_MATRIX && tag.type != MI_COMPRESSED)
+      continue;
+
+    if(f->numVars == capacity) {
+      MatVariable *tmp = (MatVariable *) realloc(f->vars, 2 * capacity * sizeof(MatVariable));
+      if(!tmp) {
+        PROBLEM "cannot allocate the index of the MAT file %s", name
+        ERROR;
+      }
+      f->vars = tmp;
+      capacity *= 2;
+    }
+
+    if(indexVariable(f, &tag))
+      f->numVars++;
+    else
+      Rf_warning("skipping an unreadable variable at offset %.0f in %s", (double) pos, name);
+  }
+
+  SET_CLASS(ans, mkString("MatFile"));
+  Rf_setAttrib(ans, Rf_install("file"), fileName);
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+SEXP
+RMatlab_matFileNames(SEXP ref)
+{
+  MatFile *f = getMatFile(ref);
+  SEXP ans;
+  int i;
+
+  PROTECT(ans = allocVector(STRSXP, f->numVars));
+  for(i = 0; i < f->numVars; i++)
+    SET_STRING_ELT(ans, i, mkChar(f->vars[i].header.name));
+  UNPROTECT(1);
+
+  return(ans);
+}
+
+/*
+  The class, dimensions, size in the file and whether each variable is compressed.
+*/
+SEXP
+RMatlab_matFileInfo(SEXP ref)
+{
+  static const char *names[] = {"name", "class", "dims", "bytes", "compressed"};
+  MatFile *f = getMatFile(ref);
+  MatHeader *h;
+  char buf[32 * (MAT_MAX_DIMS + 1)];
+  int i, j, len;
+  SEXP ans, tmp;
+
+  PROTECT(ans = allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(ans, 0, RMatlab_matFileNames(ref));
+  SET_VECTOR_ELT(ans, 1, allocVector(STRSXP, f->numVars));
+  SET_VECTOR_ELT(ans, 2, allocVector(STRSXP, f->numVars));
+  SET_VECTOR_ELT(ans, 3, allocVector(REALSXP, f->numVars));
+  SET_VECTOR_ELT(ans, 4, allocVector(LGLSXP, f->numVars));
+
+  for(i = 0; i < f->numVars; i++) {
+    h = &f->vars[i].header;
+    SET_STRING_ELT(VECTOR_ELT(ans, 1), i,
+                    mkChar(h->logical ? "logical" :
+                            (h->classID > 0 && h->classID < MAT_NUM_CLASSES ? ClassNames[h->classID] : ClassNames[0])));
+    for(j = 0, len = 0; j < h->ndims; j++)
+      len += snprintf(buf + len, sizeof(buf) - len, "%s%d", j ? "x" : "", h->dims[j]);
+    buf[len] = '\0';
+    SET_STRING_ELT(VECTOR_ELT(ans, 2), i, mkChar(buf));
+    REAL(VECTOR_ELT(ans, 3))[i] = f->vars[i].size;
+    LOGICAL(VECTOR_ELT(ans, 4))[i] = f->vars[i].compressed;
+  }
+
+  PROTECT(tmp = allocVector(STRSXP, 5));
+  for(i = 0; i < 5; i++)
+    SET_STRING_ELT(tmp, i, mkChar(names[i]));
+  SET_NAMES(ans, tmp);
+  UNPROTECT(2);
+
+  return(ans);
+}
+
+/*
+  The R value of the variable name.
+*/
+SEXP
+RMatlab_matFileGet(SEXP ref, SEXP name)
+{
+  MatFile *f = getMatFile(ref);
+  MatVariable *v = NULL;
+  SEXP ans, buf;
+  int i;
+
+  for(i = 0; i < f->numVars; i++)
+    if(strcmp(f->vars[i].header.name, CHAR(STRING_ELT(name, 0))) == 0) {
+      v = f->vars + i;
+      break;
+    }
+
+  if(!v) {
+    PROBLEM "there is no variable %s in the MAT file", CHAR(STRING_ELT(name, 0))
+    ERROR;
+  }
+
+  if(!v->compressed)
+    return(decodeArray(ref, v->body, v->size, 1));
+
+#ifdef MATFILE_ALTREP
+    /* We leave the data of a real numeric or logical array compressed until R needs it. */
+  if(rType(&v->header) != NILSXP && !v->header.complex && numElements(&v->header) > 0) {
+    PROTECT(ans = newMatVector(ref, rType(&v->header), (R_xlen_t) numElements(&v->header), NULL, 0, i));
+    setDimensions(ans, &v->header);
+    UNPROTECT(1);
+    return(ans);
+  }
+#endif
+
+  PROTECT(buf = inflateVariable(v));
+  ans = decodeArray(ref, RAW(buf) + 8, v->inflatedSize - 8, 0);
+  UNPROTECT(1);
+
+  return(ans);
+}
@@ -0,0 +1,634 @@
+#define _GNU_SOURCE  /* for struct ucred */
+
+#include "RMatlabBroker.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ A daemon that keeps Matlab engines running so that R sessions can
+ use one without waiting for Matlab to start.  R connects with
+
+     .MatlabInit(broker = TRUE)
+
+ and gets an engine of its own until it calls .MatlabClose() or exits.
+ Then the broker clears the engine's workspace (clear all, close all
+ figures and files and return to the original directory) and gives it
+ to the next client.
+
+ Usage:
+    matlabBroker [-s socket] [-n warm] [-m max] [-i idle] [-c command] [-l log] [-f]
+
+    -s  the socket to listen on. See RMatlab_brokerSocketPath() for the default.
+    -n  the number of engines to keep running, even when idle (default 1).
+    -m  the maximum number of engines, i.e. concurrent clients (default 4).
+        Further clients wait for an engine to become free.
+    -i  close engines beyond the first warm ones after they have been
+        idle for this many seconds (default 600).
+    -c  the command to start Matlab (default "matlab -nodisplay -nojvm -nosplash").
+    -l  append messages to this file.
+    -f  stay in the foreground rather than running as a daemon.
+
+ The Matlab engine API is not thread-safe, so each engine belongs to a
+ process of its own that we fork.  The main process accepts connections
+ and passes each one to an idle engine process over a socketpair
+ (SCM_RIGHTS).  The engine process tells us when it is ready for another
+ client by writing a byte to the socketpair.  If Matlab dies, so does
+ its process and we start another one if we have fewer than the warm number.
+ If Matlab fails to start, e.g. because -c is wrong, we wait longer before
+ each new attempt and, after MAX_START_FAILURES in a row, the broker exits.
+ Only the user running the broker can connect to it.
+*/
+
+#define MAX_ENGINES  64
+#define MAX_WAITING  256
+#define MAX_START_FAILURES  5
+
+typedef enum { ENGINE_STARTING, ENGINE_IDLE, ENGINE_BUSY } EngineState;
+
+typedef struct {
+  pid_t pid;
+  int control;      /* our end of the socketpair with the engine's process. */
+  EngineState state;
+  time_t idleSince;
+} EngineProcess;
+
+static EngineProcess Engines[MAX_ENGINES];
+static int NumEngines = 0;
+
+static int Waiting[MAX_WAITING];   /* the clients waiting for an engine. */
+static int NumWaiting = 0;
+
+static const char *MatlabCommand = "matlab -nodisplay -nojvm -nosplash";
+static int WarmEngines = 1, MaxEngines = 4;
+static int IdleTimeout = 600;
+
+  /* The engines in a row that exited before they were ready, and when we may start the next. */
+static int StartFailures = 0;
+static time_t NextStart = 0;
+
+static int Listener = -1;
+static volatile sig_atomic_t Finished = 0;
+static FILE *Log = NULL;
+
+
+static void
+message(const char *fmt, ...)
+{
+  char when[32];
+  time_t now = time(NULL);
+  va_list args;
+
+  if(!Log)
+    return;
+
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+  fprintf(Log, "%s matlabBroker[%d]: ", when, (int) getpid());
+  va_start(args, fmt);
+  vfprintf(Log, fmt, args);
+  va_end(args);
+  fprintf(Log, "\n");
+  fflush(Log);
+}
+
+static void
+stopBroker(int sig)
+{
+  Finished = 1;
+}
+
+
+static int
+sendDescriptor(int control, int fd)
+{
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char byte = 'C';
+  char cbuf[CMSG_SPACE(sizeof(int))];
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return(sendmsg(control, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1);
+}
+
+/* Returns the descriptor, or -1 when the main process has closed the socketpair. */
+static int
+receiveDescriptor(int control)
+{
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char byte;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  int fd = -1;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  do {
+    n = recvmsg(control, &msg, 0);
+  } while(n < 0 && errno == EINTR);
+
+  if(n <= 0)
+    return(-1);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  return(fd);
+}
+
+
+/*
+  Handle the requests from one client until it closes the connection.
+*/
+static void
+serveClient(Engine *eng, int fd)
+{
+  RMatlabWire wire;
+  mxArray *val;
+  char *str, *output;
+  int op, size, status;
+
+  RMatlabWire_init(&wire, fd);
+
+  if(RMatlabWire_getInt(&wire) != RMATLAB_BROKER_HELLO
+       || RMatlabWire_getInt(&wire) != RMATLAB_BROKER_MAGIC
+       || RMatlabWire_getInt(&wire) != RMATLAB_BROKER_VERSION) {
+    RMatlabWire_putInt(&wire, -1);
+    RMatlabWire_flush(&wire);
+    RMatlabWire_free(&wire);
+    return;
+  }
+  RMatlabWire_putInt(&wire, 0);
+  RMatlabWire_flush(&wire);
+
+  while(!wire.failed) {
+    op = RMatlabWire_getInt(&wire);
+    if(wire.failed || op == RMATLAB_BROKER_CLOSE)
+      break;
+
+    switch(op) {
+      case RMATLAB_BROKER_EVAL:
+        str = RMatlabWire_getString(&wire);
+        size = RMatlabWire_getInt(&wire);
+        if(wire.failed)
+          break;
+
+        output = NULL;
+        if(size > 0 && (output = (char *) calloc(size, 1)))
+          engOutputBuffer(eng, output, size);
+        status = engEvalString(eng, str);
+        if(output)
+          engOutputBuffer(eng, NULL, 0);
+
+        RMatlabWire_putInt(&wire, status);
+        RMatlabWire_putString(&wire, output ? output : "");
+        free(output);
+        free(str);
+        break;
+
+      case RMATLAB_BROKER_PUT:
+        str = RMatlabWire_getString(&wire);
+        val = RMatlabWire_getArray(&wire);
+        if(wire.failed)
+          break;
+        RMatlabWire_putInt(&wire, val ? engPutVariable(eng, str, val) : 1);
+        if(val)
+          mxDestroyArray(val);
+        free(str);
+        break;
+
+      case RMATLAB_BROKER_GET:
+        str = RMatlabWire_getString(&wire);
+        if(wire.failed)
+          break;
+        val = engGetVariable(eng, str);
+        RMatlabWire_putInt(&wire, val != NULL);
+        if(val) {
+          RMatlabWire_putArray(&wire, val);
+          mxDestroyArray(val);
+        }
+        free(str);
+        break;
+
+      default:
+        wire.failed = 1;
+        break;
+    }
+
+    RMatlabWire_flush(&wire);
+  }
+
+  RMatlabWire_free(&wire);
+}
+
+/*
+  Tell the main process that the engine is ready (R) or idle (I) again.
+*/
+static int
+notify(int control, char byte)
+{
+  ssize_t n;
+
+  while((n = write(control, &byte, 1)) < 0 && errno == EINTR)
+    ;
+  return(n == 1 ? 0 : -1);
+}
+
+/*
+  The body of an engine's process.  Start Matlab and then serve
+  the clients the main process gives us, one at a time.
+*/
+static void
+runEngine(int control)
+{
+  Engine *eng;
+  mxArray *home;
+  char reset[2048], dir[1024] = "", quoted[2048], *q;
+  int fd, i;
+
+  if(!(eng = engOpen(MatlabCommand))) {
+    message("cannot start Matlab with %s", MatlabCommand);
+    exit(1);
+  }
+
+  if(engEvalString(eng, "r_broker_home = pwd;") == 0 && (home = engGetVariable(eng, "r_broker_home"))) {
+    mxGetString(home, dir, sizeof(dir));
+    mxDestroyArray(home);
+  }
+    /* Double any quotes in the directory name for the Matlab string. */
+  for(i = 0, q = quoted; dir[i]; i++) {
+    if(dir[i] == '\'')
+      *q++ = '\'';
+    *q++ = dir[i];
+  }
+  *q = '\0';
+  snprintf(reset, sizeof(reset),
+           "clear all; close all force; fclose('all'); cd('%s');", quoted);
+  engEvalString(eng, reset);
+
+  message("engine ready");
+  if(notify(control, 'R') < 0) {
+    message("lost the broker's main process");
+    engClose(eng);
+    exit(1);
+  }
+
+  while((fd = receiveDescriptor(control)) >= 0) {
+    serveClient(eng, fd);
+    close(fd);
+
+      /* Give the next client a clean workspace.  If Matlab has gone, so do we. */
+    if(engEvalString(eng, reset) != 0) {
+      message("Matlab has exited");
+      exit(1);
+    }
+    if(notify(control, 'I') < 0) {
+      message("lost the broker's main process");
+      break;
+    }
+  }
+
+  engClose(eng);
+  exit(0);
+}
+
+
+static int
+startEngine()
+{
+  int fds[2];
+  pid_t pid;
+
+  if(Finished || NumEngines >= MaxEngines || time(NULL) < NextStart || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return(-1);
+
+  if((pid = fork()) < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return(-1);
+  }
+
+  if(pid == 0) {
+    int i;
+    close(fds[0]);
+    close(Listener);
+      /* We don't need the other engines' sockets or the waiting clients. */
+    for(i = 0; i < NumEngines; i++)
+      close(Engines[i].control);
+    for(i = 0; i < NumWaiting; i++)
+      close(Waiting[i]);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    runEngine(fds[1]);
+  }
+
+  close(fds[1]);
+  Engines[NumEngines].pid = pid;
+  Engines[NumEngines].control = fds[0];
+  Engines[NumEngines].state = ENGINE_STARTING;
+  Engines[NumEngines].idleSince = time(NULL);
+  NumEngines++;
+
+  return(0);
+}
+
+static void
+removeEngine(int i)
+{
+  close(Engines[i].control);
+  Engines[i] = Engines[--NumEngines];
+}
+
+/*
+  An engine's process exited before Matlab was ready.  Wait 1, 2, 4, ...
+  seconds before starting another and give up after MAX_START_FAILURES.
+*/
+static void
+engineFailedToStart(time_t now)
+{
+  if(++StartFailures >= MAX_START_FAILURES) {
+    message("Matlab failed to start %d times in a row with %s; exiting", StartFailures, MatlabCommand);
+    Finished = 1;
+    return;
+  }
+
+  NextStart = now + (1 << (StartFailures - 1));
+  message("Matlab failed to start; trying again in %d seconds", (int) (NextStart - now));
+}
+
+
+/*
+  Give the waiting clients to the idle engines and start more
+  engines if we can when clients are still waiting.
+*/
+static void
+dispatchClients()
+{
+  int i, starting = 0;
+
+  for(i = 0; i < NumEngines && NumWaiting > 0; i++) {
+    if(Engines[i].state != ENGINE_IDLE)
+      continue;
+    if(sendDescriptor(Engines[i].control, Waiting[0]) == 0) {
+      Engines[i].state = ENGINE_BUSY;
+      close(Waiting[0]);
+      memmove(Waiting, Waiting + 1, --NumWaiting * sizeof(int));
+    }
+  }
+
+  for(i = 0; i < NumEngines; i++)
+    starting += Engines[i].state == ENGINE_STARTING;
+
+  while(NumWaiting > starting && startEngine() == 0)
+    starting++;
+}
+
+/*
+  Close the engines that have been idle for too long, keeping the warm ones.
+  Closing the socketpair tells the engine's process to close Matlab and exit.
+*/
+static void
+reapEngines(time_t now)
+{
+  int i;
+
+  for(i = NumEngines - 1; i >= 0 && NumEngines > WarmEngines; i--) {
+    if(Engines[i].state == ENGINE_IDLE && now - Engines[i].idleSince >= IdleTimeout) {
+      message("closing idle engine %d", (int) Engines[i].pid);
+      removeEngine(i);
+    }
+  }
+
+  while(NumEngines < WarmEngines && startEngine() == 0)
+    ;
+}
+
+
+/*
+  Only the user who started the broker can use its engines.
+*/
+static int
+trustedClient(int fd)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid())
+    return(0);
+#endif
+  return(1);
+}
+
+static int
+listenOn(const char *path)
+{
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "matlabBroker: socket path %s is too long\n", path);
+    return(-1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return(-1);
+
+    /* If another broker is using the socket, leave it alone. Otherwise it is stale. */
+  if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "matlabBroker: a broker is already listening on %s\n", path);
+    close(fd);
+    return(-1);
+  }
+  close(fd);
+  unlink(path);
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return(-1);
+
+  mask = umask(077);
+  if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    umask(mask);
+    perror("matlabBroker");
+    close(fd);
+    return(-1);
+  }
+  umask(mask);
+
+  return(fd);
+}
+
+static void
+daemonize()
+{
+  int fd;
+
+  if(fork() > 0)
+    _exit(0);
+  setsid();
+
+  if((fd = open("/dev/null", O_RDWR)) >= 0) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    if(fd > 2)
+      close(fd);
+  }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  struct pollfd fds[MAX_ENGINES + 1];
+  char path[512], byte;
+  const char *socketPath = NULL, *logFile = NULL;
+  int foreground = 0, i, n, fd, opt;
+  ssize_t count;
+  pid_t pid;
+  time_t now;
+
+  while((opt = getopt(argc, argv, "s:n:m:i:c:l:f")) != -1) {
+    switch(opt) {
+      case 's': socketPath = optarg; break;
+      case 'n': WarmEngines = atoi(optarg); break;
+      case 'm': MaxEngines = atoi(optarg); break;
+      case 'i': IdleTimeout = atoi(optarg); break;
+      case 'c': MatlabCommand = optarg; break;
+      case 'l': logFile = optarg; break;
+      case 'f': foreground = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-s socket] [-n warm] [-m max] [-i idle] [-c command] [-l log] [-f]\n", argv[0]);
+        return(1);
+    }
+  }
+
+  if(MaxEngines > MAX_ENGINES)
+    MaxEngines = MAX_ENGINES;
+  if(MaxEngines < 1)
+    MaxEngines = 1;
+  if(WarmEngines > MaxEngines)
+    WarmEngines = MaxEngines;
+
+  if(!socketPath)
+    socketPath = RMatlab_brokerSocketPath(path, sizeof(path));
+
+    /* Listen before we detach so that clients can connect as soon as we return. */
+  if((Listener = listenOn(socketPath)) < 0)
+    return(1);
+
+  if(logFile)
+    Log = fopen(logFile, "a");
+  else if(foreground)
+    Log = stderr;
+
+  if(!foreground)
+    daemonize();
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, stopBroker);
+  signal(SIGINT, stopBroker);
+
+  message("listening on %s with %d warm engines", socketPath, WarmEngines);
+  reapEngines(time(NULL));
+
+  while(!Finished) {
+    fds[0].fd = Listener;
+    fds[0].events = NumWaiting < MAX_WAITING ? POLLIN : 0;
+    for(i = 0; i < NumEngines; i++) {
+      fds[i + 1].fd = Engines[i].control;
+      fds[i + 1].events = POLLIN;
+    }
+
+    n = poll(fds, NumEngines + 1, 1000);
+    if(Finished || (n < 0 && errno != EINTR))
+      break;
+    now = time(NULL);
+
+    if(n > 0 && (fds[0].revents & POLLIN) && (fd = accept(Listener, NULL, NULL)) >= 0) {
+      if(trustedClient(fd))
+        Waiting[NumWaiting++] = fd;
+      else
+        close(fd);
+    }
+
+      /* Go backwards as removeEngine() moves the last engine into the slot. */
+    for(i = NumEngines - 1; n > 0 && i >= 0; i--) {
+      if(!fds[i + 1].revents)
+        continue;
+      while((count = read(Engines[i].control, &byte, 1)) < 0 && errno == EINTR)
+        ;
+      if(count == 1) {
+        if(Engines[i].state == ENGINE_STARTING)
+          StartFailures = 0;
+        Engines[i].state = ENGINE_IDLE;
+        Engines[i].idleSince = now;
+      } else {
+        if(Engines[i].state == ENGINE_STARTING)
+          engineFailedToStart(now);
+        removeEngine(i);
+      }
+    }
+
+      /* Collect the engine processes that have exited. */
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+      ;
+
+    dispatchClients();
+    reapEngines(now);
+  }
+
+  message("shutting down %d engines", NumEngines);
+  for(i = NumEngines - 1; i >= 0; i--)
+    removeEngine(i);
+  for(i = 0; i < NumWaiting; i++)
+    close(Waiting[i]);
+  close(Listener);
+  unlink(socketPath);
+
+  while(wait(NULL) > 0)
+    ;
+
+  return(0);
+}
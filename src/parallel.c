@@ -0,0 +1,351 @@
+#include "RMatlabParallel.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ Copying the data of large numeric and logical arrays between R vectors
+ and Matlab arrays on several threads.
+
+ A conversion of a multi-GB array is a single pass over memory which one
+ core cannot do at the machine's memory bandwidth.  Once convertFromR()
+ and convertToR() have created the Matlab array or R vector on the calling
+ thread, they hand the copy of the data to the routines here.  If it is at
+ least Threshold bytes, we split it into pieces which Threads threads
+ (the calling thread being one of them) take in turn.  The threads only
+ touch the two blocks of memory; they never call R or the mx routines.
+
+ The elements of a cell, list or struct are converted one by one.  Between
+ RMatlab_parallelBegin() and RMatlab_parallelEnd(), the copies are queued
+ rather than done and End() does all of them together, so that many
+ medium-sized elements are spread across the threads too.  Nothing may
+ look at the data in between, so the conversions that call Matlab or R
+ (attributes.c) suspend the queue with RMatlab_parallelSuspend().
+
+ The R option RMatlab.parallel is the number of threads to use, or TRUE
+ for one per core (the default) or FALSE to copy on the calling thread.
+ RMatlab.parallelThreshold is the size, in bytes, from which we use them.
+ RMatlab_parallelConfigure() (convert.c) reads these at the start of each
+ entry point and gives them to RMatlab_parallelSetup().  This also discards
+ any copies queued by a conversion that an R error jumped out of, so every
+ entry point that converts must call it, via RMatlab_convertConfigure().  Nothing here uses
+ R or Matlab, so tests/parallelCopy.c (make paralleltest) can check it on
+ its own.
+
+ The threads are started for each large copy and finish with it, rather
+ than kept in a pool: a copy this size takes milliseconds while starting
+ a thread takes microseconds, and no thread outlives its MEX file
+ if Matlab clears it.
+*/
+
+#define PARALLEL_MAX_THREADS        64
+  /* The smallest piece of a copy handed to a thread. */
+#define PARALLEL_MIN_PIECE          (1024 * 1024)
+
+typedef enum {
+  PARALLEL_COPY,              /* bytes */
+  PARALLEL_INT_TO_DOUBLE,
+  PARALLEL_INT_TO_LOGICAL,
+  PARALLEL_LOGICAL_TO_INT,
+  PARALLEL_JOIN_COMPLEX,      /* separate real and imaginary parts into Rcomplex */
+  PARALLEL_SPLIT_COMPLEX      /* Rcomplex into separate real and imaginary parts */
+} ParallelKind;
+
+typedef struct {
+  ParallelKind kind;
+  void *dest, *dest2;
+  const void *src, *src2;
+  size_t n;                   /* number of elements (bytes for PARALLEL_COPY). */
+} ParallelJob;
+
+typedef struct {
+  const ParallelJob *job;
+  size_t from, to;
+} ParallelPiece;
+
+typedef struct {
+  ParallelPiece *pieces;
+  size_t count;
+  volatile size_t next;
+} ParallelWork;
+
+static int Threads = 1;
+static double Threshold = 8 * 1024 * 1024;
+
+  /* The queue of copies between RMatlab_parallelBegin() and End(), for this thread. */
+static __thread ParallelJob *Queue = NULL;
+static __thread size_t QueueLength = 0, QueueCapacity = 0;
+static __thread int Depth = 0;
+
+
+void
+RMatlab_parallelSetup(int threads, double threshold)
+{
+  Threads = threads < 1 ? 1 : threads;
+  if(Threads > PARALLEL_MAX_THREADS)
+    Threads = PARALLEL_MAX_THREADS;
+  Threshold = threshold;
+
+    /* Discard anything left from a conversion that raised an error. */
+  QueueLength = 0;
+  Depth = 0;
+}
+
+
+static size_t
+elementSize(ParallelKind kind)
+{
+  switch(kind) {
+    case PARALLEL_COPY:
+      return(1);
+    case PARALLEL_INT_TO_DOUBLE:
+      return(sizeof(double));
+    case PARALLEL_INT_TO_LOGICAL:
+    case PARALLEL_LOGICAL_TO_INT:
+      return(sizeof(int));
+    default:
+      return(sizeof(Rcomplex));
+  }
+}
+
+static void
+runPiece(const ParallelJob *job, size_t from, size_t to)
+{
+  size_t i;
+
+  switch(job->kind) {
+    case PARALLEL_COPY:
+      memcpy((char *) job->dest + from, (const char *) job->src + from, to - from);
+      break;
+    case PARALLEL_INT_TO_DOUBLE: {
+      double *dest = (double *) job->dest;
+      const int *src = (const int *) job->src;
+        /* R's integer NA is INT_MIN and becomes NaN, as in the column blocks (chunk.c). */
+      for(i = from; i < to; i++)
+        dest[i] = src[i] == INT_MIN ? NAN : (double) src[i];
+    }
+      break;
+    case PARALLEL_INT_TO_LOGICAL: {
+      unsigned char *dest = (unsigned char *) job->dest;
+      const int *src = (const int *) job->src;
+        /* Non-zero, including NA, is TRUE, as for a bool mxLogical. */
+      for(i = from; i < to; i++)
+        dest[i] = src[i] != 0;
+    }
+      break;
+    case PARALLEL_LOGICAL_TO_INT: {
+      int *dest = (int *) job->dest;
+      const unsigned char *src = (const unsigned char *) job->src;
+      for(i = from; i < to; i++)
+        dest[i] = src[i];
+    }
+      break;
+    case PARALLEL_JOIN_COMPLEX: {
+      Rcomplex *dest = (Rcomplex *) job->dest;
+      const double *real = (const double *) job->src, *imaginary = (const double *) job->src2;
+      for(i = from; i < to; i++) {
+        dest[i].r = real[i];
+        dest[i].i = imaginary[i];
+      }
+    }
+      break;
+    case PARALLEL_SPLIT_COMPLEX: {
+      double *real = (double *) job->dest, *imaginary = (double *) job->dest2;
+      const Rcomplex *src = (const Rcomplex *) job->src;
+      for(i = from; i < to; i++) {
+        real[i] = src[i].r;
+        imaginary[i] = src[i].i;
+      }
+    }
+      break;
+  }
+}
+
+static void *
+worker(void *data)
+{
+  ParallelWork *work = (ParallelWork *) data;
+  size_t pos;
+
+  while((pos = __sync_fetch_and_add(&work->next, 1)) < work->count)
+    runPiece(work->pieces[pos].job, work->pieces[pos].from, work->pieces[pos].to);
+
+  return(NULL);
+}
+
+/*
+  Do the copies, on several threads if there is enough to do.
+*/
+static void
+runJobs(const ParallelJob *jobs, size_t njobs)
+{
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  ParallelWork work;
+  double total = 0;
+  size_t i, j, size, pieceSize, numPieces, started = 0;
+
+  for(i = 0; i < njobs; i++)
+    total += (double) jobs[i].n * elementSize(jobs[i].kind);
+
+  if(Threads < 2 || total < Threshold) {
+    for(i = 0; i < njobs; i++)
+      runPiece(jobs + i, 0, jobs[i].n);
+    return;
+  }
+
+    /* Split the copies into a few pieces per thread so they finish together. */
+  pieceSize = (size_t) (total / (4 * Threads));
+  if(pieceSize < PARALLEL_MIN_PIECE)
+    pieceSize = PARALLEL_MIN_PIECE;
+
+    /* Count the pieces as we cut them below, in whole elements. */
+  for(i = 0, numPieces = 0; i < njobs; i++) {
+    size = pieceSize / elementSize(jobs[i].kind);
+    numPieces += (jobs[i].n + size - 1) / size;
+  }
+
+  work.pieces = (ParallelPiece *) malloc(numPieces * sizeof(ParallelPiece));
+  if(!work.pieces) {
+    for(i = 0; i < njobs; i++)
+      runPiece(jobs + i, 0, jobs[i].n);
+    return;
+  }
+
+  for(i = 0, work.count = 0; i < njobs; i++) {
+    size = pieceSize / elementSize(jobs[i].kind);
+    for(j = 0; j < jobs[i].n; j += size) {
+      work.pieces[work.count].job = jobs + i;
+      work.pieces[work.count].from = j;
+      work.pieces[work.count].to = j + size < jobs[i].n ? j + size : jobs[i].n;
+      work.count++;
+    }
+  }
+  work.next = 0;
+
+    /* If we cannot start a thread, we do its share ourselves. */
+  for(i = 0; i < (size_t) Threads - 1 && i < work.count - 1; i++)
+    if(pthread_create(threads + started, NULL, worker, &work) == 0)
+      started++;
+
+  worker(&work);
+  for(i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  free(work.pieces);
+}
+
+static void
+submit(ParallelKind kind, void *dest, void *dest2, const void *src, const void *src2, size_t n)
+{
+  ParallelJob job, *tmp;
+
+  job.kind = kind;
+  job.dest = dest;
+  job.dest2 = dest2;
+  job.src = src;
+  job.src2 = src2;
+  job.n = n;
+
+  if(n == 0)
+    return;
+
+  if(Depth == 0 || Threads < 2) {
+    runJobs(&job, 1);
+    return;
+  }
+
+  if(QueueLength == QueueCapacity) {
+    tmp = (ParallelJob *) realloc(Queue, (QueueCapacity ? 2 * QueueCapacity : 64) * sizeof(ParallelJob));
+    if(!tmp) {
+      runJobs(&job, 1);
+      return;
+    }
+    Queue = tmp;
+    QueueCapacity = QueueCapacity ? 2 * QueueCapacity : 64;
+  }
+  Queue[QueueLength++] = job;
+}
+
+static void
+flush()
+{
+  size_t n = QueueLength;
+
+  QueueLength = 0;
+  if(n)
+    runJobs(Queue, n);
+}
+
+
+void
+RMatlab_parallelBegin()
+{
+  Depth++;
+}
+
+void
+RMatlab_parallelEnd()
+{
+  if(Depth > 0 && --Depth == 0)
+    flush();
+}
+
+/*
+  Do the queued copies and stop queueing until RMatlab_parallelResume()
+  is given the result.
+*/
+int
+RMatlab_parallelSuspend()
+{
+  int depth = Depth;
+
+  flush();
+  Depth = 0;
+  return(depth);
+}
+
+void
+RMatlab_parallelResume(int depth)
+{
+  Depth = depth;
+}
+
+
+void
+RMatlab_parallelCopy(void *dest, const void *src, size_t bytes)
+{
+  submit(PARALLEL_COPY, dest, NULL, src, NULL, bytes);
+}
+
+void
+RMatlab_parallelIntToDouble(double *dest, const int *src, size_t n)
+{
+  submit(PARALLEL_INT_TO_DOUBLE, dest, NULL, src, NULL, n);
+}
+
+void
+RMatlab_parallelIntToLogical(void *dest, const int *src, size_t n)
+{
+  submit(PARALLEL_INT_TO_LOGICAL, dest, NULL, src, NULL, n);
+}
+
+void
+RMatlab_parallelLogicalToInt(int *dest, const void *src, size_t n)
+{
+  submit(PARALLEL_LOGICAL_TO_INT, dest, NULL, src, NULL, n);
+}
+
+void
+RMatlab_parallelJoinComplex(Rcomplex *dest, const double *real, const double *imaginary, size_t n)
+{
+  submit(PARALLEL_JOIN_COMPLEX, dest, NULL, real, imaginary, n);
+}
+
+void
+RMatlab_parallelSplitComplex(double *real, double *imaginary, const Rcomplex *src, size_t n)
+{
+  submit(PARALLEL_SPLIT_COMPLEX, real, imaginary, src, NULL, n);
+}
@@ -0,0 +1,344 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ Pools of R vectors and Matlab arrays that can be reused for conversions
+ of the same type and size, e.g. the arguments of callR from an optimizer
+ that calls the same R function with a fixed-size parameter vector each time.
+
+ Pooling is off unless the R option RMatlab.pool is TRUE or a number,
+ which is the number of objects of each type and size that we keep
+ (TRUE is POOL_DEFAULT_SIZE).  In all, we keep at most POOL_MAX_OBJECTS
+ of each kind.  RMatlab_poolConfigure() reads the option and is called
+ at the start of each entry point that converts values.
+
+ R vectors:
+   convertToR() gets its numeric, logical and complex vectors from
+   RMatlab_poolVector().  callR gives the arguments back via
+   RMatlab_poolReleaseVector() once the call has returned and its result
+   has been converted.  We only keep a vector if nothing in R refers to it,
+   i.e. the R function didn't keep a reference to its argument.  This relies
+   on R's reference counting; where R can't tell us, we don't reuse the vector.
+   Since initializeR, callR, callNamedR and RMatlab.so are separate
+   shared libraries, the pool lives in R, in the variable .RMatlabPool
+   in the global environment, so that they all share it.
+
+ Matlab arrays:
+   RMatlab_setVariable() converts the R value with convertFromRPooled() and
+   gives it back with RMatlab_poolReleaseArray() once Matlab has copied it.
+   These are kept in RMatlab.so.  We reshape an array with mxSetDimensions()
+   so that any array with the same class and number of elements can be used.
+   In a MEX session, the arrays we keep must be made persistent.
+
+ .MatlabPool() in R reports the statistics and empties the pools.
+*/
+
+#define POOL_DEFAULT_SIZE  8
+#define POOL_MAX_OBJECTS   256
+
+#define POOL_VARIABLE      ".RMatlabPool"
+
+enum { POOL_HITS, POOL_MISSES, POOL_RELEASED, POOL_DISCARDED, POOL_SIZE, POOL_NUM_STATS };
+static const char *StatNames[] = {"hits", "misses", "released", "discarded", "size"};
+
+static int PoolLimit = 0;
+
+
+void
+RMatlab_poolConfigure()
+{
+  static SEXP optionSym = NULL;
+  SEXP opt;
+
+  if(!optionSym)
+    optionSym = Rf_install("RMatlab.pool");
+
+  opt = Rf_GetOption1(optionSym);
+  if(TYPEOF(opt) == LGLSXP && Rf_length(opt))
+    PoolLimit = LOGICAL(opt)[0] == TRUE ? POOL_DEFAULT_SIZE : 0;
+  else if(Rf_isNumeric(opt) && Rf_length(opt))
+    PoolLimit = Rf_asInteger(opt) > 0 ? Rf_asInteger(opt) : 0;
+  else
+    PoolLimit = 0;
+}
+
+
+/*
+  The environment holding the pool of R vectors, keyed by type and length,
+  and the statistics.  We create it when create is TRUE.
+*/
+static SEXP
+vectorPool(int create)
+{
+  static SEXP sym = NULL;
+  SEXP env, stats;
+
+  if(!sym)
+    sym = Rf_install(POOL_VARIABLE);
+
+  env = Rf_findVarInFrame(R_GlobalEnv, sym);
+  if(TYPEOF(env) == ENVSXP || !create)
+    return(TYPEOF(env) == ENVSXP ? env : R_NilValue);
+
+  PROTECT(env = R_NewEnv(R_EmptyEnv, TRUE, 29));
+  PROTECT(stats = allocVector(REALSXP, POOL_NUM_STATS));
+  memset(REAL(stats), 0, sizeof(double) * POOL_NUM_STATS);
+  Rf_defineVar(Rf_install("stats"), stats, env);
+  Rf_defineVar(sym, env, R_GlobalEnv);
+  UNPROTECT(2);
+
+  return(env);
+}
+
+static SEXP
+poolKey(SEXPTYPE type, R_xlen_t n)
+{
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "%d:%.0f", (int) type, (double) n);
+  return(Rf_install(buf));
+}
+
+static void
+countVector(SEXP env, int which, int delta)
+{
+  SEXP stats = Rf_findVarInFrame(env, Rf_install("stats"));
+  if(TYPEOF(stats) == REALSXP)
+    REAL(stats)[which] += delta;
+}
+
+
+/*
+  A vector of the given type and length, with no attributes and
+  whose contents are to be filled in by the caller.
+*/
+SEXP
+RMatlab_poolVector(SEXPTYPE type, R_xlen_t n)
+{
+  SEXP env, bucket, ans;
+  int i;
+
+  if(PoolLimit < 1 || (env = vectorPool(0)) == R_NilValue)
+    return(allocVector(type, n));
+
+  bucket = Rf_findVarInFrame(env, poolKey(type, n));
+  if(TYPEOF(bucket) == VECSXP) {
+    for(i = Rf_length(bucket) - 1; i >= 0; i--) {
+      ans = VECTOR_ELT(bucket, i);
+      if(ans != R_NilValue) {
+        PROTECT(ans);
+        SET_VECTOR_ELT(bucket, i, R_NilValue);
+        countVector(env, POOL_HITS, 1);
+        countVector(env, POOL_SIZE, -1);
+        UNPROTECT(1);
+        return(ans);
+      }
+    }
+  }
+
+  countVector(env, POOL_MISSES, 1);
+  return(allocVector(type, n));
+}
+
+/*
+  Keep the vector for reuse if nothing refers to it and it has no
+  attributes other than dimensions.
+*/
+void
+RMatlab_poolReleaseVector(SEXP x)
+{
+  SEXP env, bucket, key, a, stats;
+  int i, n;
+
+  if(PoolLimit < 1)
+    return;
+
+  if(TYPEOF(x) != REALSXP && TYPEOF(x) != LGLSXP && TYPEOF(x) != CPLXSXP)
+    return;
+
+  env = vectorPool(1);
+  PROTECT(x);
+
+  for(a = ATTRIB(x); a != R_NilValue; a = CDR(a))
+    if(TAG(a) != R_DimSymbol)
+      break;
+
+  stats = Rf_findVarInFrame(env, Rf_install("stats"));
+  if(MAYBE_REFERENCED(x) || a != R_NilValue || REAL(stats)[POOL_SIZE] >= POOL_MAX_OBJECTS) {
+    countVector(env, POOL_DISCARDED, 1);
+    UNPROTECT(1);
+    return;
+  }
+
+  key = poolKey(TYPEOF(x), XLENGTH(x));
+  bucket = Rf_findVarInFrame(env, key);
+  if(TYPEOF(bucket) != VECSXP || Rf_length(bucket) != PoolLimit) {
+      /* The size of the pool has changed, so we start again. */
+    if(TYPEOF(bucket) == VECSXP)
+      for(i = 0; i < Rf_length(bucket); i++)
+        countVector(env, POOL_SIZE, -(VECTOR_ELT(bucket, i) != R_NilValue));
+    PROTECT(bucket = allocVector(VECSXP, PoolLimit));
+    Rf_defineVar(key, bucket, env);
+    UNPROTECT(1);
+  }
+
+  n = Rf_length(bucket);
+  for(i = 0; i < n; i++)
+    if(VECTOR_ELT(bucket, i) == R_NilValue)
+      break;
+
+  if(i < n) {
+    Rf_setAttrib(x, R_DimSymbol, R_NilValue);
+    SET_VECTOR_ELT(bucket, i, x);
+    countVector(env, POOL_RELEASED, 1);
+    countVector(env, POOL_SIZE, 1);
+  } else
+    countVector(env, POOL_DISCARDED, 1);
+
+  UNPROTECT(1);
+}
+
+
+/*
+  The pool of Matlab arrays.
+*/
+typedef struct {
+  mxArray *array;
+  mxClassID classID;
+  int isComplex;
+  size_t length;
+} PooledArray;
+
+static PooledArray Arrays[POOL_MAX_OBJECTS];
+static int NumArrays = 0;
+static double ArrayStats[POOL_NUM_STATS];
+
+mxArray *
+RMatlab_poolArray(mxClassID classID, mxComplexity complexity, int ndims, const mwSize *dims)
+{
+  size_t len = 1;
+  mxArray *ans;
+  int i;
+
+  for(i = 0; i < ndims; i++)
+    len *= dims[i];
+
+  if(PoolLimit > 0) {
+    for(i = NumArrays - 1; i >= 0; i--) {
+      if(Arrays[i].classID == classID && Arrays[i].isComplex == (complexity == mxCOMPLEX)
+           && Arrays[i].length == len) {
+        ans = Arrays[i].array;
+        Arrays[i] = Arrays[--NumArrays];
+        ArrayStats[POOL_HITS]++;
+        ArrayStats[POOL_SIZE]--;
+          /* Same number of elements, so this just changes the shape. */
+        mxSetDimensions(ans, dims, ndims);
+        return(ans);
+      }
+    }
+    ArrayStats[POOL_MISSES]++;
+  }
+
+  if(classID == mxLOGICAL_CLASS)
+    return(mxCreateLogicalArray(ndims, dims));
+
+  return(mxCreateNumericArray(ndims, dims, classID, complexity));
+}
+
+/*
+  persistent is TRUE if we are in a MEX session.
+*/
+void
+RMatlab_poolReleaseArray(mxArray *val, int persistent)
+{
+  int i, count = 0;
+  size_t len;
+
+  if(!val)
+    return;
+
+  if(PoolLimit < 1 || NumArrays >= POOL_MAX_OBJECTS || !(mxIsNumeric(val) || mxIsLogical(val))) {
+    if(PoolLimit > 0)
+      ArrayStats[POOL_DISCARDED]++;
+    mxDestroyArray(val);
+    return;
+  }
+
+  len = mxGetNumberOfElements(val);
+  for(i = 0; i < NumArrays; i++)
+    count += Arrays[i].classID == mxGetClassID(val) && Arrays[i].isComplex == mxIsComplex(val)
+               && Arrays[i].length == len;
+
+  if(count >= PoolLimit) {
+    ArrayStats[POOL_DISCARDED]++;
+    mxDestroyArray(val);
+    return;
+  }
+
+  if(persistent)
+    mexMakeArrayPersistent(val);
+
+  Arrays[NumArrays].array = val;
+  Arrays[NumArrays].classID = mxGetClassID(val);
+  Arrays[NumArrays].isComplex = mxIsComplex(val);
+  Arrays[NumArrays].length = len;
+  NumArrays++;
+
+  ArrayStats[POOL_RELEASED]++;
+  ArrayStats[POOL_SIZE]++;
+}
+
+
+static SEXP
+statsToR(const double *values)
+{
+  SEXP ans, names;
+  int i;
+
+  PROTECT(ans = allocVector(REALSXP, POOL_NUM_STATS));
+  PROTECT(names = allocVector(STRSXP, POOL_NUM_STATS));
+  for(i = 0; i < POOL_NUM_STATS; i++) {
+    REAL(ans)[i] = values ? values[i] : 0;
+    SET_STRING_ELT(names, i, mkChar(StatNames[i]));
+  }
+  SET_NAMES(ans, names);
+  UNPROTECT(2);
+
+  return(ans);
+}
+
+/*
+  Called from R via .MatlabPool().  Returns the statistics for the two
+  pools and, if clear is TRUE, empties the pool of Matlab arrays and resets
+  its statistics.  .MatlabPool() removes the R variable for the vectors.
+*/
+SEXP
+RMatlab_poolStats(SEXP clear)
+{
+  SEXP ans, names, env, stats;
+  int i;
+
+  env = vectorPool(0);
+  stats = env != R_NilValue ? Rf_findVarInFrame(env, Rf_install("stats")) : R_NilValue;
+
+  PROTECT(ans = allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(ans, 0, statsToR(TYPEOF(stats) == REALSXP ? REAL(stats) : NULL));
+  SET_VECTOR_ELT(ans, 1, statsToR(ArrayStats));
+  PROTECT(names = allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, mkChar("R"));
+  SET_STRING_ELT(names, 1, mkChar("Matlab"));
+  SET_NAMES(ans, names);
+
+  if(LOGICAL(clear)[0]) {
+    for(i = 0; i < NumArrays; i++)
+      mxDestroyArray(Arrays[i].array);
+    NumArrays = 0;
+    memset(ArrayStats, 0, sizeof(ArrayStats));
+  }
+
+  UNPROTECT(2);
+  return(ans);
+}
@@ -0,0 +1,364 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <stdlib.h>
+#include <string.h>
+
+static SEXP cachedCall(SEXP r_expr, const char *funcName);
+static SEXP referenceCall(SEXP r_expr, const char *funcName);
+static SEXP captureErrors(SEXP r_expr);
+static int ensureRMatlabLoaded();
+static SEXP *structArgSymbols(const mxArray *namedArgs);
+static SEXP cellArgSymbol(const mxArray *name);
+
+/*
+ Create the R call to the function funcName from the Matlab arguments.
+ The first nargs elements of args are the unnamed arguments.
+ namedArgs, if non-NULL, identifies the named arguments.  It is either a
+ Matlab cell of name-value pairs or a scalar struct whose field names are
+ the names of the arguments (see RMatlab_isNamedArgs()).  The caller must
+ check a cell has an even number of elements.
+ This is used by callR and callNamedR (wrapper.c) and by the R worker thread
+ (worker.c).  The result is not protected.
+ If the RMatlab package is loaded, an R error in the call is returned as
+ the result rather than raised (see rerror.c).
+*/
+SEXP
+RMatlab_createRCall(const char *funcName, int nargs, const mxArray *args[], const mxArray *namedArgs)
+{
+  SEXP r_expr, *syms = NULL;
+  int totalNumArgs = 0, numNamedArgs = 0, haveRMatlab, isStruct = 0;
+
+  if(namedArgs) {
+    isStruct = mxIsStruct(namedArgs);
+    numNamedArgs = isStruct ? mxGetNumberOfFields(namedArgs) : mxGetNumberOfElements(namedArgs) / 2;
+  }
+
+  totalNumArgs = nargs + numNamedArgs;
+
+  haveRMatlab = ensureRMatlabLoaded();
+
+  PROTECT(r_expr = allocVector(LANGSXP, 1 + totalNumArgs));
+  SETCAR(r_expr, Rf_install(funcName));
+
+  if(totalNumArgs > 0) {
+    int i;
+
+    SEXP el = CDR(r_expr);
+      /* Put the unnamed arguments into the call. */
+    for(i = 0 ; i < nargs ; i++) {
+        SETCAR(el, convertToR(args[i]));
+        el = CDR(el);
+    }
+
+       /* Now add the named arguments, from the fields of the struct
+          or by walking over the name, value pairs of the Matlab cell.
+        */
+    if(isStruct)
+      syms = structArgSymbols(namedArgs);
+
+    for(i = 0; i < numNamedArgs; i++) {
+      if(isStruct) {
+        SETCAR(el, convertToR(mxGetFieldByNumber(namedArgs, 0, i)));
+        SET_TAG(el, syms[i]);
+      } else {
+        SETCAR(el, convertToR(mxGetCell(namedArgs, 2 * i + 1)));
+        SET_TAG(el, cellArgSymbol(mxGetCell(namedArgs, 2 * i)));
+      }
+      el = CDR(el);
+    }
+  }
+
+  r_expr = cachedCall(r_expr, funcName);
+  if(haveRMatlab) {
+    PROTECT(r_expr);
+    PROTECT(r_expr = referenceCall(r_expr, funcName));
+    r_expr = captureErrors(r_expr);
+    UNPROTECT(2);
+  }
+  UNPROTECT(1);
+
+  return(r_expr);
+}
+
+
+/*
+ Is the last argument of callNamedR the named arguments,
+ i.e. a cell or a scalar struct other than the struct form of an RReference.
+*/
+int
+RMatlab_isNamedArgs(const mxArray *val)
+{
+  return(mxIsCell(val)
+          || (mxIsStruct(val) && mxGetNumberOfElements(val) == 1 && !RMatlab_isReferenceArray(val)));
+}
+
+
+/*
+ The symbols for the field names of a struct of named arguments.
+
+ Matlab code that calls an R function in a loop passes structs with the
+ same fields each time, so we keep the symbols for the last few layouts
+ rather than look up each name in R's symbol table on every call.
+ We recognize a layout by a hash of its field names, which we compute
+ from Matlab's own strings, and then compare the names to be sure.
+ The symbols are never garbage collected so we need not protect them.
+*/
+#define NUM_CACHED_LAYOUTS 16
+
+typedef struct {
+  unsigned int hash;
+  int numFields;
+  char **names;
+  SEXP *syms;
+} ArgLayout;
+
+static ArgLayout Layouts[NUM_CACHED_LAYOUTS];
+static int NextLayout = 0;
+
+static int
+sameLayout(const ArgLayout *layout, const mxArray *namedArgs, int numFields, unsigned int hash)
+{
+  int i;
+
+  if(!layout->syms || layout->hash != hash || layout->numFields != numFields)
+    return(0);
+
+  for(i = 0; i < numFields; i++)
+    if(strcmp(layout->names[i], mxGetFieldNameByNumber(namedArgs, i)) != 0)
+      return(0);
+
+  return(1);
+}
+
+static void
+freeLayout(ArgLayout *layout)
+{
+  int i;
+
+  for(i = 0; layout->names && i < layout->numFields; i++)
+    free(layout->names[i]);
+  free(layout->names);
+  free(layout->syms);
+  memset(layout, 0, sizeof(ArgLayout));
+}
+
+static SEXP *
+structArgSymbols(const mxArray *namedArgs)
+{
+  int i, numFields = mxGetNumberOfFields(namedArgs);
+  unsigned int hash = 2166136261u;
+  const char *p;
+  ArgLayout *layout;
+
+  for(i = 0; i < numFields; i++) {
+    for(p = mxGetFieldNameByNumber(namedArgs, i); *p; p++)
+      hash = (hash ^ (unsigned char) *p) * 16777619u;
+    hash = (hash ^ ',') * 16777619u;
+  }
+
+  for(i = 0; i < NUM_CACHED_LAYOUTS; i++)
+    if(sameLayout(Layouts + i, namedArgs, numFields, hash))
+      return(Layouts[i].syms);
+
+    /* Replace the oldest layout. */
+  layout = Layouts + NextLayout;
+  NextLayout = (NextLayout + 1) % NUM_CACHED_LAYOUTS;
+  freeLayout(layout);
+
+  layout->names = (char **) calloc(numFields + 1, sizeof(char *));
+  layout->syms = (SEXP *) calloc(numFields + 1, sizeof(SEXP));
+  if(!layout->names || !layout->syms) {
+    freeLayout(layout);
+    PROBLEM "Cannot allocate the names of the named arguments"
+    ERROR;
+  }
+  for(i = 0; i < numFields; i++) {
+    p = mxGetFieldNameByNumber(namedArgs, i);
+    layout->syms[i] = Rf_install(p);
+    layout->names[i] = strdup(p);
+  }
+  layout->numFields = numFields;
+  layout->hash = hash;
+
+  return(layout->syms);
+}
+
+/*
+ The symbol for a name in a cell of name-value pairs.
+ Names are short, so we get them into a buffer on the stack.
+*/
+static SEXP
+cellArgSymbol(const mxArray *name)
+{
+  char buf[256], *tmp = buf;
+  size_t len;
+
+  if(!name || !mxIsChar(name)) {
+    PROBLEM "The names of the named arguments must be strings"
+    ERROR;
+  }
+
+  len = mxGetNumberOfElements(name) + 1;
+  if(len > sizeof(buf))
+    tmp = (char *) R_alloc(len, sizeof(char));
+  mxGetString(name, tmp, len);
+
+  return(Rf_install(tmp));
+}
+
+
+/*
+ When initializeR is given the 'lazy' option, it doesn't load the RMatlab
+ package.  So we load it here before the first call to R.
+ We look in the namespace registry rather than the search path as that
+ is a single hash table lookup, and we remember the answer so subsequent
+ calls do nothing.  If the package cannot be loaded, we carry on and let
+ the call itself fail if it needs RMatlab.
+ This returns TRUE if the RMatlab package is loaded.
+*/
+static int
+ensureRMatlabLoaded()
+{
+  static int checked = 0, loaded = 0;
+  SEXP e, sym;
+  int errorOccurred;
+
+  if(checked)
+    return(loaded);
+
+  sym = Rf_install("RMatlab");
+  if(Rf_findVarInFrame(R_NamespaceRegistry, sym) == R_UnboundValue) {
+    PROTECT(e = Rf_lang2(Rf_install("library"), mkString("RMatlab")));
+    R_tryEval(e, R_GlobalEnv, &errorOccurred);
+    UNPROTECT(1);
+  }
+  loaded = Rf_findVarInFrame(R_NamespaceRegistry, sym) != R_UnboundValue;
+  checked = 1;
+
+  return(loaded);
+}
+
+
+/*
+ Is the R option TRUE or does it contain the name of the function.
+*/
+static int
+optionNamesFunction(SEXP optionSym, const char *funcName)
+{
+  SEXP opt;
+  int i, n, ans = 0;
+
+  opt = Rf_GetOption1(optionSym);
+  if(TYPEOF(opt) == LGLSXP && Rf_length(opt))
+    ans = LOGICAL(opt)[0] == TRUE;
+  else if(TYPEOF(opt) == STRSXP) {
+    n = Rf_length(opt);
+    for(i = 0; i < n && !ans; i++)
+      ans = strcmp(CHAR(STRING_ELT(opt, i)), funcName) == 0;
+  }
+
+  return(ans);
+}
+
+/*
+ If the R option RMatlab.cacheCalls is TRUE or contains the name
+ of the function being called, we arrange to evaluate the call via
+ the cache of results in the RMatlab package (see cache.R).
+ The call is quoted so that the already converted arguments
+ are not evaluated again.
+ Otherwise, we return the call unaltered.
+*/
+static SEXP
+cachedCall(SEXP r_expr, const char *funcName)
+{
+  static SEXP optionSym = NULL;
+  SEXP fun;
+  int cache;
+
+  if(!optionSym)
+    optionSym = Rf_install("RMatlab.cacheCalls");
+
+  cache = optionNamesFunction(optionSym, funcName);
+
+  if(!cache)
+    return(r_expr);
+
+  PROTECT(fun = Rf_lang3(Rf_install(":::"), Rf_install("RMatlab"), Rf_install(".RMatlabCachedEval")));
+  PROTECT(r_expr = Rf_lang2(Rf_install("quote"), r_expr));
+  r_expr = Rf_lang2(fun, r_expr);
+  UNPROTECT(2);
+
+  return(r_expr);
+}
+
+/*
+ If the R option RMatlab.references is TRUE or contains the name of the
+ function being called, we evaluate the call via .RMatlabEvalReference()
+ (references.R) so that the result is kept in R and Matlab gets an
+ RReference to it (see references.c).  As in cachedCall(), the call is quoted.
+*/
+static SEXP
+referenceCall(SEXP r_expr, const char *funcName)
+{
+  static SEXP optionSym = NULL;
+  SEXP fun;
+
+  if(!optionSym)
+    optionSym = Rf_install("RMatlab.references");
+
+  if(!optionNamesFunction(optionSym, funcName))
+    return(r_expr);
+
+  PROTECT(fun = Rf_lang3(Rf_install(":::"), Rf_install("RMatlab"), Rf_install(".RMatlabEvalReference")));
+  PROTECT(r_expr = Rf_lang2(Rf_install("quote"), r_expr));
+  r_expr = Rf_lang2(fun, r_expr);
+  UNPROTECT(2);
+
+  return(r_expr);
+}
+
+/*
+ Evaluate the call via .RMatlabEvalCapture() (errors.R) so that an
+ R error is returned as an RMatlabRError object describing it.
+ As in cachedCall(), the call is quoted.
+*/
+static SEXP
+captureErrors(SEXP r_expr)
+{
+  SEXP fun;
+
+  PROTECT(fun = Rf_lang3(Rf_install(":::"), Rf_install("RMatlab"), Rf_install(".RMatlabEvalCapture")));
+  PROTECT(r_expr = Rf_lang2(Rf_install("quote"), r_expr));
+  r_expr = Rf_lang2(fun, r_expr);
+  UNPROTECT(2);
+
+  return(r_expr);
+}
+
+
+/*
+ Once the call from RMatlab_createRCall() has been evaluated and its
+ result converted, give the arguments back to the pool of R vectors
+ (see pool.c).  We take them out of the call first so that the call
+ itself doesn't count as a reference to them.  We leave the result
+ alone in case the function returned one of its arguments.
+*/
+void
+RMatlab_releaseRCall(SEXP call, SEXP result)
+{
+  SEXP el, x;
+
+    /* Unwrap RMatlab:::.RMatlabEvalCapture(quote(call)) from captureErrors(),
+       RMatlab:::.RMatlabEvalReference(quote(call)) from referenceCall()
+       and RMatlab:::.RMatlabCachedEval(quote(call)) from cachedCall(). */
+  while(TYPEOF(CAR(call)) == LANGSXP)
+    call = CADR(CADR(call));
+
+  for(el = CDR(call); el != R_NilValue; el = CDR(el)) {
+    x = CAR(el);
+    SETCAR(el, R_NilValue);
+    if(x != result)
+      RMatlab_poolReleaseVector(x);
+  }
+}
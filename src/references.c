@@ -0,0 +1,156 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ References to R objects from Matlab.
+
+ callR('.RReference', 'lm', ...) and the calls to the R functions named in the
+ R option RMatlab.references return a reference to the result rather than
+ converting it, e.g. for a fitted model that Matlab only passes on to predict
+ or summary.  The R object is kept in the table .RMatlabReferenceTable in the
+ RMatlab namespace (see references.R) and .RMatlabReference() returns its
+ integer identifier with the class RMatlabReference.  We convert this to an
+ RReference object in Matlab (inst/mex/RReference.m) whose delete() method
+ removes the R object from the table when Matlab clears the last copy of it.
+ When an RReference is passed to R, we put the R object itself in the call.
+
+ Where we cannot call Matlab to create the RReference object, e.g. on the R
+ worker thread, the reference is a struct with the single field RReferenceId.
+*/
+
+#define REFERENCE_ID_FIELD "RReferenceId"
+
+int
+RMatlab_isRReference(SEXP val)
+{
+  return(OBJECT(val) && Rf_inherits(val, "RMatlabReference"));
+}
+
+int
+RMatlab_isReferenceArray(const mxArray *val)
+{
+  return(strcmp(mxGetClassName(val), "RReference") == 0
+          || (mxIsStruct(val) && mxGetNumberOfElements(val) == 1 && mxGetNumberOfFields(val) == 1
+                && mxGetFieldNumber(val, REFERENCE_ID_FIELD) == 0));
+}
+
+static mxArray *
+referenceStruct(double id)
+{
+  static const char *fields[] = {REFERENCE_ID_FIELD};
+  mxArray *ans;
+
+  ans = mxCreateStructMatrix(1, 1, 1, fields);
+  mxSetFieldByNumber(ans, 0, 0, mxCreateDoubleScalar(id));
+
+  return(ans);
+}
+
+mxArray *
+RMatlab_referenceFromR(SEXP val, int canCallMatlab)
+{
+  SEXP klass = Rf_getAttrib(val, Rf_install("RClass"));
+  const mxArray *args[2];
+  mxArray *ans = NULL;
+  double id = Rf_asReal(val);
+
+  if(canCallMatlab) {
+    args[0] = mxCreateDoubleScalar(id);
+    args[1] = mxCreateString(Rf_length(klass) ? CHAR(STRING_ELT(klass, 0)) : "");
+    ans = RMatlab_callMatlab("RReference", 2, args);
+    mxDestroyArray((mxArray *) args[0]);
+    mxDestroyArray((mxArray *) args[1]);
+  }
+
+    /* If RReference.m isn't on Matlab's path, the R object is only released by .RReleaseReference(). */
+  if(!ans)
+    ans = referenceStruct(id);
+
+  return(ans);
+}
+
+static double
+referenceId(const mxArray *val, int canCallMatlab)
+{
+  mxArray *id;
+  double ans;
+
+  if(mxIsStruct(val))
+    return(mxGetScalar(mxGetFieldByNumber(val, 0, 0)));
+
+  if(!canCallMatlab || !(id = mxGetProperty(val, 0, "id"))) {
+    PROBLEM "Cannot get the identifier of the RReference here"
+    ERROR;
+  }
+
+  ans = mxGetScalar(id);
+  mxDestroyArray(id);
+  return(ans);
+}
+
+/*
+  The R object to which the RReference refers.
+*/
+SEXP
+RMatlab_referenceToR(const mxArray *val, int canCallMatlab)
+{
+  SEXP ns, table, ans;
+  char id[32];
+
+  snprintf(id, sizeof(id), "%d", (int) referenceId(val, canCallMatlab));
+
+  PROTECT(ns = R_FindNamespace(mkString("RMatlab")));
+  table = Rf_findVarInFrame(ns, Rf_install(".RMatlabReferenceTable"));
+  UNPROTECT(1);
+  ans = TYPEOF(table) == ENVSXP ? Rf_findVarInFrame(table, Rf_install(id)) : R_UnboundValue;
+  if(ans == R_UnboundValue) {
+    PROBLEM "The R object for the RReference %s has been released", id
+    ERROR;
+  }
+
+  return(ans);
+}
+
+/*
+  The struct form of the RReference, for RMatlab_portableArray().
+  This must be called on Matlab's thread.
+*/
+mxArray *
+RMatlab_portableReference(const mxArray *val)
+{
+  mxArray *id, *ans;
+
+  if(mxIsStruct(val))
+    return(mxDuplicateArray(val));
+
+  if(!(id = mxGetProperty(val, 0, "id")))
+    return(NULL);
+
+  ans = referenceStruct(mxGetScalar(id));
+  mxDestroyArray(id);
+  return(ans);
+}
+
+/*
+  The RReference object for the struct form, for RMatlab_nativeArray(),
+  or NULL if Matlab cannot create it.  This must be called on Matlab's thread.
+*/
+mxArray *
+RMatlab_nativeReference(const mxArray *val)
+{
+  const mxArray *args[2];
+  mxArray *ans;
+
+  if(!mxIsStruct(val))
+    return(NULL);
+
+  args[0] = mxGetFieldByNumber(val, 0, 0);
+  args[1] = mxCreateString("");
+  ans = RMatlab_callMatlab("RReference", 2, args);
+  mxDestroyArray((mxArray *) args[1]);
+
+  return(ans);
+}
@@ -0,0 +1,169 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+ Errors in calls from Matlab to R (callR, callNamedR and callRAsync).
+
+ RMatlab_createRCall() arranges for the call to be evaluated via
+ .RMatlabEvalCapture() (errors.R) which, rather than raising an R error,
+ returns an object of class RMatlabRError giving the message, the call,
+ the class of the condition and the traceback.  This comes back to us as
+ the result of the call and we turn it into a Matlab error whose identifier
+ is RMatlab:R:<class>, e.g. RMatlab:R:simpleError.
+
+ Matlab errors can only carry an identifier and a message, so we also
+ assign the details to the global Matlab variable RLastError, a struct
+ with fields function, message, call, class and traceback.  A Matlab
+ program can catch the error and look at
+    global RLastError
+    RLastError.traceback
+ rather than parse the message.
+
+ The caller releases its R objects and then raises the error with
+    mexErrMsgIdAndTxt(info.id, "%s", info.message)
+ as this doesn't return.
+
+ RMatlab_recordRError() reads the R object and assigns RLastError, so it
+ can only be used where R runs on Matlab's thread.  With R on the worker
+ thread (worker.c), RMatlab_describeRError() builds the message and the
+ RLastError struct there and RMatlab_publishRError() assigns it on Matlab's
+ thread.  RMatlab_recordRErrorMessage() doesn't use R.
+*/
+
+#define RLAST_ERROR_VARIABLE "RLastError"
+
+int
+RMatlab_isRError(SEXP val)
+{
+  return(val && Rf_inherits(val, "RMatlabRError"));
+}
+
+static SEXP
+getElement(SEXP obj, const char *name)
+{
+  SEXP names = GET_NAMES(obj);
+  int i, n = Rf_length(obj);
+
+  for(i = 0; i < n && i < Rf_length(names); i++)
+    if(strcmp(CHAR(STRING_ELT(names, i)), name) == 0)
+      return(VECTOR_ELT(obj, i));
+
+  return(R_NilValue);
+}
+
+static const char *
+getString(SEXP obj, const char *name)
+{
+  SEXP el = getElement(obj, name);
+  return(TYPEOF(el) == STRSXP && Rf_length(el) ? CHAR(STRING_ELT(el, 0)) : "");
+}
+
+static mxArray *
+stringsToCell(SEXP strings)
+{
+  mxArray *ans;
+  int i, n = TYPEOF(strings) == STRSXP ? Rf_length(strings) : 0;
+
+  ans = mxCreateCellMatrix(n, 1);
+  for(i = 0; i < n; i++)
+    mxSetCell(ans, i, mxCreateString(CHAR(STRING_ELT(strings, i))));
+
+  return(ans);
+}
+
+static mxArray *
+lastErrorStruct(const char *funcName, const char *message, const char *call, mxArray *klass, mxArray *traceback)
+{
+  static const char *fields[] = {"function", "message", "call", "class", "traceback"};
+  mxArray *err;
+
+  err = mxCreateStructMatrix(1, 1, 5, fields);
+  mxSetField(err, 0, "function", mxCreateString(funcName));
+  mxSetField(err, 0, "message", mxCreateString(message));
+  mxSetField(err, 0, "call", mxCreateString(call));
+  mxSetField(err, 0, "class", klass);
+  mxSetField(err, 0, "traceback", traceback);
+
+  return(err);
+}
+
+/*
+  Assign the RLastError struct from RMatlab_describeRError() or
+  RMatlab_recordRErrorMessage().  This must be called on Matlab's thread.
+*/
+void
+RMatlab_publishRError(RMatlabErrorInfo *info)
+{
+  if(!info->lastError)
+    return;
+
+    /* This copies the value. */
+  mexPutVariable("global", RLAST_ERROR_VARIABLE, info->lastError);
+  mxDestroyArray(info->lastError);
+  info->lastError = NULL;
+}
+
+
+/*
+  Fill in the identifier and message for the Matlab error from
+  .RMatlabEvalCapture() and the RLastError struct for
+  RMatlab_publishRError().  This uses R but not Matlab.
+*/
+void
+RMatlab_describeRError(RMatlabErrorInfo *info, const char *funcName, SEXP err)
+{
+  SEXP klass = getElement(err, "class");
+  const char *call = getString(err, "call"), *name;
+  char *p;
+
+  name = TYPEOF(klass) == STRSXP && Rf_length(klass) ? CHAR(STRING_ELT(klass, 0)) : "error";
+  snprintf(info->id, sizeof(info->id), "RMatlab:R:%s%s", isalpha((unsigned char) name[0]) ? "" : "x", name);
+    /* Each part of a Matlab identifier can only have letters, digits and underscores. */
+  for(p = info->id + strlen("RMatlab:R:"); *p; p++)
+    if(!isalnum((unsigned char) *p) && *p != '_')
+      *p = '_';
+
+  if(call[0])
+    snprintf(info->message, sizeof(info->message), "Error in R when calling function %s: %s\n  in %s",
+               funcName, getString(err, "message"), call);
+  else
+    snprintf(info->message, sizeof(info->message), "Error in R when calling function %s: %s",
+               funcName, getString(err, "message"));
+
+  info->lastError = lastErrorStruct(funcName, getString(err, "message"), call,
+                                      stringsToCell(klass), stringsToCell(getElement(err, "traceback")));
+}
+
+/*
+  Record the error from .RMatlabEvalCapture() in RLastError and
+  fill in the identifier and message for the Matlab error.
+*/
+void
+RMatlab_recordRError(RMatlabErrorInfo *info, const char *funcName, SEXP err)
+{
+  RMatlab_describeRError(info, funcName, err);
+  RMatlab_publishRError(info);
+}
+
+/*
+  For the errors that don't come from .RMatlabEvalCapture(), e.g. in
+  converting the arguments or when the call is cancelled.
+  message is used as is.  This doesn't use R.
+*/
+void
+RMatlab_recordRErrorMessage(RMatlabErrorInfo *info, const char *funcName, const char *id, const char *message)
+{
+  mxArray *klass;
+
+  snprintf(info->id, sizeof(info->id), "%s", id);
+  snprintf(info->message, sizeof(info->message), "%s", message);
+
+  klass = mxCreateCellMatrix(1, 1);
+  mxSetCell(klass, 0, mxCreateString("error"));
+  info->lastError = lastErrorStruct(funcName, message, "", klass, mxCreateCellMatrix(0, 1));
+  RMatlab_publishRError(info);
+}
@@ -0,0 +1,210 @@
+#include "RMatlabConvert.h"
+
+#include <Rdefines.h>
+#include <Rversion.h>
+#include <limits.h>
+
+#if R_VERSION >= R_Version(3, 5, 0)
+#include <R_ext/Altrep.h>
+#endif
+
+/*
+ Read-only arguments for the Matlab functions R calls via .MatlabMexCall().
+
+ convertFromR() copies each R vector into a new Matlab array.  For a large
+ double vector that the Matlab function only reads, the copy is wasted, so
+ with .readOnly (or the R option RMatlab.readOnlyArgs) TRUE, RMatlab_invoke
+ instead gives Matlab an array whose data is the R vector's own memory:
+   - the R object is pinned as it is in the list of arguments of the .Call()
+     for the duration of the call, and marked not mutable so that R copies
+     it rather than changing it while Matlab may still see it;
+   - Matlab passes its arguments to M-functions copy on write, so a
+     function that modifies its argument modifies its own copy;
+   - an array Matlab returns that still refers to the R data (e.g. from
+     a function that returns its argument, or returns it in a cell or
+     struct) is converted to a new R vector by convertToR() like any other,
+     and so copied;
+   - before we destroy the arrays, we detach the R data from them, and
+     from any arrays in the cells and fields of the results, with
+     RMatlab_shareDetach() so that Matlab doesn't free it.
+ The Matlab function must not keep its argument beyond the call, e.g. in
+ a global or persistent variable or a handle object.  We cannot detect
+ this: such a copy is a separate array that only Matlab knows about, and
+ the API has no documented way to ask whether an array's data is shared.
+ R may then free or reuse the memory while Matlab still refers to it, so
+ the help for .MatlabMexCall() states this as a requirement of .readOnly.
+
+ MathWorks documents setting the data of an array to memory that mxMalloc()
+ didn't allocate as undefined.  It works because Matlab only frees or
+ reallocates the data of an array it destroys or resizes, and we detach the
+ data first, but it relies on this, so the option is off by default.
+
+ Only double and (with the interleaved complex API) complex vectors and
+ arrays share their memory: Matlab's logical arrays are a byte per element
+ and R's an int, and R's integers are converted to doubles.  Values that
+ convertFromR() converts with their attributes, ALTREP vectors, which
+ may not have their data in memory, and vectors smaller than
+ SHARE_MIN_BYTES, for which the copy is cheaper than the bookkeeping,
+ are copied as before.
+*/
+
+#define SHARE_MIN_BYTES 65536
+
+/*
+  Can the Matlab array for this R value refer to its data.
+*/
+int
+RMatlab_shareEligible(SEXP val)
+{
+  R_xlen_t len;
+  SEXP dims;
+
+  if(TYPEOF(val) != REALSXP
+#if MX_HAS_INTERLEAVED_COMPLEX
+      && TYPEOF(val) != CPLXSXP
+#endif
+     )
+    return(0);
+
+#if R_VERSION >= R_Version(3, 5, 0)
+  if(ALTREP(val))
+    return(0);
+#endif
+
+  if(OBJECT(val) || RMatlab_convertsAttributes(val))
+    return(0);
+
+  len = XLENGTH(val);
+  if(len * (TYPEOF(val) == CPLXSXP ? sizeof(Rcomplex) : sizeof(double)) < SHARE_MIN_BYTES)
+    return(0);
+
+    /* A vector's length is its first dimension, which may be an int (RMatlabSize.h). */
+  dims = GET_DIM(val);
+  if(dims == R_NilValue && len > INT_MAX)
+    return(0);
+
+  return(1);
+}
+
+/*
+  A Matlab array whose data is that of the R value, for which
+  RMatlab_shareEligible() is TRUE.  The caller keeps val alive for as long
+  as Matlab has the array and releases it with RMatlab_shareRelease().
+*/
+mxArray *
+RMatlab_shareFromR(SEXP val)
+{
+  mxArray *ans;
+  SEXP rdims = GET_DIM(val);
+  mwSize vectorDims[2], *dims = vectorDims;
+  int ndims = 2;
+
+  if(rdims == R_NilValue) {
+    vectorDims[0] = (mwSize) XLENGTH(val);
+    vectorDims[1] = 1;
+  } else {
+    dims = RMatlab_dimsFromR(rdims);
+    ndims = Rf_length(rdims);
+  }
+
+    /* An empty array, so there is no data of Matlab's to free. */
+  ans = mxCreateNumericMatrix(0, 0, mxDOUBLE_CLASS, TYPEOF(val) == CPLXSXP ? mxCOMPLEX : mxREAL);
+  if(!ans)
+    return(NULL);
+
+#if MX_HAS_INTERLEAVED_COMPLEX
+  if(TYPEOF(val) == CPLXSXP)
+      /* mxComplexDouble has the same layout as Rcomplex. */
+    mxSetComplexDoubles(ans, (mxComplexDouble *) COMPLEX(val));
+  else
+    mxSetDoubles(ans, REAL(val));
+#else
+  mxSetPr(ans, REAL(val));
+#endif
+  mxSetDimensions(ans, dims, ndims);
+
+#if R_VERSION >= R_Version(3, 1, 0)
+  MARK_NOT_MUTABLE(val);
+#else
+  SET_NAMED(val, 2);
+#endif
+
+  return(ans);
+}
+
+/*
+  Is the data of the Matlab array that of the R value, e.g. because
+  Matlab returned a shared copy of an argument from RMatlab_shareFromR().
+  This doesn't look inside cells and structs.
+*/
+static int
+refersTo(const mxArray *arr, SEXP val)
+{
+  if(!arr || mxIsCell(arr) || mxIsStruct(arr) || mxIsEmpty(arr))
+    return(0);
+
+#if MX_HAS_INTERLEAVED_COMPLEX
+  if(TYPEOF(val) == CPLXSXP)
+    return(mxIsComplex(arr) && (void *) mxGetComplexDoubles(arr) == (void *) COMPLEX(val));
+#endif
+  return(mxIsDouble(arr) && !mxIsComplex(arr) && mxGetPr(arr) == REAL(val));
+}
+
+static void
+detach(mxArray *arr)
+{
+#if MX_HAS_INTERLEAVED_COMPLEX
+  if(mxIsComplex(arr))
+    mxSetComplexDoubles(arr, NULL);
+  else
+    mxSetDoubles(arr, NULL);
+#else
+  mxSetPr(arr, NULL);
+#endif
+  mxSetM(arr, 0);
+  mxSetN(arr, 0);
+}
+
+/*
+  Detach the data of the R value from the array and from the arrays in its
+  cells and the fields of its structs, at any depth, so that the array can
+  be destroyed.  Returns the number of arrays that referred to it.
+*/
+int
+RMatlab_shareDetach(mxArray *arr, SEXP val)
+{
+  int i, j, n, nfields, count = 0;
+
+  if(!arr)
+    return(0);
+
+  if(mxIsCell(arr)) {
+    n = mxGetNumberOfElements(arr);
+    for(i = 0; i < n; i++)
+      count += RMatlab_shareDetach(mxGetCell(arr, i), val);
+  } else if(mxIsStruct(arr)) {
+    n = mxGetNumberOfElements(arr);
+    nfields = mxGetNumberOfFields(arr);
+    for(i = 0; i < n; i++)
+      for(j = 0; j < nfields; j++)
+        count += RMatlab_shareDetach(mxGetFieldByNumber(arr, i, j), val);
+  } else if(refersTo(arr, val)) {
+    detach(arr);
+    count++;
+  }
+
+  return(count);
+}
+
+/*
+  Detach the R data from an array from RMatlab_shareFromR() and destroy it.
+*/
+void
+RMatlab_shareRelease(mxArray *arr)
+{
+  if(!arr)
+    return;
+
+  detach(arr);
+  mxDestroyArray(arr);
+}
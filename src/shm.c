@@ -0,0 +1,321 @@
+#include "RMatlabConvert.h"
+#include "RMatlabShm.h"
+
+#include "RMatlabBroker.h"
+
+#include <Rdefines.h>
+#include <string.h>
+
+/*
+ The R side of the shared memory transport for the Matlab engine.
+ Rather than sending a large numeric array through the engine's pipe
+ via engPutVariable() (after converting it to an mxArray), we write
+ the data once into a POSIX shared memory segment and have the
+ RMatlabShm MEX function in the Matlab process create the array from it.
+ Only the command naming the segment crosses the pipe.
+ Similarly for retrieving the value of a Matlab variable.
+
+ This is only used with the engine interface, when it has been enabled via
+ .MatlabTransport(), and for arrays with at least ShmThreshold bytes.
+ The RMatlabShm MEX file must be on Matlab's path.
+
+ We keep one segment for each engine and reuse it for all transfers,
+ creating a larger one when an array does not fit.  Once the Matlab side
+ has mapped it, we remove its name so that it does not outlive the two processes.
+*/
+
+static int UseShm = 0;
+static double ShmThreshold = 1048576;
+
+typedef struct _RMatlabShmConnection {
+  Engine *engine;
+  RMatlabShmSegment seg;
+  struct _RMatlabShmConnection *next;
+} RMatlabShmConnection;
+
+static RMatlabShmConnection *Connections = NULL;
+
+
+static RMatlabShmConnection *
+getConnection(Engine *eng)
+{
+  RMatlabShmConnection *con;
+
+  for(con = Connections; con; con = con->next)
+    if(con->engine == eng)
+      return(con);
+
+  con = (RMatlabShmConnection *) calloc(1, sizeof(RMatlabShmConnection));
+  con->engine = eng;
+  con->next = Connections;
+  Connections = con;
+
+  return(con);
+}
+
+/*
+  Make certain the engine's segment has at least size bytes,
+  replacing it with a new, larger one if necessary (see shmSegment.c).
+*/
+static void *
+reserveSegment(RMatlabShmConnection *con, size_t size)
+{
+  if(!RMatlabShm_reserve(&con->seg, size)) {
+    PROBLEM "Cannot create the shared memory segment %s of %.0f bytes", con->seg.name, (double) size
+    ERROR;
+  }
+
+  return(con->seg.segment);
+}
+
+/*
+  Discard the segment for this engine, e.g. when it is closed.
+*/
+void
+RMatlab_shmRelease(Engine *eng)
+{
+  RMatlabShmConnection *con, *prev = NULL;
+
+  for(con = Connections; con; prev = con, con = con->next) {
+    if(con->engine == eng) {
+      RMatlabShm_release(&con->seg);
+      if(prev)
+        prev->next = con->next;
+      else
+        Connections = con->next;
+      free(con);
+      return;
+    }
+  }
+}
+
+
+/*
+  Should we send val via shared memory? This is for plain
+  numeric, integer, logical and complex vectors & arrays.
+*/
+int
+RMatlab_shmEligible(Engine *eng, SEXP val)
+{
+  size_t size;
+
+  if(!UseShm || !eng || OBJECT(val) || RMatlab_convertsAttributes(val) || Rf_length(GET_DIM(val)) > RMATLAB_SHM_MAX_DIMS)
+    return(0);
+
+  switch(TYPEOF(val)) {
+    case REALSXP:
+    case INTSXP:
+      size = sizeof(double);
+      break;
+    case CPLXSXP:
+      size = 2 * sizeof(double);
+      break;
+    case LGLSXP:
+      size = 1;
+      break;
+    default:
+      return(0);
+  }
+
+  return(size * XLENGTH(val) >= ShmThreshold);
+}
+
+
+/*
+  Write the R vector into the engine's segment, creating a larger one
+  if necessary.
+*/
+static void *
+writeSegment(RMatlabShmConnection *con, SEXP val)
+{
+  long long dims[RMATLAB_SHM_MAX_DIMS];
+  int i, ndims, type;
+  R_xlen_t j, n = XLENGTH(val);
+  SEXP rdims = GET_DIM(val);
+  RMatlabShmHeader *hdr;
+  void *segment;
+
+  ndims = Rf_length(rdims);
+  if(ndims == 0) {
+    ndims = 2;
+    dims[0] = n;
+    dims[1] = 1;
+  } else
+    for(i = 0; i < ndims; i++)
+      dims[i] = INTEGER(rdims)[i];
+
+  type = TYPEOF(val) == CPLXSXP ? RMATLAB_SHM_COMPLEX :
+           (TYPEOF(val) == LGLSXP ? RMATLAB_SHM_LOGICAL : RMATLAB_SHM_DOUBLE);
+
+  segment = reserveSegment(con, RMatlabShm_segmentSize(type, n));
+  hdr = RMatlabShm_initHeader(segment, type, ndims, dims);
+
+  switch(TYPEOF(val)) {
+    case REALSXP:
+      RMatlab_parallelCopy(RMatlabShm_data(hdr), REAL(val), n * sizeof(double));
+      break;
+    case INTSXP:
+      RMatlab_parallelIntToDouble((double *) RMatlabShm_data(hdr), INTEGER(val), n);
+      break;
+    case CPLXSXP:
+      RMatlab_parallelCopy(RMatlabShm_data(hdr), COMPLEX(val), n * sizeof(Rcomplex));
+      break;
+    case LGLSXP: {
+      unsigned char *data = (unsigned char *) RMatlabShm_data(hdr);
+      for(j = 0; j < n; j++)
+        data[j] = LOGICAL(val)[j] != 0;
+    }
+      break;
+  }
+
+  return(segment);
+}
+
+/*
+  Create the R object from the contents of the segment.
+  This follows convertToR() in dropping the dimensions of row and column
+  vectors.
+*/
+static SEXP
+readSegment(RMatlabShmHeader *hdr)
+{
+  SEXP ans, dims;
+  R_xlen_t j, n = hdr->length;
+  int i, type;
+
+  type = hdr->type == RMATLAB_SHM_COMPLEX ? CPLXSXP :
+          (hdr->type == RMATLAB_SHM_LOGICAL ? LGLSXP : REALSXP);
+
+  PROTECT(ans = allocVector(type, n));
+
+  switch(hdr->type) {
+    case RMATLAB_SHM_DOUBLE:
+      RMatlab_parallelCopy(REAL(ans), RMatlabShm_data(hdr), n * sizeof(double));
+      break;
+    case RMATLAB_SHM_COMPLEX:
+      RMatlab_parallelCopy(COMPLEX(ans), RMatlabShm_data(hdr), n * sizeof(Rcomplex));
+      break;
+    case RMATLAB_SHM_LOGICAL: {
+      unsigned char *data = (unsigned char *) RMatlabShm_data(hdr);
+      for(j = 0; j < n; j++)
+        LOGICAL(ans)[j] = data[j];
+    }
+      break;
+  }
+
+  if(!(hdr->ndims == 2 && (hdr->dims[0] == 1 || hdr->dims[1] == 1))) {
+    PROTECT(dims = allocVector(INTSXP, hdr->ndims));
+    for(i = 0; i < hdr->ndims; i++)
+      INTEGER(dims)[i] = hdr->dims[i];
+    Rf_setAttrib(ans, R_DimSymbol, dims);
+    UNPROTECT(1);
+  }
+
+  UNPROTECT(1);
+  return(ans);
+}
+
+
+/*
+  Assign val to the Matlab variable varName via the shared memory segment.
+  Returns the status from engEvalString(), or -1 if the Matlab side did
+  not read the segment, e.g. because RMatlabShm is not on Matlab's path.
+  In that case, the caller should use engPutVariable().
+*/
+int
+RMatlab_shmPutVariable(Engine *eng, const char *varName, SEXP val)
+{
+  RMatlabShmConnection *con = getConnection(eng);
+  RMatlabShmHeader *hdr;
+  char *cmd;
+  int status;
+
+  hdr = (RMatlabShmHeader *) writeSegment(con, val);
+
+  cmd = R_alloc(strlen(varName) + strlen(con->seg.name) + 64, sizeof(char));
+  sprintf(cmd, "%s = RMatlabShm('get', '%s');", varName, con->seg.name);
+  status = RMatlab_engEvalString(eng, cmd);
+
+  if(status == 0 && hdr->consumed)
+    RMatlabShm_mapped(&con->seg);
+  else {
+      /* Start again with a new segment next time, in case Matlab lost its mapping. */
+    RMatlabShm_release(&con->seg);
+    status = -1;
+  }
+
+  return(status);
+}
+
+/*
+  Retrieve the value of the Matlab variable varName via the shared memory segment.
+  If the variable is not a numeric or logical array of at least ShmThreshold bytes,
+  the Matlab side leaves the segment empty and we return NULL
+  so that the caller uses engGetVariable().
+*/
+SEXP
+RMatlab_shmGetVariable(Engine *eng, const char *varName)
+{
+  RMatlabShmConnection *con;
+  RMatlabShmHeader *hdr;
+  char *cmd;
+  int tries;
+
+  if(!UseShm || !eng)
+    return(NULL);
+
+  con = getConnection(eng);
+  reserveSegment(con, RMATLAB_SHM_DATA_OFFSET + (size_t) ShmThreshold);
+
+  for(tries = 0; tries < 2; tries++) {
+    hdr = RMatlabShm_clearHeader(con->seg.segment);
+
+    cmd = R_alloc(strlen(varName) + strlen(con->seg.name) + 64, sizeof(char));
+    sprintf(cmd, "RMatlabShm('put', '%s', %s, %.0f);", con->seg.name, varName, ShmThreshold);
+    if(RMatlab_engEvalString(eng, cmd) != 0)
+      return(NULL);
+
+    if(hdr->needed > 0 && hdr->needed > (long long) con->seg.size) {
+        /* The array didn't fit, but Matlab has mapped this segment. */
+      RMatlabShm_mapped(&con->seg);
+      reserveSegment(con, hdr->needed);
+      continue;
+    }
+
+    if(!RMatlabShm_checkHeader(con->seg.segment, con->seg.size))
+      return(NULL);
+
+    RMatlabShm_mapped(&con->seg);
+    return(readSegment(hdr));
+  }
+
+  return(NULL);
+}
+
+
+/*
+  Entry point for .MatlabTransport() to enable or disable the shared memory
+  transport and set the minimum size of the arrays that use it.
+  Returns the previous settings.
+*/
+SEXP
+RMatlab_setTransport(SEXP shm, SEXP threshold)
+{
+  SEXP ans, names;
+
+  PROTECT(ans = allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(ans, 0, ScalarLogical(UseShm));
+  SET_VECTOR_ELT(ans, 1, ScalarReal(ShmThreshold));
+  PROTECT(names = allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, mkChar("shm"));
+  SET_STRING_ELT(names, 1, mkChar("threshold"));
+  SET_NAMES(ans, names);
+
+  if(Rf_length(shm))
+    UseShm = LOGICAL(shm)[0];
+  if(Rf_length(threshold))
+    ShmThreshold = REAL(threshold)[0];
+
+  UNPROTECT(2);
+  return(ans);
+}
@@ -0,0 +1,287 @@
+#include "RMatlabShm.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Map all the pages at once rather than faulting them in one at a time as we copy. */
+#ifdef MAP_POPULATE
+#define RMATLAB_MAP_FLAGS (MAP_SHARED | MAP_POPULATE)
+#else
+#define RMATLAB_MAP_FLAGS MAP_SHARED
+#endif
+
+/*
+ Creating, mapping and describing the POSIX shared memory segments
+ used to transfer arrays to and from the Matlab engine.
+ This is used on both sides of the connection and by tests/shmTransfer.c,
+ so it only uses POSIX facilities.  The management of the segments for each
+ side is here too, so that the test runs the same code as R and Matlab.
+*/
+
+size_t
+RMatlabShm_elementSize(int type)
+{
+  switch(type) {
+    case RMATLAB_SHM_DOUBLE:
+      return(sizeof(double));
+    case RMATLAB_SHM_COMPLEX:
+      return(2 * sizeof(double));
+    case RMATLAB_SHM_LOGICAL:
+      return(1);
+  }
+  return(0);
+}
+
+size_t
+RMatlabShm_segmentSize(int type, long long length)
+{
+  return(RMATLAB_SHM_DATA_OFFSET + RMatlabShm_elementSize(type) * (size_t) length);
+}
+
+
+/*
+  Create a new segment of the given size and map it into our address space.
+  Returns NULL if this fails.
+*/
+void *
+RMatlabShm_create(const char *name, size_t size)
+{
+  int fd;
+  void *ptr;
+
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+  if(fd < 0)
+    return(NULL);
+
+  if(ftruncate(fd, size) < 0) {
+    close(fd);
+    shm_unlink(name);
+    return(NULL);
+  }
+
+  ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, RMATLAB_MAP_FLAGS, fd, 0);
+  close(fd);
+
+  if(ptr == MAP_FAILED) {
+    shm_unlink(name);
+    return(NULL);
+  }
+
+  return(ptr);
+}
+
+/*
+  Map an existing segment, returning its size via size.
+*/
+void *
+RMatlabShm_open(const char *name, size_t *size)
+{
+  int fd;
+  struct stat info;
+  void *ptr;
+
+  fd = shm_open(name, O_RDWR, 0);
+  if(fd < 0)
+    return(NULL);
+
+  if(fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(RMatlabShmHeader)) {
+    close(fd);
+    return(NULL);
+  }
+
+  ptr = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, RMATLAB_MAP_FLAGS, fd, 0);
+  close(fd);
+
+  if(ptr == MAP_FAILED)
+    return(NULL);
+
+  *size = info.st_size;
+  return(ptr);
+}
+
+void
+RMatlabShm_close(void *ptr, size_t size)
+{
+  if(ptr)
+    munmap(ptr, size);
+}
+
+int
+RMatlabShm_unlink(const char *name)
+{
+  return(shm_unlink(name));
+}
+
+/*
+  A name for a new segment that is unique to this process.
+*/
+char *
+RMatlabShm_uniqueName(char *buf, size_t len)
+{
+  static unsigned int counter = 0;
+
+  snprintf(buf, len, "/rmatlab-%ld-%u", (long) getpid(), counter++);
+  return(buf);
+}
+
+
+RMatlabShmHeader *
+RMatlabShm_initHeader(void *segment, int type, int ndims, const long long *dims)
+{
+  RMatlabShmHeader *hdr = (RMatlabShmHeader *) segment;
+  int i;
+
+  memset(hdr, 0, sizeof(RMatlabShmHeader));
+  hdr->magic = RMATLAB_SHM_MAGIC;
+  hdr->version = RMATLAB_SHM_VERSION;
+  hdr->type = type;
+  hdr->ndims = ndims;
+  hdr->length = 1;
+  for(i = 0; i < ndims; i++) {
+    hdr->dims[i] = dims[i];
+    hdr->length *= dims[i];
+  }
+  hdr->dataOffset = RMATLAB_SHM_DATA_OFFSET;
+
+  return(hdr);
+}
+
+/*
+  Mark the segment as not containing an array, before we ask the other
+  side to write one into it.
+*/
+RMatlabShmHeader *
+RMatlabShm_clearHeader(void *segment)
+{
+  RMatlabShmHeader *hdr = (RMatlabShmHeader *) segment;
+
+  memset(hdr, 0, sizeof(RMatlabShmHeader));
+  hdr->magic = RMATLAB_SHM_MAGIC;
+  hdr->version = RMATLAB_SHM_VERSION;
+  hdr->dataOffset = RMATLAB_SHM_DATA_OFFSET;
+
+  return(hdr);
+}
+
+/*
+  Verify that the mapped segment contains a header we understand
+  and is large enough for the data it describes.
+*/
+RMatlabShmHeader *
+RMatlabShm_checkHeader(void *segment, size_t size)
+{
+  RMatlabShmHeader *hdr = (RMatlabShmHeader *) segment;
+
+  if(!hdr || size < sizeof(RMatlabShmHeader)
+       || hdr->magic != RMATLAB_SHM_MAGIC || hdr->version != RMATLAB_SHM_VERSION
+       || hdr->ndims < 1 || hdr->ndims > RMATLAB_SHM_MAX_DIMS
+       || RMatlabShm_elementSize(hdr->type) == 0
+       || RMatlabShm_segmentSize(hdr->type, hdr->length) > size)
+    return(NULL);
+
+  return(hdr);
+}
+
+
+/*
+  Make certain R's segment has at least size bytes, replacing it
+  with a new, larger one if necessary.  Returns NULL if this fails.
+*/
+void *
+RMatlabShm_reserve(RMatlabShmSegment *seg, size_t size)
+{
+  if(seg->segment && seg->size >= size)
+    return(seg->segment);
+
+  RMatlabShm_release(seg);
+
+    /* Leave some room to grow. */
+  size += size / 4;
+  seg->segment = RMatlabShm_create(RMatlabShm_uniqueName(seg->name, sizeof(seg->name)), size);
+  if(!seg->segment)
+    return(NULL);
+  seg->size = size;
+  seg->unlinked = 0;
+
+  return(seg->segment);
+}
+
+/*
+  Called once the Matlab side has used the segment, and so has mapped it.
+*/
+void
+RMatlabShm_mapped(RMatlabShmSegment *seg)
+{
+  if(!seg->unlinked) {
+    RMatlabShm_unlink(seg->name);
+    seg->unlinked = 1;
+  }
+}
+
+void
+RMatlabShm_release(RMatlabShmSegment *seg)
+{
+  if(!seg->segment)
+    return;
+
+  RMatlabShm_close(seg->segment, seg->size);
+  if(!seg->unlinked)
+    RMatlabShm_unlink(seg->name);
+  seg->segment = NULL;
+  seg->size = 0;
+}
+
+
+/*
+  Map the segment R named, unless it is the one we already have mapped.
+  Returns NULL if we cannot.
+*/
+RMatlabShmHeader *
+RMatlabShm_map(RMatlabShmMapping *m, const char *name)
+{
+  if(!m->segment || strcmp(name, m->name) != 0) {
+    RMatlabShm_unmap(m);
+    m->segment = RMatlabShm_open(name, &m->size);
+    if(!m->segment)
+      return(NULL);
+    snprintf(m->name, sizeof(m->name), "%s", name);
+  }
+
+  return((RMatlabShmHeader *) m->segment);
+}
+
+void
+RMatlabShm_unmap(RMatlabShmMapping *m)
+{
+  RMatlabShm_close(m->segment, m->size);
+  m->segment = NULL;
+  m->size = 0;
+  m->name[0] = '\0';
+}
+
+/*
+  The header for the array Matlab writes into the mapped segment for R, or
+  NULL if it doesn't fit, in which case we record the size we need for R.
+*/
+RMatlabShmHeader *
+RMatlabShm_reply(RMatlabShmMapping *m, int type, int ndims, const long long *dims)
+{
+  long long length = 1;
+  size_t size;
+  int i;
+
+  for(i = 0; i < ndims; i++)
+    length *= dims[i];
+
+  size = RMatlabShm_segmentSize(type, length);
+  if(size > m->size) {
+    ((RMatlabShmHeader *) m->segment)->needed = size;
+    return(NULL);
+  }
+
+  return(RMatlabShm_initHeader(m->segment, type, ndims, dims));
+}
@@ -0,0 +1,347 @@
+#include "RMatlabConvert.h"
+#include <Rdefines.h>
+#include <Rversion.h>
+
+#include <string.h>
+#include <stdint.h>
+
+/*
+ Support for synchronizing R values with the Matlab workspace.
+
+ When the caller of .MatlabPut() asks for it, we remember a content hash
+ of each value we assign to a Matlab variable, keyed by the engine,
+ the workspace and the name of the variable.  If the same value is
+ assigned again, we skip the conversion and the transfer altogether.
+
+ We also hold a weak reference to the R object we sent and mark it as
+ not mutable. If the caller passes the very same object again, any
+ modification of it in R would have made a new copy, so we don't even
+ need to compute the hash.
+
+ We cannot see assignments made on the Matlab side (e.g. via .MatlabEval()),
+ so callers must use .MatlabSyncReset() if they modify these variables there.
+*/
+
+typedef struct _RMatlabSyncEntry {
+  void *engine;
+  char *where;
+  char *name;
+
+  SEXP ref;                /* weak reference to the last value we sent. */
+  int type;
+  R_xlen_t length;
+  RMatlabHash hash;
+
+  struct _RMatlabSyncEntry *next;
+} RMatlabSyncEntry;
+
+static RMatlabSyncEntry *SyncEntries = NULL;
+
+
+/*
+  A fast, non-cryptographic hash of a block of memory.
+  We process 32 bytes at a time in 4 independent lanes so that the
+  multiplications can overlap, and then combine the lanes.
+*/
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+hashRound(uint64_t acc, uint64_t w)
+{
+  acc += w * HASH_PRIME2;
+  acc = ROTL64(acc, 31);
+  return(acc * HASH_PRIME1);
+}
+
+RMatlabHash
+RMatlab_hashBytes(const void *data, size_t len, RMatlabHash seed)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + len;
+  uint64_t h, w;
+
+  if(len >= 32) {
+    uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2,
+             v2 = seed + HASH_PRIME2,
+             v3 = seed,
+             v4 = seed - HASH_PRIME1;
+
+    for( ; p + 32 <= end; p += 32) {
+      memcpy(&w, p, 8);      v1 = hashRound(v1, w);
+      memcpy(&w, p + 8, 8);  v2 = hashRound(v2, w);
+      memcpy(&w, p + 16, 8); v3 = hashRound(v3, w);
+      memcpy(&w, p + 24, 8); v4 = hashRound(v4, w);
+    }
+    h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+  } else
+    h = seed + HASH_PRIME3;
+
+  h += (uint64_t) len;
+
+  for( ; p + 8 <= end; p += 8) {
+    memcpy(&w, p, 8);
+    h ^= hashRound(0, w);
+    h = ROTL64(h, 27) * HASH_PRIME1 + HASH_PRIME3;
+  }
+  for( ; p < end; p++) {
+    h ^= (*p) * HASH_PRIME3;
+    h = ROTL64(h, 11) * HASH_PRIME1;
+  }
+
+  /* Final avalanche. */
+  h ^= h >> 33;
+  h *= HASH_PRIME2;
+  h ^= h >> 29;
+  h *= HASH_PRIME3;
+  h ^= h >> 32;
+
+  return(h);
+}
+
+
+/*
+  Hash the contents of an R object, including its attributes
+  (e.g. dim, names, class).  Strings are hashed by their contents
+  so that the value is the same across R sessions.
+  Things we cannot sensibly hash by value (environments, closures, external pointers)
+  are hashed by their address.
+*/
+RMatlabHash
+RMatlab_hashRObject(SEXP obj, RMatlabHash h)
+{
+  R_xlen_t i, n;
+  int type = TYPEOF(obj);
+
+  h = RMatlab_hashBytes(&type, sizeof(type), h);
+
+  switch(type) {
+    case NILSXP:
+      return(h);
+    case LGLSXP:
+      h = RMatlab_hashBytes(LOGICAL(obj), XLENGTH(obj) * sizeof(int), h);
+      break;
+    case INTSXP:
+      h = RMatlab_hashBytes(INTEGER(obj), XLENGTH(obj) * sizeof(int), h);
+      break;
+    case REALSXP:
+      h = RMatlab_hashBytes(REAL(obj), XLENGTH(obj) * sizeof(double), h);
+      break;
+    case CPLXSXP:
+      h = RMatlab_hashBytes(COMPLEX(obj), XLENGTH(obj) * sizeof(Rcomplex), h);
+      break;
+    case RAWSXP:
+      h = RMatlab_hashBytes(RAW(obj), XLENGTH(obj), h);
+      break;
+    case CHARSXP:
+      h = RMatlab_hashBytes(CHAR(obj), LENGTH(obj), h);
+      break;
+    case SYMSXP:
+      h = RMatlab_hashRObject(PRINTNAME(obj), h);
+      break;
+    case STRSXP:
+      n = XLENGTH(obj);
+      for(i = 0; i < n; i++) {
+        SEXP el = STRING_ELT(obj, i);
+        if(el == NA_STRING)
+          h = RMatlab_hashBytes("\0NA", 3, h);
+        else
+          h = RMatlab_hashBytes(CHAR(el), LENGTH(el) + 1, h);
+      }
+      break;
+    case VECSXP:
+    case EXPRSXP:
+      n = XLENGTH(obj);
+      for(i = 0; i < n; i++)
+        h = RMatlab_hashRObject(VECTOR_ELT(obj, i), h);
+      break;
+    case LISTSXP:
+    case LANGSXP:
+      for( ; obj != R_NilValue; obj = CDR(obj)) {
+        h = RMatlab_hashRObject(TAG(obj), h);
+        h = RMatlab_hashRObject(CAR(obj), h);
+      }
+      return(h);
+    default:
+      h = RMatlab_hashBytes(&obj, sizeof(SEXP), h);
+      return(h);
+  }
+
+  if(ATTRIB(obj) != R_NilValue)
+    h = RMatlab_hashRObject(ATTRIB(obj), h);
+
+  return(h);
+}
+
+
+static RMatlabSyncEntry *
+findSyncEntry(void *engine, const char *where, const char *name, RMatlabSyncEntry **prev)
+{
+  RMatlabSyncEntry *ptr, *last = NULL;
+
+  for(ptr = SyncEntries; ptr; last = ptr, ptr = ptr->next) {
+    if(ptr->engine == engine && strcmp(ptr->name, name) == 0
+         && strcmp(ptr->where, where) == 0) {
+      if(prev)
+        *prev = last;
+      return(ptr);
+    }
+  }
+
+  return(NULL);
+}
+
+static void
+freeSyncEntry(RMatlabSyncEntry *entry)
+{
+  if(entry->ref != R_NilValue)
+    R_ReleaseObject(entry->ref);
+  free(entry->name);
+  free(entry->where);
+  free(entry);
+}
+
+/*
+  Hold a weak reference to val as the value we last sent for this entry.
+*/
+static void
+setSyncReference(RMatlabSyncEntry *entry, SEXP val)
+{
+  if(entry->ref != R_NilValue)
+    R_ReleaseObject(entry->ref);
+
+    /* Any modification of val in R now has to make a copy, so if we
+       see the same object again, it has the same contents. */
+#if R_VERSION >= R_Version(3, 1, 0)
+  MARK_NOT_MUTABLE(val);
+#else
+  SET_NAMED(val, 2);
+#endif
+  entry->ref = R_MakeWeakRef(val, R_NilValue, R_NilValue, FALSE);
+  R_PreserveObject(entry->ref);
+}
+
+/*
+  Remember the value val as the current value of the variable name
+  in the given engine & workspace.
+*/
+void
+RMatlab_syncRecord(void *engine, const char *where, const char *name, SEXP val, RMatlabHash hash)
+{
+  RMatlabSyncEntry *entry;
+
+  entry = findSyncEntry(engine, where, name, NULL);
+  if(!entry) {
+    entry = (RMatlabSyncEntry *) calloc(1, sizeof(RMatlabSyncEntry));
+    entry->engine = engine;
+    entry->where = strdup(where);
+    entry->name = strdup(name);
+    entry->ref = R_NilValue;
+    entry->next = SyncEntries;
+    SyncEntries = entry;
+  }
+
+  entry->type = TYPEOF(val);
+  entry->length = Rf_xlength(val);
+  entry->hash = hash;
+  setSyncReference(entry, val);
+}
+
+/*
+  Determine whether the Matlab variable already holds the value val,
+  as far as we know. If the object is not the one we sent but has the same
+  contents, we update our reference to it.
+  The hash of val is returned via hash if we had to compute it so that
+  the caller can record it without computing it again.
+*/
+int
+RMatlab_syncIsCurrent(void *engine, const char *where, const char *name, SEXP val, RMatlabHash *hash)
+{
+  RMatlabSyncEntry *entry;
+
+  *hash = 0;
+  entry = findSyncEntry(engine, where, name, NULL);
+
+  if(entry && entry->ref != R_NilValue && R_WeakRefKey(entry->ref) == val)
+    return(1);
+
+  *hash = RMatlab_hashRObject(val, 0);
+
+  if(!entry || entry->type != TYPEOF(val) || entry->length != Rf_xlength(val)
+       || entry->hash != *hash)
+    return(0);
+
+  setSyncReference(entry, val);
+  return(1);
+}
+
+/*
+  Discard what we know about the variable name in the workspace where,
+  or in all the workspaces if where is NULL, or about all the variables
+  in these workspaces of that engine if name is NULL.
+*/
+void
+RMatlab_syncForget(void *engine, const char *where, const char *name)
+{
+  RMatlabSyncEntry *ptr, *prev = NULL, *next;
+
+  for(ptr = SyncEntries; ptr; ptr = next) {
+    next = ptr->next;
+    if(ptr->engine == engine && (!where || strcmp(ptr->where, where) == 0)
+        && (!name || strcmp(ptr->name, name) == 0)) {
+      if(prev)
+        prev->next = next;
+      else
+        SyncEntries = next;
+      freeSyncEntry(ptr);
+    } else
+      prev = ptr;
+  }
+}
+
+
+/*
+  Entry point for .MatlabSyncReset() and .MatlabRemove().
+  If names is empty, we forget all the variables in that engine,
+  and if where is empty, the variables in all its workspaces.
+*/
+SEXP
+RMatlab_syncReset(SEXP names, SEXP where, SEXP engine)
+{
+  void *eng = NULL;
+  const char *whereName = NULL;
+  int i, n;
+
+  if(TYPEOF(engine) == EXTPTRSXP)
+    eng = R_ExternalPtrAddr(engine);
+  if(Rf_length(where))
+    whereName = CHAR(STRING_ELT(where, 0));
+
+  n = Rf_length(names);
+  if(n == 0)
+    RMatlab_syncForget(eng, whereName, NULL);
+
+  for(i = 0; i < n; i++)
+    RMatlab_syncForget(eng, whereName, CHAR(STRING_ELT(names, i)));
+
+  return(R_NilValue);
+}
+
+
+/*
+  Entry point to compute the hash of an R object, e.g. for the keys
+  in the cache of results of function calls (see cache.R).
+  Returns the hash as a string of hexadecimal digits.
+*/
+SEXP
+RMatlab_hashObject(SEXP obj)
+{
+  char buf[2 * sizeof(RMatlabHash) + 1];
+
+  sprintf(buf, "%016llx", RMatlab_hashRObject(obj, 0));
+  return(mkString(buf));
+}
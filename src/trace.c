@@ -0,0 +1,356 @@
+#include "RMatlabTrace.h"
+
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+ The ring buffer of trace events.  See RMatlabTrace.h.
+*/
+
+  /* The trace used by the code in this shared library. */
+static RMatlabTrace *Current = NULL;
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static unsigned long
+threadId()
+{
+#if defined(__linux__) && defined(SYS_gettid)
+  return((unsigned long) syscall(SYS_gettid));
+#else
+  return((unsigned long) (uintptr_t) pthread_self());
+#endif
+}
+
+
+RMatlabTrace *
+RMatlab_traceCreate(size_t capacity)
+{
+  RMatlabTrace *trace;
+
+  trace = (RMatlabTrace *) calloc(1, sizeof(RMatlabTrace));
+  if(!trace)
+    return(NULL);
+
+  trace->events = (RMatlabTraceEvent *) calloc(capacity, sizeof(RMatlabTraceEvent));
+  if(!trace->events) {
+    free(trace);
+    return(NULL);
+  }
+
+  trace->magic = RMATLAB_TRACE_MAGIC;
+  trace->capacity = capacity;
+  trace->start = now();
+  trace->enabled = 1;
+
+  return(trace);
+}
+
+/*
+  Make the trace available to the other MEX files via the Matlab global variable.
+  This must be called on Matlab's thread.
+*/
+void
+RMatlab_tracePublish(RMatlabTrace *trace)
+{
+  mxArray *ptr;
+
+  ptr = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+  *((unsigned long long *) mxGetData(ptr)) = (unsigned long long) (uintptr_t) trace;
+  mexPutVariable("global", RMATLAB_TRACE_VARIABLE, ptr);
+  mxDestroyArray(ptr);
+}
+
+/*
+  Use the trace published in Matlab, if there is one.
+  This must be called on Matlab's thread.
+*/
+void
+RMatlab_traceUseShared()
+{
+  const mxArray *ptr;
+  RMatlabTrace *trace = NULL;
+
+  ptr = mexGetVariablePtr("global", RMATLAB_TRACE_VARIABLE);
+  if(ptr && mxGetClassID(ptr) == mxUINT64_CLASS && mxGetNumberOfElements(ptr) == 1) {
+    trace = (RMatlabTrace *) (uintptr_t) *((unsigned long long *) mxGetData(ptr));
+    if(trace && trace->magic != RMATLAB_TRACE_MAGIC)
+      trace = NULL;
+  }
+
+  Current = trace;
+}
+
+void
+RMatlab_traceUse(RMatlabTrace *trace)
+{
+  Current = trace;
+}
+
+RMatlabTrace *
+RMatlab_traceCurrent()
+{
+  return(Current);
+}
+
+
+/*
+  The time to pass to RMatlab_traceEnd(), or -1 if we are not tracing.
+*/
+double
+RMatlab_traceBegin()
+{
+  RMatlabTrace *trace = Current;
+
+  if(!trace || !trace->enabled)
+    return(-1);
+
+  return((now() - trace->start) * 1e6);
+}
+
+void
+RMatlab_traceEnd(double begin, const char *name, const char *detail, double bytes)
+{
+  RMatlabTrace *trace = Current;
+  RMatlabTraceEvent *ev;
+  size_t pos;
+
+  if(begin < 0 || !trace)
+    return;
+
+  pos = __sync_fetch_and_add(&trace->next, 1);
+  ev = trace->events + pos % trace->capacity;
+
+  ev->seq = 0;
+  __sync_synchronize();
+
+  ev->begin = begin;
+  ev->end = (now() - trace->start) * 1e6;
+  ev->bytes = bytes;
+  ev->thread = threadId();
+  snprintf(ev->name, sizeof(ev->name), "%s", name);
+  snprintf(ev->detail, sizeof(ev->detail), "%s", detail ? detail : "");
+
+  __sync_synchronize();
+  ev->seq = pos + 1;
+}
+
+
+static void
+writeString(FILE *f, const char *str)
+{
+  fputc('"', f);
+  for( ; *str; str++) {
+    if(*str == '"' || *str == '\\')
+      fprintf(f, "\\%c", *str);
+    else if((unsigned char) *str < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char) *str);
+    else
+      fputc(*str, f);
+  }
+  fputc('"', f);
+}
+
+/*
+  Write the events in the buffer to the file in Chrome's trace event format,
+  as complete ("X") events.  Returns the number of events or -1 if the file
+  cannot be opened.
+*/
+int
+RMatlab_traceWrite(RMatlabTrace *trace, const char *fileName)
+{
+  RMatlabTraceEvent *ev;
+  size_t first, last, pos;
+  int count = 0;
+  FILE *f;
+
+  if(!trace || !(f = fopen(fileName, "w")))
+    return(-1);
+
+  last = trace->next;
+  first = last > trace->capacity ? last - trace->capacity : 0;
+
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for(pos = first; pos < last; pos++) {
+    ev = trace->events + pos % trace->capacity;
+      /* Skip the events still being recorded or overwritten since we started. */
+    if(ev->seq != pos + 1)
+      continue;
+
+    fprintf(f, "%s  {\"ph\": \"X\", \"cat\": \"RMatlab\", \"name\": ", count ? ",\n" : "");
+    writeString(f, ev->name);
+    fprintf(f, ", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %lu, \"args\": {",
+              ev->begin, ev->end - ev->begin, (int) getpid(), ev->thread);
+    fprintf(f, "\"detail\": ");
+    writeString(f, ev->detail);
+    if(ev->bytes >= 0)
+      fprintf(f, ", \"bytes\": %.0f", ev->bytes);
+    fprintf(f, "}}");
+    count++;
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+
+  return(count);
+}
+
+/*
+  If RMATLAB_TRACE_DIR is set, write the trace to RMatlab-<pid>.json in that directory.
+*/
+int
+RMatlab_traceWriteToDir(RMatlabTrace *trace)
+{
+  const char *dir = getenv("RMATLAB_TRACE_DIR");
+  char fileName[1024];
+
+  if(!trace || !dir || !dir[0])
+    return(-1);
+
+  snprintf(fileName, sizeof(fileName), "%s/RMatlab-%d.json", dir, (int) getpid());
+  return(RMatlab_traceWrite(trace, fileName));
+}
+
+
+/*
+  The size of the data in a Matlab array or R object, for the trace.
+*/
+double
+RMatlab_traceArrayBytes(const mxArray *val)
+{
+  double total = 0;
+  int i, j, n, nfields;
+
+  if(!val)
+    return(0);
+
+  n = mxGetNumberOfElements(val);
+  if(mxIsCell(val)) {
+    for(i = 0; i < n; i++)
+      total += RMatlab_traceArrayBytes(mxGetCell(val, i));
+  } else if(mxIsStruct(val)) {
+    nfields = mxGetNumberOfFields(val);
+    for(i = 0; i < n; i++)
+      for(j = 0; j < nfields; j++)
+        total += RMatlab_traceArrayBytes(mxGetFieldByNumber(val, i, j));
+  } else
+#if MX_HAS_INTERLEAVED_COMPLEX
+    total = (double) n * mxGetElementSize(val);
+#else
+    total = (double) n * mxGetElementSize(val) * (mxIsComplex(val) ? 2 : 1);
+#endif
+
+  return(total);
+}
+
+double
+RMatlab_traceRBytes(SEXP val)
+{
+  double total = 0;
+  R_xlen_t i, n;
+
+  switch(TYPEOF(val)) {
+    case LGLSXP:
+    case INTSXP:
+      return((double) XLENGTH(val) * sizeof(int));
+    case REALSXP:
+      return((double) XLENGTH(val) * sizeof(double));
+    case CPLXSXP:
+      return((double) XLENGTH(val) * sizeof(Rcomplex));
+    case RAWSXP:
+      return((double) XLENGTH(val));
+    case STRSXP:
+      n = XLENGTH(val);
+      for(i = 0; i < n; i++)
+        total += LENGTH(STRING_ELT(val, i));
+      return(total);
+    case VECSXP:
+      n = XLENGTH(val);
+      for(i = 0; i < n; i++)
+        total += RMatlab_traceRBytes(VECTOR_ELT(val, i));
+      return(total);
+    default:
+      return(0);
+  }
+}
+
+
+static void
+writeAtExit()
+{
+  RMatlab_traceWriteToDir(Current);
+}
+
+/*
+  Called from R via .MatlabTrace() to turn tracing on or off (enable is
+  TRUE or FALSE, or NA to leave it as it is) and write the trace to file,
+  if this is not empty.  mex is TRUE if R is running inside Matlab.
+  Then we use the trace Matlab shares, or create one and share it
+  so that the MEX files record into it too.  Otherwise, RMatlab.so keeps
+  its own and, if RMATLAB_TRACE_DIR is set, writes it there when R exits.
+  Returns whether tracing is on, the number of events in the buffer
+  and the number written to the file.
+*/
+SEXP
+RMatlab_traceControl(SEXP enable, SEXP file, SEXP size, SEXP mex)
+{
+  static const char *names[] = {"enabled", "events", "written"};
+  RMatlabTrace *trace;
+  int on = LOGICAL(enable)[0], written = 0, i;
+  SEXP ans, tmp;
+
+  if(LOGICAL(mex)[0])
+    RMatlab_traceUseShared();
+  trace = Current;
+
+  if(on == TRUE && !trace) {
+    if(!(trace = RMatlab_traceCreate(Rf_asInteger(size) > 0 ? Rf_asInteger(size) : RMATLAB_TRACE_SIZE))) {
+      PROBLEM "Cannot allocate the trace buffer"
+      ERROR;
+    }
+    if(LOGICAL(mex)[0])
+      RMatlab_tracePublish(trace);
+    else if(getenv("RMATLAB_TRACE_DIR"))
+      atexit(writeAtExit);
+    Current = trace;
+  }
+
+  if(trace && on != NA_LOGICAL)
+    trace->enabled = on;
+
+  if(Rf_length(file) && CHAR(STRING_ELT(file, 0))[0]) {
+    written = RMatlab_traceWrite(trace, CHAR(STRING_ELT(file, 0)));
+    if(written < 0) {
+      PROBLEM "Cannot write the trace to %s", CHAR(STRING_ELT(file, 0))
+      ERROR;
+    }
+  }
+
+  PROTECT(ans = allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(ans, 0, ScalarLogical(trace && trace->enabled));
+  SET_VECTOR_ELT(ans, 1, ScalarReal(!trace ? 0 : (double) (trace->next < trace->capacity ? trace->next : trace->capacity)));
+  SET_VECTOR_ELT(ans, 2, ScalarInteger(written));
+  PROTECT(tmp = allocVector(STRSXP, 3));
+  for(i = 0; i < 3; i++)
+    SET_STRING_ELT(tmp, i, mkChar(names[i]));
+  SET_NAMES(ans, tmp);
+  UNPROTECT(2);
+
+  return(ans);
+}
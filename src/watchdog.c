@@ -0,0 +1,182 @@
+#include "RMatlabWatchdog.h"
+
+#include <Rinterface.h> /* for R_interrupts_pending */
+
+#include <errno.h>
+#include <sys/time.h>
+
+/*
+ The watchdog thread used to bound the time of calls between R and Matlab
+ and to cancel them.  This is used by RMatlab.so for calls to the Matlab
+ engine (where fire sends Matlab an interrupt) and by callR, callNamedR and
+ the R worker thread for calls to R (where fire sets R_interrupts_pending
+ so that R raises an interrupt at its next check).
+
+ The watchdog wakes up every POLL_INTERVAL seconds to call poll, if given.
+*/
+
+#define POLL_INTERVAL 0.05
+
+
+static void
+deadlineAfter(struct timespec *when, double secs)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  when->tv_sec = now.tv_sec + (time_t) secs;
+  when->tv_nsec = now.tv_usec * 1000 + (long) ((secs - (time_t) secs) * 1e9);
+  if(when->tv_nsec >= 1000000000) {
+    when->tv_sec++;
+    when->tv_nsec -= 1000000000;
+  }
+}
+
+static double
+elapsedSince(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return((now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) * 1e-6);
+}
+
+static void *
+watchdogMain(void *data)
+{
+  RMatlabWatchdog *dog = (RMatlabWatchdog *) data;
+  struct timeval start, firedAt;
+  struct timespec wakeup;
+  RMatlabCancelReason reason;
+
+  gettimeofday(&start, NULL);
+  firedAt = start;
+
+  pthread_mutex_lock(&dog->lock);
+  while(!dog->done) {
+    deadlineAfter(&wakeup, POLL_INTERVAL);
+    if(pthread_cond_timedwait(&dog->finished, &dog->lock, &wakeup) != ETIMEDOUT || dog->done)
+      continue;
+
+    if(dog->reason == RMATLAB_NOT_CANCELLED) {
+      reason = RMATLAB_NOT_CANCELLED;
+      if(dog->timeout >= 0 && elapsedSince(&start) >= dog->timeout)
+        reason = RMATLAB_TIMED_OUT;
+      else if(dog->poll && dog->poll(dog->data))
+        reason = RMATLAB_INTERRUPTED;
+
+      if(reason != RMATLAB_NOT_CANCELLED) {
+        dog->reason = reason;
+        gettimeofday(&firedAt, NULL);
+        dog->fire(dog->data, reason, 0);
+      }
+    } else if(!dog->escalated && dog->grace >= 0 && elapsedSince(&firedAt) >= dog->grace) {
+      dog->escalated = 1;
+      dog->fire(dog->data, dog->reason, 1);
+    }
+  }
+  pthread_mutex_unlock(&dog->lock);
+
+  return(NULL);
+}
+
+
+/*
+  Start watching a call.  If there is neither a timeout nor a poll function,
+  there is nothing to do and we don't create the thread.
+  Returns 0 if the thread could not be created.
+*/
+int
+RMatlabWatchdog_start(RMatlabWatchdog *dog, double timeout, double grace,
+                       RMatlabWatchdogFire fire, RMatlabWatchdogPoll poll, void *data)
+{
+  dog->timeout = timeout;
+  dog->grace = grace;
+  dog->fire = fire;
+  dog->poll = poll;
+  dog->data = data;
+  dog->done = 0;
+  dog->reason = RMATLAB_NOT_CANCELLED;
+  dog->escalated = 0;
+  dog->running = 0;
+
+  if(timeout < 0 && !poll)
+    return(1);
+
+  pthread_mutex_init(&dog->lock, NULL);
+  pthread_cond_init(&dog->finished, NULL);
+  if(pthread_create(&dog->thread, NULL, watchdogMain, dog) != 0)
+    return(0);
+
+  dog->running = 1;
+  return(1);
+}
+
+/*
+  The call has returned. Stop the watchdog and report whether it fired.
+*/
+RMatlabCancelReason
+RMatlabWatchdog_stop(RMatlabWatchdog *dog)
+{
+  if(!dog->running)
+    return(RMATLAB_NOT_CANCELLED);
+
+  pthread_mutex_lock(&dog->lock);
+  dog->done = 1;
+  pthread_cond_signal(&dog->finished);
+  pthread_mutex_unlock(&dog->lock);
+
+  pthread_join(dog->thread, NULL);
+  pthread_mutex_destroy(&dog->lock);
+  pthread_cond_destroy(&dog->finished);
+  dog->running = 0;
+
+  return(dog->reason);
+}
+
+
+static void
+interruptR(void *data, RMatlabCancelReason reason, int escalate)
+{
+  R_interrupts_pending = TRUE;
+}
+
+/*
+  Evaluate the R call as R_tryEval() does, but interrupt it if it runs for
+  longer than the number of seconds given by the R option RMatlab.callTimeout.
+  Ctrl-C in Matlab doesn't interrupt the call: Matlab has no documented
+  way for a MEX file to ask whether the user has pressed it.
+  reason reports whether the call was cancelled.
+  R unwinds the call as for any other error, so the caller just has to
+  deal with errorOccurred.
+*/
+SEXP
+RMatlab_tryEvalWithTimeout(SEXP e, SEXP env, int *errorOccurred, RMatlabCancelReason *reason)
+{
+  static SEXP optionSym = NULL;
+  RMatlabWatchdog dog;
+  double timeout = -1;
+  SEXP opt, ans;
+
+  if(!optionSym)
+    optionSym = Rf_install("RMatlab.callTimeout");
+
+  opt = Rf_GetOption1(optionSym);
+  if(Rf_isNumeric(opt) && Rf_length(opt) && R_FINITE(Rf_asReal(opt)) && Rf_asReal(opt) >= 0)
+    timeout = Rf_asReal(opt);
+
+    /* If we can't start the watchdog, we just evaluate the call. */
+  RMatlabWatchdog_start(&dog, timeout, -1, interruptR, NULL, NULL);
+
+  ans = R_tryEval(e, env, errorOccurred);
+  *reason = RMatlabWatchdog_stop(&dog);
+
+  if(*reason != RMATLAB_NOT_CANCELLED) {
+      /* In case the call finished before R noticed the interrupt. */
+    R_interrupts_pending = FALSE;
+    if(!*errorOccurred)
+      *reason = RMATLAB_NOT_CANCELLED;
+  }
+
+  return(ans);
+}
@@ -0,0 +1,478 @@
+#include "RMatlabBroker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ Sending Matlab arrays between the broker and its clients.
+ This is used by both the broker and RMatlab.so and so uses only
+ the mx routines, not R or the engine.
+
+ An array is sent as
+   class id (-1 for a NULL or an array we cannot send),
+   complexity, number of dimensions, the dimensions as 64 bit integers
+ followed by
+   cell:    each element, recursively
+   struct:  number of fields, the field names, then each field of each element
+   otherwise: the real and then (if complex) the imaginary data, as in Matlab's
+              separate complex storage (see putComplexParts()).
+ Sparse matrices, function handles and objects are sent as NULL.
+ The dimensions are 64 bit whatever the width of mwSize on either side,
+ and a side whose mwSize is an int (Matlab before 7.3) fails to read an
+ array with a dimension it cannot hold.
+*/
+
+#define WIRE_BUFFER_SIZE   65536
+#define WIRE_MAX_DIMS      64
+
+void
+RMatlabWire_init(RMatlabWire *w, int fd)
+{
+  w->fd = fd;
+  w->failed = 0;
+  w->inLen = w->inPos = w->outLen = 0;
+  w->capacity = WIRE_BUFFER_SIZE;
+  w->in = (char *) malloc(w->capacity);
+  w->out = (char *) malloc(w->capacity);
+  if(!w->in || !w->out)
+    w->failed = 1;
+}
+
+void
+RMatlabWire_free(RMatlabWire *w)
+{
+  free(w->in);
+  free(w->out);
+  w->in = w->out = NULL;
+}
+
+
+static int
+writeAll(int fd, const char *ptr, size_t n)
+{
+  ssize_t count;
+
+  while(n > 0) {
+      /* MSG_NOSIGNAL so that a peer that has gone away doesn't kill us with SIGPIPE. */
+    count = send(fd, ptr, n, MSG_NOSIGNAL);
+    if(count < 0 && errno == EINTR)
+      continue;
+    if(count <= 0)
+      return(-1);
+    ptr += count;
+    n -= count;
+  }
+  return(0);
+}
+
+static int
+readAll(int fd, char *ptr, size_t n)
+{
+  ssize_t count;
+
+  while(n > 0) {
+    count = read(fd, ptr, n);
+    if(count < 0 && errno == EINTR)
+      continue;
+    if(count <= 0)
+      return(-1);
+    ptr += count;
+    n -= count;
+  }
+  return(0);
+}
+
+
+int
+RMatlabWire_flush(RMatlabWire *w)
+{
+  if(!w->failed && w->outLen > 0 && writeAll(w->fd, w->out, w->outLen) < 0)
+    w->failed = 1;
+  w->outLen = 0;
+
+  return(w->failed ? -1 : 0);
+}
+
+static void
+putBytes(RMatlabWire *w, const void *data, size_t n)
+{
+  if(w->failed)
+    return;
+
+    /* Large blocks go straight to the socket rather than through the buffer. */
+  if(w->outLen + n > w->capacity) {
+    RMatlabWire_flush(w);
+    if(n >= w->capacity) {
+      if(!w->failed && writeAll(w->fd, (const char *) data, n) < 0)
+        w->failed = 1;
+      return;
+    }
+  }
+
+  memcpy(w->out + w->outLen, data, n);
+  w->outLen += n;
+}
+
+static void
+getBytes(RMatlabWire *w, void *data, size_t n)
+{
+  size_t avail;
+  ssize_t count;
+
+  if(w->failed)
+    return;
+
+  avail = w->inLen - w->inPos;
+  if(avail >= n) {
+    memcpy(data, w->in + w->inPos, n);
+    w->inPos += n;
+    return;
+  }
+
+  memcpy(data, w->in + w->inPos, avail);
+  data = (char *) data + avail;
+  n -= avail;
+  w->inLen = w->inPos = 0;
+
+  if(n >= w->capacity) {
+    if(readAll(w->fd, (char *) data, n) < 0)
+      w->failed = 1;
+    return;
+  }
+
+    /* Read what we need and whatever else has arrived. */
+  while(w->inLen < n) {
+    count = read(w->fd, w->in + w->inLen, w->capacity - w->inLen);
+    if(count < 0 && errno == EINTR)
+      continue;
+    if(count <= 0) {
+      w->failed = 1;
+      return;
+    }
+    w->inLen += count;
+  }
+  memcpy(data, w->in, n);
+  w->inPos = n;
+}
+
+
+void
+RMatlabWire_putInt(RMatlabWire *w, int val)
+{
+  putBytes(w, &val, sizeof(val));
+}
+
+int
+RMatlabWire_getInt(RMatlabWire *w)
+{
+  int val = 0;
+
+  getBytes(w, &val, sizeof(val));
+  return(w->failed ? -1 : val);
+}
+
+static void
+putSize(RMatlabWire *w, size_t val)
+{
+  long long tmp = (long long) val;
+
+  putBytes(w, &tmp, sizeof(tmp));
+}
+
+static long long
+getSize(RMatlabWire *w)
+{
+  long long val = 0;
+
+  getBytes(w, &val, sizeof(val));
+  return(w->failed ? -1 : val);
+}
+
+void
+RMatlabWire_putString(RMatlabWire *w, const char *str)
+{
+  int n = strlen(str);
+
+  RMatlabWire_putInt(w, n);
+  putBytes(w, str, n);
+}
+
+char *
+RMatlabWire_getString(RMatlabWire *w)
+{
+  int n;
+  char *str;
+
+  n = RMatlabWire_getInt(w);
+  if(w->failed || n < 0 || !(str = (char *) malloc(n + 1))) {
+    w->failed = 1;
+    return(NULL);
+  }
+
+  getBytes(w, str, n);
+  str[n] = '\0';
+  if(w->failed) {
+    free(str);
+    return(NULL);
+  }
+
+  return(str);
+}
+
+
+static int
+canSend(const mxArray *val)
+{
+  if(!val || mxIsSparse(val) || mxGetNumberOfDimensions(val) > WIRE_MAX_DIMS)
+    return(0);
+
+  switch(mxGetClassID(val)) {
+    case mxCELL_CLASS:
+    case mxSTRUCT_CLASS:
+    case mxLOGICAL_CLASS:
+    case mxCHAR_CLASS:
+    case mxDOUBLE_CLASS:
+    case mxSINGLE_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+      return(1);
+    default:
+      return(0);
+  }
+}
+
+#if MX_HAS_INTERLEAVED_COMPLEX
+/*
+  The wire has the real parts followed by the imaginary parts, as the broker
+  is built with Matlab's separate complex storage.  With the interleaved API
+  (mex -R2018a), we split the (real, imaginary) pairs into these two blocks
+  and join them again, a buffer at a time.
+*/
+#define WIRE_SPLIT_SIZE    8192
+
+static void
+putComplexParts(RMatlabWire *w, const mxArray *val)
+{
+  char buf[WIRE_SPLIT_SIZE];
+  const char *data = (const char *) mxGetData(val);
+  size_t size = mxGetElementSize(val) / 2, n = mxGetNumberOfElements(val), i, j, count;
+  int part;
+
+  for(part = 0; part < 2; part++)
+    for(i = 0; i < n; i += count) {
+      count = n - i < WIRE_SPLIT_SIZE / size ? n - i : WIRE_SPLIT_SIZE / size;
+      for(j = 0; j < count; j++)
+        memcpy(buf + j * size, data + (2 * (i + j) + part) * size, size);
+      putBytes(w, buf, count * size);
+    }
+}
+
+static void
+getComplexParts(RMatlabWire *w, mxArray *val)
+{
+  char buf[WIRE_SPLIT_SIZE];
+  char *data = (char *) mxGetData(val);
+  size_t size = mxGetElementSize(val) / 2, n = mxGetNumberOfElements(val), i, j, count;
+  int part;
+
+  for(part = 0; part < 2 && !w->failed; part++)
+    for(i = 0; i < n && !w->failed; i += count) {
+      count = n - i < WIRE_SPLIT_SIZE / size ? n - i : WIRE_SPLIT_SIZE / size;
+      getBytes(w, buf, count * size);
+      for(j = 0; j < count; j++)
+        memcpy(data + (2 * (i + j) + part) * size, buf + j * size, size);
+    }
+}
+#endif
+
+void
+RMatlabWire_putArray(RMatlabWire *w, const mxArray *val)
+{
+  int j, ndims, nfields;
+  size_t i, n;
+  const mwSize *dims;
+
+  if(!canSend(val)) {
+    RMatlabWire_putInt(w, -1);
+    return;
+  }
+
+  ndims = mxGetNumberOfDimensions(val);
+  dims = mxGetDimensions(val);
+  n = mxGetNumberOfElements(val);
+
+  RMatlabWire_putInt(w, mxGetClassID(val));
+  RMatlabWire_putInt(w, mxIsComplex(val));
+  RMatlabWire_putInt(w, ndims);
+  for(j = 0; j < ndims; j++)
+    putSize(w, dims[j]);
+
+  switch(mxGetClassID(val)) {
+    case mxCELL_CLASS:
+      for(i = 0; i < n; i++)
+        RMatlabWire_putArray(w, mxGetCell(val, i));
+      break;
+
+    case mxSTRUCT_CLASS:
+      nfields = mxGetNumberOfFields(val);
+      RMatlabWire_putInt(w, nfields);
+      for(j = 0; j < nfields; j++)
+        RMatlabWire_putString(w, mxGetFieldNameByNumber(val, j));
+      for(i = 0; i < n; i++)
+        for(j = 0; j < nfields; j++)
+          RMatlabWire_putArray(w, mxGetFieldByNumber(val, i, j));
+      break;
+
+    default:
+#if MX_HAS_INTERLEAVED_COMPLEX
+      if(mxIsComplex(val))
+        putComplexParts(w, val);
+      else
+        putBytes(w, mxGetData(val), n * mxGetElementSize(val));
+#else
+      putBytes(w, mxGetData(val), n * mxGetElementSize(val));
+      if(mxIsComplex(val))
+        putBytes(w, mxGetImagData(val), n * mxGetElementSize(val));
+#endif
+      break;
+  }
+}
+
+mxArray *
+RMatlabWire_getArray(RMatlabWire *w)
+{
+  int j, ndims, nfields, classID, isComplex;
+  size_t i, n;
+  long long dim;
+  mwSize dims[WIRE_MAX_DIMS];
+  char **names;
+  mxArray *ans;
+
+  classID = RMatlabWire_getInt(w);
+  if(w->failed || classID < 0)
+    return(NULL);
+
+  isComplex = RMatlabWire_getInt(w);
+  ndims = RMatlabWire_getInt(w);
+  if(w->failed || ndims < 2 || ndims > WIRE_MAX_DIMS) {
+    w->failed = 1;
+    return(NULL);
+  }
+  for(j = 0; j < ndims; j++) {
+    dim = getSize(w);
+    dims[j] = (mwSize) dim;
+    if(w->failed || dim < 0 || (long long) dims[j] != dim) {
+      w->failed = 1;
+      return(NULL);
+    }
+  }
+
+  switch(classID) {
+    case mxCELL_CLASS:
+      ans = mxCreateCellArray(ndims, dims);
+      if(!ans) {
+        w->failed = 1;
+        return(NULL);
+      }
+      n = mxGetNumberOfElements(ans);
+      for(i = 0; i < n && !w->failed; i++)
+        mxSetCell(ans, i, RMatlabWire_getArray(w));
+      break;
+
+    case mxSTRUCT_CLASS:
+      nfields = RMatlabWire_getInt(w);
+      if(w->failed || nfields < 0)
+        return(NULL);
+      names = (char **) calloc(nfields + 1, sizeof(char *));
+      for(j = 0; j < nfields; j++)
+        names[j] = RMatlabWire_getString(w);
+      ans = w->failed ? NULL : mxCreateStructArray(ndims, dims, nfields, (const char **) names);
+      for(j = 0; j < nfields; j++)
+        free(names[j]);
+      free(names);
+      if(!ans)
+        return(NULL);
+
+      n = mxGetNumberOfElements(ans);
+      for(i = 0; i < n && !w->failed; i++)
+        for(j = 0; j < nfields && !w->failed; j++)
+          mxSetFieldByNumber(ans, i, j, RMatlabWire_getArray(w));
+      break;
+
+    case mxCHAR_CLASS:
+      ans = mxCreateCharArray(ndims, dims);
+      if(!ans) {
+        w->failed = 1;
+        return(NULL);
+      }
+      getBytes(w, mxGetData(ans), mxGetNumberOfElements(ans) * mxGetElementSize(ans));
+      break;
+
+    case mxLOGICAL_CLASS:
+      ans = mxCreateLogicalArray(ndims, dims);
+      if(!ans) {
+        w->failed = 1;
+        return(NULL);
+      }
+      getBytes(w, mxGetData(ans), mxGetNumberOfElements(ans) * mxGetElementSize(ans));
+      break;
+
+    default:
+      ans = mxCreateNumericArray(ndims, dims, (mxClassID) classID, isComplex ? mxCOMPLEX : mxREAL);
+      if(!ans) {
+        w->failed = 1;
+        return(NULL);
+      }
+#if MX_HAS_INTERLEAVED_COMPLEX
+      if(isComplex)
+        getComplexParts(w, ans);
+      else
+        getBytes(w, mxGetData(ans), mxGetNumberOfElements(ans) * mxGetElementSize(ans));
+#else
+      getBytes(w, mxGetData(ans), mxGetNumberOfElements(ans) * mxGetElementSize(ans));
+      if(isComplex)
+        getBytes(w, mxGetImagData(ans), mxGetNumberOfElements(ans) * mxGetElementSize(ans));
+#endif
+      break;
+  }
+
+  if(w->failed) {
+    if(ans)
+      mxDestroyArray(ans);
+    return(NULL);
+  }
+
+  return(ans);
+}
+
+
+/*
+ The default location of the broker's socket:
+ $RMATLAB_BROKER, or RMatlabBroker in $XDG_RUNTIME_DIR (which only the
+ user can access), or /tmp/RMatlabBroker-<uid>.
+*/
+const char *
+RMatlab_brokerSocketPath(char *buf, size_t size)
+{
+  const char *tmp;
+
+  if((tmp = getenv("RMATLAB_BROKER")) && tmp[0])
+    snprintf(buf, size, "%s", tmp);
+  else if((tmp = getenv("XDG_RUNTIME_DIR")) && tmp[0])
+    snprintf(buf, size, "%s/%s", tmp, RMATLAB_BROKER_SOCKET);
+  else
+    snprintf(buf, size, "/tmp/%s-%d", RMATLAB_BROKER_SOCKET, (int) getuid());
+
+  return(buf);
+}
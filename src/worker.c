@@ -0,0 +1,518 @@
+#include "RMatlabWorker.h"
+#include "RMatlabWatchdog.h"
+
+#include <Rdefines.h>
+#include <Rinterface.h> /* for R_interrupts_pending */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/time.h>
+
+/*
+ The R worker thread and the queue of calls to it.
+ See RMatlabWorker.h.
+
+ The Matlab arguments are copied and made persistent when a call is
+ submitted, and converted to R on the worker thread.
+ Only the worker thread uses R.  When a call is collected, Matlab's thread
+ asks the worker to finish it (finishJob()) and waits: the worker converts
+ the result to Matlab, or describes the R error, and releases the R object.
+ The arrays are created while Matlab's thread is in the MEX function that
+ returns them, as with any MEX function.  The worker thread cannot call
+ Matlab, so factors, data frames and references come in the attribute form
+ and RMatlab_nativeArray() makes them categorical arrays, tables and
+ RReferences on Matlab's thread.
+*/
+
+
+static RMatlabJob *
+findJob(RMatlabWorker *worker, int id, RMatlabJob **prev)
+{
+  RMatlabJob *job, *p = NULL;
+
+  for(job = worker->jobs; job; p = job, job = job->next)
+    if(job->id == id)
+      break;
+
+  if(prev)
+    *prev = p;
+
+  return(job);
+}
+
+/*
+  Release everything for this job. This must be called on Matlab's thread
+  as it destroys the copies of the arguments.
+*/
+static void
+freeJob(RMatlabJob *job)
+{
+  int i;
+
+  for(i = 0; i < job->nargs; i++)
+    mxDestroyArray(job->args[i]);
+  if(job->namedArgs)
+    mxDestroyArray(job->namedArgs);
+  if(job->output)
+    mxDestroyArray(job->output);
+  free(job->args);
+  free(job->funcName);
+  free(job->errorMessage);
+  free(job->error);
+  free(job);
+}
+
+
+/*
+  Evaluate the call for this job. This is run on the worker thread
+  via R_ToplevelExec() so that any R error in converting the arguments
+  returns to us.
+*/
+static void
+evalJob(void *data)
+{
+  RMatlabJob *job = (RMatlabJob *) data;
+  SEXP e, ans;
+  int errorOccurred = 0, i;
+  RMatlabCancelReason cancelled;
+  double t0, bytes = 0;
+
+    /* The code on this thread is initializeR's, so we use the trace of the MEX file that submitted the call. */
+  RMatlab_traceUse(job->trace);
+
+  RMatlab_poolConfigure();
+    /* We cannot call Matlab from this thread, so categorical arrays and tables were made portable when submitted. */
+  RMatlab_convertConfigure(0);
+  t0 = RMatlab_traceBegin();
+  PROTECT(e = RMatlab_createRCall(job->funcName, job->nargs, (const mxArray **) job->args, job->namedArgs));
+  if(t0 >= 0) {
+    for(i = 0; i < job->nargs; i++)
+      bytes += RMatlab_traceArrayBytes(job->args[i]);
+    bytes += RMatlab_traceArrayBytes(job->namedArgs);
+    RMatlab_traceEnd(t0, "convertToR", job->funcName, bytes);
+  }
+
+  t0 = RMatlab_traceBegin();
+  ans = RMatlab_tryEvalWithTimeout(e, R_GlobalEnv, &errorOccurred, &cancelled);
+  RMatlab_traceEnd(t0, "R", job->funcName, -1);
+
+  if(errorOccurred && job->cancelled) {
+    job->errorMessage = strdup("the call was cancelled");
+    job->errorId = "RMatlab:cancelled";
+  } else if(errorOccurred && cancelled == RMATLAB_TIMED_OUT) {
+    job->errorMessage = strdup("the call exceeded the time limit (RMatlab.callTimeout)");
+    job->errorId = "RMatlab:timeout";
+  } else if(errorOccurred && cancelled == RMATLAB_INTERRUPTED) {
+    job->errorMessage = strdup("the call was interrupted");
+    job->errorId = "RMatlab:interrupted";
+  } else if(errorOccurred)
+    job->errorMessage = strdup(R_curErrorBuf());
+  else {
+      /* For an error captured as an RMatlabRError, we keep it to report the details when collected. */
+    R_PreserveObject(ans);
+    job->result = ans;
+    if(RMatlab_isRError(ans))
+      job->errorMessage = strdup("error in R");
+    RMatlab_releaseRCall(e, ans);
+  }
+
+  UNPROTECT(1);
+}
+
+/*
+  Convert the result of the call to Matlab, or describe the error in R,
+  and release the R object.  This is run on the worker thread via
+  R_ToplevelExec() while Matlab's thread waits in RMatlabWorker_collect().
+*/
+static void
+finishJob(void *data)
+{
+  RMatlabJob *job = (RMatlabJob *) data;
+  SEXP result = job->result;
+  double t0;
+
+  RMatlab_traceUse(job->trace);
+
+    /* Release it now so an R error in the conversion doesn't leave it preserved. */
+  PROTECT(result);
+  R_ReleaseObject(result);
+  job->result = NULL;
+
+  if(RMatlab_isRError(result)) {
+    job->error = (RMatlabErrorInfo *) calloc(1, sizeof(RMatlabErrorInfo));
+    RMatlab_describeRError(job->error, job->funcName, result);
+  } else {
+    RMatlab_convertConfigure(RMATLAB_CONVERT_DEFERRED);
+    t0 = RMatlab_traceBegin();
+    job->output = convertFromR(result, 1, NULL);
+    RMatlab_traceEnd(t0, "convertFromR", job->funcName, t0 >= 0 ? RMatlab_traceRBytes(result) : -1);
+  }
+
+  UNPROTECT(1);
+}
+
+/*
+  The next job to run: a collected job to finish first, so that Matlab's
+  thread isn't kept waiting, and otherwise the next queued call.
+*/
+static RMatlabJob *
+nextJob(RMatlabWorker *worker)
+{
+  RMatlabJob *job;
+
+  for(job = worker->jobs; job; job = job->next)
+    if(job->finishing && !job->finished)
+      return(job);
+
+  for(job = worker->jobs; job; job = job->next)
+    if(job->status == RMATLAB_JOB_QUEUED)
+      return(job);
+
+  return(NULL);
+}
+
+static void *
+workerMain(void *data)
+{
+  RMatlabWorker *worker = (RMatlabWorker *) data;
+  RMatlabJob *job;
+  int status;
+
+  status = worker->initR(worker->argc, worker->argv);
+
+  pthread_mutex_lock(&worker->lock);
+  worker->initStatus = status;
+  worker->started = 1;
+  pthread_cond_broadcast(&worker->changed);
+  pthread_mutex_unlock(&worker->lock);
+
+  if(!status)
+    return(NULL);
+
+  while(1) {
+    pthread_mutex_lock(&worker->lock);
+    while(!worker->shutdown && !(job = nextJob(worker)))
+      pthread_cond_wait(&worker->changed, &worker->lock);
+    if(worker->shutdown) {
+      pthread_mutex_unlock(&worker->lock);
+      break;
+    }
+
+    if(job->finishing) {
+      pthread_mutex_unlock(&worker->lock);
+      if(!R_ToplevelExec(finishJob, job) && !job->error) {
+        free(job->errorMessage);
+        job->errorMessage = strdup(R_curErrorBuf());
+        job->errorId = "RMatlab:conversion";
+      }
+      pthread_mutex_lock(&worker->lock);
+      job->finished = 1;
+      pthread_cond_broadcast(&worker->changed);
+      pthread_mutex_unlock(&worker->lock);
+      continue;
+    }
+
+    job->status = RMATLAB_JOB_RUNNING;
+    pthread_mutex_unlock(&worker->lock);
+
+      /* In case a cancel of the previous call arrived just as it finished. */
+    R_interrupts_pending = FALSE;
+
+    if(!R_ToplevelExec(evalJob, job) && !job->errorMessage) {
+      job->errorMessage = strdup(R_curErrorBuf());
+      job->errorId = "RMatlab:conversion";
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    job->status = job->errorMessage ? RMATLAB_JOB_ERROR : RMATLAB_JOB_DONE;
+    pthread_cond_broadcast(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  if(worker->endR)
+    worker->endR();
+
+  return(NULL);
+}
+
+
+/*
+  Create the worker thread and wait for it to initialize R
+  by calling initR. Returns NULL if either fails.
+*/
+RMatlabWorker *
+RMatlabWorker_start(int argc, char **argv, RMatlabWorkerInitFun initR, RMatlabWorkerEndFun endR)
+{
+  RMatlabWorker *worker;
+
+  worker = (RMatlabWorker *) calloc(1, sizeof(RMatlabWorker));
+  worker->magic = RMATLAB_WORKER_MAGIC;
+  worker->argc = argc;
+  worker->argv = argv;
+  worker->initR = initR;
+  worker->endR = endR;
+  worker->nextId = 1;
+  pthread_mutex_init(&worker->lock, NULL);
+  pthread_cond_init(&worker->changed, NULL);
+
+  if(pthread_create(&worker->thread, NULL, workerMain, worker) != 0) {
+    free(worker);
+    return(NULL);
+  }
+
+  pthread_mutex_lock(&worker->lock);
+  while(!worker->started)
+    pthread_cond_wait(&worker->changed, &worker->lock);
+  pthread_mutex_unlock(&worker->lock);
+
+  if(!worker->initStatus) {
+    pthread_join(worker->thread, NULL);
+    free(worker);
+    return(NULL);
+  }
+
+  return(worker);
+}
+
+/*
+  Stop the worker thread once it finishes the current call, and end R.
+  Calls that haven't been run are discarded.
+  We don't free the RMatlabWorker itself as the other MEX files may still
+  find its address in the Matlab global variable, but they will see it is
+  no longer valid.
+*/
+void
+RMatlabWorker_stop(RMatlabWorker *worker)
+{
+  RMatlabJob *job, *next;
+
+  pthread_mutex_lock(&worker->lock);
+  worker->shutdown = 1;
+  pthread_cond_broadcast(&worker->changed);
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_join(worker->thread, NULL);
+  worker->magic = 0;
+
+  for(job = worker->jobs; job; job = next) {
+    next = job->next;
+    freeJob(job);
+  }
+  worker->jobs = NULL;
+}
+
+
+void
+RMatlabWorker_publish(RMatlabWorker *worker)
+{
+  mxArray *ptr;
+
+  ptr = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+  *((unsigned long long *) mxGetData(ptr)) = (unsigned long long) (uintptr_t) worker;
+  mexPutVariable("global", RMATLAB_WORKER_VARIABLE, ptr);
+  mxDestroyArray(ptr);
+}
+
+/*
+  Get the worker published by initializeR, or NULL if R is not running
+  on a worker thread.
+*/
+RMatlabWorker *
+RMatlabWorker_find()
+{
+  const mxArray *ptr;
+  RMatlabWorker *worker;
+
+  ptr = mexGetVariablePtr("global", RMATLAB_WORKER_VARIABLE);
+  if(!ptr || mxGetClassID(ptr) != mxUINT64_CLASS || mxGetNumberOfElements(ptr) != 1)
+    return(NULL);
+
+  worker = (RMatlabWorker *) (uintptr_t) *((unsigned long long *) mxGetData(ptr));
+  if(!worker || worker->magic != RMATLAB_WORKER_MAGIC)
+    return(NULL);
+
+  return(worker);
+}
+
+
+/*
+  Queue a call to the R function funcName and return its identifier.
+*/
+int
+RMatlabWorker_submit(RMatlabWorker *worker, const char *funcName, int nargs, const mxArray *args[],
+                      const mxArray *namedArgs)
+{
+  RMatlabJob *job, *last;
+  int i;
+
+  job = (RMatlabJob *) calloc(1, sizeof(RMatlabJob));
+  job->funcName = strdup(funcName);
+  job->trace = RMatlab_traceCurrent();
+  job->nargs = nargs;
+  job->args = (mxArray **) calloc(nargs > 0 ? nargs : 1, sizeof(mxArray *));
+  for(i = 0; i < nargs; i++) {
+    job->args[i] = RMatlab_portableArray(args[i]);
+    mexMakeArrayPersistent(job->args[i]);
+  }
+  if(namedArgs) {
+    job->namedArgs = RMatlab_portableArray(namedArgs);
+    mexMakeArrayPersistent(job->namedArgs);
+  }
+  job->status = RMATLAB_JOB_QUEUED;
+
+  pthread_mutex_lock(&worker->lock);
+  job->id = worker->nextId++;
+  if(worker->jobs) {
+    for(last = worker->jobs; last->next; last = last->next) ;
+    last->next = job;
+  } else
+    worker->jobs = job;
+  pthread_cond_broadcast(&worker->changed);
+  pthread_mutex_unlock(&worker->lock);
+
+  return(job->id);
+}
+
+/*
+  The status of the call, or -1 if there is no such call
+  (e.g. it has already been collected).
+*/
+int
+RMatlabWorker_status(RMatlabWorker *worker, int id)
+{
+  RMatlabJob *job;
+  int status;
+
+  pthread_mutex_lock(&worker->lock);
+  job = findJob(worker, id, NULL);
+  status = job ? (int) job->status : -1;
+  pthread_mutex_unlock(&worker->lock);
+
+  return(status);
+}
+
+/*
+  Wait for the call to finish, for at most timeout seconds
+  or indefinitely if timeout is negative.
+  Returns the status of the call.
+*/
+int
+RMatlabWorker_wait(RMatlabWorker *worker, int id, double timeout)
+{
+  RMatlabJob *job;
+  struct timeval now;
+  struct timespec deadline;
+  int status;
+
+  if(timeout >= 0) {
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + (time_t) timeout;
+    deadline.tv_nsec = now.tv_usec * 1000 + (long) ((timeout - (time_t) timeout) * 1e9);
+    if(deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&worker->lock);
+  while((job = findJob(worker, id, NULL)) &&
+          (job->status == RMATLAB_JOB_QUEUED || job->status == RMATLAB_JOB_RUNNING)) {
+    if(timeout < 0)
+      pthread_cond_wait(&worker->changed, &worker->lock);
+    else if(pthread_cond_timedwait(&worker->changed, &worker->lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  status = job ? (int) job->status : -1;
+  pthread_mutex_unlock(&worker->lock);
+
+  return(status);
+}
+
+/*
+  Cancel the call. If it hasn't started, it is simply marked as failed.
+  If it is running, we interrupt R. Either way, collecting it raises an error.
+  Returns the status of the call before it was cancelled.
+*/
+int
+RMatlabWorker_cancel(RMatlabWorker *worker, int id)
+{
+  RMatlabJob *job;
+  int status;
+
+  pthread_mutex_lock(&worker->lock);
+  job = findJob(worker, id, NULL);
+  status = job ? (int) job->status : -1;
+  if(status == RMATLAB_JOB_QUEUED) {
+    job->errorMessage = strdup("the call was cancelled");
+    job->errorId = "RMatlab:cancelled";
+    job->status = RMATLAB_JOB_ERROR;
+    pthread_cond_broadcast(&worker->changed);
+  } else if(status == RMATLAB_JOB_RUNNING) {
+    job->cancelled = 1;
+    R_interrupts_pending = TRUE;
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return(status);
+}
+
+/*
+  Wait for the call to finish and put its result, converted to Matlab, in output.
+  If the R call failed, this raises a Matlab error with R's error message.
+  Either way, the call is then discarded.
+*/
+void
+RMatlabWorker_collect(RMatlabWorker *worker, int id, int nout, mxArray *output[])
+{
+  static RMatlabErrorInfo info;
+  char errorMessage[4096];
+  RMatlabJob *job, *prev;
+  mxArray *ans;
+  int status;
+
+  status = RMatlabWorker_wait(worker, id, -1);
+  if(status < 0)
+    mexErrMsgTxt("No such R call. It may already have been collected.");
+
+    /* Have the worker convert the result or describe the R error, as only it may use R. */
+  pthread_mutex_lock(&worker->lock);
+  job = findJob(worker, id, &prev);
+  if(job->result) {
+    job->finishing = 1;
+    pthread_cond_broadcast(&worker->changed);
+    while(!job->finished && !worker->shutdown)
+      pthread_cond_wait(&worker->changed, &worker->lock);
+  }
+  if(prev)
+    prev->next = job->next;
+  else
+    worker->jobs = job->next;
+  pthread_mutex_unlock(&worker->lock);
+
+  if(job->error) {
+    info = *job->error;
+    RMatlab_publishRError(&info);
+    freeJob(job);
+    mexErrMsgIdAndTxt(info.id, "%s", info.message);
+  }
+
+  if(job->errorMessage && !job->output) {
+    snprintf(errorMessage, sizeof(errorMessage), "Error in R when calling function %s: %s",
+               job->funcName, job->errorMessage);
+    RMatlab_recordRErrorMessage(&info, job->funcName, job->errorId ? job->errorId : "RMatlab:R:error",
+                                  errorMessage);
+    freeJob(job);
+    mexErrMsgIdAndTxt(info.id, "%s", info.message);
+  }
+
+  ans = RMatlab_nativeArray(job->output);
+  job->output = NULL;
+  freeJob(job);
+
+  if(nout > 0)
+    output[0] = ans;
+  else if(ans)
+    mxDestroyArray(ans);
+}
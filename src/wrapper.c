@@ -1,82 +1,151 @@
 #include "RMatlabConvert.h"
+#include "RMatlabWorker.h"
+#include "RMatlabWatchdog.h"
+#include "RMatlabTrace.h"
+
+#include <string.h>
 
 /*
  This handles calling R functions with named arguments.
  The first nargs - 1  elements of the args array of inputs
  consist of the unnamed arguments.  The last element
  is expected to be a Matlab cell of name-value pairs
- identifying the named arguments.
+ or a scalar struct whose fields are the named arguments.
  The remainder of the code is the same as callR.
  In fact, we should consolidate the two into a single block
  of code and pass the named arguments as an additional argument from the
  mexFunction. 
+ The call itself is created by RMatlab_createRCall() in rcall.c.
 */
-mxArray *
-callR(char *funcName, int nargs, const mxArray *args[], const mxArray *namedArgs,
-        int nout, mxArray *output[])
+typedef struct {
+  const char *funcName;
+  int nargs;
+  const mxArray **args;
+  const mxArray *namedArgs;
+
+  SEXP call, ans;         /* preserved, or NULL */
+  int errorOccurred;
+  RMatlabCancelReason cancelled;
+} RCall;
+
+/*
+ Create the call and evaluate it.  This is run via R_ToplevelExec() so that
+ an R error in converting the arguments comes back to callR() with R's
+ stacks restored rather than jumping out of the MEX function.
+*/
+static void
+evalRCall(void *data)
 {
-  SEXP r_expr, rans; 
-  int errorOccurred = 0;
-  mxArray *mxAns;
-  int totalNumArgs = 0, numNamedArgs = 0;
-
-  
-  if(namedArgs) { 
-      numNamedArgs = mxGetNumberOfElements(namedArgs);
-      if(numNamedArgs % 2) {
-        mexErrMsgTxt("The collection of named arguments does not have an even number of elements");
-      }
-      numNamedArgs /= 2;
+  RCall *c = (RCall *) data;
+  double t0, bytes = 0;
+  int i;
+
+  t0 = RMatlab_traceBegin();
+  c->call = RMatlab_createRCall(c->funcName, c->nargs, c->args, c->namedArgs);
+  R_PreserveObject(c->call);
+  if(t0 >= 0) {
+    for(i = 0; i < c->nargs; i++)
+      bytes += RMatlab_traceArrayBytes(c->args[i]);
+    bytes += RMatlab_traceArrayBytes(c->namedArgs);
+    RMatlab_traceEnd(t0, "convertToR", c->funcName, bytes);
   }
 
-  totalNumArgs = nargs + numNamedArgs;
+  t0 = RMatlab_traceBegin();
+  c->ans = RMatlab_tryEvalWithTimeout(c->call, R_GlobalEnv, &c->errorOccurred, &c->cancelled);
+  RMatlab_traceEnd(t0, "R", c->funcName, -1);
+  if(c->errorOccurred)
+    c->ans = NULL;
+  else
+    R_PreserveObject(c->ans);
+}
 
-  PROTECT(r_expr = allocVector(LANGSXP, 1 + totalNumArgs));
-  SETCAR(r_expr, Rf_install(funcName));
+static void
+releaseRCall(RCall *c)
+{
+  if(c->ans)
+    R_ReleaseObject(c->ans);
+  if(c->call)
+    R_ReleaseObject(c->call);
+}
 
-  if(totalNumArgs > 0) { 
-    int i, ctr;
 
-    SEXP el = CDR(r_expr);
-      /* Put the unnamed arguments into the call. */ 
-    for(i = 0 ; i < nargs ; i++) {
-        SETCAR(el, convertToR(args[i]));
-        el = CDR(el);
-    }
+mxArray *
+callR(char *funcName, int nargs, const mxArray *args[], const mxArray *namedArgs,
+        int nout, mxArray *output[])
+{
+  static RMatlabErrorInfo info;
+  char buf[4096];
+  mxArray *mxAns;
+  RMatlabWorker *worker;
+  RCall c;
+  double t0, t1, bytes;
+  int i, level;
 
-       /* Now add the named arguments. The idea is to walk over the  
-          name, value pairs of the Matlab cell
-        */
-    for(i = 0, ctr = 0; i < numNamedArgs; i++, ctr += 2) {
-	char *buf;
-	int len;
-	const mxArray *name;
-
-        SETCAR(el, convertToR(mxGetCell(namedArgs, ctr + 1)));
-
-	name = mxGetCell(namedArgs, ctr);
-	len = mxGetN(name) * mxGetM(name) + 1;
-	buf = (char *) R_alloc(len, sizeof(char)); 	
-	mxGetString(name, buf, len); 
-        SET_TAG(el, Rf_install(buf));
-	el = CDR(el);
-    }
+  if(namedArgs && mxIsCell(namedArgs) && mxGetNumberOfElements(namedArgs) % 2) {
+    mexErrMsgTxt("The collection of named arguments does not have an even number of elements");
   }
 
-  rans = R_tryEval(r_expr, R_GlobalEnv, &errorOccurred);
-
-  if(errorOccurred) {
-    /* error from R. */
-    UNPROTECT(1);
-    MATLAB_ERROR_MESSAGE("Error in R when calling function");
+    /* If R is running on its own thread (initializeR with 'async'), have it do the work. */
+  if((worker = RMatlabWorker_find())) {
+    RMatlabWorker_collect(worker, RMatlabWorker_submit(worker, funcName, nargs, args, namedArgs),
+                            nout, output);
+    return(nout > 0 ? output[0] : NULL);
   }
 
-  /* Convert the result to Matlab objects. */
-  PROTECT(rans);
-  mxAns = convertFromR(rans, nout, output); 
-  UNPROTECT(2);
+  t0 = RMatlab_traceBegin();
+
+  memset(&c, 0, sizeof(c));
+  c.funcName = funcName;
+  c.nargs = nargs;
+  c.args = args;
+  c.namedArgs = namedArgs;
+
+  RMatlab_poolConfigure();
+  RMatlab_convertConfigure(1);
+
+    /* Check the arguments fit in the memory budget before we convert them (see budget.c). */
+  level = RMatlab_budgetEnter();
+  bytes = RMatlab_budgetToR(namedArgs);
+  for(i = 0; i < nargs; i++)
+    bytes += RMatlab_budgetToR(args[i]);
+
+  if(!RMatlab_budgetReserve(bytes)) {
+    RMatlab_recordRErrorMessage(&info, funcName, "RMatlab:budget", RMatlab_budgetDescribe(bytes, "The arguments of", funcName));
+  } else if(!R_ToplevelExec(evalRCall, &c)) {
+    snprintf(buf, sizeof(buf), "Error in R converting the arguments for function %s: %s", funcName, R_curErrorBuf());
+    RMatlab_recordRErrorMessage(&info, funcName, "RMatlab:conversion", buf);
+  } else if(c.errorOccurred && c.cancelled == RMATLAB_TIMED_OUT) {
+    snprintf(buf, sizeof(buf), "The call to the R function %s exceeded the time limit (RMatlab.callTimeout)", funcName);
+    RMatlab_recordRErrorMessage(&info, funcName, "RMatlab:timeout", buf);
+  } else if(c.errorOccurred && c.cancelled == RMATLAB_INTERRUPTED) {
+    snprintf(buf, sizeof(buf), "The call to the R function %s was interrupted", funcName);
+    RMatlab_recordRErrorMessage(&info, funcName, "RMatlab:interrupted", buf);
+  } else if(c.errorOccurred) {
+      /* The error wasn't captured, e.g. the RMatlab package couldn't be loaded. */
+    snprintf(buf, sizeof(buf), "Error in R when calling function %s: %s", funcName, R_curErrorBuf());
+    RMatlab_recordRErrorMessage(&info, funcName, "RMatlab:R:error", buf);
+  } else if(RMatlab_isRError(c.ans))
+    RMatlab_recordRError(&info, funcName, c.ans);
+  else if(!RMatlab_budgetReserve(bytes = RMatlab_budgetFromR(c.ans)))
+    RMatlab_recordRErrorMessage(&info, funcName, "RMatlab:budget", RMatlab_budgetDescribe(bytes, "The result of", funcName));
+  else {
+      /* Convert the result to Matlab objects. */
+    t1 = RMatlab_traceBegin();
+    mxAns = convertFromR(c.ans, nout, output); 
+    RMatlab_traceEnd(t1, "convertFromR", funcName, t1 >= 0 ? RMatlab_traceRBytes(c.ans) : -1);
+    RMatlab_releaseRCall(c.call, c.ans);
+    releaseRCall(&c);
+    RMatlab_budgetLeave(level);
+    RMatlab_traceEnd(t0, "callR", funcName, -1);
+    return(mxAns);
+  }
 
-  return(mxAns);
+    /* mexErrMsgIdAndTxt() doesn't return, so we release everything first. */
+  releaseRCall(&c);
+  RMatlab_budgetLeave(level);
+  RMatlab_traceEnd(t0, "callR", funcName, -1);
+  mexErrMsgIdAndTxt(info.id, "%s", info.message);
+  return(NULL);
 }
 
 
@@ -95,6 +164,8 @@ mexFunction(int nlhs, mxArray *plhs[],
   checkRIsInitialized();
 #endif
 
+  RMatlab_traceUseShared();
+
 
   /* Check we have a single string argument. */
   if(nrhs == 0 || !mxIsChar(prhs[0]) || mxGetM(prhs[0]) != 1)
@@ -110,12 +181,12 @@ mexFunction(int nlhs, mxArray *plhs[],
 
 #ifdef R_NAMED_CALL
  {
-       /* The -2 is because nrhs contains the cell with the named arguments
-          and the cell is not an actual argument, 
+       /* The -2 is because nrhs contains the cell or struct with the named
+          arguments and it is not an actual argument, 
           just a container for actual arguments. 
           And of course we subtract one for the name of the function to be called.
         */
-   int haveNames = nrhs > 1 && mxIsCell(prhs[nrhs-1]);
+   int haveNames = nrhs > 1 && RMatlab_isNamedArgs(prhs[nrhs-1]);
    callR(buf, nrhs - (haveNames ? 2 : 1), prhs+1, 
              haveNames ? prhs[nrhs - 1] : NULL, nlhs, plhs);
  }
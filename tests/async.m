@@ -0,0 +1,31 @@
+% Run matlab
+%  matlab -nojvm -nosplash -nodisplay
+% and then give the command
+%   async
+% R runs on its own thread while Matlab continues.
+
+initializeR({'RMatlab' '--silent' '--vanilla'}, 'async')
+
+t1 = callRAsync('submit', 'Sys.sleep', 2)
+t2 = callRAsync('submitNamed', 'rnorm', 5, {'mean' 100})
+
+% Matlab is not blocked while R sleeps.
+callRAsync('poll', t1)
+x = svd(rand(500));
+
+callRAsync('wait', t1, 0.1)
+callRAsync('collect', t1);
+o = callRAsync('collect', t2)
+
+% Calls are evaluated in order, and callR waits for its result.
+t3 = callRAsync('submit', 'assign', 'y', 1:10);
+o = callR('sum', 1:10)
+callRAsync('collect', t3);
+
+% Errors in R are raised when the call is collected.
+t4 = callRAsync('submit', 'stop', 'intentional error');
+try
+  callRAsync('collect', t4)
+catch
+  disp(lasterr)
+end
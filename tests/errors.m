@@ -0,0 +1,36 @@
+% Run matlab
+%  matlab -nojvm -nosplash -nodisplay
+% and then give the command
+%   errors
+% Errors in R are raised in Matlab with an identifier RMatlab:R:<class>
+% and the details are in the global variable RLastError.
+
+initializeR({'RMatlab' '--silent' '--vanilla'})
+global RLastError
+
+try
+  callR('stop', 'intentional error')
+catch
+  err = lasterror;
+  disp(err.identifier)          % RMatlab:R:simpleError
+end
+RLastError
+
+callR('source', '../tests/error.R');
+try
+  callR('errorOuter', 'a')
+catch
+  disp(lasterr)
+end
+RLastError.call                 % log(x)
+RLastError.traceback            % errorOuter("a"), errorInner(x)
+
+% Errors in converting the arguments have the identifier RMatlab:conversion.
+% Here the name of a named argument isn't a string.
+try
+  callNamedR('seq', 1, {3 10})
+catch
+  err = lasterror;
+  disp(err.identifier)          % RMatlab:conversion
+  disp(err.message)             % ... The names of the named arguments must be strings
+end
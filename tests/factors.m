@@ -0,0 +1,26 @@
+% Run matlab
+%  matlab -nojvm -nosplash -nodisplay
+% and then give the command
+%   factors
+% Factors become categorical arrays and data frames tables, and back.
+
+initializeR({'RMatlab' '--silent' '--vanilla'})
+
+f = callNamedR('factor', {'lo' 'hi' 'lo' 'mid'}, {'levels' {'lo' 'mid' 'hi'}})
+categories(f)
+callR('levels', f)              % lo mid hi
+callR('nlevels', f)             % 3
+
+o = callNamedR('factor', {'b' 'a'}, {'levels' {'a' 'b'} 'ordered' true});
+isordinal(o)                    % 1
+
+d = callNamedR('data.frame', {'x' [1 2 3] 'g' {'a' 'b' 'a'} 'stringsAsFactors' true})
+class(d.g)                      % categorical
+callR('nrow', d)                % 3
+callR('class', d)               % data.frame
+
+% Names and dimnames, via the RMatlab.attributes option.
+callNamedR('options', {'RMatlab.attributes' true});
+t = callR('table', {'a' 'b' 'a'})
+t.RAttributes.dimnames
+callR('dimnames', t)           % restored from RAttributes
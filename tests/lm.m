@@ -6,6 +6,16 @@ d = callR('.REvalString', 'lm(y~x)')
 
 
 # Note that the terms & call fields are not transferred.
-# Need to implement the opaque references.
+# See below for references to the model instead.
  
 
+
+% With a reference, the model stays in R and only the results come back.
+fit = callR('.RReference', '.REvalString', 'lm(y~x)')
+callR('coef', fit)
+callR('predict', fit)
+s = callR('.RReference', 'summary', fit);
+callR('getElement', s, 'r.squared')
+callR('.RReferences')
+clear fit s
+callR('.RReferences')
@@ -0,0 +1,22 @@
+% Run matlab
+%  matlab -nojvm -nosplash -nodisplay
+% and then give the command
+%   namedArgs
+% Named arguments for callNamedR as a cell of name-value pairs or a struct.
+
+initializeR({'RMatlab' '--silent' '--vanilla'})
+
+callNamedR('paste', 1:3, 5:7, {'collapse', ' < ', 'sep', ', '})        % 1, 5 < 2, 6 < 3, 7
+callNamedR('paste', 1:3, 5:7, struct('collapse', ' < ', 'sep', ', '))  % the same
+
+% The same fields in a different order.
+callNamedR('paste', 1:3, 5:7, struct('sep', ', ', 'collapse', ' < '))
+
+% A struct with the same fields each time, as in a loop over models.
+opts = struct('mean', 2, 'sd', 0.5);
+for i = 1:1000
+  x = callNamedR('rnorm', 3, opts);
+end
+x
+
+callNamedR('round', 2.567, struct('digits', 1))                       % 2.6
@@ -0,0 +1,254 @@
+/*
+ Check the copies on several threads in src/parallel.c without R or Matlab.
+
+ We use several threads and a low threshold so that the copies are split
+ into pieces, and compare every element with the result of a plain loop.
+ The sizes are not multiples of the pieces so the last piece of each copy
+ is short.  We cover each kind of copy, including splitting and joining
+ complex values, and the queue of copies between RMatlab_parallelBegin()
+ and RMatlab_parallelEnd(), with nesting and RMatlab_parallelSuspend().
+
+   cc -O2 -I../src -I$R_HOME/include -o parallelCopy parallelCopy.c ../src/parallel.c -lpthread
+   ./parallelCopy [threads]
+*/
+
+#include "RMatlabParallel.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+  /* Larger than a few pieces (at least 1MB each) per thread. */
+#define LARGE  (3 * 1024 * 1024 + 17)
+#define MEDIUM (64 * 1024 + 5)
+#define NUM_QUEUED 40
+
+static int Failures = 0;
+
+static void
+check(int ok, const char *what)
+{
+  printf("%-50s %s\n", what, ok ? "ok" : "FAILED");
+  if(!ok)
+    Failures++;
+}
+
+static void *
+allocate(size_t n)
+{
+  void *p = calloc(n, 1);
+  if(!p) {
+    fprintf(stderr, "cannot allocate %lu bytes\n", (unsigned long) n);
+    exit(2);
+  }
+  return(p);
+}
+
+static void
+testCopy(size_t n)
+{
+  unsigned char *src = allocate(n), *dest = allocate(n);
+  size_t i;
+  int ok = 1;
+
+  for(i = 0; i < n; i++)
+    src[i] = (unsigned char) (i * 31 + 7);
+  RMatlab_parallelCopy(dest, src, n);
+  for(i = 0; i < n; i++)
+    ok = ok && dest[i] == src[i];
+  check(ok, n > MEDIUM ? "copy bytes (large)" : "copy bytes (small)");
+
+  free(src);
+  free(dest);
+}
+
+static void
+testIntToDouble(size_t n)
+{
+  int *src = allocate(n * sizeof(int));
+  double *dest = allocate(n * sizeof(double));
+  size_t i;
+  int ok = 1;
+
+  for(i = 0; i < n; i++)
+    src[i] = (int) i - (int) (n / 2);
+  src[0] = INT_MIN;
+  RMatlab_parallelIntToDouble(dest, src, n);
+  for(i = 1; i < n; i++)
+    ok = ok && dest[i] == (double) src[i];
+  check(ok, "integer to double");
+  check(isnan(dest[0]), "R's integer NA is NaN");
+
+  free(src);
+  free(dest);
+}
+
+static void
+testLogical(size_t n)
+{
+  int *src = allocate(n * sizeof(int)), *back = allocate(n * sizeof(int));
+  unsigned char *dest = allocate(n);
+  size_t i;
+  int ok = 1;
+
+    /* INT_MIN is R's NA, which becomes TRUE. */
+  for(i = 0; i < n; i++)
+    src[i] = i % 3 == 0 ? 0 : (i % 3 == 1 ? 1 : INT_MIN);
+  RMatlab_parallelIntToLogical(dest, src, n);
+  for(i = 0; i < n; i++)
+    ok = ok && dest[i] == (src[i] != 0);
+  check(ok, "R logical to Matlab logical");
+  check(dest[2] == 1, "R's NA is TRUE in Matlab");
+
+  RMatlab_parallelLogicalToInt(back, dest, n);
+  ok = 1;
+  for(i = 0; i < n; i++)
+    ok = ok && back[i] == (src[i] != 0);
+  check(ok, "Matlab logical to R logical");
+
+  free(src);
+  free(back);
+  free(dest);
+}
+
+static void
+testComplex(size_t n)
+{
+  Rcomplex *src = allocate(n * sizeof(Rcomplex)), *back = allocate(n * sizeof(Rcomplex));
+  double *real = allocate(n * sizeof(double)), *imaginary = allocate(n * sizeof(double));
+  size_t i;
+  int ok = 1;
+
+  for(i = 0; i < n; i++) {
+    src[i].r = i + 0.5;
+    src[i].i = -(double) i;
+  }
+  RMatlab_parallelSplitComplex(real, imaginary, src, n);
+  for(i = 0; i < n; i++)
+    ok = ok && real[i] == src[i].r && imaginary[i] == src[i].i;
+  check(ok, "split complex");
+
+  RMatlab_parallelJoinComplex(back, real, imaginary, n);
+  ok = 1;
+  for(i = 0; i < n; i++)
+    ok = ok && back[i].r == src[i].r && back[i].i == src[i].i;
+  check(ok, "join complex");
+
+  free(src);
+  free(back);
+  free(real);
+  free(imaginary);
+}
+
+static int
+allCopied(double **dest, double **src, int count, size_t n)
+{
+  int j;
+
+  for(j = 0; j < count; j++)
+    if(memcmp(dest[j], src[j], n * sizeof(double)))
+      return(0);
+  return(1);
+}
+
+static int
+noneCopied(double **dest, int count, size_t n)
+{
+  int j;
+  size_t i;
+
+  for(j = 0; j < count; j++)
+    for(i = 0; i < n; i++)
+      if(dest[j][i] != 0)
+        return(0);
+  return(1);
+}
+
+/*
+  Many medium-sized copies, as for the elements of a cell or list, are
+  queued until the outermost RMatlab_parallelEnd() and then done together.
+*/
+static void
+testQueue(int threads)
+{
+  double *src[NUM_QUEUED], *dest[NUM_QUEUED];
+  size_t i, n = MEDIUM;
+  int j, depth;
+
+  for(j = 0; j < NUM_QUEUED; j++) {
+    src[j] = allocate(n * sizeof(double));
+    dest[j] = allocate(n * sizeof(double));
+    for(i = 0; i < n; i++)
+      src[j][i] = j * 1e6 + i;
+  }
+
+  RMatlab_parallelBegin();
+  for(j = 0; j < NUM_QUEUED / 2; j++)
+    RMatlab_parallelCopy(dest[j], src[j], n * sizeof(double));
+
+    /* A nested Begin/End, as for a cell within a cell, doesn't run the queue. */
+  RMatlab_parallelBegin();
+  for(; j < NUM_QUEUED; j++)
+    RMatlab_parallelCopy(dest[j], src[j], n * sizeof(double));
+  RMatlab_parallelEnd();
+
+  if(threads > 1)
+    check(noneCopied(dest, NUM_QUEUED, n), "queued copies wait for the outer End");
+  RMatlab_parallelEnd();
+  check(allCopied(dest, src, NUM_QUEUED, n), "queued copies done at the outer End");
+
+    /* Suspend runs what is queued and copies immediately until Resume. */
+  for(j = 0; j < NUM_QUEUED; j++)
+    memset(dest[j], 0, n * sizeof(double));
+  RMatlab_parallelBegin();
+  RMatlab_parallelCopy(dest[0], src[0], n * sizeof(double));
+  depth = RMatlab_parallelSuspend();
+  check(allCopied(dest, src, 1, n), "suspend runs the queue");
+  RMatlab_parallelCopy(dest[1], src[1], n * sizeof(double));
+  check(allCopied(dest + 1, src + 1, 1, n), "copies while suspended are done at once");
+  RMatlab_parallelResume(depth);
+  RMatlab_parallelCopy(dest[2], src[2], n * sizeof(double));
+  if(threads > 1)
+    check(noneCopied(dest + 2, 1, n), "resume queues again");
+  RMatlab_parallelEnd();
+  check(allCopied(dest, src, 3, n), "copies done after resume and End");
+
+  for(j = 0; j < NUM_QUEUED; j++) {
+    free(src[j]);
+    free(dest[j]);
+  }
+}
+
+static void
+runAll(int threads, double threshold)
+{
+  printf("\n%d thread(s), threshold %.0f bytes\n", threads, threshold);
+  RMatlab_parallelSetup(threads, threshold);
+
+  testCopy(LARGE * sizeof(double) + 3);
+  testCopy(MEDIUM);
+  testIntToDouble(LARGE);
+  testLogical(LARGE);
+  testComplex(LARGE);
+  testQueue(threads);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+
+  if(threads < 2)
+    threads = 2;
+
+  runAll(threads, 1024);
+  runAll(threads + 3, 1024);
+    /* Above the threshold, everything is copied on the calling thread. */
+  runAll(threads, 1e12);
+  runAll(1, 1024);
+
+  printf("\n%s\n", Failures ? "FAILED" : "All passed");
+  return(Failures ? 1 : 0);
+}
@@ -0,0 +1,35 @@
+% Run matlab
+%  matlab -nojvm -nosplash -nodisplay
+% and then give the command
+%   pool
+% With the R option RMatlab.pool TRUE, the R vectors for the arguments of
+% callR are reused, but not when the R function keeps a reference to one.
+
+initializeR({'RMatlab' '--silent' '--vanilla'})
+callNamedR('options', {'RMatlab.pool' true});
+callR('source', '../tests/pool.R');
+
+% sum doesn't keep its argument, so its vector is reused.
+x = (1:100)';
+callR('sum', x);
+callR('sum', x + 1);
+stats = callR('.MatlabPool');
+stats                           % hits > 0
+
+% keepArg stores its argument in the global variable kept.  The next call,
+% with a vector of the same type and length, must not overwrite it.
+callR('keepArg', x);
+callR('keepArg', zeros(100, 1));
+isequal(callR('get', 'kept'), zeros(100, 1))            % 1
+callR('keepArg', x);
+callR('sum', -x);
+isequal(callR('get', 'kept'), x)                        % 1
+
+% The same when the argument is kept in a list.
+callR('keepInList', x);
+callR('sum', 2 * x);
+y = callR('get', 'keptList');
+isequal(y{1}, x)                                        % 1
+
+callNamedR('.MatlabPool', {'clear' true});
+callNamedR('options', {'RMatlab.pool' false});
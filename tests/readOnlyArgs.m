@@ -0,0 +1,33 @@
+% Run matlab
+%  matlab -nojvm -nosplash -nodisplay
+% and then give the command
+%   readOnlyArgs
+% Large double arguments of Matlab functions called from R that refer to
+% the R vector rather than a copy of it.
+
+initializeR({'RMatlab' '--silent' '--vanilla'})
+
+x = (1:2^20)';
+callNamedR('.MatlabMexCall', 'sum', x, {'.readOnly' true})          % 549756338176
+
+% double returns its argument, so the result refers to the R data
+% until it is copied to a new R vector.
+y = callNamedR('.MatlabMexCall', 'double', x, {'.readOnly' true});
+isequal(x, y)
+
+% The same inside a cell and a struct, which must not free the R data.
+fid = fopen(fullfile(tempdir, 'wrapShared.m'), 'w');
+fprintf(fid, 'function [c, s] = wrapShared(x)\nc = {x};\ns = struct(''a'', x);\n');
+fclose(fid);
+addpath(tempdir);
+y = callNamedR('.MatlabMexCall', 'wrapShared', x, {'.nout' 2 '.readOnly' true});
+isequal(x, y{1}{1}, y{2}.a)
+callR('gc');
+
+% Only the second argument is read-only; the first is copied.
+callNamedR('.MatlabMexCall', 'dot', x, x, {'.readOnly' [false true]})
+
+% The same via .Matlab with the option.
+callNamedR('options', {'RMatlab.readOnlyArgs' true});
+callR('.Matlab', 'max', x)                                          % 1048576
+callNamedR('options', {'RMatlab.readOnlyArgs' false});
@@ -0,0 +1,332 @@
+/*
+ Exercise the shared memory transport with a stand-in for the Matlab engine
+ process, so that this can be run on Linux without Matlab.
+
+ Both sides use the routines in src/shmSegment.c that R (shm.c) and
+ the RMatlabShm MEX function use: R's side reserves, replaces and unlinks
+ its segment with RMatlabShm_reserve(), RMatlabShm_mapped() and
+ RMatlabShm_release(), and the stand-in maps it with RMatlabShm_map() and
+ writes its replies with RMatlabShm_reply(), which asks for a larger segment
+ when the array does not fit.  Only the copies of the data in and out of
+ R vectors and mxArrays are done here, with memcpy() as they are there.
+
+ The stand-in is a child process that reads one-line commands from a pipe,
+ as the engine does:
+    get <segment>       copy the array out of the segment (as RMatlabShm('get') does)
+    put <segment>       copy its n x 1 array into the segment (as RMatlabShm('put') does)
+    pipe                read its n doubles from the command pipe itself
+    check               reply with a checksum of the array it last received
+ and replies "ok" (or "needed" or "error").  We time each transfer up to
+ that reply and verify the data afterwards, so that the timings don't
+ include the checksums.  We compare the time to move the data via the
+ segment with the time to push it through the pipe, as engPutVariable() does.
+
+   cc -O2 -I../src -o shmTransfer shmTransfer.c ../src/shmSegment.c -lrt
+   ./shmTransfer [megabytes] [iterations]
+*/
+
+#include "RMatlabShm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+static double
+checksum(const double *x, long long n)
+{
+  long long i;
+  double total = 0;
+  for(i = 0; i < n; i++)
+    total += x[i] * ((i % 7) + 1);
+  return(total);
+}
+
+static void *
+allocate(size_t n)
+{
+  void *p = malloc(n);
+  if(!p) {
+    fprintf(stderr, "cannot allocate %lu bytes\n", (unsigned long) n);
+    exit(2);
+  }
+  return(p);
+}
+
+static int
+readFully(FILE *in, void *buf, size_t len)
+{
+  return(fread(buf, 1, len, in) == len);
+}
+
+
+/*
+ The stand-in engine.  x is the array it sends and received the one
+ it was last sent, as the Matlab variables would be.
+*/
+static void
+standInEngine(FILE *in, FILE *out, const double *x, long long n)
+{
+  RMatlabShmMapping mapping;
+  RMatlabShmHeader *hdr;
+  char line[256], name[128];
+  double *received = (double *) allocate(n * sizeof(double));
+  long long length = 0, dims[2];
+
+  memset(&mapping, 0, sizeof(mapping));
+
+  while(fgets(line, sizeof(line), in)) {
+    if(sscanf(line, "get %127s", name) == 1) {
+      hdr = RMatlabShm_map(&mapping, name);
+      if(!hdr || !RMatlabShm_checkHeader(hdr, mapping.size) || hdr->length > n)
+        fprintf(out, "error\n");
+      else {
+          /* This is the copy into the new mxArray. */
+        length = hdr->length;
+        memcpy(received, RMatlabShm_data(hdr), length * sizeof(double));
+        hdr->consumed = 1;
+        fprintf(out, "ok\n");
+      }
+    } else if(sscanf(line, "put %127s", name) == 1) {
+      dims[0] = n;
+      dims[1] = 1;
+      if(!RMatlabShm_map(&mapping, name))
+        fprintf(out, "error\n");
+      else if(!(hdr = RMatlabShm_reply(&mapping, RMATLAB_SHM_DOUBLE, 2, dims)))
+        fprintf(out, "needed\n");
+      else {
+        memcpy(RMatlabShm_data(hdr), x, n * sizeof(double));
+        fprintf(out, "ok\n");
+      }
+    } else if(strncmp(line, "pipe", 4) == 0) {
+      length = readFully(in, received, n * sizeof(double)) ? n : 0;
+      fprintf(out, "ok\n");
+    } else if(strncmp(line, "check", 5) == 0) {
+      fprintf(out, "%lld %.17g\n", length, checksum(received, length));
+    } else
+      break;
+    fflush(out);
+  }
+
+  RMatlabShm_unmap(&mapping);
+  free(received);
+}
+
+
+static FILE *Command, *Reply;
+
+static int
+request(const char *cmd, const char *name, const char *expected)
+{
+  char line[256];
+
+  fprintf(Command, "%s %s\n", cmd, name);
+  fflush(Command);
+  return(fgets(line, sizeof(line), Reply) && strncmp(line, expected, strlen(expected)) == 0);
+}
+
+/*
+  Does the stand-in have the n values whose checksum is expected.
+*/
+static int
+engineHas(long long n, double expected)
+{
+  char line[256];
+  long long length;
+  double got;
+
+  fprintf(Command, "check\n");
+  fflush(Command);
+  return(fgets(line, sizeof(line), Reply) && sscanf(line, "%lld %lf", &length, &got) == 2
+          && length == n && got == expected);
+}
+
+/*
+  R's side of a put, following RMatlab_shmPutVariable() in shm.c.
+*/
+static int
+shmPut(RMatlabShmSegment *seg, const double *x, long long n)
+{
+  long long dims[2];
+  RMatlabShmHeader *hdr;
+
+  dims[0] = n;
+  dims[1] = 1;
+  if(!RMatlabShm_reserve(seg, RMatlabShm_segmentSize(RMATLAB_SHM_DOUBLE, n))) {
+    perror("shm_open");
+    exit(2);
+  }
+  hdr = RMatlabShm_initHeader(seg->segment, RMATLAB_SHM_DOUBLE, 2, dims);
+  memcpy(RMatlabShm_data(hdr), x, n * sizeof(double));
+
+  if(!request("get", seg->name, "ok") || !hdr->consumed) {
+    RMatlabShm_release(seg);
+    return(0);
+  }
+  RMatlabShm_mapped(seg);
+  return(1);
+}
+
+/*
+  R's side of a get, following RMatlab_shmGetVariable() in shm.c.
+  The segment starts small so that the first get has to replace it.
+  The copy out of the segment goes into copy.
+*/
+static int
+shmGet(RMatlabShmSegment *seg, double *copy, long long n)
+{
+  RMatlabShmHeader *hdr;
+  int tries;
+
+  if(!RMatlabShm_reserve(seg, RMATLAB_SHM_DATA_OFFSET + 1024)) {
+    perror("shm_open");
+    exit(2);
+  }
+
+  for(tries = 0; tries < 2; tries++) {
+    hdr = RMatlabShm_clearHeader(seg->segment);
+    request("put", seg->name, "");
+
+    if(hdr->needed > 0 && hdr->needed > (long long) seg->size) {
+      RMatlabShm_mapped(seg);
+      RMatlabShm_reserve(seg, hdr->needed);
+      continue;
+    }
+
+    if(!RMatlabShm_checkHeader(seg->segment, seg->size) || hdr->length != n)
+      return(0);
+
+    RMatlabShm_mapped(seg);
+    memcpy(copy, RMatlabShm_data(hdr), n * sizeof(double));
+    return(1);
+  }
+
+  return(0);
+}
+
+
+static int Failures = 0;
+
+static void
+check(int ok, const char *what)
+{
+  if(!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    Failures++;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int toEngine[2], fromEngine[2], iter, iterations;
+  long long i, n;
+  double *x, *fromEngineData, *copy, expected, fromEngineSum, start, firstPut, firstGet,
+         putTime = 0, getTime = 0, pipeTime = 0;
+  char line[256];
+  RMatlabShmSegment seg;
+  pid_t pid;
+
+  n = (argc > 1 ? atof(argv[1]) : 256) * 1024 * 1024 / sizeof(double);
+  iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+  x = (double *) allocate(n * sizeof(double));
+  fromEngineData = (double *) allocate(n * sizeof(double));
+  copy = (double *) allocate(n * sizeof(double));
+  for(i = 0; i < n; i++) {
+    x[i] = i * 0.5;
+    fromEngineData[i] = i;
+  }
+  expected = checksum(x, n);
+  fromEngineSum = checksum(fromEngineData, n);
+
+  if(pipe(toEngine) < 0 || pipe(fromEngine) < 0) {
+    perror("pipe");
+    return(2);
+  }
+
+  pid = fork();
+  if(pid == 0) {
+    close(toEngine[1]);
+    close(fromEngine[0]);
+    standInEngine(fdopen(toEngine[0], "r"), fdopen(fromEngine[1], "w"), fromEngineData, n);
+    _exit(0);
+  }
+
+  close(toEngine[0]);
+  close(fromEngine[1]);
+  Command = fdopen(toEngine[1], "w");
+  Reply = fdopen(fromEngine[0], "r");
+  memset(&seg, 0, sizeof(seg));
+
+    /* The first transfer in each direction creates and maps the segment. */
+  start = now();
+  check(shmPut(&seg, x, n), "first shared memory put");
+  firstPut = now() - start;
+  check(seg.unlinked, "segment unlinked once mapped");
+  check(engineHas(n, expected), "first shared memory put data");
+
+    /* This replaces the segment with a small one which is too small for the array. */
+  RMatlabShm_release(&seg);
+  start = now();
+  check(shmGet(&seg, copy, n), "first shared memory get");
+  firstGet = now() - start;
+  check(seg.size >= RMatlabShm_segmentSize(RMATLAB_SHM_DOUBLE, n), "segment replaced by a larger one");
+  check(checksum(copy, n) == fromEngineSum, "first shared memory get data");
+
+    /* Subsequent ones reuse it, as does the pipe. */
+  for(iter = 0; iter < iterations; iter++) {
+    start = now();
+    check(shmPut(&seg, x, n), "shared memory put");
+    putTime += now() - start;
+    check(engineHas(n, expected), "shared memory put data");
+
+    memset(copy, 0, n * sizeof(double));
+    start = now();
+    check(shmGet(&seg, copy, n), "shared memory get");
+    getTime += now() - start;
+    check(checksum(copy, n) == fromEngineSum, "shared memory get data");
+
+    start = now();
+    fprintf(Command, "pipe\n");
+    fwrite(x, sizeof(double), n, Command);
+    fflush(Command);
+    check(fgets(line, sizeof(line), Reply) && strncmp(line, "ok", 2) == 0, "pipe transfer");
+    pipeTime += now() - start;
+    check(engineHas(n, expected), "pipe transfer data");
+  }
+
+  fprintf(Command, "quit\n");
+  fclose(Command);
+  waitpid(pid, NULL, 0);
+  RMatlabShm_release(&seg);
+
+#define RATE(t) (n * sizeof(double) / (t) / 1e9)
+  printf("%.0f MB: first shared memory put %.3fs (%.2f GB/s), get %.3fs (%.2f GB/s)\n",
+          n * sizeof(double) / 1048576.0, firstPut, RATE(firstPut), firstGet, RATE(firstGet));
+  if(iterations > 0)
+    printf("%d more: shared memory put %.3fs (%.2f GB/s), get %.3fs (%.2f GB/s), pipe %.3fs (%.2f GB/s)\n",
+            iterations,
+            putTime / iterations, RATE(putTime / iterations),
+            getTime / iterations, RATE(getTime / iterations),
+            pipeTime / iterations, RATE(pipeTime / iterations));
+
+  if(Failures == 0)
+    printf("OK\n");
+
+  free(x);
+  free(fromEngineData);
+  free(copy);
+
+  return(Failures > 0);
+}